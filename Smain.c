@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,683 +10,3097 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include "dfs_proto.h"
+#include "dfs_loop.h"
+#include "dfs_server.h"
+#include "dfs_pool.h"
+#include "dfs_tar.h"
+#include "dfs_archive.h"
+#include "dfs_index.h"
+#include "dfs_notify.h"
+#include "dfs_route.h"
+#include "dfs_range.h"
+#include "dfs_cache.h"
+#include "dfs_gzip.h"
+#include "dfs_pack.h"
+#include "dfs_commit.h"
+#include "dfs_journal.h"
 
 #define PORT 6060             // Port number for the Smain server
 #define BUFFER_SIZE 1024      // Buffer size for data transmission
-#define PDF_SERVER_PORT 6061  // Port number for the PDF server
-#define TEXT_SERVER_PORT 6062 // Port number for the Text server
+#define ROUTES_FILE ".dfs_routes" // Routing table below $HOME, unless given with -r
+#define DISPLAY_DEADLINE 2000 // Milliseconds a storage server has to start its part of a listing
+#define FETCH_DEADLINE 5000   // Milliseconds a storage server has to start sending a file
+#define DTAR_DEADLINE 10000   // Milliseconds a storage server has to start its part of a dtar archive
+#define UPDATE_DEADLINE 5000  // Milliseconds a storage server has to confirm a removal, or an upload it has the body of
+#define UPLOAD_MIN_RATE 1024  // Bytes per millisecond a spooled upload is expected to reach a storage server at, at least
+#define COMMIT_MIN_RATE 65536 // Bytes per millisecond a storage server checksums and syncs a committed upload at, at least
+#define HEDGE_MIN_DELAY 2     // Milliseconds a fetch runs at least before another copy is asked as well
+#define HEDGE_MAX_DELAY 500   // Milliseconds it runs at most, also while the server's 95th percentile is unknown
+#define HEDGE_BUDGET 10       // Percent of the fetches of replicated files that may be hedged
+#define CACHE_SIZE 64         // MiB of fetched files each worker keeps in memory, unless given with -c
+#define CACHE_OBJECT_MAX (1024 * 1024) // Largest file kept, bigger ones are always fetched
+#define CACHE_REPORT 60000    // Milliseconds between reports of how the cache does
+
+// How a relay passes the reply of a storage server on
+#define RELAY_STREAM 0 // Forward the reply frames to the client as they arrive
+#define RELAY_PART 1   // Merged in whole lines into a reply other relays feed too; errors are dropped
+#define RELAY_STATUS 2 // Keep only the status and message for the caller
+
+// Sources of the files in the namespace index
+#define SRC_LOCAL 0 // .c files on Smain's own disk
+#define SRC_NODE 1  // Files held by the storage node in slot 0 of the routing table, SRC_NODE + n for slot n
+
+#define WATCH_RETRY 1000         // Milliseconds between attempts to subscribe to a storage server's changes
+#define REBALANCE_BATCH 256      // Moves planned by one pass over the namespace index
+#define REBALANCE_RETRY 30000    // Milliseconds before moves that failed are tried again
+#define REBALANCE_PERIOD 60000   // Milliseconds between passes looking for copies that went missing
+#define FORWARD_BATCH 16         // Journaled uploads sent on to the storage nodes at once
+#define FORWARD_TICK 50          // Milliseconds between looks at the journal for uploads of other workers
+#define FORWARD_RETRY_MIN 100    // Milliseconds before a journaled upload that failed is sent again, doubled per failure
+#define FORWARD_RETRY_MAX 5000   // Upper bound of that delay
+#define JOURNAL_TIDY 1000        // Milliseconds between removals of drained journal files
+
+// Routing table used while there is no file: one Spdf and one Stext, as before there was a table
+const char default_routes[] = "pdf 127.0.0.1:6061 ~/spdf\ntxt 127.0.0.1:6062 ~/stext\n";
+
+struct relay;
+
+// State of one client connection
+struct client
+{
+    struct dfs_conn *conn;          // Connection to the client
+    uint32_t req_id;                // Id of the request being served
+    int opcode;                     // Opcode of the request being served
+    char filename[BUFFER_SIZE];     // File named by the request
+    char full_path[BUFFER_SIZE];    // Where the file lives locally or on the storage server, or the directory a display lists
+    int upload_fd;                  // Destination of a .c upload, -1 otherwise
+    struct dfs_commit *commit;      // Temporary file of a whole .c upload, moved into place once on disk
+    char *pack_buf;                 // Or the body of a small .c upload collected for the pack with -k
+    size_t pack_len;                // Bytes of pack_buf in use
+    uint32_t pack_crc;              // CRC-32 of them
+    int upload_err;                 // errno of a failed upload, answered once the body is drained
+    int upload_relayed;             // The .pdf/.txt upload streams to a storage server, which answers it
+    struct dfs_journal_write journal_write; // Or its body is written to the journal with -b, fd -1 otherwise
+    int journaled;                  // The file of an rmfile had an upload pending in the journal, dropped
+    unsigned targets;               // Slots of the storage nodes a replicated upload goes to, once spooled to upload_fd
+    char msg[BUFFER_SIZE + PATH_MAX]; // Error message of a failed upload, room for a path and why
+    int ranged;                     // The dfile asks for a range, or the ufile sends a part (see dfs_range.h); -1 if malformed
+    char range_args[3][DFS_RANGE_ID_MAX + 1]; // Their range arguments, or the upload a stat asks about, passed on to the storage nodes
+    int range_argc;                 // Number of them, 0 for a whole file
+    uint64_t range_off;             // Range of a ranged dfile of a .c file
+    uint64_t range_len;
+    struct dfs_range_part part;     // Where the part of a ranged .c upload goes, or the upload a stat asks about
+    uint64_t held;                  // Least bytes of the upload held by the copies answering a stat so far
+    struct relay *relay;            // Request forwarded to a storage server, if any
+    struct relay *hedge;            // Second request for the file of a dfile, racing relay
+    int hedged;                     // A hedge was sent for the current dfile
+    int64_t hedge_at;               // dfs_now_ms() at which the hedge is due, 0 if none is planned
+    struct client *hedge_next;      // Next client in the list of fetches waiting to be hedged
+    struct relay *parts[DFS_ROUTE_MAX_NODES]; // Storage nodes still adding to a display listing, or to a replicated request
+    int parts_pending;              // Number of them
+    int copies_ok;                  // Copies a replicated request succeeded on so far
+    int copies_needed;              // Copies it must succeed on
+    int copies_err;                 // errno of the last copy that failed
+    int copies_failed;              // Copies that failed, not counting removals of copies that did not exist
+    struct dfs_tar tar;             // Archive of .c files being streamed by dtar
+    struct dfs_gzip *gzip;          // Compresses the archive of a dtar --compress, NULL otherwise
+    int tar_fd;                     // Member of a compressed .c archive being read, -1 between members
+    uint64_t tar_left;              // Bytes of it still to read
+    size_t tar_pad;                 // Padding that follows them
+    struct dfs_pack_span *pack_spans; // Packed members of a compressed .c archive, read before the others
+    ssize_t pack_nspans;            // Number of them
+    ssize_t pack_next;              // Next of them to read
+    uint64_t pack_pos;              // Bytes of it read so far
+    int nodes[DFS_ROUTE_MAX_NODES]; // Slots of the storage nodes asked in turn: the parts of a dtar, the copies of a dfile
+    int node_count;                 // Number of them
+    int node_next;                  // Next of them to ask
+    int tar_sent;                   // Part of the archive was passed to the client
+    char *ranges[DFS_ROUTE_MAX_NODES]; // Hash ranges each node sends its files of in a replicated dtar, by slot
+    size_t ranges_len[DFS_ROUTE_MAX_NODES];
+    struct dtar_journaled *journal_members; // Uploads of the type of a dtar the journal held as it started, archived last
+    size_t journal_count;         // Number of them
+    size_t journal_next;          // Next of them to archive
+    uint64_t journal_pos;         // Bytes of its body compressed so far
+    int journal_active;           // Their turn came, the archive goes on from client_drain
+    time_t journal_time;          // Modification time of their members
+    char flight_key[BUFFER_SIZE + 64]; // What the dfile or dtar asks for while others can still join it, "" otherwise
+    struct client *leader;          // Client whose request this one shares the reply of, NULL if none
+    struct client *followers;       // Clients sharing the reply of this one's request
+    struct client *follower_next;   // Next of the leader's followers
+};
+
+// Lines of a listing of ~/smain read from the disk, the packed files are added to
+struct local_listing
+{
+    struct client *cl;             // Client the listing goes to
+    const char *pathname;          // Directory listed, as named by the request
+    char *listing;                 // Lines batched into a single reply frame
+    size_t *listing_len;           // Bytes of listing in use
+};
+
+// Lines of a storage node's part of a listing, the files the journal still holds for it are added to
+struct journal_listing
+{
+    struct client *cl;             // Client the listing goes to
+    int slot;                      // Node whose part it is
+    const char *server_path;       // Directory listed, on that node
+    char *listing;                 // Lines batched into a single reply frame
+    size_t *listing_len;           // Bytes of listing in use
+    int lines;                     // Lines added
+};
+
+// An upload the journal holds, archived by a dtar of its type after the parts of the storage nodes
+struct dtar_journaled
+{
+    char *name;                    // Member name: where it goes on its node, without the leading slash
+    char file[DFS_JOURNAL_NAME_MAX]; // Data file holding the body
+    int fd;                        // A descriptor of it, shared by the members of the same file
+    int own_fd;                    // The first of them, which closes it
+    uint64_t offset;               // Where the body starts in it
+    uint64_t size;                 // Bytes of the body
+};
+
+// A request forwarded to Spdf or Stext on behalf of a client
+struct relay
+{
+    struct dfs_call call;                            // Request on a pooled storage server connection
+    struct client *client;                           // Client waiting for the reply, NULL once it left
+    int mode;                                        // RELAY_*
+    int opcode;                                      // Opcode of the forwarded request
+    int started;                                     // Reply frames were already passed to the client
+    int passed;                                      // The reply frame being received is passed to the client
+    int chained;                                     // One part of a reply made of several: frames keep DFS_F_MORE, errors are not passed on
+    int failover;                                    // Another copy can answer instead: errors are not passed on
+    int hedge;                                       // Second request of a hedged fetch
+    int finished;                                    // The final reply frame arrived or the relay failed
+    int failed;                                      // The storage server could not be reached or went away
+    int status;                                      // Status of the final reply frame
+    int slot;                                        // Slot of the storage node in the routing table, -1 for others
+    char arg[24];                                    // First argument of the final reply frame
+    char *cache_data;                                // The fetched file being collected for the cache, if it is wanted
+    uint64_t cache_len;                              // Bytes of the file
+    uint64_t cache_got;                              // Bytes collected so far
+    unsigned long cache_gen;                         // Generation of its key in the cache when the reply started
+    char cache_key[BUFFER_SIZE];                     // Path of the file relative to the stores
+    struct dfs_hdr hdr;                              // Reply frame being received
+    char msg[BUFFER_SIZE];                           // Message carried by the reply
+    size_t msg_len;                                  // Bytes of msg in use
+    uint64_t body_left;                              // Bytes of the reply frame body still to come
+    void (*done)(struct client *cl, struct relay *r); // Continuation once the reply is complete
+};
+
+// Changes of a storage server's store, pushed over a connection of their own
+struct subscription
+{
+    struct dfs_conn *conn;         // NULL while not subscribed
+    int source;                    // SRC_* the server's files are indexed as
+    char host[64];                 // Address of the server
+    int port;
+    int synced;                    // The index holds the server's current contents
+    struct dfs_hdr hdr;            // Reply frame being received
+    char carry[PATH_MAX + 8];      // Start of a record whose end has not arrived yet
+    size_t carry_len;              // Bytes of carry in use
+};
+
+// In-memory index of the ~/smain namespace, kept by each epoll worker. display and the
+// existence checks of .c files are answered from it instead of the disk.
+struct namespace_index
+{
+    struct dfs_index index;        // Directories and files below ~/smain, whichever server holds them
+    char root[BUFFER_SIZE];        // ~/smain
+    int started;                   // Set up in this worker
+    struct dfs_notify local;       // Watch on ~/smain feeding the .c files into index
+    int local_ready;               // The .c files in index are current
+    struct subscription subs[DFS_ROUTE_MAX_NODES]; // Changes pushed by the storage nodes, by slot
+    struct dfs_timer timer;        // Subscribes again to servers that went away
+};
+
+// Fetches whose storage server is slow to answer are hedged: once the server's 95th percentile
+// reply time has passed, the next copy is asked as well and whichever answers first is passed to
+// the client. Kept by each worker, with counters of how that goes.
+struct hedging
+{
+    int started;                   // timer is set up in this worker
+    struct dfs_timer timer;        // Fires when the earliest hedge is due
+    struct client *waiting;        // Fetches with a hedge planned, linked through hedge_next
+    unsigned long fetches;         // Fetches of files with more than one copy
+    unsigned long fired;           // Hedges sent
+    unsigned long won;             // Hedged fetches the hedge answered first
+    unsigned long lost;            // Hedged fetches the first request answered first
+};
+
+// Small and medium files fetched from the storage nodes are kept in memory by each worker, with
+// how often they were answered from there. Reports of that are logged now and then.
+struct caching
+{
+    struct dfs_cache cache;        // Files by path relative to the stores
+    struct dfs_timer timer;        // Fires for the next report
+    unsigned long reported;        // Lookups at the last report
+};
+
+// A copy of a file to make on a storage node the routing table places it on, or to drop from
+// one it no longer does
+struct rebalance_move
+{
+    int from;                      // Slot of a node holding the file
+    int to;                        // Slot of the node to copy it to, -1 to drop it from the other
+    char path[BUFFER_SIZE];        // Path relative to ~/smain and to the stores
+};
+
+// Moves files after storage nodes were added or the replication changed, run by the first epoll
+// worker only. Moves are planned from the namespace index once it holds every node's files, and
+// made one at a time: a missing copy is fetched from a node holding the file and streamed to the
+// new one; copies no longer wanted are removed once every wanted one is there.
+struct rebalancer
+{
+    int enabled;                   // This worker moves files
+    int dirty;                     // The index was not checked against the current table yet
+    int64_t not_before;            // Moves that failed are not tried again before then
+    int64_t next_pass;             // When the index is checked again, for copies that went missing
+    struct rebalance_move moves[REBALANCE_BATCH]; // Moves planned by the last pass
+    size_t count;                  // Moves planned
+    size_t next;                   // Next move to make
+    int progress;                  // Moves of this batch that succeeded
+    int failures;                  // Moves of this batch that failed
+    struct rebalance_move *move;   // Move in progress, NULL between moves
+    char from_path[BUFFER_SIZE];   // The file on the node it is copied from or dropped from
+    char to_path[BUFFER_SIZE];     // The file on the node it is copied to
+    struct dfs_call get;           // DFILE from the node holding the file
+    struct dfs_call put;           // UFILE to the new node, the body of get streams into it
+    struct dfs_call del;           // RMFILE of a copy no longer wanted
+    int get_ended, get_ok;         // get is over, and delivered the whole file
+    int put_started, put_ended, put_ok; // put was sent, is over, and stored the file
+    struct dfs_loop *loop;         // Loop of the worker
+};
+
+// A journaled upload on its way to the storage nodes
+struct forward
+{
+    int busy;                      // In use
+    int settling;                  // Stored on enough nodes, logged as forwarded by forward_settle
+    int dropping;                  // The file was removed meanwhile, the copies made are being removed
+    struct dfs_journal_entry entry; // The upload, its path pointing at path
+    char path[BUFFER_SIZE];        // Where the file goes in the ~/smain namespace
+    char rel[BUFFER_SIZE];         // Its path on the storage nodes, as route_file sets it
+    struct dfs_call calls[DFS_ROUTE_MAX_NODES]; // UFILE (or RMFILE) to each of them, by slot
+    unsigned stored;               // Slots of the nodes that stored it
+    int pending;                   // Calls not over yet
+    int needed;                    // Copies it must reach, the quorum of its type
+};
+
+// Sends the uploads journaled with -b on to the storage nodes, run by the first epoll worker
+// only. Up to FORWARD_BATCH of them go out at once, oldest first, one per file at a time; those
+// that fail are tried again after a delay growing with each failure. Uploads the worker journals
+// itself go out right away, those of the others once a tick finds them.
+struct forwarder
+{
+    int enabled;                   // This worker forwards
+    struct dfs_loop *loop;         // Loop of the worker
+    struct dfs_timer timer;        // Ticks of every worker: forwarding, and tidying the journal
+    int64_t next_tidy;             // When the journal is tidied next
+    struct forward slots[FORWARD_BATCH]; // Uploads in flight
+    int busy;                      // Slots in use
+    unsigned long forwarded;       // Uploads forwarded
+    unsigned long retried;         // Attempts that failed and are tried again
+};
 
 // Function prototypes
-void prcclient(int client_sock);
-void ensure_directory_exists(char *path);
+void accept_client(struct dfs_loop *loop, int client_sock);
+void start_worker(struct dfs_loop *loop);
+void prcclient(struct dfs_conn *conn, struct dfs_hdr *hdr, char **argv);
+void client_body(struct dfs_conn *conn, const char *data, size_t len);
+void client_body_end(struct dfs_conn *conn);
+void client_drain(struct dfs_conn *conn);
+void client_close(struct dfs_conn *conn);
 void expand_tilde(char *path);
-void replace_smain_with_spdf(char *path);
-void replace_smain_with_stext(char *path);
-void upload_file_to_path(const char *filename, const char *destination_path, int client_sock);
-void download_file(const char *filename, int client_sock);
-void delete_file(const char *filename, int client_sock);
-void fetch_file_from_server(const char *filename, const char *server_ip, int server_port, int client_sock);
-void send_delete_request_to_server(const char *filename, const char *server_ip, int server_port);
-void handle_dtar(const char *filetype, int client_sock);
-void request_tarball_from_server(const char *command, const char *server_ip, int server_port, int client_sock);
-void handle_display_command(const char *pathname, int client_sock);
-
-int main()
-{
-    int server_sock, client_sock;                     // Server socket and client socket descriptors
-    struct sockaddr_in server_addr, client_addr;      // Structures for server and client addresses
-    socklen_t addr_size = sizeof(struct sockaddr_in); // Size of address structure
-    pid_t child_pid;                                  // Process ID for the child process
-
-    // Creating socket for the server
-    if ((server_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-    {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
+int route_file(const char *type, const char *path, int *replicas, unsigned *holders, char *rel);
+int node_path(const struct dfs_route_node *node, const char *rel, char *server_path);
+int order_by_cost(struct dfs_loop *loop, unsigned slots, int *ordered);
+const char *type_title(const char *type);
+void routes_refresh(struct dfs_loop *loop);
+void upload_file_to_path(struct client *cl, const char *filename, const char *destination_path, uint64_t body_len);
+void query_upload(struct client *cl, const char *filename, const char *destination_path);
+void finish_upload(struct client *cl);
+void upload_committed(struct dfs_commit *c, int err);
+int store_packed(struct client *cl);
+int send_packed(struct client *cl, const char *path);
+void compact_pack(struct dfs_timer *timer);
+void forward_upload_to_server(struct client *cl, const struct dfs_route_node *node, uint64_t body_len);
+int spool_open(void);
+void start_replicated(struct client *cl, int opcode, unsigned targets, int needed);
+void replica_done(struct client *cl, struct relay *r);
+void download_file(struct client *cl, const char *filename);
+void send_cached(struct client *cl, const struct dfs_cache_entry *e);
+void cache_report(struct dfs_timer *timer);
+void delete_file(struct client *cl, const char *filename);
+void fetch_next_copy(struct client *cl);
+struct relay *fetch_start(struct client *cl);
+void fetch_done(struct client *cl, struct relay *r);
+void fetch_won(struct client *cl, struct relay *r);
+void hedge_plan(struct client *cl, struct relay *r);
+void hedge_cancel(struct client *cl);
+void hedge_tick(struct dfs_timer *timer);
+void hedge_fire(struct client *cl);
+int flight_join(struct client *cl, const char *kind);
+void flight_seal(struct client *cl);
+void flight_promote(struct client *cl);
+void flight_error(struct client *cl, int opcode, int status, const char *msg);
+void flight_release(struct client *cl);
+void flight_close(struct client *cl);
+void handle_dtar(struct client *cl, const char *filetype, const char *mode);
+void send_tarball(struct client *cl);
+void send_tarball_gzip(struct client *cl);
+int dtar_gzip_start(struct client *cl);
+void dtar_gzip_emit(struct dfs_gzip *z, const void *data, size_t len);
+void dtar_gzip_progress(struct dfs_gzip *z);
+void dtar_gzip_end(struct dfs_gzip *z, int failed);
+void dtar_pack_reset(struct client *cl);
+void dtar_assign(struct client *cl, const struct dfs_route_ring *ring);
+void dtar_add_range(struct client *cl, int slot, uint64_t lo, uint64_t hi);
+void dtar_reset(struct client *cl);
+void dtar_next_part(struct client *cl);
+void dtar_part_done(struct client *cl, struct relay *r);
+void dtar_journaled_add(struct dfs_journal *j, const struct dfs_journal_entry *e, void *data);
+int dtar_journaled_pump(struct client *cl);
+void dtar_journaled_queue(struct client *cl, struct client *c);
+void dtar_journaled_stat(const struct client *cl, struct stat *st);
+void handle_display_command(struct client *cl, const char *pathname);
+void display_part_done(struct client *cl, struct relay *r);
+int display_path_on_server(const char *pathname, const struct dfs_route_node *node, char *server_path);
+void send_local_file(struct client *cl, const char *path);
+int relay_args(struct client *cl, const char *server_path, const char **args);
+int64_t commit_time(struct client *cl);
+struct relay *start_relay(struct client *cl, int mode, int opcode, int argc, const char **argv, const char *server_ip, int server_port, uint64_t body_len, void (*done)(struct client *, struct relay *));
+void relay_finish(struct relay *r, int status, int failed, const char *msg);
+void relay_status_done(struct client *cl, struct relay *r);
+void relay_frame(struct dfs_call *call, struct dfs_hdr *hdr, char **argv);
+void relay_body(struct dfs_call *call, const char *data, size_t len);
+void relay_lines(struct relay *r, struct client *cl, const char *data, size_t len);
+void relay_end(struct dfs_call *call, int status, int failed);
+void ns_start(struct dfs_loop *loop);
+void ns_local_event(struct dfs_notify *n, int event, const char *path);
+void ns_pack_event(struct dfs_pack *p, int event, const char *path);
+void ns_packed(const struct dfs_pack_object *o, void *data);
+void ns_subscribe(struct subscription *sub, struct dfs_loop *loop);
+void ns_follow_routes(struct dfs_loop *loop);
+void ns_retry(struct dfs_timer *timer);
+void ns_sub_frame(struct dfs_conn *conn, struct dfs_hdr *hdr, char **argv);
+void ns_sub_body(struct dfs_conn *conn, const char *data, size_t len);
+void ns_sub_body_end(struct dfs_conn *conn);
+void ns_sub_close(struct dfs_conn *conn);
+void ns_apply(struct subscription *sub, char *record);
+void ns_update(int source, int event, const char *path);
+void ns_confirmed(int slot, int opcode, const char *rel);
+int ns_path(const char *path, char *key);
+int ns_has_local(const char *path);
+void listing_add(struct client *cl, char *listing, size_t *listing_len, const char *line);
+void listing_packed(const char *name, void *data);
+void listing_journaled(const struct dfs_journal_entry *e, const char *name, void *data);
+int listing_has_journaled(const char *dir, const char *name);
+size_t listing_drop_journaled(const char *dir, char *lines, size_t len);
+void rebalance_tick(void);
+void rebalance_scan(void);
+void rebalance_plan(const char *path, unsigned sources);
+void rebalance_next(void);
+void rebalance_step(void);
+void rebalance_finish(int ok);
+void move_get_frame(struct dfs_call *call, struct dfs_hdr *hdr, char **argv);
+void move_get_body(struct dfs_call *call, const char *data, size_t len);
+void move_get_end(struct dfs_call *call, int status, int failed);
+void move_put_end(struct dfs_call *call, int status, int failed);
+void move_del_end(struct dfs_call *call, int status, int failed);
+void journal_event(struct dfs_journal *j, const char *path);
+void journal_tick(struct dfs_timer *timer);
+int send_journaled(struct client *cl, const char *path);
+void forward_pump(void);
+void forward_start(struct forward *f, struct dfs_journal_entry *e);
+void forward_end(struct dfs_call *call, int status, int failed);
+void forward_finish(struct forward *f);
+void forward_settle(struct dfs_loop *loop);
+void forward_drop(struct forward *f);
+void forward_free(struct forward *f);
+
+// Callbacks of client connections
+const struct dfs_conn_ops client_ops = {NULL, prcclient, client_body, client_body_end, client_drain, client_close};
+
+// Callbacks of requests forwarded to the storage servers
+const struct dfs_call_ops relay_ops = {relay_frame, relay_body, relay_end};
+
+// Callbacks of subscriptions to the storage servers' changes
+const struct dfs_conn_ops subscription_ops = {NULL, ns_sub_frame, ns_sub_body, ns_sub_body_end, NULL, ns_sub_close};
+
+// Callbacks of the steps of a move between storage nodes
+const struct dfs_call_ops move_get_ops = {move_get_frame, move_get_body, move_get_end};
+const struct dfs_call_ops move_put_ops = {NULL, NULL, move_put_end};
+const struct dfs_call_ops move_del_ops = {NULL, NULL, move_del_end};
+
+// Callbacks of the requests forwarding journaled uploads
+const struct dfs_call_ops forward_ops = {NULL, NULL, forward_end};
+
+struct dfs_server_opts opts; // Port, concurrency model and workers
+struct dfs_archive archive;  // Cached archive of the .c files served by dtar
+struct dfs_pack pack;        // Small .c files appended to segments with -k, instead of a file each
+struct dfs_timer compactor;  // Compacts the pack now and then
+struct namespace_index ns;   // Index of the ~/smain namespace
+struct dfs_routes routes;    // Storage nodes holding the files of each type
+struct rebalancer rebalance; // Moves of files between storage nodes
+struct hedging hedging;      // Second requests for slow fetches
+struct caching caching;      // Files fetched lately
+struct dfs_map flights;      // Fetches and dtars of the storage nodes' files others can join, by what they ask for
+struct dfs_journal journal;  // Uploads of the storage nodes' files acknowledged before they reach them, with -b
+struct forwarder forwarder;  // Sends those on
+
+int main(int argc, char *argv[])
+{
+    int opt; // Current command line option
+    int use_pack = 0; // Pack small .c files
+    int write_back = 0; // Journal uploads of the storage nodes' files and answer them right away
+    char routes_path[BUFFER_SIZE]; // Routing table
+    uint64_t cache_mib;            // Size of each worker's cache
+
+    // Parse the command line: -m epoll|fork selects the concurrency model,
+    // -w the number of worker processes (0 = one per core), -a pins workers to CPUs,
+    // -r names the routing table, -c the MiB of fetched files each worker caches (0 = none),
+    // -k packs .c files of up to 64 KiB into segments, -g is how many milliseconds a .c upload
+    // waits for others to be synced along with it, -b answers uploads of the storage nodes' files once
+    // they are in a local journal, which is forwarded to the nodes in the background
+    dfs_server_opts_init(&opts, PORT);
+    snprintf(routes_path, BUFFER_SIZE, "%s/%s", getenv("HOME"), ROUTES_FILE);
+    cache_mib = CACHE_SIZE;
+    while ((opt = getopt(argc, argv, "m:w:ar:c:kg:b")) != -1)
+    {
+        if (opt == 'r')
+            snprintf(routes_path, BUFFER_SIZE, "%s", optarg);
+        else if (opt == 'k')
+            use_pack = 1;
+        else if (opt == 'b')
+            write_back = 1;
+        else if (opt == 'g' && atoi(optarg) >= 0 && optarg[0] >= '0' && optarg[0] <= '9')
+            dfs_commit_window(atoi(optarg));
+        else if (opt == 'c' ? dfs_range_number(optarg, &cache_mib) < 0 : dfs_server_opt(&opts, opt, optarg) < 0)
+        {
+            fprintf(stderr,
+                    "Usage: %s [-m epoll|fork] [-w workers] [-a] [-r routing table] [-c cache MiB] [-k] [-g ms] [-b]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
     }
 
-    // Setting up the server address structure
-    server_addr.sin_family = AF_INET;         // IPv4 address family
-    server_addr.sin_addr.s_addr = INADDR_ANY; // Accept connections from any IP address
-    server_addr.sin_port = htons(PORT);       // Port number, converted to network byte order
+    // Storage nodes by file type, the table is reloaded whenever its file changes
+    if (dfs_routes_init(&routes, routes_path, default_routes) < 0)
+        exit(EXIT_FAILURE);
+
+    // Writes to clients that went away must fail with EPIPE instead of killing the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Archive the .c files once, ufile and rmfile keep it current from then on
+    char root[BUFFER_SIZE];
+    snprintf(root, BUFFER_SIZE, "%s/smain", getenv("HOME"));
+    dfs_commit_sweep(root, 0); // Uploads cut short by the end of the last run never land
+    dfs_archive_init(&archive, "c", root, ".c", 0, 1);
+
+    // The packed .c files stay where they are, the workers' indexes learn of them as they start
+    if (use_pack && dfs_pack_init(&pack, "c", root) == 0)
+        pack.on_change = ns_pack_event;
+
+    // Journaled uploads are forwarded by a long lived worker, which fork mode has not
+    if (write_back && opts.mode == DFS_MODE_FORK)
+        fprintf(stderr, "Write-back needs epoll workers, uploads are relayed as usual\n");
+    else if (write_back && dfs_journal_init(&journal) == 0)
+        journal.on_change = journal_event;
+
+    // Each worker fills its own copy of the cache, memory is taken as files arrive
+    dfs_cache_init(&caching.cache, (size_t)cache_mib * 1024 * 1024, CACHE_OBJECT_MAX);
+
+    printf("Smain server listening on port %d (%s mode, %d workers)\n", PORT,
+           opts.mode == DFS_MODE_FORK ? "fork" : "epoll", opts.workers);
+
+    // Each worker binds its own listener and serves its clients until it is stopped
+    opts.on_start = start_worker;
+    dfs_serve(&opts, accept_client);
+    return 0;
+}
+
+// Set up a long lived epoll worker: an index of the namespace that saves display and existence
+// checks the round trips, kept current (and the files placed where the routing table wants them)
+// whether or not clients arrive
+void start_worker(struct dfs_loop *loop)
+{
+    ns_start(loop);
+    if (caching.cache.capacity > 0 && dfs_timer_start(loop, &caching.timer, CACHE_REPORT, cache_report, NULL) < 0)
+        perror("timerfd failed"); // The cache works on, unreported
+    if (pack.ready && dfs_timer_start(loop, &compactor, DFS_PACK_COMPACT_PERIOD, compact_pack, NULL) < 0)
+        perror("timerfd failed"); // The pack only grows then
+
+    // One worker forwards the journaled uploads, each tidies the files it journaled them to
+    forwarder.loop = loop;
+    forwarder.enabled = journal.ready && opts.index == 0;
+    if (forwarder.enabled)
+        loop->before_wait = forward_settle;
+    if (journal.ready && dfs_timer_start(loop, &forwarder.timer, FORWARD_TICK, journal_tick, NULL) < 0)
+        perror("timerfd failed"); // Uploads are then forwarded as this worker journals more of them
+}
+
+// Move the live files out of mostly dead segments of the pack, whichever worker gets to it
+void compact_pack(struct dfs_timer *timer)
+{
+    (void)timer;
+    dfs_pack_compact(&pack);
+}
 
-    // Binding the socket to the specified port
-    if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+// Set up the state of a newly accepted client connection
+void accept_client(struct dfs_loop *loop, int client_sock)
+{
+    struct client *cl = (struct client *)calloc(1, sizeof(struct client));
+    if (cl == NULL)
     {
-        perror("Bind failed");
-        close(server_sock);
-        exit(EXIT_FAILURE);
+        close(client_sock);
+        return;
     }
+    cl->upload_fd = -1;
+    cl->journal_write.fd = -1;
+    cl->tar_fd = -1;
 
-    // Listening for incoming connections
-    if (listen(server_sock, 10) < 0)
+    if ((cl->conn = dfs_conn_new(loop, client_sock, &client_ops, cl)) == NULL)
     {
-        perror("Listen failed");
-        close(server_sock);
-        exit(EXIT_FAILURE);
+        free(cl);
+        return;
     }
+    cl->conn->free_data = 1; // The client state lives as long as its connection
 
-    printf("Smain server listening on port %d\n", PORT);
+    routes_refresh(loop);
 
-    while (1)
+    // Long lived workers keep connections to the storage servers open and ready
+    if (opts.mode == DFS_MODE_EPOLL)
     {
-        // Accepting a client connection
-        if ((client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &addr_size)) < 0)
-        {
-            perror("Client accept failed");
-            continue;
-        }
-
-        // Creating a child process to handle the client request
-        if ((child_pid = fork()) == 0)
-        {
-            close(server_sock);     // Child process doesn't need the server socket
-            prcclient(client_sock); // Handling client request in the child process
-            exit(0);                // Exiting child process after handling client
-        }
-        else
+        for (int n = 0; n < DFS_ROUTE_MAX_NODES; n++)
         {
-            close(client_sock);         // Parent process doesn't need the client socket
-            waitpid(-1, NULL, WNOHANG); // Reap any finished child processes
+            if (routes.nodes[n].used)
+                dfs_pool_get(loop, routes.nodes[n].host, routes.nodes[n].port);
         }
     }
-
-    close(server_sock); // Closing server socket when exiting
-    return 0;
 }
 
-void prcclient(int client_sock)
+// Take in changes of the routing table. The index follows the storage nodes of the new table,
+// and files the table now places elsewhere are moved there.
+void routes_refresh(struct dfs_loop *loop)
 {
-    char buffer[BUFFER_SIZE];           // Buffer for receiving data from the client
-    char command[BUFFER_SIZE];          // Buffer for storing the command received from the client
-    char filename[BUFFER_SIZE];         // Buffer for storing the filename received from the client
-    char destination_path[BUFFER_SIZE]; // Buffer for storing the destination path received from the client
+    if (!dfs_routes_refresh(&routes) || !ns.started)
+        return;
+    ns_follow_routes(loop);
+    rebalance.dirty = 1;
+    rebalance.not_before = 0;
+}
 
-    while (1)
-    {
-        // Clear buffers before reading new data
-        bzero(buffer, BUFFER_SIZE);
-        bzero(command, BUFFER_SIZE);
-        bzero(filename, BUFFER_SIZE);
-        bzero(destination_path, BUFFER_SIZE);
+// Storage nodes of a file of type (the extension) at path. replicas gets the slots of the nodes
+// the table places its copies on, in order of preference, and holders the slots the index has it
+// on, which differ until the rebalancer caught up with the table. rel gets the path the nodes know
+// the file by: below their store, or the path itself outside ~/smain. Returns the number of
+// replicas, -1 if no node stores the type.
+int route_file(const char *type, const char *path, int *replicas, unsigned *holders, char *rel)
+{
+    const char *below = strstr(path, "/smain/"); // Path relative to ~/smain
+    char key[BUFFER_SIZE];                       // Directory of the file in the index
+    char *slash;
+    int count;
 
-        // Read the client command from the socket
-        read(client_sock, buffer, BUFFER_SIZE);
+    snprintf(rel, BUFFER_SIZE, "%s", below != NULL ? below + strlen("/smain/") : path);
+    if ((count = dfs_route_replicas(&routes, type, rel, replicas)) == 0)
+        return -1;
 
-        // Parse the command, filename, and destination path from the received buffer
-        sscanf(buffer, "%s %s %s", command, filename, destination_path);
+    *holders = 0;
+    if (below != NULL && ns_path(path, key) && (slash = strrchr(key, '/')) != NULL)
+    {
+        unsigned sources;
 
-        // Handle file upload
-        if (strcmp(command, "ufile") == 0)
-        {
-            printf("Uploading file: %s to %s\n", filename, destination_path);
-            // Call function to handle uploading file to the specified path
-            upload_file_to_path(filename, destination_path, client_sock);
-        }
-        // Handle file download
-        else if (strcmp(command, "dfile") == 0)
-        {
-            printf("Requested file for download: %s\n", filename);
-            // Call function to handle downloading the file
-            download_file(filename, client_sock);
-        }
-        // Handle file removal
-        else if (strcmp(command, "rmfile") == 0)
-        {
-            printf("Requested file for removal: %s\n", filename);
-            // Call function to handle removing the file
-            delete_file(filename, client_sock);
-        }
-        // Handle tar creation and download
-        else if (strcmp(command, "dtar") == 0)
-        {
-            printf("Handling tar creation and download for filetype: %s\n", filename);
-            // Call function to handle tarball creation and downloading
-            handle_dtar(filename, client_sock);
-        }
-        // Handle display command
-        else if (strcmp(command, "display") == 0)
+        *slash = '\0';
+        sources = dfs_index_sources(&ns.index, key, slash + 1);
+        for (int slot = 0; slot < DFS_ROUTE_MAX_NODES; slot++)
         {
-            printf("Displaying files in path: %s\n", filename);
-            // Call function to handle displaying files in the specified path
-            handle_display_command(filename, client_sock);
+            if ((sources & (1u << (SRC_NODE + slot))) && routes.nodes[slot].used &&
+                strcmp(routes.nodes[slot].type, type) == 0)
+                *holders |= 1u << slot;
         }
     }
+    return count;
 }
 
-// Function to handle the "display" command
-void handle_display_command(const char *pathname, int client_sock)
+// Path of a file on a storage node, from its path rel as set by route_file. Returns -1 with errno
+// ENAMETOOLONG if it does not fit: cut short, it would name another file.
+int node_path(const struct dfs_route_node *node, const char *rel, char *server_path)
 {
-    char buffer[BUFFER_SIZE]; // Buffer for sending data to the client
-    DIR *dir;                 // Pointer to directory stream
-    struct dirent *entry;     // Pointer to directory entry structure
+    int len;
 
-    // Open the directory specified by pathname
-    dir = opendir(pathname);
-    if (dir == NULL)
+    if (rel[0] == '/')
+        len = snprintf(server_path, BUFFER_SIZE, "%s", rel); // Paths outside ~/smain are passed on as they are
+    else
+        len = snprintf(server_path, BUFFER_SIZE, "%s/%s", node->store, rel);
+    if (len >= BUFFER_SIZE)
     {
-        // If directory cannot be opened, send an error message to the client
-        perror("Could not open directory");
-        snprintf(buffer, BUFFER_SIZE, "Error: Could not open directory %s\n", pathname);
-        write(client_sock, buffer, strlen(buffer));
-        return;
+        errno = ENAMETOOLONG;
+        return -1;
     }
+    return 0;
+}
 
-    // Notify the client about the start of the list of .c files
-    snprintf(buffer, BUFFER_SIZE, "C Files in %s:\n", pathname);
-    write(client_sock, buffer, strlen(buffer));
+// Put the storage nodes of a mask of slots in the order they are expected to answer in: by the
+// latency of their recent replies, scaled by the requests they are busy with. Returns their number.
+int order_by_cost(struct dfs_loop *loop, unsigned slots, int *ordered)
+{
+    int64_t costs[DFS_ROUTE_MAX_NODES];
+    int count = 0;
 
-    // Read and list all .c files in the directory
-    while ((entry = readdir(dir)) != NULL)
+    for (int slot = 0; slot < DFS_ROUTE_MAX_NODES; slot++)
     {
-        // Check if the file has a .c extension
-        if (strstr(entry->d_name, ".c"))
+        struct dfs_backend *backend;
+        int64_t cost;
+        int i;
+
+        if (!(slots & (1u << slot)) || !routes.nodes[slot].used)
+            continue;
+        backend = dfs_pool_get(loop, routes.nodes[slot].host, routes.nodes[slot].port);
+        cost = backend != NULL ? dfs_backend_cost(backend) : INT64_MAX;
+        for (i = count; i > 0 && costs[i - 1] > cost; i--)
         {
-            // Send the full path of the .c file to the client
-            snprintf(buffer, BUFFER_SIZE, "%s/%s\n", pathname, entry->d_name);
-            write(client_sock, buffer, strlen(buffer));
+            costs[i] = costs[i - 1];
+            ordered[i] = ordered[i - 1];
         }
+        costs[i] = cost;
+        ordered[i] = slot;
+        count++;
     }
+    return count;
+}
 
-    // Close the directory stream
-    closedir(dir);
-
-    // Fetch and list .pdf files from the Spdf server
-    request_tarball_from_server("display .pdf", "127.0.0.1", PDF_SERVER_PORT, client_sock);
-
-    // Fetch and list .txt files from the Stext server
-    request_tarball_from_server("display .txt", "127.0.0.1", TEXT_SERVER_PORT, client_sock);
+// Heading of the files of a type in listings
+const char *type_title(const char *type)
+{
+    if (strcmp(type, "pdf") == 0)
+        return "PDF";
+    if (strcmp(type, "txt") == 0)
+        return "Text";
+    return type;
 }
 
-// Function to handle tarball creation and sending based on filetype
-void handle_dtar(const char *filetype, int client_sock)
+// Dispatch a request frame of a client. Requests answered from a storage server hold the
+// connection until the reply is complete, the rest are answered before returning.
+void prcclient(struct dfs_conn *conn, struct dfs_hdr *hdr, char **argv)
 {
-    // Check the filetype and handle accordingly
-    if (strcmp(filetype, ".c") == 0)
+    struct client *cl = (struct client *)conn->data;
+    char *filename = argv[0];         // First argument: file name, path or file type
+    char *destination_path = argv[1]; // Second argument: destination of an upload
+
+    cl->req_id = hdr->req_id;
+    cl->opcode = hdr->opcode;
+    cl->ranged = 0;
+    cl->range_argc = 0;
+
+    // A download may ask for a range of the file and an upload send a part of it, the arguments
+    // saying which follow the usual ones
+    if (hdr->opcode == DFS_OP_UFILE)
     {
-        // Handle tarball creation for .c files in Smain
-        char tarfile[BUFFER_SIZE];                                       // Buffer for the tarball filename
-        snprintf(tarfile, BUFFER_SIZE, "%s/cfiles.tar", getenv("HOME")); // Define tarball file path
-
-        // Create a tarball of all .c files in the Smain directory
-        char command[BUFFER_SIZE]; // Buffer for system command
-        snprintf(command, BUFFER_SIZE, "find %s/smain -maxdepth 1 -name '*.c' -print | tar -cvf %s -T -", getenv("HOME"), tarfile);
-        printf("Executing: %s\n", command);
-        system(command); // Execute the command to create the tarball
-
-        // Send the tarball to the client
-        FILE *fp = fopen(tarfile, "rb"); // Open the tarball file for reading in binary mode
-        if (fp == NULL)
-        {
-            perror("File open error"); // Handle file open error
-            return;
-        }
-
-        // Read and send the tarball content to the client
-        int bytes_read;
-        char buffer[BUFFER_SIZE]; // Buffer for reading file content
-        while ((bytes_read = fread(buffer, sizeof(char), BUFFER_SIZE, fp)) > 0)
-        {
-            write(client_sock, buffer, bytes_read); // Send file content to the client
-        }
+        cl->ranged = dfs_range_parse_part(argv[2], argv[3], argv[4], hdr->length - hdr->arglen, &cl->part);
+        cl->range_argc = cl->ranged > 0 ? 3 : 0;
+    }
+    else if (hdr->opcode == DFS_OP_DFILE)
+    {
+        cl->ranged = dfs_range_parse(argv[1], argv[2], &cl->range_off, &cl->range_len);
+        cl->range_argc = cl->ranged > 0 ? 2 : 0;
+    }
+    else if (hdr->opcode == DFS_OP_STAT)
+    {
+        cl->ranged = dfs_range_parse_id(argv[2], argv[3], &cl->part) < 0 ? -1 : 1;
+        cl->range_argc = cl->ranged > 0 ? 2 : 0;
+    }
+    for (int i = 0; i < cl->range_argc; i++)
+        snprintf(cl->range_args[i], sizeof(cl->range_args[i]), "%s", argv[hdr->opcode == DFS_OP_DFILE ? i + 1 : i + 2]);
 
-        fclose(fp); // Close the file after sending
-        printf("Tarball %s sent to client.\n", tarfile);
+    // Handle file upload, the body is written or forwarded as it arrives
+    if (hdr->opcode == DFS_OP_UFILE)
+    {
+        printf("Uploading file: %s to %s\n", filename, destination_path);
+        // Call function to handle uploading file to the specified path
+        upload_file_to_path(cl, filename, destination_path, hdr->length - hdr->arglen);
+    }
+    // Handle a query of how much of an upload arrived
+    else if (hdr->opcode == DFS_OP_STAT)
+    {
+        printf("Resuming upload of %s to %s\n", filename, destination_path);
+        query_upload(cl, filename, destination_path);
+    }
+    // Handle file download
+    else if (hdr->opcode == DFS_OP_DFILE && cl->ranged < 0)
+    {
+        dfs_conn_send_error(conn, DFS_OP_DFILE, hdr->req_id, EINVAL, "Invalid range");
+    }
+    else if (hdr->opcode == DFS_OP_DFILE)
+    {
+        printf("Requested file for download: %s\n", filename);
+        // Call function to handle downloading the file
+        download_file(cl, filename);
+    }
+    // Handle file removal
+    else if (hdr->opcode == DFS_OP_RMFILE)
+    {
+        printf("Requested file for removal: %s\n", filename);
+        // Call function to handle removing the file
+        delete_file(cl, filename);
     }
-    else if (strcmp(filetype, ".pdf") == 0)
+    // Handle tar creation and download
+    else if (hdr->opcode == DFS_OP_DTAR)
     {
-        // Forward the request to Spdf server to create and send the tarball
-        request_tarball_from_server("dtar .pdf", "127.0.0.1", PDF_SERVER_PORT, client_sock);
+        printf("Handling tar creation and download for filetype: %s\n", filename);
+        // Call function to handle tarball creation and downloading
+        handle_dtar(cl, filename, destination_path);
     }
-    else if (strcmp(filetype, ".txt") == 0)
+    // Handle display command
+    else if (hdr->opcode == DFS_OP_DISPLAY)
     {
-        // Forward the request to Stext server to create and send the tarball
-        request_tarball_from_server("dtar .txt", "127.0.0.1", TEXT_SERVER_PORT, client_sock);
+        printf("Displaying files in path: %s\n", filename);
+        // Call function to handle displaying files in the specified path
+        handle_display_command(cl, filename);
     }
     else
     {
-        // Handle unknown filetype
-        printf("Unknown filetype: %s\n", filetype);
+        // Handle unknown opcodes
+        printf("Unknown opcode: %d\n", hdr->opcode);
+        dfs_conn_send_error(conn, hdr->opcode, hdr->req_id, EOPNOTSUPP, "Unknown command");
     }
 }
 
-// Function to request a tarball from a server
-void request_tarball_from_server(const char *command, const char *server_ip, int server_port, int client_sock)
+// Body bytes of a client request, only .c uploads and the spools of replicated uploads are
+// written here. Bodies of other .pdf/.txt uploads are spliced to the storage server and never
+// pass through this handler.
+void client_body(struct dfs_conn *conn, const char *data, size_t len)
 {
-    int sock;
-    struct sockaddr_in server_addr;
-    char buffer[BUFFER_SIZE];
-
-    // Print connection details for debugging
-    printf("Connecting to server at %s:%d to request: %s\n", server_ip, server_port, command);
+    struct client *cl = (struct client *)conn->data;
 
-    // Create a socket for communication with the server
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    if (cl->opcode == DFS_OP_UFILE && cl->pack_buf != NULL)
     {
-        perror("Socket creation failed");
+        memcpy(cl->pack_buf + cl->pack_len, data, len); // Allocated for the whole body
+        cl->pack_len += len;
+        cl->pack_crc = dfs_crc32(cl->pack_crc, data, len);
         return;
     }
-
-    // Set up the server address structure
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port);
-    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
-
-    // Connect to the server
-    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    if (cl->opcode == DFS_OP_UFILE && cl->journal_write.fd >= 0)
     {
-        perror("Connection to server failed");
-        close(sock);
+        if (dfs_journal_write(&cl->journal_write, data, len) < 0)
+        {
+            cl->upload_err = errno;
+            snprintf(cl->msg, sizeof(cl->msg), "Could not journal %s: %s", cl->full_path, strerror(errno));
+            dfs_journal_abort(&journal, &cl->journal_write);
+        }
         return;
     }
+    if (cl->opcode != DFS_OP_UFILE || cl->upload_fd < 0)
+        return; // Drained: failed uploads, or the rest of one whose storage server went away
 
-    // Send the command to the server
-    write(sock, command, strlen(command));
-
-    // Receive the tarball from the server and send it to the client
-    int bytes_read;
-    while ((bytes_read = read(sock, buffer, BUFFER_SIZE)) > 0)
+    // A part of a .c file goes to its place in the partial file, a spool holds just the body
+    if ((cl->ranged && cl->targets == 0 ? dfs_range_part_write(cl->upload_fd, cl->full_path, &cl->part, data, len)
+                                        : dfs_write_full(cl->upload_fd, data, len)) < 0)
     {
-        write(client_sock, buffer, bytes_read);
+        cl->upload_err = errno;
+        snprintf(cl->msg, sizeof(cl->msg), "Could not write %s: %s", cl->full_path, strerror(errno));
+        if (cl->commit != NULL)
+            dfs_commit_abort(cl->commit); // Closes upload_fd, the file it wrote goes away
+        else
+            close(cl->upload_fd);
+        cl->commit = NULL;
+        cl->upload_fd = -1;
     }
-
-    // Close the socket after communication is complete
-    close(sock);
-    printf("Tarball received and sent to client.\n");
 }
 
-// Function to upload a file to a specified path, potentially redirecting to other servers
-void upload_file_to_path(const char *filename, const char *destination_path, int client_sock)
+// End of a client request body
+void client_body_end(struct dfs_conn *conn)
 {
-    char buffer[BUFFER_SIZE];    // Buffer for file data
-    char full_path[BUFFER_SIZE]; // Full path where the file will be saved
-    char file_type[10];          // File extension
+    struct client *cl = (struct client *)conn->data;
 
-    // Extract the file extension from the filename
-    sscanf(filename, "%*[^.].%s", file_type);
+    if (cl->opcode == DFS_OP_UFILE)
+        finish_upload(cl);
+}
 
-    // Expand any tilde (~) in the destination path and build the full path
-    strcpy(full_path, destination_path);
-    expand_tilde(full_path);
+// The client caught up with its queued output, let a paused relay or archive continue
+void client_drain(struct dfs_conn *conn)
+{
+    struct client *cl = (struct client *)conn->data;
+    struct client *lead = cl->leader != NULL ? cl->leader : cl; // Client whose relay feeds this one
 
-    // Handle different file types
-    if (strcmp(file_type, "c") == 0)
+    if (lead->relay != NULL)
+        dfs_call_resume(&lead->relay->call);
+    for (int i = 0; i < DFS_ROUTE_MAX_NODES; i++)
     {
-        // Ensure the destination directory exists
-        ensure_directory_exists(full_path);
-        strcat(full_path, "/");      // Append a slash to the path
-        strcat(full_path, filename); // Append the filename to the path
-
-        printf("Saving .c file to: %s\n", full_path);
-
-        // Open the file for writing in binary mode
-        FILE *fp = fopen(full_path, "wb");
-        if (fp == NULL)
-        {
-            perror("File open error");
-            return;
-        }
-
-        // Read the file data from the client and write it to the file
-        int bytes_read;
-        while ((bytes_read = read(client_sock, buffer, BUFFER_SIZE)) > 0)
-        {
-            fwrite(buffer, sizeof(char), bytes_read, fp);
-            if (bytes_read < BUFFER_SIZE)
-                break; // End of file
-        }
+        if (cl->parts[i] != NULL)
+            dfs_call_resume(&cl->parts[i]->call);
+    }
+    if (cl->tar.active)
+        send_tarball(cl);
+    if (lead->journal_active)
+        dtar_next_part(lead);
+}
 
-        fclose(fp); // Close the file after writing
-        printf("File upload complete: %s\n", full_path);
+// The client went away, abandon whatever was in progress for it
+void client_close(struct dfs_conn *conn)
+{
+    struct client *cl = (struct client *)conn->data;
+
+    if (cl->commit != NULL)
+        dfs_commit_close(cl->commit); // A file on its way into place still lands
+    else if (cl->upload_fd >= 0)
+        close(cl->upload_fd);
+    cl->commit = NULL;
+    cl->upload_fd = -1;
+    if (cl->journal_write.fd >= 0)
+        dfs_journal_abort(&journal, &cl->journal_write);
+    free(cl->pack_buf);
+    cl->pack_buf = NULL;
+    // A shared request goes on for the others, led by one of them
+    if (cl->leader != NULL)
+    {
+        struct client **pp = &cl->leader->followers;
+        while (*pp != cl)
+            pp = &(*pp)->follower_next;
+        *pp = cl->follower_next;
+        cl->leader = NULL;
     }
-    else if (strcmp(file_type, "pdf") == 0)
+    if (cl->followers != NULL)
+        flight_promote(cl);
+    flight_seal(cl);
+
+    dfs_tar_abort(&cl->tar);
+    dtar_reset(cl);
+    if (cl->gzip != NULL)
+        dfs_gzip_close(cl->gzip);
+    cl->gzip = NULL;
+    if (cl->tar_fd >= 0)
+        close(cl->tar_fd);
+    cl->tar_fd = -1;
+    dtar_pack_reset(cl);
+    hedge_cancel(cl);
+    if (cl->hedge != NULL)
     {
-        // Redirect the path to the Spdf server for .pdf files
-        replace_smain_with_spdf(full_path);
-        ensure_directory_exists(full_path);
-        strcat(full_path, "/");      // Append a slash to the path
-        strcat(full_path, filename); // Append the filename to the path
-
-        printf("Redirecting and saving .pdf file to: %s\n", full_path);
-
-        // Upload the .pdf file to the Spdf server
-        int sock;
-        struct sockaddr_in server_addr;
-
-        if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        cl->hedge->client = NULL;
+        cl->hedge = NULL;
+    }
+    if (cl->relay != NULL)
+    {
+        // The rest of the reply is drained without a receiver, the connection stays pooled
+        struct relay *r = cl->relay;
+        cl->relay = NULL;
+        r->client = NULL;
+        dfs_call_resume(&r->call);
+    }
+    for (int i = 0; i < DFS_ROUTE_MAX_NODES; i++)
+    {
+        struct relay *r = cl->parts[i];
+        if (r != NULL)
         {
-            perror("Socket creation failed");
-            return;
+            cl->parts[i] = NULL;
+            r->client = NULL;
+            dfs_call_resume(&r->call);
         }
+    }
+}
 
-        // Set up the server address for Spdf
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(PDF_SERVER_PORT);
-        inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+// Function to handle the "display" command
+void handle_display_command(struct client *cl, const char *pathname)
+{
+    char buffer[BUFFER_SIZE + NAME_MAX + 2]; // Buffer for one line of the listing, a directory and a name in it
+    char listing[BUFFER_SIZE * 4];           // Lines batched into a single reply frame
+    size_t listing_len = 0;                  // Bytes currently batched in listing
+    char key[BUFFER_SIZE];                   // pathname as a directory of the namespace index
+    int indexed = ns_path(pathname, key);
+    struct dfs_index_dir *d = NULL;
+
+    // Refused before any of the listing goes out if a storage node cannot be asked for its part
+    for (int slot = 0; slot < DFS_ROUTE_MAX_NODES; slot++)
+    {
+        char server_path[BUFFER_SIZE];
 
-        // Connect to the Spdf server
-        if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+        if (routes.nodes[slot].used && display_path_on_server(pathname, &routes.nodes[slot], server_path) < 0 &&
+            errno == ENAMETOOLONG)
         {
-            perror("Connection to Spdf server failed");
-            close(sock);
+            dfs_conn_send_error(cl->conn, DFS_OP_DISPLAY, cl->req_id, ENAMETOOLONG, "Error: Path too long\n");
             return;
         }
+    }
 
-        // Send the filename to the Spdf server
-        snprintf(buffer, BUFFER_SIZE, "ufile %s", full_path);
-        write(sock, buffer, strlen(buffer));
+    // With -b the uploads the journal holds are listed where they are going, in place of any copy
+    // a node still has: the directory is kept for the lines of the nodes' parts
+    snprintf(cl->full_path, BUFFER_SIZE, "%s", pathname);
+    expand_tilde(cl->full_path);
+    for (size_t len = strlen(cl->full_path); len > 1 && cl->full_path[len - 1] == '/';)
+        cl->full_path[--len] = '\0';
+    dfs_journal_poll(&journal);
 
-        // Send the file content to the Spdf server
-        FILE *fp = fopen(filename, "rb");
-        if (fp == NULL)
+    if (indexed && ns.local_ready)
+    {
+        // The index knows the directory, after taking in the changes made so far
+        dfs_notify_poll(&ns.local);
+        dfs_pack_poll(&pack);
+        d = dfs_index_dir(&ns.index, key);
+        if (d == NULL || !(d->sources & (1u << SRC_LOCAL)))
         {
-            perror("File open error");
-            close(sock);
+            snprintf(buffer, sizeof(buffer), "Error: Could not open directory %s\n", pathname);
+            dfs_conn_send_error(cl->conn, DFS_OP_DISPLAY, cl->req_id, ENOENT, buffer);
             return;
         }
 
-        int bytes_read;
-        while ((bytes_read = fread(buffer, sizeof(char), BUFFER_SIZE, fp)) > 0)
+        listing_len = snprintf(listing, sizeof(listing), "C Files in %s:\n", pathname);
+        for (size_t i = 0; i < d->count; i++)
         {
-            write(sock, buffer, bytes_read);
+            if (!(d->entries[i].sources & (1u << SRC_LOCAL)))
+                continue;
+            snprintf(buffer, sizeof(buffer), "%s/%s\n", pathname, d->entries[i].name);
+            listing_add(cl, listing, &listing_len, buffer);
         }
-
-        fclose(fp);  // Close the file after sending
-        close(sock); // Close the socket connection
-        printf("File upload to Spdf complete: %s\n", full_path);
     }
-    else if (strcmp(file_type, "txt") == 0)
+    else
     {
-        // Redirect the path to the Stext server for .txt files
-        replace_smain_with_stext(full_path);
-        ensure_directory_exists(full_path);
-        strcat(full_path, "/");      // Append a slash to the path
-        strcat(full_path, filename); // Append the filename to the path
-
-        printf("Redirecting and saving .txt file to: %s\n", full_path);
-
-        // Upload the .txt file to the Stext server
-        int sock;
-        struct sockaddr_in server_addr;
-
-        if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-        {
-            perror("Socket creation failed");
-            return;
-        }
+        // Without an index, read the directory
+        DIR *dir = opendir(pathname);
+        struct dirent *entry;
 
-        // Set up the server address for Stext
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(TEXT_SERVER_PORT);
-        inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
-
-        // Connect to the Stext server
-        if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+        if (dir == NULL)
         {
-            perror("Connection to Stext server failed");
-            close(sock);
+            // If directory cannot be opened, send an error message to the client
+            int err = errno; // Saved before perror can change it
+            perror("Could not open directory");
+            snprintf(buffer, sizeof(buffer), "Error: Could not open directory %s\n", pathname);
+            dfs_conn_send_error(cl->conn, DFS_OP_DISPLAY, cl->req_id, err, buffer);
             return;
         }
 
-        // Send the filename to the Stext server
-        snprintf(buffer, BUFFER_SIZE, "ufile %s", full_path);
-        write(sock, buffer, strlen(buffer));
-
-        // Send the file content to the Stext server
-        FILE *fp = fopen(filename, "rb");
-        if (fp == NULL)
-        {
-            perror("File open error");
-            close(sock);
-            return;
-        }
+        // Notify the client about the start of the list of .c files
+        listing_len = snprintf(listing, sizeof(listing), "C Files in %s:\n", pathname);
 
-        int bytes_read;
-        while ((bytes_read = fread(buffer, sizeof(char), BUFFER_SIZE, fp)) > 0)
+        // Read and list all .c files in the directory
+        while ((entry = readdir(dir)) != NULL)
         {
-            write(sock, buffer, bytes_read);
+            size_t name_len = strlen(entry->d_name);
+            if (name_len > 2 && strcmp(entry->d_name + name_len - 2, ".c") == 0)
+            {
+                snprintf(buffer, sizeof(buffer), "%s/%s\n", pathname, entry->d_name);
+                listing_add(cl, listing, &listing_len, buffer);
+            }
         }
+        closedir(dir);
 
-        fclose(fp);  // Close the file after sending
-        close(sock); // Close the socket connection
-        printf("File upload to Stext complete: %s\n", full_path);
+        // Packed files have no directory entry
+        struct local_listing l = {cl, pathname, listing, &listing_len};
+        dfs_pack_list(&pack, pathname, listing_packed, &l);
     }
-}
-
-// Function to ensure that a directory and its parent directories exist
-void ensure_directory_exists(char *path)
-{
-    struct stat st = {0};   // Structure to hold directory status
-    char temp[BUFFER_SIZE]; // Temporary buffer to manipulate the path
-    char *p = NULL;         // Pointer for traversing the path
 
-    // Copy the path to a temporary buffer
-    snprintf(temp, sizeof(temp), "%s", path);
+    // Send what is left of the local listing, more parts follow from the servers
+    dfs_conn_send_frame(cl->conn, DFS_OP_DISPLAY, DFS_F_REPLY | DFS_F_MORE, 0, cl->req_id, listing, listing_len);
 
-    // Iterate over each character in the path
-    for (p = temp + 1; *p; p++)
+    // Ask every storage node for its files at the same time, each merges its lines into the
+    // reply as they arrive and the listing ends with the slowest of them
+    unsigned listed = 0; // Sources whose files were listed from the index, a copy is listed once
+    cl->parts_pending = 0;
+    for (int slot = 0; slot < DFS_ROUTE_MAX_NODES; slot++)
     {
-        // If a '/' character is found, create the directory up to that point
-        if (*p == '/')
+        const struct dfs_route_node *node = &routes.nodes[slot];
+        char server_path[BUFFER_SIZE]; // Directory on the storage node
+        const char *arg;
+        struct relay *r;
+
+        if (!node->used || display_path_on_server(pathname, node, server_path) < 0)
+            continue; // Outside ~/smain, the storage nodes have nothing there
+
+        // The files the journal holds for the node, under a heading of their own if the node's
+        // part comes from the node
+        struct journal_listing jl = {cl, slot, server_path, listing, &listing_len, 0};
+        listing_len = snprintf(listing, sizeof(listing), "%s Files in %s:\n", type_title(node->type), server_path);
+        dfs_journal_list(&journal, cl->full_path, listing_journaled, &jl);
+
+        // Nodes whose changes the index follows are listed from it
+        if (indexed && ns.subs[slot].synced)
         {
-            *p = '\0'; // Temporarily terminate the string at the '/'
-            if (stat(temp, &st) == -1)
+            int source = ns.subs[slot].source;
+            d = dfs_index_dir(&ns.index, key);
+            if (d != NULL && !(d->sources & (1u << source)))
+                d = NULL; // Not a directory on that node
+            if (d != NULL)
+                listed |= 1u << source;
+            for (size_t i = 0; d != NULL && i < d->count; i++)
             {
-                // Directory does not exist, attempt to create it
-                if (mkdir(temp, S_IRWXU) != 0 && errno != EEXIST)
-                {
-                    perror("Failed to create directory");
-                }
+                if (!(d->entries[i].sources & (1u << source)) || (d->entries[i].sources & listed & ~(1u << source)) ||
+                    listing_has_journaled(cl->full_path, d->entries[i].name))
+                    continue;
+                snprintf(buffer, sizeof(buffer), "%s/%s\n", server_path, d->entries[i].name);
+                listing_add(cl, listing, &listing_len, buffer);
             }
-            *p = '/'; // Restore the '/' character
+            if (d != NULL || jl.lines > 0)
+                dfs_conn_send_frame(cl->conn, DFS_OP_DISPLAY, DFS_F_REPLY | DFS_F_MORE, 0, cl->req_id, listing,
+                                    listing_len);
+            continue;
         }
+        if (jl.lines > 0)
+            dfs_conn_send_frame(cl->conn, DFS_OP_DISPLAY, DFS_F_REPLY | DFS_F_MORE, 0, cl->req_id, listing, listing_len);
+
+        arg = server_path;
+        r = start_relay(cl, RELAY_PART, DFS_OP_DISPLAY, 1, &arg, node->host, node->port, 0, display_part_done);
+        if (r == NULL)
+            continue; // Unreachable parts are left out of the listing
+        cl->relay = NULL; // Parts are tracked separately, several run at once
+        cl->parts[slot] = r;
+        cl->parts_pending++;
+        r->call.deadline = dfs_now_ms() + DISPLAY_DEADLINE;
     }
 
-    // Ensure the final directory in the path is created
-    if (stat(temp, &st) == -1)
-    {
-        if (mkdir(temp, S_IRWXU) != 0 && errno != EEXIST)
-        {
-            perror("Failed to create directory");
-        }
-    }
+    if (cl->parts_pending > 0)
+        dfs_conn_hold(cl->conn); // Released by the last part
+    else
+        dfs_conn_send_frame(cl->conn, DFS_OP_DISPLAY, DFS_F_REPLY, 0, cl->req_id, NULL, 0);
 }
 
-// Function to download a file based on its type and send it to the client
-void download_file(const char *filename, int client_sock)
+// A storage server finished its part of a display listing (or failed or missed the deadline)
+void display_part_done(struct client *cl, struct relay *r)
 {
-    char file_type[10];                       // Buffer to store the file extension
-    sscanf(filename, "%*[^.].%s", file_type); // Extract the file extension
-
-    // Expand any tilde (~) in the filename and get the full path
-    char full_path[BUFFER_SIZE];
-    strcpy(full_path, filename);
-    expand_tilde(full_path);
-
-    // Print the full path after tilde expansion
-    printf("Full path after expansion: %s\n", full_path);
-
-    // Handle the file based on its type
-    if (strcmp(file_type, "c") == 0)
-    {
-        // Handle .c files locally
-        printf("Handling .c file locally: %s\n", full_path);
-        FILE *fp = fopen(full_path, "rb"); // Open the file for reading in binary mode
-        if (fp == NULL)
-        {
-            perror("File open error");
-            return;
-        }
-
-        char buffer[BUFFER_SIZE]; // Buffer for file data
-        int bytes_read;
-        // Read the file in chunks and send to the client
-        while ((bytes_read = fread(buffer, sizeof(char), BUFFER_SIZE, fp)) > 0)
-        {
-            write(client_sock, buffer, bytes_read);
-        }
-
-        fclose(fp); // Close the file after sending
-    }
-    else if (strcmp(file_type, "pdf") == 0)
-    {
-        // Handle .pdf files by fetching from the Spdf server
-        replace_smain_with_spdf(full_path);
-        printf("Fetching .pdf file from Spdf: %s\n", full_path);
-        fetch_file_from_server(full_path, "127.0.0.1", PDF_SERVER_PORT, client_sock);
-    }
-    else if (strcmp(file_type, "txt") == 0)
+    for (int i = 0; i < DFS_ROUTE_MAX_NODES; i++)
     {
-        // Handle .txt files by fetching from the Stext server
-        replace_smain_with_stext(full_path);
-        printf("Fetching .txt file from Stext: %s\n", full_path);
-        fetch_file_from_server(full_path, "127.0.0.1", TEXT_SERVER_PORT, client_sock);
+        if (cl->parts[i] == r)
+            cl->parts[i] = NULL;
     }
+    if (r->failed)
+        printf("Storage server %s, its files are left out of the listing\n",
+               r->status == ETIMEDOUT ? "missed the display deadline" : "unavailable");
+    if (--cl->parts_pending > 0)
+        return; // Others are still adding to the listing
+
+    // Terminate the multi-part reply
+    dfs_conn_send_frame(cl->conn, DFS_OP_DISPLAY, DFS_F_REPLY, 0, cl->req_id, NULL, 0);
+    dfs_conn_release(cl->conn);
 }
 
-// Function to delete a file based on its type and send the request to the appropriate server if needed
-void delete_file(const char *filename, int client_sock)
+// Append a line to a listing, sending the lines batched so far first if it does not fit
+void listing_add(struct client *cl, char *listing, size_t *listing_len, const char *line)
 {
-    char file_type[10];                       // Buffer to store the file extension
-    sscanf(filename, "%*[^.].%s", file_type); // Extract the file extension
-
-    // Expand any tilde (~) in the filename and get the full path
-    char full_path[BUFFER_SIZE];
-    strcpy(full_path, filename);
-    expand_tilde(full_path);
+    size_t len = strlen(line);
 
-    // Print the full path for deletion
-    printf("Full path for deletion: %s\n", full_path);
-
-    // Handle the file based on its type
-    if (strcmp(file_type, "c") == 0)
-    {
-        // Handle .c files locally
-        printf("Deleting .c file locally: %s\n", full_path);
-        if (remove(full_path) == 0) // Remove the file
-        {
-            printf("File deleted successfully.\n");
-        }
-        else
-        {
-            perror("File deletion error"); // Print error if file deletion fails
-        }
-    }
-    else if (strcmp(file_type, "pdf") == 0)
+    if (*listing_len + len > BUFFER_SIZE * 4)
     {
-        // Handle .pdf files by requesting deletion from Spdf server
-        replace_smain_with_spdf(full_path);
-        send_delete_request_to_server(full_path, "127.0.0.1", PDF_SERVER_PORT);
-    }
-    else if (strcmp(file_type, "txt") == 0)
-    {
-        // Handle .txt files by requesting deletion from Stext server
-        replace_smain_with_stext(full_path);
-        send_delete_request_to_server(full_path, "127.0.0.1", TEXT_SERVER_PORT);
+        dfs_conn_send_frame(cl->conn, DFS_OP_DISPLAY, DFS_F_REPLY | DFS_F_MORE, 0, cl->req_id, listing, *listing_len);
+        *listing_len = 0;
     }
+    memcpy(listing + *listing_len, line, len);
+    *listing_len += len;
 }
 
-// Function to send a delete request to a server
-void send_delete_request_to_server(const char *filename, const char *server_ip, int server_port)
+// Function to add the line of a packed .c file to a listing read from the disk
+void listing_packed(const char *name, void *data)
 {
-    int sock;
-    struct sockaddr_in server_addr;
-
-    // Print the details of the delete request
-    printf("Sending delete request to server at %s:%d for file: %s\n", server_ip, server_port, filename);
-
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-    {
-        perror("Socket creation failed");
-        return;
-    }
+    struct local_listing *l = (struct local_listing *)data;
+    char line[BUFFER_SIZE];
 
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port);
-    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    if (snprintf(line, BUFFER_SIZE, "%s/%s\n", l->pathname, name) < BUFFER_SIZE)
+        listing_add(l->cl, l->listing, l->listing_len, line);
+}
 
-    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-    {
-        perror("Connection to server failed");
-        close(sock);
+// Function to add the line of a file the journal holds to the part of the node it goes to
+void listing_journaled(const struct dfs_journal_entry *e, const char *name, void *data)
+{
+    struct journal_listing *l = (struct journal_listing *)data;
+    const char *type = strrchr(name, '.');
+    const char *below = strstr(e->path, "/smain/"); // Path relative to the stores
+    char line[BUFFER_SIZE + NAME_MAX + 2];
+
+    if (type == NULL || below == NULL ||
+        dfs_route_lookup(&routes, type + 1, below + strlen("/smain/")) != l->slot ||
+        snprintf(line, sizeof(line), "%s/%s\n", l->server_path, name) >= (int)sizeof(line))
         return;
-    }
-
-    // Send delete command to the server
-    char command[BUFFER_SIZE];
-    snprintf(command, sizeof(command), "rmfile %s", filename);
-    write(sock, command, strlen(command));
-
-    close(sock);
+    listing_add(l->cl, l->listing, l->listing_len, line);
+    l->lines++;
 }
 
-// Function to fetch a file from a server and send it to the client
-void fetch_file_from_server(const char *filename, const char *server_ip, int server_port, int client_sock)
+// Whether the file name in directory dir is listed from the journal, as of its last sync here
+int listing_has_journaled(const char *dir, const char *name)
 {
-    int sock;
-    struct sockaddr_in server_addr;
-    char buffer[BUFFER_SIZE]; // Buffer for file data
-
-    // Print the details of the fetch request
-    printf("Connecting to server at %s:%d to fetch file: %s\n", server_ip, server_port, filename);
+    char path[BUFFER_SIZE + NAME_MAX + 2];
 
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-    {
-        perror("Socket creation failed");
-        return;
-    }
+    return journal.pending > 0 && snprintf(path, sizeof(path), "%s/%s", dir, name) < (int)sizeof(path) &&
+           dfs_journal_has(&journal, path);
+}
 
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port);
-    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+// Drop the lines of a storage node's part of the listing of directory dir naming files that are
+// listed from the journal. Returns the bytes of lines kept.
+size_t listing_drop_journaled(const char *dir, char *lines, size_t len)
+{
+    size_t kept = 0;
 
-    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    for (size_t start = 0, end; start < len; start = end)
     {
-        perror("Connection to server failed");
-        close(sock);
-        return;
+        char *newline = memchr(lines + start, '\n', len - start);
+        const char *slash;
+        char name[NAME_MAX + 1];
+        size_t name_len;
+
+        end = newline != NULL ? (size_t)(newline - lines) + 1 : len;
+        slash = memrchr(lines + start, '/', end - start);
+        name_len = slash != NULL && newline != NULL ? (size_t)(newline - slash - 1) : 0;
+        if (lines[start] == '/' && name_len > 0 && name_len <= NAME_MAX)
+        {
+            memcpy(name, slash + 1, name_len);
+            name[name_len] = '\0';
+            if (listing_has_journaled(dir, name))
+                continue;
+        }
+        memmove(lines + kept, lines + start, end - start);
+        kept += end - start;
     }
+    return kept;
+}
 
-    // Send the filename to the server
-    write(sock, filename, strlen(filename));
+// Map a directory below ~/smain to the same directory in the store of a storage node, returns -1
+// for directories outside ~/smain, and with errno ENAMETOOLONG for paths too long to map
+int display_path_on_server(const char *pathname, const struct dfs_route_node *node, char *server_path)
+{
+    char path[BUFFER_SIZE];
+    const char *rel;
+    size_t len;
 
-    // Open the file for writing (to save data received from the server)
-    FILE *fp = fopen(filename, "wb");
-    if (fp == NULL)
+    errno = 0;
+    if (snprintf(path, BUFFER_SIZE - 1, "%s", pathname) >= BUFFER_SIZE - 1)
     {
-        perror("File open error");
-        close(sock);
-        return;
+        errno = ENAMETOOLONG;
+        return -1;
     }
-
-    // Receive the file from the server and write to local file
-    int bytes_read;
-    while ((bytes_read = read(sock, buffer, BUFFER_SIZE)) > 0)
+    expand_tilde(path);
+    len = strlen(path);
+    if (len == 0 || path[len - 1] != '/')
+        strcat(path, "/"); // ~/smain itself maps as well
+    if ((rel = strstr(path, "/smain/")) == NULL)
+        return -1;
+
+    // A path cut short would list another directory
+    if (snprintf(server_path, BUFFER_SIZE, "%s/%s", node->store, rel + strlen("/smain/")) >= BUFFER_SIZE)
     {
-        fwrite(buffer, sizeof(char), bytes_read, fp);
-        if (bytes_read < BUFFER_SIZE)
-            break;
+        errno = ENAMETOOLONG;
+        return -1;
     }
+    len = strlen(server_path);
+    while (len > 1 && server_path[len - 1] == '/')
+        server_path[--len] = '\0';
+    return 0;
+}
 
-    fclose(fp);  // Close the local file
-    close(sock); // Close the connection to the server
+// Function to handle tarball creation and sending based on filetype. With mode "gzip" (dtar
+// --compress) the archive is sent gzip compressed, across all cores.
+void handle_dtar(struct client *cl, const char *filetype, const char *mode)
+{
+    const struct dfs_route_ring *ring; // Storage nodes of the type
+    int compress = strcmp(mode, "gzip") == 0;
 
-    // Open the file for reading (to send data to the client)
-    fp = fopen(filename, "rb");
-    if (fp == NULL)
+    if (mode[0] != '\0' && !compress)
     {
-        perror("File open error");
+        dfs_conn_send_error(cl->conn, DFS_OP_DTAR, cl->req_id, EINVAL, "Unknown archive mode");
         return;
     }
 
-    // Send the file data to the client
-    while ((bytes_read = fread(buffer, sizeof(char), BUFFER_SIZE, fp)) > 0)
+    // Check the filetype and handle accordingly
+    if (strcmp(filetype, ".c") == 0)
     {
-        write(client_sock, buffer, bytes_read);
-    }
+        // The packed .c files go first, straight from their segments, or read into the compressor
+        uint64_t packed;
+        if (pack.ready && !compress && dfs_pack_send(&pack, cl->conn, DFS_OP_DTAR, cl->req_id, 0, NULL, NULL) < 0)
+        {
+            dfs_conn_send_error(cl->conn, DFS_OP_DTAR, cl->req_id, EIO, "Could not read the packed files");
+            return;
+        }
 
-    fclose(fp); // Close the file after sending
-}
+        // Send the cached archive of the .c files directly in the Smain directory
+        if (!compress && dfs_archive_send(&archive, cl->conn, DFS_OP_DTAR, cl->req_id, 0, NULL, NULL) == 0)
+            return;
+
+        // Without it, or compressed, stream a tarball built while it is sent
+        char root[BUFFER_SIZE]; // Directory the archive is made of
+        snprintf(root, BUFFER_SIZE, "%s/smain", getenv("HOME"));
+        if (compress && pack.ready &&
+            (cl->pack_nspans = dfs_pack_snapshot(&pack, 0, NULL, NULL, &cl->pack_spans, &packed)) < 0)
+        {
+            cl->pack_nspans = 0;
+            dfs_conn_send_error(cl->conn, DFS_OP_DTAR, cl->req_id, EIO, "Could not read the packed files");
+            return;
+        }
+        if (compress && dtar_gzip_start(cl) < 0)
+        {
+            dtar_pack_reset(cl);
+            return;
+        }
+        dfs_tar_start(&cl->tar, cl->conn, DFS_OP_DTAR, cl->req_id, root, ".c", 0);
+        dfs_conn_hold(cl->conn); // Released once the end of the archive is queued
+        send_tarball(cl);
+    }
+    else if (filetype[0] == '.' && (ring = dfs_route_ring(&routes, filetype + 1)) != NULL)
+    {
+        // Every storage node of the type sends its files as a part of the archive, one after the
+        // other. An archive of the type already in flight is shared instead.
+        snprintf(cl->filename, BUFFER_SIZE, "%s", filetype);
+        if (flight_join(cl, compress ? "dtar.gz" : "dtar"))
+        {
+            printf("Sharing the %s archive already in flight\n", filetype);
+            return;
+        }
+        if (compress && dtar_gzip_start(cl) < 0)
+        {
+            flight_seal(cl);
+            return;
+        }
+        cl->node_count = cl->node_next = cl->tar_sent = 0;
+        dtar_reset(cl);
+
+        // With -b the uploads the journal holds go last, they replace any older copy a node sends
+        cl->journal_time = time(NULL);
+        dfs_journal_each(&journal, dtar_journaled_add, cl);
+        if (ring->copies > 1)
+        {
+            dtar_assign(cl, ring); // Each file from one of its copies
+        }
+        else
+        {
+            for (int slot = 0; slot < DFS_ROUTE_MAX_NODES; slot++)
+            {
+                if (routes.nodes[slot].used && strcmp(routes.nodes[slot].type, filetype + 1) == 0)
+                    cl->nodes[cl->node_count++] = slot;
+            }
+        }
+        dfs_conn_hold(cl->conn); // Released once the end of the archive is queued
+        dtar_next_part(cl);
+    }
+    else
+    {
+        // Handle unknown filetype
+        printf("Unknown filetype: %s\n", filetype);
+        dfs_conn_send_error(cl->conn, DFS_OP_DTAR, cl->req_id, EINVAL, "Unknown filetype");
+    }
+}
+
+// Function to queue the next members of a .c tarball, called again from client_drain until it is complete
+void send_tarball(struct client *cl)
+{
+    if (cl->gzip != NULL)
+        send_tarball_gzip(cl);
+    else if (dfs_tar_pump(&cl->tar))
+        dfs_conn_release(cl->conn);
+}
+
+// Function to feed the members of a .c tarball to its compressor, a chunk at a time while the
+// compressor and the client keep up. Called again from client_drain, dtar_gzip_end completes it.
+void send_tarball_gzip(struct client *cl)
+{
+    unsigned char headers[DFS_TAR_HEADERS_MAX]; // Header blocks of the next member
+    char buffer[65536];                         // Contents of the current member
+    struct stat st;
+    int failed = 0;
+
+    while (!failed && cl->tar.active && !cl->conn->closed && !dfs_gzip_busy(cl->gzip) &&
+           !dfs_conn_congested(cl->conn))
+    {
+        if (cl->tar_fd >= 0 && cl->tar_left == 0)
+        {
+            // The member is complete once padded to a whole block
+            close(cl->tar_fd);
+            cl->tar_fd = -1;
+            failed = dfs_gzip_write(cl->gzip, dfs_tar_zeros, cl->tar_pad) < 0;
+        }
+        else if (cl->tar_fd >= 0)
+        {
+            // The next chunk of its contents, zeros for what a file that shrank no longer has
+            size_t n = cl->tar_left < sizeof(buffer) ? cl->tar_left : sizeof(buffer);
+            ssize_t got = read(cl->tar_fd, buffer, n);
+            if (got <= 0)
+            {
+                memset(buffer, 0, n);
+                got = n;
+            }
+            cl->tar_left -= got;
+            failed = dfs_gzip_write(cl->gzip, buffer, got) < 0;
+        }
+        else if (cl->pack_next < cl->pack_nspans)
+        {
+            // The packed members first, read as they are
+            struct dfs_pack_span *span = &cl->pack_spans[cl->pack_next];
+            size_t n = span->length - cl->pack_pos < sizeof(buffer) ? span->length - cl->pack_pos : sizeof(buffer);
+            ssize_t got = pread(span->fd, buffer, n, span->offset + cl->pack_pos);
+            if (got <= 0)
+            {
+                perror("Could not read the packed files");
+                failed = 1;
+                break;
+            }
+            if ((cl->pack_pos += got) == span->length)
+            {
+                cl->pack_next++;
+                cl->pack_pos = 0;
+            }
+            failed = dfs_gzip_write(cl->gzip, buffer, got) < 0;
+        }
+        else if ((cl->tar_fd = dfs_tar_next(&cl->tar, &st)) >= 0)
+        {
+            size_t hlen = dfs_tar_headers(headers, &st, cl->tar.path[0] == '/' ? cl->tar.path + 1 : cl->tar.path);
+            cl->tar_left = st.st_size;
+            cl->tar_pad = dfs_tar_padding(st.st_size);
+            cl->tar.members++;
+            failed = dfs_gzip_write(cl->gzip, headers, hlen) < 0;
+        }
+        else
+        {
+            // End of archive, the end of the compressed stream follows from dtar_gzip_end
+            printf("Archive of %llu .c files compressed\n", (unsigned long long)cl->tar.members);
+            dfs_tar_abort(&cl->tar);
+            dtar_pack_reset(cl);
+            failed = dfs_gzip_write(cl->gzip, dfs_tar_zeros, sizeof(dfs_tar_zeros)) < 0 || dfs_gzip_end(cl->gzip) < 0;
+        }
+    }
+    if (failed)
+        dfs_conn_close(cl->conn); // Out of memory, the archive cannot be completed
+}
+
+// Function to let go of the packed members of a compressed .c archive
+void dtar_pack_reset(struct client *cl)
+{
+    if (cl->pack_spans != NULL)
+        dfs_pack_spans_free(cl->pack_spans, cl->pack_nspans);
+    cl->pack_spans = NULL;
+    cl->pack_nspans = cl->pack_next = 0;
+    cl->pack_pos = 0;
+}
+
+// Function to set up the compression of a dtar --compress, the archive is fed to cl->gzip instead
+// of the client. Answers the client and returns -1 if it cannot be compressed.
+int dtar_gzip_start(struct client *cl)
+{
+    struct dfs_gzip *z = dfs_gzip_new(cl->conn->loop);
+
+    if (z == NULL)
+    {
+        perror("Could not start compression");
+        dfs_conn_send_error(cl->conn, DFS_OP_DTAR, cl->req_id, ENOMEM, "Could not start compression");
+        return -1;
+    }
+    z->emit = dtar_gzip_emit;
+    z->on_progress = dtar_gzip_progress;
+    z->on_end = dtar_gzip_end;
+    z->data = cl;
+    cl->gzip = z;
+    return 0;
+}
+
+// A compressed block of the archive is ready, it goes to the client and the clients sharing its dtar
+void dtar_gzip_emit(struct dfs_gzip *z, const void *data, size_t len)
+{
+    struct client *cl = (struct client *)z->data;
+
+    dfs_conn_send_frame(cl->conn, DFS_OP_DTAR, DFS_F_REPLY | DFS_F_MORE, 0, cl->req_id, data, len);
+    for (struct client *f = cl->followers; f != NULL; f = f->follower_next)
+        dfs_conn_send_frame(f->conn, DFS_OP_DTAR, DFS_F_REPLY | DFS_F_MORE, 0, f->req_id, data, len);
+}
+
+// The compressor caught up: the archive goes on wherever it waited for that
+void dtar_gzip_progress(struct dfs_gzip *z)
+{
+    client_drain(((struct client *)z->data)->conn);
+}
+
+// The compressed archive was sent whole, or compression failed halfway
+void dtar_gzip_end(struct dfs_gzip *z, int failed)
+{
+    struct client *cl = (struct client *)z->data;
+
+    if (failed)
+    {
+        printf("Compression of an archive failed\n");
+        flight_close(cl);
+        return;
+    }
+    dfs_conn_send_frame(cl->conn, DFS_OP_DTAR, DFS_F_REPLY, 0, cl->req_id, NULL, 0);
+    for (struct client *f = cl->followers; f != NULL; f = f->follower_next)
+        dfs_conn_send_frame(f->conn, DFS_OP_DTAR, DFS_F_REPLY, 0, f->req_id, NULL, 0);
+    flight_release(cl);
+}
+
+// Function to share the files of a replicated type out among their copies for a dtar. Each arc of
+// the ring goes to the copy expected to answer first, weighed by the arcs it already has, and a
+// node's part of the archive holds the files hashing into its arcs.
+void dtar_assign(struct client *cl, const struct dfs_route_ring *ring)
+{
+    int64_t costs[DFS_ROUTE_MAX_NODES]; // dfs_backend_cost of each node
+    int arcs[DFS_ROUTE_MAX_NODES] = {0}; // Arcs given to each node
+    int first = -1;                      // Node of the first arc, which also takes the hashes past the last point
+
+    for (int slot = 0; slot < DFS_ROUTE_MAX_NODES; slot++)
+    {
+        struct dfs_backend *backend = NULL;
+        if (routes.nodes[slot].used)
+            backend = dfs_pool_get(cl->conn->loop, routes.nodes[slot].host, routes.nodes[slot].port);
+        costs[slot] = backend != NULL ? dfs_backend_cost(backend) : INT64_MAX;
+    }
+
+    // Arc i holds the hashes after point i - 1 up to point i
+    for (size_t i = 0; i < ring->count; i++)
+    {
+        int slots[DFS_ROUTE_MAX_COPIES], count = dfs_route_arc_replicas(ring, i, slots), best = slots[0];
+        uint64_t lo = i > 0 ? ring->points[i - 1].hash + 1 : 0;
+
+        for (int c = 1; c < count; c++)
+        {
+            int node = slots[c];
+            if (costs[node] != INT64_MAX &&
+                (costs[best] == INT64_MAX || costs[node] * (arcs[node] + 1) < costs[best] * (arcs[best] + 1)))
+                best = node;
+        }
+        arcs[best]++;
+        if (i == 0)
+            first = best;
+        if (i == 0 || ring->points[i].hash != ring->points[i - 1].hash) // Points of the same hash leave no arc
+            dtar_add_range(cl, best, lo, ring->points[i].hash);
+    }
+    if (first >= 0 && ring->points[ring->count - 1].hash != UINT64_MAX)
+        dtar_add_range(cl, first, ring->points[ring->count - 1].hash + 1, UINT64_MAX);
+
+    for (int slot = 0; slot < DFS_ROUTE_MAX_NODES; slot++)
+    {
+        if (cl->ranges_len[slot] > 0)
+            cl->nodes[cl->node_count++] = slot;
+    }
+}
+
+// Add a range of hashes to the part of a node, merged with its last range if they touch
+void dtar_add_range(struct client *cl, int slot, uint64_t lo, uint64_t hi)
+{
+    char line[40];
+    int len;
+    char *text;
+
+    if (cl->ranges_len[slot] > 0)
+    {
+        // The last line ends in the hash before lo if the ranges touch
+        char *last = cl->ranges[slot] + cl->ranges_len[slot] - 1;
+        unsigned long long prev_lo, prev_hi;
+
+        while (last > cl->ranges[slot] && last[-1] != '\n')
+            last--;
+        if (sscanf(last, "%llx %llx", &prev_lo, &prev_hi) == 2 && prev_hi + 1 == lo)
+        {
+            cl->ranges_len[slot] = last - cl->ranges[slot];
+            lo = prev_lo;
+        }
+    }
+    len = snprintf(line, sizeof(line), "%llx %llx\n", (unsigned long long)lo, (unsigned long long)hi);
+    if ((text = realloc(cl->ranges[slot], cl->ranges_len[slot] + len + 1)) == NULL)
+        return; // The part misses these files
+    memcpy(text + cl->ranges_len[slot], line, len + 1);
+    cl->ranges[slot] = text;
+    cl->ranges_len[slot] += len;
+}
+
+// Free the ranges of a replicated dtar and the uploads of the journal it archives
+void dtar_reset(struct client *cl)
+{
+    for (int slot = 0; slot < DFS_ROUTE_MAX_NODES; slot++)
+    {
+        free(cl->ranges[slot]);
+        cl->ranges[slot] = NULL;
+        cl->ranges_len[slot] = 0;
+    }
+    for (size_t i = 0; i < cl->journal_count; i++)
+    {
+        if (cl->journal_members[i].own_fd)
+            close(cl->journal_members[i].fd);
+        free(cl->journal_members[i].name);
+    }
+    free(cl->journal_members);
+    cl->journal_members = NULL;
+    cl->journal_count = cl->journal_next = 0;
+    cl->journal_pos = 0;
+    cl->journal_active = 0;
+}
+
+// Function to take an upload of the type of a dtar the journal holds into the archive, as the file
+// the node it goes to will have
+void dtar_journaled_add(struct dfs_journal *j, const struct dfs_journal_entry *e, void *data)
+{
+    struct client *cl = (struct client *)data;
+    size_t len = strlen(e->path), suffix_len = strlen(cl->filename);
+    const char *below = strstr(e->path, "/smain/"); // Path relative to the stores
+    char server_path[BUFFER_SIZE];
+    struct dtar_journaled *m;
+    size_t same;
+    int slot;
+
+    if (len <= suffix_len || strcmp(e->path + len - suffix_len, cl->filename) != 0 || below == NULL ||
+        (slot = dfs_route_lookup(&routes, cl->filename + 1, below + strlen("/smain/"))) < 0 ||
+        node_path(&routes.nodes[slot], below + strlen("/smain/"), server_path) < 0)
+        return;
+    if (cl->journal_count == 0 || (cl->journal_count >= 16 && (cl->journal_count & (cl->journal_count - 1)) == 0))
+    {
+        // Room for 16, doubled whenever that is used up
+        m = (struct dtar_journaled *)realloc(cl->journal_members,
+                                             (cl->journal_count ? cl->journal_count * 2 : 16) * sizeof(*m));
+        if (m == NULL)
+            return;
+        cl->journal_members = m;
+    }
+    m = &cl->journal_members[cl->journal_count];
+    memset(m, 0, sizeof(*m));
+    snprintf(m->file, sizeof(m->file), "%s", e->file);
+    m->offset = e->offset;
+    m->size = e->size;
+
+    // Bodies of the same data file are mostly logged close together
+    for (same = cl->journal_count; same > 0 && strcmp(cl->journal_members[same - 1].file, m->file) != 0; same--)
+        ;
+    if (same > 0)
+        m->fd = cl->journal_members[same - 1].fd;
+    else if ((m->fd = dfs_journal_open(j, e)) >= 0)
+        m->own_fd = 1;
+    if (m->fd < 0 || (m->name = strdup(server_path[0] == '/' ? server_path + 1 : server_path)) == NULL)
+    {
+        if (m->own_fd)
+            close(m->fd);
+        return; // The archive misses it, like a file a node cannot read
+    }
+    cl->journal_count++;
+}
+
+// Function to archive the uploads of the journal a dtar archives after the parts of the nodes.
+// Without compression their members are queued at once, to the client and those sharing its
+// archive: the connections hold ranges of the data files, not their contents. Compressed, they
+// are fed to the compressor while it and the clients keep up. Returns 1 once all are archived, 0
+// if it must be called again from client_drain, -1 if the archive cannot be completed.
+int dtar_journaled_pump(struct client *cl)
+{
+    unsigned char headers[DFS_TAR_HEADERS_MAX]; // Header blocks of the next member
+    char buffer[65536];                         // Contents of the member being compressed
+    struct stat st;
+
+    if (cl->journal_next < cl->journal_count)
+        flight_seal(cl); // Once the archive started, no other can join it
+    if (cl->gzip == NULL)
+    {
+        for (struct client *c = cl; c != NULL; c = c == cl ? cl->followers : c->follower_next)
+            dtar_journaled_queue(cl, c);
+        cl->tar_sent |= cl->journal_count > 0;
+        cl->journal_next = cl->journal_count;
+        return 1;
+    }
+
+    dtar_journaled_stat(cl, &st);
+    while (cl->journal_next < cl->journal_count && !cl->conn->closed)
+    {
+        struct dtar_journaled *m = &cl->journal_members[cl->journal_next];
+        size_t n = m->size - cl->journal_pos < sizeof(buffer) ? m->size - cl->journal_pos : sizeof(buffer);
+        int congested = dfs_gzip_busy(cl->gzip);
+        ssize_t got;
+
+        for (struct client *c = cl; c != NULL; c = c == cl ? cl->followers : c->follower_next)
+            congested |= !c->conn->closed && dfs_conn_congested(c->conn);
+        if (congested)
+            return 0;
+
+        // The header, the next chunk of the body, and the padding once it is complete
+        st.st_size = (off_t)m->size;
+        got = n > 0 ? pread(m->fd, buffer, n, m->offset + cl->journal_pos) : 0;
+        if ((n > 0 && got <= 0) ||
+            (cl->journal_pos == 0 && dfs_gzip_write(cl->gzip, headers, dfs_tar_headers(headers, &st, m->name)) < 0) ||
+            (got > 0 && dfs_gzip_write(cl->gzip, buffer, got) < 0))
+        {
+            perror("Could not archive a journaled upload");
+            return -1;
+        }
+        cl->tar_sent = 1;
+        cl->journal_pos += got;
+        if (cl->journal_pos < m->size)
+            continue;
+        if (dfs_gzip_write(cl->gzip, dfs_tar_zeros, dfs_tar_padding(m->size)) < 0)
+            return -1;
+        cl->journal_pos = 0;
+        cl->journal_next++;
+    }
+    return 1;
+}
+
+// Function to queue the members of the uploads of the journal a dtar archives to one of the
+// clients it goes to. The bodies of a data file are sent from a descriptor of their own, which
+// the last of them closes.
+void dtar_journaled_queue(struct client *cl, struct client *c)
+{
+    unsigned char headers[DFS_TAR_HEADERS_MAX]; // Header blocks of a member
+    struct stat st;
+
+    dtar_journaled_stat(cl, &st);
+    for (size_t i = 0; i < cl->journal_count; i++)
+    {
+        const struct dtar_journaled *first = &cl->journal_members[i];
+        size_t last = cl->journal_count; // Last member of the file with a body, which closes fd
+        int fd = -1;
+
+        if (!first->own_fd)
+            continue; // Queued along with the first of its file
+        for (size_t j = i; j < cl->journal_count; j++)
+        {
+            if (cl->journal_members[j].fd == first->fd && cl->journal_members[j].size > 0)
+                last = j;
+        }
+        if (last < cl->journal_count && (fd = dup(first->fd)) < 0)
+        {
+            perror("Could not archive a journaled upload");
+            dfs_conn_close(c->conn); // The announced archive cannot be completed
+            return;
+        }
+        for (size_t j = i; j < cl->journal_count; j++)
+        {
+            const struct dtar_journaled *m = &cl->journal_members[j];
+            size_t padding = dfs_tar_padding(m->size), hlen;
+
+            if (m->fd != first->fd)
+                continue;
+            st.st_size = (off_t)m->size;
+            hlen = dfs_tar_headers(headers, &st, m->name);
+            dfs_conn_write_hdr(c->conn, DFS_OP_DTAR, DFS_F_REPLY | DFS_F_MORE, 0, c->req_id, 0,
+                               hlen + m->size + padding);
+            dfs_conn_write(c->conn, headers, hlen);
+            if (j == last)
+                dfs_conn_write_file(c->conn, fd, (off_t)m->offset, m->size);
+            else if (m->size > 0)
+                dfs_conn_write_file_range(c->conn, fd, (off_t)m->offset, m->size);
+            if (padding > 0)
+                dfs_conn_write(c->conn, dfs_tar_zeros, padding);
+        }
+    }
+}
+
+// Function to fill in the status the members of the uploads of the journal are archived with
+void dtar_journaled_stat(const struct client *cl, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFREG | 0644;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_mtime = cl->journal_time;
+}
+
+// Function to request the next part of a dtar archive from a storage node, its frames are
+// streamed to the client. The archive is ended here once every node sent its part.
+void dtar_next_part(struct client *cl)
+{
+    const char *argv[2] = {cl->filename, "part"}; // Parts come without the end blocks
+
+    while (cl->node_next < cl->node_count)
+    {
+        int slot = cl->nodes[cl->node_next++];
+        const struct dfs_route_node *node = &routes.nodes[slot];
+        struct relay *r;
+
+        if (!node->used || strcmp(node->type, cl->filename + 1) != 0)
+            continue; // Removed from the routing table meanwhile
+
+        // Print connection details for debugging
+        printf("Connecting to server at %s:%d to request: %d %s\n", node->host, node->port, DFS_OP_DTAR, cl->filename);
+        r = start_relay(cl, RELAY_STREAM, DFS_OP_DTAR, 2, argv, node->host, node->port, cl->ranges_len[slot],
+                        dtar_part_done);
+        if (r == NULL)
+        {
+            if (cl->tar_sent)
+                flight_close(cl); // A half sent archive cannot be completed
+            else
+                flight_error(cl, DFS_OP_DTAR, EHOSTUNREACH, "Storage server unavailable");
+            return;
+        }
+        r->chained = 1;
+        r->call.deadline = dfs_now_ms() + DTAR_DEADLINE;
+        if (cl->ranges_len[slot] > 0)
+            dfs_conn_write(r->call.link->conn, cl->ranges[slot], cl->ranges_len[slot]);
+        return;
+    }
+
+    // Then the uploads the journal held, a later member of the same name replaces an earlier one
+    // as the archive is extracted
+    int rc = dtar_journaled_pump(cl);
+    if (rc < 0)
+    {
+        flight_close(cl);
+        return;
+    }
+    if ((cl->journal_active = rc == 0))
+        return; // Continued from client_drain
+    dtar_reset(cl);
+    if (cl->gzip != NULL)
+    {
+        // The compressed archive ends from dtar_gzip_end, once the last block went out
+        if (dfs_gzip_write(cl->gzip, dfs_tar_zeros, sizeof(dfs_tar_zeros)) < 0 || dfs_gzip_end(cl->gzip) < 0)
+            flight_close(cl);
+        return;
+    }
+    dfs_conn_send_frame(cl->conn, DFS_OP_DTAR, DFS_F_REPLY, 0, cl->req_id, dfs_tar_zeros, sizeof(dfs_tar_zeros));
+    for (struct client *f = cl->followers; f != NULL; f = f->follower_next)
+        dfs_conn_send_frame(f->conn, DFS_OP_DTAR, DFS_F_REPLY, 0, f->req_id, dfs_tar_zeros, sizeof(dfs_tar_zeros));
+    flight_release(cl);
+}
+
+// A storage node finished its part of a dtar archive
+void dtar_part_done(struct client *cl, struct relay *r)
+{
+    cl->tar_sent |= r->started;
+    if (r->failed || r->status != 0)
+    {
+        if (cl->tar_sent)
+            flight_close(cl); // A half sent archive cannot be completed
+        else
+            flight_error(cl, DFS_OP_DTAR, r->status, r->msg);
+        return;
+    }
+    dtar_next_part(cl);
+}
+
+// Function to prepare an upload to a specified path, potentially redirecting to other servers.
+// A .c body is written by client_body as it arrives and finished by finish_upload, a .pdf/.txt
+// body streams on to its storage server.
+void upload_file_to_path(struct client *cl, const char *filename, const char *destination_path, uint64_t body_len)
+{
+    char file_type[10] = ""; // File extension
+    char path[BUFFER_SIZE];  // Where the file goes in the ~/smain namespace
+    int replicas[DFS_ROUTE_MAX_COPIES]; // Storage nodes the table places a file stored elsewhere on
+    unsigned holders;        // Storage nodes holding it now
+    int count;               // Number of replicas
+
+    // Extract the file extension from the filename
+    sscanf(filename, "%*[^.].%9s", file_type);
+    snprintf(cl->filename, BUFFER_SIZE, "%s", filename);
+    cl->upload_fd = -1;
+    cl->upload_err = 0;
+    cl->upload_relayed = 0;
+    cl->targets = 0;
+
+    // Expand any tilde (~) in the destination path and build the full path
+    snprintf(cl->full_path, BUFFER_SIZE, "%s", destination_path);
+    expand_tilde(cl->full_path);
+    snprintf(path, BUFFER_SIZE, "%s/%s", cl->full_path, filename);
+
+    // Handle different file types
+    if (cl->ranged < 0)
+    {
+        cl->upload_err = EINVAL; // Answered once the body is drained
+        snprintf(cl->msg, BUFFER_SIZE, "Invalid upload range");
+    }
+    else if (strcmp(file_type, "c") == 0)
+    {
+        // Ensure the destination directory exists
+        if (dfs_make_dirs(cl->full_path) < 0)
+            perror("Failed to create directory");
+        strcat(cl->full_path, "/");      // Append a slash to the path
+        strcat(cl->full_path, filename); // Append the filename to the path
+
+        printf("Saving .c file to: %s\n", cl->full_path);
+
+        // Open a temporary file for writing, moved into place once it is on disk. A part of a file
+        // sent in ranges goes to its place in the partial file, the commit has no body and moves
+        // that into place. A small file to pack is collected in memory instead.
+        if (cl->ranged && cl->part.commit)
+            return;
+        else if (!cl->ranged && pack.ready && body_len <= DFS_PACK_OBJECT_MAX &&
+                 (cl->pack_buf = (char *)malloc(body_len + 1)) != NULL)
+        {
+            cl->pack_len = 0;
+            cl->pack_crc = 0;
+            return;
+        }
+        else if (cl->ranged)
+            cl->upload_fd = dfs_range_part_open(cl->full_path, &cl->part);
+        else if ((cl->commit = dfs_commit_open(cl->full_path)) != NULL)
+            cl->upload_fd = cl->commit->fd;
+        if (cl->upload_fd < 0)
+        {
+            cl->upload_err = errno;
+            perror("File open error");
+            snprintf(cl->msg, sizeof(cl->msg), "Could not create %s: %s", cl->full_path, strerror(cl->upload_err));
+        }
+    }
+    else if ((count = route_file(file_type, path, replicas, &holders, cl->filename)) > 0)
+    {
+        // The file goes to the storage nodes the routing table places its copies on, which
+        // create the directories it needs, and over the copies the rebalancer has not dropped yet.
+        // The cache forgets the old contents right away.
+        dfs_cache_remove(&caching.cache, cl->filename);
+        for (int i = 0; i < count; i++)
+            holders |= 1u << replicas[i];
+        if (!cl->ranged && journal.ready && dfs_journal_begin(&journal, body_len, &cl->journal_write) == 0)
+        {
+            // With -b the body goes to the journal and the client is answered once it is on disk
+            // there, the forwarder takes it to the nodes. Parts of a resumable upload are relayed
+            // as usual, the nodes keep track of them.
+            printf("Journaling .%s file for %d storage nodes: %s\n", file_type, __builtin_popcount(holders), path);
+            snprintf(cl->full_path, BUFFER_SIZE, "%s", path);
+        }
+        else if ((holders & (holders - 1)) == 0)
+        {
+            // A single copy streams through to its node
+            const struct dfs_route_node *node = &routes.nodes[__builtin_ctz(holders)];
+            if (node_path(node, cl->filename, cl->full_path) < 0)
+            {
+                cl->upload_err = ENAMETOOLONG; // Answered once the body is drained
+                snprintf(cl->msg, sizeof(cl->msg), "Path too long for the storage node: %s", path);
+            }
+            else
+            {
+                printf("Redirecting and saving .%s file to %s:%d: %s\n", file_type, node->host, node->port, cl->full_path);
+                forward_upload_to_server(cl, node, body_len);
+            }
+        }
+        else if ((cl->upload_fd = spool_open()) >= 0)
+        {
+            // Several copies are sent from a spool once the client sent the whole file,
+            // by finish_upload
+            printf("Replicating .%s file to %d storage nodes: %s\n", file_type, __builtin_popcount(holders), cl->filename);
+            if (snprintf(cl->full_path, BUFFER_SIZE, "the spool of %s", cl->filename) >= BUFFER_SIZE)
+                snprintf(cl->full_path, BUFFER_SIZE, "the spool"); // Only named in messages
+            cl->targets = holders;
+            cl->copies_needed = dfs_route_ring(&routes, file_type)->quorum;
+
+            // A commit finds the parts on the copies it succeeds on, so each part must reach every copy
+            if (cl->ranged && !cl->part.commit)
+                cl->copies_needed = __builtin_popcount(holders);
+        }
+        else
+        {
+            cl->upload_err = errno;
+            perror("Could not create upload spool");
+            snprintf(cl->msg, BUFFER_SIZE, "Could not spool %s: %s", filename, strerror(cl->upload_err));
+        }
+    }
+    else
+    {
+        // Handle unknown file types
+        printf("Unsupported file type: %s\n", filename);
+        cl->upload_err = EINVAL;
+        snprintf(cl->msg, BUFFER_SIZE, "Only .c files and the file types of the routing table are supported");
+    }
+}
+
+// Function to complete an upload once the client has sent the whole body
+void finish_upload(struct client *cl)
+{
+    struct stat st; // The file a commit moved into place
+
+    if (cl->upload_err != 0)
+    {
+        if (cl->commit != NULL)
+            dfs_commit_abort(cl->commit);
+        else if (cl->upload_fd >= 0)
+            close(cl->upload_fd); // The spool of a replicated upload
+        if (cl->journal_write.fd >= 0)
+            dfs_journal_abort(&journal, &cl->journal_write);
+        cl->commit = NULL;
+        cl->upload_fd = -1;
+        free(cl->pack_buf);
+        cl->pack_buf = NULL;
+        dfs_conn_send_error(cl->conn, DFS_OP_UFILE, cl->req_id, cl->upload_err, cl->msg);
+        return;
+    }
+
+    // A small .c file goes into the pack, or is written the usual way if the pack cannot take it
+    int packed = cl->pack_buf != NULL ? store_packed(cl) : 0;
+    if (packed < 0)
+    {
+        dfs_conn_send_error(cl->conn, DFS_OP_UFILE, cl->req_id, cl->upload_err, cl->msg);
+        return;
+    }
+    if (packed)
+    {
+        printf("File upload complete: %s (packed)\n", cl->full_path);
+        dfs_conn_send_frame(cl->conn, DFS_OP_UFILE, DFS_F_REPLY, 0, cl->req_id, NULL, 0);
+        return;
+    }
+
+    if (cl->journal_write.fd >= 0)
+    {
+        // Answered as soon as the journal holds it, the forwarder takes it on from there
+        if (dfs_journal_commit(&journal, &cl->journal_write, cl->full_path) < 0)
+        {
+            int err = errno;
+            snprintf(cl->msg, sizeof(cl->msg), "Could not journal %s: %s", cl->full_path, strerror(err));
+            dfs_conn_send_error(cl->conn, DFS_OP_UFILE, cl->req_id, err, cl->msg);
+            return;
+        }
+        printf("File upload complete: %s (journaled)\n", cl->full_path);
+        dfs_conn_send_frame(cl->conn, DFS_OP_UFILE, DFS_F_REPLY, 0, cl->req_id, NULL, 0);
+        forward_pump();
+        return;
+    }
+
+    if (cl->upload_relayed)
+    {
+        cl->upload_relayed = 0; // The storage server's reply answers the client
+        if (cl->relay != NULL)
+            cl->relay->call.deadline = dfs_now_ms() + UPDATE_DEADLINE + commit_time(cl); // It has the body, or nearly
+        return;
+    }
+
+    if (cl->targets != 0)
+    {
+        // Every copy goes out from the spool, the client is answered once enough are stored
+        start_replicated(cl, DFS_OP_UFILE, cl->targets, cl->copies_needed);
+        close(cl->upload_fd);
+        cl->upload_fd = -1;
+        return;
+    }
+
+    if (cl->ranged && !cl->part.commit)
+    {
+        // The part is acknowledged once it is recorded as held, a resumed upload does not send it again
+        if (dfs_range_checkpoint(cl->upload_fd, cl->full_path, &cl->part) < 0)
+        {
+            int err = errno;
+            snprintf(cl->msg, sizeof(cl->msg), "Could not write %s: %s", cl->full_path, strerror(err));
+            dfs_conn_send_error(cl->conn, DFS_OP_UFILE, cl->req_id, err, cl->msg);
+        }
+        else
+        {
+            dfs_conn_send_frame(cl->conn, DFS_OP_UFILE, DFS_F_REPLY, 0, cl->req_id, NULL, 0);
+        }
+        close(cl->upload_fd);
+        cl->upload_fd = -1;
+        return;
+    }
+    if (cl->commit != NULL)
+    {
+        // The file goes into place once it is on disk along with the other uploads of its batch,
+        // upload_committed answers
+        cl->upload_fd = -1;
+        dfs_conn_hold(cl->conn); // Pipelined requests wait for the reply
+        dfs_commit_submit(cl->conn->loop, cl->commit, upload_committed, cl);
+        return;
+    }
+    if (cl->upload_fd >= 0)
+        close(cl->upload_fd); // Close the file after writing
+    cl->upload_fd = -1;
+    if (cl->ranged && dfs_range_part_commit(cl->full_path, &cl->part, NULL, NULL, &st) < 0)
+    {
+        int err = errno;
+        snprintf(cl->msg, sizeof(cl->msg), "Could not complete %s: %s", cl->full_path,
+                 err == EAGAIN ? "parts are missing" : strerror(err));
+        dfs_conn_send_error(cl->conn, DFS_OP_UFILE, cl->req_id, err, cl->msg);
+        return;
+    }
+    printf("File upload complete: %s\n", cl->full_path);
+    dfs_pack_remove(&pack, cl->full_path); // A version packed before is stale, downloads look there first
+    dfs_archive_add(&archive, cl->full_path);
+    dfs_conn_send_frame(cl->conn, DFS_OP_UFILE, DFS_F_REPLY, 0, cl->req_id, NULL, 0);
+}
+
+// Function to store the body of a small .c upload in the pack. Returns 1, 0 if the pack could not
+// take it and the body was written to a temporary file to commit instead, or -1 with upload_err and
+// msg set.
+int store_packed(struct client *cl)
+{
+    struct stat st; // The file as the pack describes it
+    int packed = dfs_pack_put(&pack, cl->full_path, cl->pack_buf, cl->pack_len, cl->pack_crc, &st) == 0;
+
+    if (packed)
+    {
+        // The file of an older version, stored before it was small enough or without -k, is stale
+        if (unlink(cl->full_path) == 0)
+            dfs_archive_remove(&archive, cl->full_path);
+    }
+    else if ((cl->commit = dfs_commit_open(cl->full_path)) == NULL ||
+             dfs_write_full(cl->commit->fd, cl->pack_buf, cl->pack_len) < 0)
+    {
+        cl->upload_err = errno;
+        snprintf(cl->msg, sizeof(cl->msg), "Could not write %s: %s", cl->full_path, strerror(cl->upload_err));
+        if (cl->commit != NULL)
+            dfs_commit_abort(cl->commit);
+        cl->commit = NULL;
+    }
+    free(cl->pack_buf);
+    cl->pack_buf = NULL;
+    return cl->upload_err != 0 ? -1 : packed;
+}
+
+// Function to answer a .c upload once its file is in place and on disk, or failed
+void upload_committed(struct dfs_commit *c, int err)
+{
+    struct client *cl = (struct client *)c->data;
+
+    if (err == 0)
+    {
+        printf("File upload complete: %s\n", c->path);
+        dfs_pack_remove(&pack, c->path); // A version packed before is stale, downloads look there first
+        dfs_archive_add(&archive, c->path);
+    }
+    if (cl == NULL)
+        return; // The client went away, the file is stored all the same
+    cl->commit = NULL;
+    if (err == 0)
+        dfs_conn_send_frame(cl->conn, DFS_OP_UFILE, DFS_F_REPLY, 0, cl->req_id, NULL, 0);
+    else
+    {
+        snprintf(cl->msg, sizeof(cl->msg), "Could not store %s: %s", c->path, strerror(err));
+        dfs_conn_send_error(cl->conn, DFS_OP_UFILE, cl->req_id, err, cl->msg);
+    }
+    dfs_conn_release(cl->conn);
+}
+
+// Function to answer how many bytes of a ranged upload arrived from the offset of cl->part on, for
+// a client resuming it: the least any copy holds, as the parts went to all of them
+void query_upload(struct client *cl, const char *filename, const char *destination_path)
+{
+    char file_type[10] = ""; // File extension
+    char path[BUFFER_SIZE];  // Where the file goes in the ~/smain namespace
+    int replicas[DFS_ROUTE_MAX_COPIES]; // Storage nodes the table places a file stored elsewhere on
+    unsigned holders;        // Storage nodes holding it now
+    int count;               // Number of replicas
+
+    sscanf(filename, "%*[^.].%9s", file_type);
+    snprintf(cl->full_path, BUFFER_SIZE, "%s", destination_path);
+    expand_tilde(cl->full_path);
+    snprintf(path, BUFFER_SIZE, "%s/%s", cl->full_path, filename);
+
+    if (cl->ranged < 0)
+    {
+        dfs_conn_send_error(cl->conn, DFS_OP_STAT, cl->req_id, EINVAL, "Invalid upload id");
+    }
+    else if (strcmp(file_type, "c") == 0)
+    {
+        // A .c upload is kept here
+        char held_text[24];
+        const char *held_arg = held_text;
+        if (dfs_range_held(path, &cl->part, cl->part.offset, &cl->held) < 0)
+        {
+            int err = errno;
+            snprintf(cl->msg, sizeof(cl->msg), "Could not read the upload of %s: %s", path, strerror(err));
+            dfs_conn_send_error(cl->conn, DFS_OP_STAT, cl->req_id, err, cl->msg);
+            return;
+        }
+        snprintf(held_text, sizeof(held_text), "%llu", (unsigned long long)cl->held);
+        dfs_conn_write_hdr_args(cl->conn, DFS_OP_STAT, DFS_F_REPLY, 0, cl->req_id, 1, &held_arg, 0);
+    }
+    else if ((count = route_file(file_type, path, replicas, &holders, cl->filename)) > 0)
+    {
+        // Every copy an upload would go to is asked
+        for (int i = 0; i < count; i++)
+            holders |= 1u << replicas[i];
+        start_replicated(cl, DFS_OP_STAT, holders, __builtin_popcount(holders));
+    }
+    else
+    {
+        dfs_conn_send_error(cl->conn, DFS_OP_STAT, cl->req_id, EINVAL, "Only .c files and the file types of the routing table are supported");
+    }
+}
+
+// Function to stream an upload on to its storage node as the client sends it. The request
+// goes out as soon as the client's header arrives and the body is spliced from the client socket
+// to the storage server connection, so neither memory nor disk of Smain holds the file. The
+// client is answered by relay_status_done.
+void forward_upload_to_server(struct client *cl, const struct dfs_route_node *node, uint64_t body_len)
+{
+    const char *args[1 + 3]; // The destination path, and where a part goes
+    int argc = relay_args(cl, cl->full_path, args);
+    struct relay *r;
+
+    // Send the destination path to the server, the body follows as it arrives
+    if ((r = start_relay(cl, RELAY_STATUS, DFS_OP_UFILE, argc, args, node->host, node->port, body_len, relay_status_done)) == NULL)
+    {
+        cl->upload_err = EHOSTUNREACH; // Answered once the body is drained
+        snprintf(cl->msg, BUFFER_SIZE, "Storage server unavailable");
+        return;
+    }
+    r->slot = (int)(node - routes.nodes);
+    cl->upload_relayed = 1;
+    dfs_conn_hold(cl->conn);
+
+    // A request announcing a body that cannot follow would corrupt the connection, drop it
+    if (body_len > 0 && dfs_call_splice_body(&r->call, cl->conn) < 0)
+        dfs_conn_close(r->call.link->conn); // Fails the relay, the client gets an error reply
+}
+
+// Function to create the spool of a replicated upload: an unlinked file below $HOME that holds the
+// body until it is sent to every copy. Returns its descriptor, -1 on failure.
+int spool_open(void)
+{
+    char path[BUFFER_SIZE];
+    int fd;
+
+    snprintf(path, BUFFER_SIZE, "%s/.dfs_spool_XXXXXX", getenv("HOME"));
+    if ((fd = mkostemp(path, O_CLOEXEC)) >= 0)
+        unlink(path); // Gone with the last descriptor
+    return fd;
+}
+
+// Function to send a request for the file cl->filename to every storage node of a mask of slots,
+// an upload with the spool in upload_fd as its body. The client is answered by replica_done once
+// needed of them succeeded, or once too few are left to.
+void start_replicated(struct client *cl, int opcode, unsigned targets, int needed)
+{
+    struct stat st;     // Size of the spooled body
+    char msg[BUFFER_SIZE];
+
+    st.st_size = 0;
+    if (opcode == DFS_OP_UFILE && fstat(cl->upload_fd, &st) < 0)
+        targets = 0;
+    cl->parts_pending = cl->copies_ok = cl->copies_failed = 0;
+    cl->copies_needed = needed;
+    cl->held = UINT64_MAX;
+    snprintf(msg, BUFFER_SIZE, "Storage server unavailable");
+    for (int slot = 0; slot < DFS_ROUTE_MAX_NODES; slot++)
+    {
+        const struct dfs_route_node *node = &routes.nodes[slot];
+        char server_path[BUFFER_SIZE]; // The file on the node
+        const char *args[1 + 3];
+        int argc = relay_args(cl, server_path, args);
+        struct relay *r;
+
+        if (!(targets & (1u << slot)) || !node->used)
+            continue;
+        if (node_path(node, cl->filename, server_path) < 0)
+        {
+            cl->copies_err = ENAMETOOLONG; // Counts as a failed copy
+            cl->copies_failed++;
+            snprintf(cl->msg, sizeof(cl->msg), "Path too long for the storage node: %s", cl->filename);
+            continue;
+        }
+        printf("Sending request %d to server at %s:%d for file: %s\n", opcode, node->host, node->port, server_path);
+        r = start_relay(cl, RELAY_STATUS, opcode, argc, args, node->host, node->port, st.st_size, replica_done);
+        if (r == NULL)
+        {
+            cl->copies_err = EHOSTUNREACH; // Counts as a failed copy
+            cl->copies_failed++;
+            snprintf(cl->msg, BUFFER_SIZE, "%s", msg);
+            continue;
+        }
+        cl->relay = NULL; // Tracked as parts, several run at once
+        cl->parts[slot] = r;
+        r->slot = slot;
+        r->call.deadline = dfs_now_ms() + UPDATE_DEADLINE + st.st_size / UPLOAD_MIN_RATE + commit_time(cl);
+        cl->parts_pending++;
+
+        // The whole body is queued at once, so nothing else gets between the request and it
+        if (st.st_size > 0)
+        {
+            int fd = dup(cl->upload_fd);
+            if (fd < 0)
+                dfs_conn_close(r->call.link->conn); // Fails the copy
+            else
+                dfs_conn_write_file(r->call.link->conn, fd, 0, st.st_size);
+        }
+    }
+
+    if (cl->parts_pending < needed)
+    {
+        // Not enough copies can succeed, those sent still complete without the client
+        for (int i = 0; i < DFS_ROUTE_MAX_NODES; i++)
+        {
+            if (cl->parts[i] != NULL)
+                cl->parts[i]->client = NULL;
+            cl->parts[i] = NULL;
+        }
+        dfs_conn_send_error(cl->conn, opcode, cl->req_id, EHOSTUNREACH, msg);
+        return;
+    }
+    dfs_conn_hold(cl->conn); // Released by replica_done
+}
+
+// A copy of a replicated request succeeded or failed
+void replica_done(struct client *cl, struct relay *r)
+{
+    int ok;
+
+    for (int i = 0; i < DFS_ROUTE_MAX_NODES; i++)
+    {
+        if (cl->parts[i] == r)
+            cl->parts[i] = NULL;
+    }
+    cl->parts_pending--;
+    if (r->status == 0)
+    {
+        cl->copies_ok++;
+        if (!cl->ranged || cl->part.commit)
+            ns_confirmed(r->slot, cl->opcode, cl->filename); // Parts make no file until the commit
+        if (cl->opcode == DFS_OP_STAT && strtoull(r->arg, NULL, 10) < cl->held)
+            cl->held = strtoull(r->arg, NULL, 10);
+    }
+    else if (cl->opcode != DFS_OP_RMFILE || r->status != ENOENT || cl->copies_failed == 0)
+    {
+        cl->copies_err = r->status; // Reported if the request fails
+        cl->copies_failed += cl->opcode != DFS_OP_RMFILE || r->status != ENOENT;
+        snprintf(cl->msg, BUFFER_SIZE, "%s", r->msg);
+    }
+
+    // An upload is answered as soon as its outcome is certain, the remaining copies complete in
+    // the background. A removal waits for every copy, and fails if one may be left: the
+    // rebalancer would bring the file back from it.
+    if (cl->opcode == DFS_OP_RMFILE ? cl->parts_pending > 0
+                                    : cl->copies_ok < cl->copies_needed &&
+                                          cl->copies_ok + cl->parts_pending >= cl->copies_needed)
+        return;
+    ok = (cl->copies_ok >= cl->copies_needed || (cl->opcode == DFS_OP_RMFILE && cl->journaled)) &&
+         (cl->opcode != DFS_OP_RMFILE || cl->copies_failed == 0);
+    for (int i = 0; i < DFS_ROUTE_MAX_NODES; i++)
+    {
+        if (cl->parts[i] != NULL)
+            cl->parts[i]->client = NULL;
+        cl->parts[i] = NULL;
+    }
+
+    if (cl->opcode != DFS_OP_STAT)
+        dfs_cache_remove(&caching.cache, cl->filename); // A fetch that ran meanwhile may have cached the old contents
+    if (ok && cl->opcode == DFS_OP_STAT)
+    {
+        char held_text[24];
+        const char *held_arg = held_text;
+        snprintf(held_text, sizeof(held_text), "%llu", (unsigned long long)cl->held);
+        dfs_conn_write_hdr_args(cl->conn, DFS_OP_STAT, DFS_F_REPLY, 0, cl->req_id, 1, &held_arg, 0);
+    }
+    else if (ok)
+    {
+        printf("%s %s on %d copies\n", cl->opcode == DFS_OP_UFILE ? "Stored" : "Removed", cl->filename, cl->copies_ok);
+        dfs_conn_send_frame(cl->conn, cl->opcode, DFS_F_REPLY, 0, cl->req_id, NULL, 0);
+    }
+    else
+    {
+        printf("Request %d for %s succeeded on %d copies, %d needed\n", cl->opcode, cl->filename, cl->copies_ok,
+               cl->copies_needed);
+        dfs_conn_send_error(cl->conn, cl->opcode, cl->req_id, cl->copies_err, cl->msg);
+    }
+    dfs_conn_release(cl->conn);
+}
+
+// Function to queue a local file as the reply to the current request
+void send_local_file(struct client *cl, const char *path)
+{
+    struct stat st; // Size of the file, announced in the reply header
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC); // Open the file for reading
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        int err = errno; // Saved before perror can change it
+        perror("File open error");
+        dfs_conn_send_error(cl->conn, cl->opcode, cl->req_id, err, "File open error");
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    // The reply header announces the size, the content is sent as the socket accepts it
+    if (cl->ranged)
+    {
+        dfs_range_send(cl->conn, cl->opcode, cl->req_id, fd, st.st_size, cl->range_off, cl->range_len);
+        return;
+    }
+    dfs_conn_write_hdr(cl->conn, cl->opcode, DFS_F_REPLY, 0, cl->req_id, 0, st.st_size);
+    if (st.st_size > 0)
+        dfs_conn_write_file(cl->conn, fd, 0, st.st_size);
+    else
+        close(fd);
+}
+
+// Function to estimate the milliseconds a storage server may take to move the file of a committed
+// upload into place, on top of the usual deadline
+int64_t commit_time(struct client *cl)
+{
+    return cl->opcode == DFS_OP_UFILE && cl->ranged > 0 && cl->part.commit ? cl->part.total / COMMIT_MIN_RATE : 0;
+}
+
+// Function to build the arguments of a request for the file at server_path on a storage node: the
+// path, followed by the range arguments of a ranged dfile or ufile. Returns their number.
+int relay_args(struct client *cl, const char *server_path, const char **args)
+{
+    args[0] = server_path;
+    for (int i = 0; i < cl->range_argc; i++)
+        args[i + 1] = cl->range_args[i];
+    return 1 + cl->range_argc;
+}
+
+// Function to download a file based on its type and send it to the client
+void download_file(struct client *cl, const char *filename)
+{
+    char file_type[10] = "";                    // Buffer to store the file extension
+    sscanf(filename, "%*[^.].%9s", file_type); // Extract the file extension
+
+    // Expand any tilde (~) in the filename and get the full path
+    char full_path[BUFFER_SIZE];
+    int replicas[DFS_ROUTE_MAX_COPIES]; // Storage nodes the table places a file stored elsewhere on
+    unsigned holders;                   // Storage nodes the index has it on
+    int count;                          // Number of replicas
+    struct dfs_cache_entry *cached;     // Copy of the file kept in memory
+    snprintf(full_path, BUFFER_SIZE, "%s", filename);
+    expand_tilde(full_path);
+
+    // Print the full path after tilde expansion
+    printf("Full path after expansion: %s\n", full_path);
+
+    // Handle the file based on its type
+    if (strcmp(file_type, "c") == 0)
+    {
+        // Handle .c files locally, from the pack or else the disk. A file the index does not know
+        // is not looked for on disk.
+        printf("Handling .c file locally: %s\n", full_path);
+        if (send_packed(cl, full_path))
+            printf("Served from the pack: %s\n", full_path);
+        else if (ns_has_local(full_path) == 0)
+            dfs_conn_send_error(cl->conn, DFS_OP_DFILE, cl->req_id, ENOENT, "File open error");
+        else
+            send_local_file(cl, full_path);
+    }
+    else if ((count = route_file(file_type, full_path, replicas, &holders, cl->filename)) > 0 &&
+             send_journaled(cl, full_path))
+    {
+        // Handle the other types from the journal while their upload is on its way to the nodes
+        printf("Served from the journal: %s\n", full_path);
+    }
+    else if (count > 0 && (cached = dfs_cache_get(&caching.cache, cl->filename)) != NULL)
+    {
+        // Handle the other types from memory if the file was fetched lately
+        printf("Serving .%s file from the cache: %s\n", file_type, cl->filename);
+        send_cached(cl, cached);
+    }
+    else if (count > 0 && flight_join(cl, "dfile"))
+    {
+        // Handle the other types by sharing the reply of the same fetch in flight, if any
+        printf("Sharing the fetch of %s already in flight\n", cl->filename);
+    }
+    else if (count > 0)
+    {
+        // Handle the other types by fetching from the storage nodes holding the file, or that
+        // should while the index does not know it: the one expected to answer first, the others
+        // stand in if it cannot
+        if (holders == 0)
+        {
+            for (int i = 0; i < count; i++)
+                holders |= 1u << replicas[i];
+        }
+        printf("Fetching .%s file from the storage nodes: %s\n", file_type, cl->filename);
+        cl->node_count = order_by_cost(cl->conn->loop, holders, cl->nodes);
+        cl->node_next = 0;
+        cl->hedged = 0;
+        if (cl->node_count > 1)
+            hedging.fetches++;
+        dfs_conn_hold(cl->conn); // Released by fetch_done
+        fetch_next_copy(cl);
+    }
+    else
+    {
+        // Handle unknown file types
+        dfs_conn_send_error(cl->conn, DFS_OP_DFILE, cl->req_id, EINVAL, "Only .c files and the file types of the routing table are supported");
+    }
+}
+
+// Function to queue a .c file the pack holds as the reply to a dfile, or the range it asks for.
+// Returns 0 if the pack does not hold it.
+int send_packed(struct client *cl, const char *path)
+{
+    struct dfs_pack_object o; // Where the file is, and its size
+    char *data;               // Its contents
+
+    if (dfs_pack_get(&pack, path, &o, &data) <= 0)
+        return 0;
+    struct dfs_cache_entry e = {0}; // Sent like a copy the cache holds
+    e.data = data;
+    e.len = o.size;
+    send_cached(cl, &e);
+    free(data);
+    return 1;
+}
+
+// Function to queue a file whose upload the journal holds as the reply to a dfile, or the range it
+// asks for. Returns 0 if it holds none.
+int send_journaled(struct client *cl, const char *path)
+{
+    struct dfs_journal_entry e; // Where the body is, and its size
+    uint64_t off = 0, len;      // Bytes of the file sent
+    char total[24];             // Size of the whole file, the argument of a ranged reply
+    const char *arg = total;
+    int fd;                     // The data file holding it
+
+    if (dfs_journal_find(&journal, path, &e, &fd) <= 0)
+        return 0; // A journal that cannot be read leaves it to the storage nodes, which may have it
+    len = e.size;
+    if (cl->ranged)
+    {
+        off = cl->range_off < e.size ? cl->range_off : e.size;
+        len = cl->range_len < e.size - off ? cl->range_len : e.size - off;
+        snprintf(total, sizeof(total), "%llu", (unsigned long long)e.size);
+        dfs_conn_write_hdr_args(cl->conn, DFS_OP_DFILE, DFS_F_REPLY, 0, cl->req_id, 1, &arg, len);
+    }
+    else
+    {
+        dfs_conn_write_hdr(cl->conn, DFS_OP_DFILE, DFS_F_REPLY, 0, cl->req_id, 0, len);
+    }
+    if (len > 0)
+        dfs_conn_write_file(cl->conn, fd, e.offset + off, len);
+    else
+        close(fd);
+    return 1;
+}
+
+// Function to queue the copy of a file the cache holds as the reply to a dfile, or the range it asks for
+void send_cached(struct client *cl, const struct dfs_cache_entry *e)
+{
+    uint64_t off = 0, len = e->len; // Bytes of the file sent
+    char total[24];                 // Size of the whole file, the argument of a ranged reply
+    const char *arg = total;
+
+    if (!cl->ranged)
+    {
+        dfs_conn_write_hdr(cl->conn, DFS_OP_DFILE, DFS_F_REPLY, 0, cl->req_id, 0, len);
+        dfs_conn_write(cl->conn, e->data, len);
+        return;
+    }
+    off = cl->range_off < e->len ? cl->range_off : e->len;
+    len = cl->range_len < e->len - off ? cl->range_len : e->len - off;
+    snprintf(total, sizeof(total), "%zu", e->len);
+    dfs_conn_write_hdr_args(cl->conn, DFS_OP_DFILE, DFS_F_REPLY, 0, cl->req_id, 1, &arg, len);
+    dfs_conn_write(cl->conn, e->data + off, len);
+}
+
+// Log how the cache of this worker does, when it was used since the last report
+void cache_report(struct dfs_timer *timer)
+{
+    const struct dfs_cache *c = &caching.cache;
+    unsigned long lookups = c->stats.hits + c->stats.misses;
+
+    (void)timer;
+    if (lookups == caching.reported)
+        return;
+    caching.reported = lookups;
+    printf("Cache: %lu hits, %lu misses (%.1f%% hit rate), %zu files in %zu of %zu bytes, "
+           "%lu admitted, %lu rejected, %lu evicted, %lu invalidated\n",
+           c->stats.hits, c->stats.misses, 100.0 * c->stats.hits / lookups, c->count, c->used, c->capacity,
+           c->stats.admitted, c->stats.rejected, c->stats.evicted, c->stats.invalidated);
+}
+
+// Function to delete a file based on its type and send the request to the appropriate server if needed
+void delete_file(struct client *cl, const char *filename)
+{
+    char file_type[10] = "";                    // Buffer to store the file extension
+    sscanf(filename, "%*[^.].%9s", file_type); // Extract the file extension
+    char msg[BUFFER_SIZE];                      // Error message reported to the client
+    int replicas[DFS_ROUTE_MAX_COPIES];         // Storage nodes the table places a file stored elsewhere on
+    unsigned holders;                           // Storage nodes the index has it on
+    int count;                                  // Number of replicas
+
+    // Expand any tilde (~) in the filename and get the full path
+    char full_path[BUFFER_SIZE];
+    snprintf(full_path, BUFFER_SIZE, "%s", filename);
+    expand_tilde(full_path);
+
+    // Print the full path for deletion
+    printf("Full path for deletion: %s\n", full_path);
+
+    // Handle the file based on its type
+    if (strcmp(file_type, "c") == 0)
+    {
+        // Handle .c files locally
+        printf("Deleting .c file locally: %s\n", full_path);
+        if (dfs_pack_remove(&pack, full_path) == 1)
+        {
+            printf("File deleted successfully.\n");
+            dfs_conn_send_frame(cl->conn, DFS_OP_RMFILE, DFS_F_REPLY, 0, cl->req_id, NULL, 0);
+        }
+        else if (ns_has_local(full_path) == 0)
+        {
+            dfs_conn_send_error(cl->conn, DFS_OP_RMFILE, cl->req_id, ENOENT, "File deletion error: No such file or directory");
+        }
+        else if (remove(full_path) == 0) // Remove the file
+        {
+            printf("File deleted successfully.\n");
+            dfs_archive_remove(&archive, full_path);
+            dfs_conn_send_frame(cl->conn, DFS_OP_RMFILE, DFS_F_REPLY, 0, cl->req_id, NULL, 0);
+        }
+        else
+        {
+            int err = errno; // Saved before perror can change it
+            perror("File deletion error"); // Print error if file deletion fails
+            snprintf(msg, sizeof(msg), "File deletion error: %s", strerror(err));
+            dfs_conn_send_error(cl->conn, DFS_OP_RMFILE, cl->req_id, err, msg);
+        }
+    }
+    else if ((count = route_file(file_type, full_path, replicas, &holders, cl->filename)) > 0)
+    {
+        // Handle the other types by requesting deletion from every storage node holding a copy,
+        // it succeeds if any of them had one or the journal held an upload of it not forwarded
+        // yet. The cache forgets it right away.
+        dfs_cache_remove(&caching.cache, cl->filename);
+        cl->journaled = dfs_journal_remove(&journal, full_path) == 1;
+        for (int i = 0; i < count; i++)
+            holders |= 1u << replicas[i];
+        start_replicated(cl, DFS_OP_RMFILE, holders, 1);
+    }
+    else
+    {
+        dfs_conn_send_error(cl->conn, DFS_OP_RMFILE, cl->req_id, EINVAL, "Only .c files and the file types of the routing table are supported");
+    }
+}
+
+// Function to fetch cl->filename from the next storage node holding a copy, the reply is spliced
+// through to the client as it arrives. The copy after it is asked too if the node is slow.
+void fetch_next_copy(struct client *cl)
+{
+    struct relay *r = fetch_start(cl);
+
+    if (r != NULL)
+    {
+        r->failover = cl->node_next < cl->node_count; // The last copy's error goes to the client as it is
+        if (r->failover)
+            hedge_plan(cl, r);
+        return;
+    }
+    flight_error(cl, DFS_OP_DFILE, EHOSTUNREACH, "Storage server unavailable");
+}
+
+// Function to request cl->filename from the next storage node holding a copy that can be reached.
+// Returns the relay, which is cl->relay, or NULL once no copy is left.
+struct relay *fetch_start(struct client *cl)
+{
+    while (cl->node_next < cl->node_count)
+    {
+        const struct dfs_route_node *node = &routes.nodes[cl->nodes[cl->node_next++]];
+        char server_path[BUFFER_SIZE]; // The file on the node
+        const char *args[1 + 3];
+        int argc = relay_args(cl, server_path, args);
+        struct relay *r;
+
+        // Print the details of the fetch request
+        if (node_path(node, cl->filename, server_path) < 0)
+            continue; // The copy cannot be named on that node
+        printf("Connecting to server at %s:%d to fetch file: %s\n", node->host, node->port, server_path);
+        r = start_relay(cl, RELAY_STREAM, DFS_OP_DFILE, argc, args, node->host, node->port, 0, fetch_done);
+        if (r == NULL)
+            continue;
+        r->call.deadline = dfs_now_ms() + FETCH_DEADLINE;
+        return r;
+    }
+    return NULL;
+}
+
+// A storage node answered a fetch: the file went to the client, or the next copy is tried
+void fetch_done(struct client *cl, struct relay *r)
+{
+    if ((r->failed || r->status != 0) && !r->started)
+    {
+        if (cl->relay != NULL || cl->hedge != NULL)
+        {
+            printf("Copy unavailable (%s), the other request goes on\n", r->msg);
+            return;
+        }
+        hedge_cancel(cl);
+        if (cl->node_next < cl->node_count)
+        {
+            printf("Copy unavailable (%s), trying the next one\n", r->msg);
+            fetch_next_copy(cl);
+            return;
+        }
+        if (r->failed || r->failover)
+        {
+            hedge_cancel(cl);
+            flight_error(cl, r->opcode, r->status, r->msg);
+            return;
+        }
+    }
+    hedge_cancel(cl);
+    flight_release(cl);
+}
+
+// A fetch passes its first reply frame to the client: a hedge is no longer needed, and of two
+// racing requests the other one is left to finish without a receiver
+void fetch_won(struct client *cl, struct relay *r)
+{
+    struct relay *other = r == cl->hedge ? cl->relay : cl->hedge;
+
+    hedge_cancel(cl);
+    if (!cl->hedged)
+        return;
+    cl->hedged = 0;
+    if (other != NULL)
+        other->client = NULL;
+    cl->relay = r;
+    cl->hedge = NULL;
+    if (r->hedge)
+        hedging.won++;
+    else
+        hedging.lost++;
+    printf("Hedged fetch of %s answered by the %s request (%lu hedges for %lu fetches: %lu won, %lu lost)\n",
+           cl->filename, r->hedge ? "second" : "first", hedging.fired, hedging.fetches, hedging.won, hedging.lost);
+}
+
+// Plan a hedge for a fetch, due once its storage server's replies would usually have started
+void hedge_plan(struct client *cl, struct relay *r)
+{
+    int64_t p95 = r->call.link != NULL ? dfs_backend_p95(r->call.link->backend) : -1;
+    int64_t delay = p95 < 0 ? HEDGE_MAX_DELAY : (p95 + 999) / 1000;
+
+    if (delay < HEDGE_MIN_DELAY)
+        delay = HEDGE_MIN_DELAY;
+    if (delay > HEDGE_MAX_DELAY)
+        delay = HEDGE_MAX_DELAY;
+    if (!hedging.started)
+    {
+        // One timer per worker, armed for the earliest hedge due
+        if (dfs_timer_start(cl->conn->loop, &hedging.timer, 0, hedge_tick, NULL) < 0)
+            return; // Fetches go unhedged
+        hedging.started = 1;
+    }
+    if (cl->hedge_at == 0)
+    {
+        cl->hedge_next = hedging.waiting;
+        hedging.waiting = cl;
+    }
+    cl->hedge_at = dfs_now_ms() + delay;
+    hedge_tick(NULL); // Arms the timer
+}
+
+// Take a fetch off the list of those waiting for a hedge
+void hedge_cancel(struct client *cl)
+{
+    if (cl->hedge_at == 0)
+        return;
+    for (struct client **pp = &hedging.waiting; *pp != NULL; pp = &(*pp)->hedge_next)
+    {
+        if (*pp == cl)
+        {
+            *pp = cl->hedge_next;
+            break;
+        }
+    }
+    cl->hedge_at = 0;
+    cl->hedge_next = NULL;
+}
+
+// Send the hedges that are due and arm the timer for the next one
+void hedge_tick(struct dfs_timer *timer)
+{
+    int64_t now = dfs_now_ms();
+    int64_t next = 0; // When the earliest hedge not yet due is
+
+    (void)timer;
+    for (struct client **pp = &hedging.waiting; *pp != NULL;)
+    {
+        struct client *cl = *pp;
+        if (cl->hedge_at <= now)
+        {
+            *pp = cl->hedge_next;
+            cl->hedge_at = 0;
+            cl->hedge_next = NULL;
+            hedge_fire(cl);
+            continue;
+        }
+        if (next == 0 || cl->hedge_at < next)
+            next = cl->hedge_at;
+        pp = &cl->hedge_next;
+    }
+    if (next != 0)
+        dfs_timer_arm(&hedging.timer, (int)(next - now));
+}
+
+// Function to ask the next copy for the file of a fetch whose storage server has not answered yet
+void hedge_fire(struct client *cl)
+{
+    struct relay *first = cl->relay;
+    struct relay *r;
+
+    if (first == NULL || first->started || cl->hedge != NULL)
+        return; // Answered or failed over meanwhile
+    if (hedging.fired * 100 > hedging.fetches * HEDGE_BUDGET)
+        return; // Hedges must not add more than a fraction to the load of the storage servers
+
+    printf("No reply yet for %s, asking another copy as well\n", cl->filename);
+    r = fetch_start(cl);
+    cl->relay = first; // fetch_start made the hedge the client's relay
+    if (r == NULL)
+        return;
+    r->hedge = 1;
+    r->failover = 1; // Its error waits for the first request's outcome
+    cl->hedge = r;
+    cl->hedged = 1;
+    hedging.fired++;
+}
+
+// Function to make a dfile or dtar of the storage nodes' files share the reply of an identical
+// request in flight whose reply has not started yet: the burst of requests for the same objects
+// after files are published then costs one fetch or one archive. Returns 1 if cl joined one,
+// otherwise cl's request is registered for others to join and 0 returned.
+int flight_join(struct client *cl, const char *kind)
+{
+    size_t *value;
+    int len = snprintf(cl->flight_key, sizeof(cl->flight_key), "%s %s", kind, cl->filename);
+
+    for (int i = 0; i < cl->range_argc && len < (int)sizeof(cl->flight_key); i++)
+        len += snprintf(cl->flight_key + len, sizeof(cl->flight_key) - len, " %s", cl->range_args[i]);
+    if (len >= (int)sizeof(cl->flight_key))
+    {
+        cl->flight_key[0] = '\0'; // Served on its own
+        return 0;
+    }
+    if ((value = dfs_map_get(&flights, cl->flight_key)) != NULL)
+    {
+        struct client *leader = (struct client *)*value;
+
+        cl->flight_key[0] = '\0';
+        cl->leader = leader;
+        cl->follower_next = leader->followers;
+        leader->followers = cl;
+        dfs_conn_hold(cl->conn); // Released with the leader's
+        return 1;
+    }
+    if (dfs_map_put(&flights, cl->flight_key, (size_t)cl) < 0)
+        cl->flight_key[0] = '\0';
+    return 0;
+}
+
+// Function to close a request to clients joining it, once its reply starts or it is over
+void flight_seal(struct client *cl)
+{
+    if (cl->flight_key[0] == '\0')
+        return;
+    dfs_map_del(&flights, cl->flight_key);
+    cl->flight_key[0] = '\0';
+}
+
+// Function to hand a shared request over to the first of its followers, as its leader goes away
+void flight_promote(struct client *cl)
+{
+    struct client *next = cl->followers;
+    int hedge_planned = cl->hedge_at != 0;
+
+    hedge_cancel(cl);
+    next->leader = NULL;
+    next->followers = next->follower_next;
+    next->follower_next = NULL;
+    for (struct client *f = next->followers; f != NULL; f = f->follower_next)
+        f->leader = next;
+    cl->followers = NULL;
+
+    // The relays and the progress of the fetch or archive, next asked for the same
+    next->relay = cl->relay;
+    next->hedge = cl->hedge;
+    next->hedged = cl->hedged;
+    if (next->relay != NULL)
+        next->relay->client = next;
+    if (next->hedge != NULL)
+        next->hedge->client = next;
+    cl->relay = cl->hedge = NULL;
+    memcpy(next->nodes, cl->nodes, sizeof(cl->nodes));
+    next->node_count = cl->node_count;
+    next->node_next = cl->node_next;
+    next->tar_sent = cl->tar_sent;
+    next->gzip = cl->gzip;
+    if (next->gzip != NULL)
+        next->gzip->data = next;
+    cl->gzip = NULL;
+    for (int slot = 0; slot < DFS_ROUTE_MAX_NODES; slot++)
+    {
+        next->ranges[slot] = cl->ranges[slot];
+        next->ranges_len[slot] = cl->ranges_len[slot];
+        cl->ranges[slot] = NULL;
+        cl->ranges_len[slot] = 0;
+    }
+    next->journal_members = cl->journal_members;
+    next->journal_count = cl->journal_count;
+    next->journal_next = cl->journal_next;
+    next->journal_pos = cl->journal_pos;
+    next->journal_active = cl->journal_active;
+    next->journal_time = cl->journal_time;
+    cl->journal_members = NULL;
+    cl->journal_count = cl->journal_next = 0;
+    cl->journal_active = 0;
+    if (cl->flight_key[0] != '\0')
+    {
+        snprintf(next->flight_key, sizeof(next->flight_key), "%s", cl->flight_key);
+        flight_seal(cl);
+        if (dfs_map_put(&flights, next->flight_key, (size_t)next) < 0)
+            next->flight_key[0] = '\0';
+    }
+    if (hedge_planned && next->relay != NULL)
+        hedge_plan(next, next->relay);
+}
+
+// Function to answer a request, and the clients sharing it, with an error
+void flight_error(struct client *cl, int opcode, int status, const char *msg)
+{
+    dfs_conn_send_error(cl->conn, opcode, cl->req_id, status, msg);
+    for (struct client *f = cl->followers; f != NULL; f = f->follower_next)
+        dfs_conn_send_error(f->conn, opcode, f->req_id, status, msg);
+    flight_release(cl);
+}
+
+// Function to end a request whose reply is queued, and go on with the next requests of the clients
+// that shared it
+void flight_release(struct client *cl)
+{
+    struct client *f = cl->followers;
+
+    flight_seal(cl);
+    if (cl->gzip != NULL)
+        dfs_gzip_close(cl->gzip);
+    cl->gzip = NULL;
+    cl->followers = NULL;
+    for (struct client *g = f; g != NULL; g = g->follower_next)
+        g->leader = NULL;
+    while (f != NULL)
+    {
+        struct client *next = f->follower_next;
+        f->follower_next = NULL;
+        dfs_conn_release(f->conn);
+        f = next;
+    }
+    dfs_conn_release(cl->conn);
+}
+
+// Function to drop the connections of a request, and of the clients sharing it, whose reply
+// cannot be completed
+void flight_close(struct client *cl)
+{
+    struct client *f = cl->followers;
+
+    flight_seal(cl);
+    cl->followers = NULL;
+    for (struct client *g = f; g != NULL; g = g->follower_next)
+        g->leader = NULL;
+    while (f != NULL)
+    {
+        struct client *next = f->follower_next;
+        f->follower_next = NULL;
+        dfs_conn_close(f->conn);
+        f = next;
+    }
+    dfs_conn_close(cl->conn);
+}
+
+// Function to forward a request with argc arguments to a storage server over its connection pool.
+// The request header is queued right away, body_len body bytes must be queued by the caller on
+// r->call.link->conn. Returns NULL on failure.
+struct relay *start_relay(struct client *cl, int mode, int opcode, int argc, const char **argv, const char *server_ip,
+                          int server_port, uint64_t body_len, void (*done)(struct client *, struct relay *))
+{
+    struct dfs_backend *backend = dfs_pool_get(cl->conn->loop, server_ip, server_port);
+    struct relay *r = (struct relay *)calloc(1, sizeof(struct relay));
+    if (backend == NULL || r == NULL)
+    {
+        free(r);
+        return NULL;
+    }
+    r->call.ops = &relay_ops;
+    r->client = cl;
+    r->mode = mode;
+    r->opcode = opcode;
+    r->slot = -1;
+    r->done = done;
+
+    // Queue the request on the least busy connection to the storage server
+    if (dfs_pool_call(backend, &r->call, opcode, argc, argv, body_len) < 0)
+    {
+        free(r);
+        return NULL;
+    }
+    cl->relay = r;
+    return r;
+}
+
+// Function to complete a relay and hand the outcome to its continuation
+void relay_finish(struct relay *r, int status, int failed, const char *msg)
+{
+    struct client *cl = r->client;
+
+    if (r->finished)
+        return;
+    r->finished = 1;
+    r->status = status;
+    r->failed = failed;
+    if (msg != NULL)
+        r->msg_len = snprintf(r->msg, BUFFER_SIZE, "%s", msg);
+
+    if (cl != NULL)
+    {
+        if (cl->relay == r)
+            cl->relay = NULL;
+        if (cl->hedge == r)
+            cl->hedge = NULL;
+        r->client = NULL;
+        if (failed && r->mode == RELAY_STREAM && r->started)
+            flight_close(cl); // A half relayed reply cannot be completed
+        else
+            r->done(cl, r);
+    }
+}
+
+// Continuation of relays whose outcome is a plain status reply
+void relay_status_done(struct client *cl, struct relay *r)
+{
+    // A fetch that ran while the upload did may have cached the old contents
+    dfs_cache_remove(&caching.cache, cl->filename);
+    if (r->status == 0 && (!cl->ranged || cl->part.commit))
+        ns_confirmed(r->slot, r->opcode, cl->filename);
+    if (r->status != 0)
+        dfs_conn_send_error(cl->conn, r->opcode, cl->req_id, r->status, r->msg);
+    else
+        dfs_conn_send_frame(cl->conn, r->opcode, DFS_F_REPLY, 0, cl->req_id, NULL, 0);
+    dfs_conn_release(cl->conn);
+}
+
+// A reply frame header arrived from the storage server
+void relay_frame(struct dfs_call *call, struct dfs_hdr *hdr, char **argv)
+{
+    struct relay *r = (struct relay *)call;
+    struct client *cl = r->client;
+    uint64_t body_len = hdr->length - hdr->arglen;
+
+    r->hdr = *hdr;
+    r->msg_len = 0;
+    r->body_left = body_len;
+    r->passed = 0;
+    snprintf(r->arg, sizeof(r->arg), "%s", hdr->arglen > 0 ? argv[0] : "");
+
+    // Streamed replies are passed on frame by frame under the client's request id. The parts of
+    // a chained reply are not the end of it, their errors and empty frames are not passed on, nor
+    // are the errors of a copy another one can stand in for.
+    if (cl != NULL && r->mode == RELAY_STREAM && !((r->chained || r->failover) && hdr->status != 0) &&
+        !(r->chained && body_len == 0))
+    {
+        uint16_t flags = DFS_F_REPLY | (r->chained ? DFS_F_MORE : hdr->flags & DFS_F_MORE);
+        if (!r->started && (cl->hedge_at != 0 || cl->hedged))
+            fetch_won(cl, r);
+        // The arguments of the reply, the size of the whole file for a range, go along as they are,
+        // to the clients sharing the request too. Once the reply started, no other can join it.
+        // A compressed archive leaves in frames of its own.
+        flight_seal(cl);
+        for (struct client *c = cl->gzip == NULL ? cl : NULL; c != NULL; c = c == cl ? cl->followers : c->follower_next)
+        {
+            dfs_conn_write_hdr(c->conn, r->opcode, flags, hdr->status, c->req_id, hdr->arglen, hdr->length);
+            dfs_conn_write(c->conn, argv[0], hdr->arglen);
+        }
+        r->started = r->passed = 1;
+
+        // Whole replies move from the storage server to the client through a pipe, the pipe
+        // bounds the bytes in flight so a slow client slows down the storage server. A shared
+        // reply, or a whole file the cache wants, is passed on by relay_body instead.
+        if (body_len > 0 && r->opcode == DFS_OP_DFILE && hdr->status == 0 && !(hdr->flags & DFS_F_MORE) &&
+            (!cl->ranged || (cl->range_off == 0 && strtoull(r->arg, NULL, 10) == body_len)) &&
+            dfs_cache_wants(&caching.cache, cl->filename, body_len) && (r->cache_data = malloc(body_len)) != NULL)
+        {
+            r->cache_len = body_len;
+            r->cache_gen = dfs_cache_generation(&caching.cache, cl->filename);
+            snprintf(r->cache_key, BUFFER_SIZE, "%s", cl->filename);
+        }
+        if (body_len > 0 && r->cache_data == NULL && cl->followers == NULL && cl->gzip == NULL)
+            dfs_call_splice(call, cl->conn);
+    }
+}
+
+// Part of a reply body arrived from the storage server
+void relay_body(struct dfs_call *call, const char *data, size_t len)
+{
+    struct relay *r = (struct relay *)call;
+    struct client *cl = r->client;
+
+    r->body_left -= len;
+    if (cl == NULL)
+        return; // Nobody waits for the reply any more
+
+    if (r->mode == RELAY_PART && r->hdr.status == 0)
+    {
+        // Pass the data on, and stop reading while the client is behind
+        relay_lines(r, cl, data, len);
+        if (!cl->conn->closed && dfs_conn_congested(cl->conn))
+            dfs_call_pause(call);
+    }
+    else if (r->mode == RELAY_STREAM && r->passed)
+    {
+        // The same, to every client sharing the reply, until the slowest of them is behind. An
+        // archive to compress goes to the compressor, until it is behind.
+        int congested = cl->gzip != NULL && dfs_gzip_busy(cl->gzip);
+
+        if (cl->gzip != NULL && dfs_gzip_write(cl->gzip, data, len) < 0)
+        {
+            flight_close(cl); // Out of memory, the archive cannot be completed
+            return;
+        }
+        for (struct client *c = cl; c != NULL; c = c == cl ? cl->followers : c->follower_next)
+        {
+            if (cl->gzip == NULL)
+                dfs_conn_write(c->conn, data, len);
+            congested |= !c->conn->closed && dfs_conn_congested(c->conn);
+        }
+        if (r->cache_data != NULL && len <= r->cache_len - r->cache_got)
+        {
+            memcpy(r->cache_data + r->cache_got, data, len);
+            r->cache_got += len;
+        }
+        if (congested)
+            dfs_call_pause(call);
+    }
+    else
+    {
+        // Keep the message of a status reply or of an error
+        size_t n = BUFFER_SIZE - 1 - r->msg_len;
+        if (n > len)
+            n = len;
+        memcpy(r->msg + r->msg_len, data, n);
+        r->msg_len += n;
+        r->msg[r->msg_len] = '\0';
+    }
+}
+
+// Pass the complete lines of a part on as a reply frame of their own, so parts arriving at the
+// same time never mix within a line. A partial last line waits in msg for the rest.
+void relay_lines(struct relay *r, struct client *cl, const char *data, size_t len)
+{
+    size_t n = len; // Bytes of data passed on now
+    int whole;      // Everything goes: the frame is complete or the line too long to keep
+
+    while (n > 0 && data[n - 1] != '\n')
+        n--;
+    whole = r->body_left == 0 || r->msg_len + (len - n) >= BUFFER_SIZE;
+    if (whole)
+        n = len;
+
+    if ((n > 0 || (whole && r->msg_len > 0)) && r->opcode == DFS_OP_DISPLAY && journal.pending > 0)
+    {
+        // Files the journal holds were listed from it already
+        char *lines = (char *)malloc(r->msg_len + n);
+        size_t kept = 0;
+
+        r->started = 1;
+        if (lines != NULL)
+        {
+            memcpy(lines, r->msg, r->msg_len);
+            memcpy(lines + r->msg_len, data, n);
+            kept = listing_drop_journaled(cl->full_path, lines, r->msg_len + n);
+            dfs_conn_send_frame(cl->conn, r->opcode, DFS_F_REPLY | DFS_F_MORE, 0, cl->req_id, lines, kept);
+        }
+        free(lines); // Without memory the lines are left out, like a part that failed
+        r->msg_len = 0;
+    }
+    else if (n > 0 || (whole && r->msg_len > 0))
+    {
+        r->started = 1;
+        dfs_conn_write_hdr(cl->conn, r->opcode, DFS_F_REPLY | DFS_F_MORE, 0, cl->req_id, 0, r->msg_len + n);
+        dfs_conn_write(cl->conn, r->msg, r->msg_len);
+        dfs_conn_write(cl->conn, data, n);
+        r->msg_len = 0;
+    }
+    memcpy(r->msg + r->msg_len, data + n, len - n);
+    r->msg_len += len - n;
+}
+
+// The reply is complete, or the connection carrying it failed
+void relay_end(struct dfs_call *call, int status, int failed)
+{
+    struct relay *r = (struct relay *)call;
+
+    if (failed && !r->finished)
+        printf(status == ETIMEDOUT ? "Storage server too slow to answer\n" : "Storage server connection lost\n");
+    relay_finish(r, status, failed, failed ? (status == ETIMEDOUT ? "Storage server timed out" : "Storage server unavailable") : NULL);
+
+    // A file collected whole is offered to the cache, unless it changed while it was fetched
+    if (r->cache_data != NULL && !failed && r->cache_got == r->cache_len &&
+        r->cache_gen == dfs_cache_generation(&caching.cache, r->cache_key))
+        dfs_cache_put(&caching.cache, r->cache_key, r->cache_data, r->cache_len);
+    else
+        free(r->cache_data);
+    free(r); // The pool no longer refers to the call
+}
 
 // Function to expand a tilde (~) in the path to the user's home directory
 void expand_tilde(char *path)
@@ -707,38 +3122,766 @@ void expand_tilde(char *path)
     }
 }
 
-// Function to replace "/smain/" with "/spdf/" in the path and update it to point to the Spdf server
-void replace_smain_with_spdf(char *path)
+// Build the namespace index of this worker: the .c files below ~/smain from a scan kept current
+// by inotify, the files of the other types from subscriptions to the storage nodes
+void ns_start(struct dfs_loop *loop)
+{
+    ns.started = 1;
+    snprintf(ns.root, BUFFER_SIZE, "%s/smain", getenv("HOME"));
+    mkdir(ns.root, S_IRWXU);
+    ns.local_ready = dfs_notify_start(loop, &ns.local, ns.root, ns_local_event, NULL) == 0;
+    if (pack.ready)
+        dfs_pack_each(&pack, ns_packed, NULL); // Changes from now on come from ns_pack_event
+
+    ns_follow_routes(loop);
+    if (dfs_timer_start(loop, &ns.timer, WATCH_RETRY, ns_retry, loop) < 0)
+        perror("timerfd failed"); // Servers that go away are then listed by asking them
+
+    // One worker moves the files the table places elsewhere, the table may have changed while
+    // Smain was down
+    rebalance.loop = loop;
+    rebalance.enabled = opts.index == 0;
+    rebalance.dirty = 1;
+}
+
+// Subscribe to the storage nodes of the routing table, dropping the subscriptions (and what the
+// index holds from them) of nodes that left the table or whose slot now holds another node
+void ns_follow_routes(struct dfs_loop *loop)
+{
+    for (int slot = 0; slot < DFS_ROUTE_MAX_NODES; slot++)
+    {
+        struct subscription *sub = &ns.subs[slot];
+        const struct dfs_route_node *node = &routes.nodes[slot];
+
+        if (sub->conn != NULL && (!node->used || strcmp(sub->host, node->host) != 0 || sub->port != node->port))
+            dfs_conn_close(sub->conn); // Forgets the node's files
+        if (!node->used || sub->conn != NULL)
+            continue;
+        sub->source = SRC_NODE + slot;
+        snprintf(sub->host, sizeof(sub->host), "%s", node->host);
+        sub->port = node->port;
+        ns_subscribe(sub, loop);
+    }
+}
+
+// A change below ~/smain, only .c files are Smain's own
+void ns_local_event(struct dfs_notify *n, int event, const char *path)
+{
+    size_t len = strlen(path);
+
+    (void)n;
+    if ((event == DFS_NOTIFY_ADD || event == DFS_NOTIFY_DEL) && (len < 2 || strcmp(path + len - 2, ".c") != 0))
+        return;
+
+    // A file stored in the pack replaced the file of an older version: it is still there
+    char canonical[PATH_MAX];
+    if (event == DFS_NOTIFY_DEL && pack.ready &&
+        snprintf(canonical, sizeof(canonical), "%s/%s", pack.root, path) < (int)sizeof(canonical) &&
+        dfs_pack_has(&pack, canonical))
+        return;
+    ns_update(SRC_LOCAL, event, path);
+
+    // Forgetting everything forgot the packed files too, the scan only finds the others
+    if (event == DFS_NOTIFY_RESET && pack.ready)
+        dfs_pack_each(&pack, ns_packed, NULL);
+}
+
+// A .c file was stored in the pack or removed from it, by any worker
+void ns_pack_event(struct dfs_pack *p, int event, const char *path)
+{
+    struct stat st;
+
+    if (!ns.started)
+        return; // The worker's index takes the pack as it is when it starts
+    if (event == DFS_NOTIFY_DEL && stat(path, &st) == 0)
+        return; // Replaced by a file of its own, inotify reported that
+    ns_update(SRC_LOCAL, event, path + strlen(p->root) + 1);
+}
+
+// A file of the pack, entered into the index of a worker
+void ns_packed(const struct dfs_pack_object *o, void *data)
+{
+    (void)data;
+    ns_update(SRC_LOCAL, DFS_NOTIFY_ADD, o->path + strlen(pack.root) + 1);
+}
+
+// Apply a change reported by a source to the index, path is relative to ~/smain
+void ns_update(int source, int event, const char *path)
+{
+    char dir[BUFFER_SIZE]; // Directory of the index the change concerns
+    const char *slash = strrchr(path, '/');
+    const char *name = slash ? slash + 1 : path;
+    size_t dir_len = slash ? (size_t)(slash - path) : 0;
+
+    if (event == DFS_NOTIFY_ADD_DIR || event == DFS_NOTIFY_DEL_DIR || event == DFS_NOTIFY_RESET)
+        dir_len = strlen(path); // The path names the directory itself
+    if (snprintf(dir, BUFFER_SIZE, "%s%s%.*s", ns.root, dir_len ? "/" : "", (int)dir_len, path) >= BUFFER_SIZE)
+        return;
+
+    if (event == DFS_NOTIFY_ADD)
+        dfs_index_add(&ns.index, dir, name, source);
+    else if (event == DFS_NOTIFY_DEL)
+        dfs_index_remove(&ns.index, dir, name, source);
+    else if (event == DFS_NOTIFY_ADD_DIR)
+        dfs_index_add_dir(&ns.index, dir, source);
+    else if (event == DFS_NOTIFY_DEL_DIR || event == DFS_NOTIFY_RESET)
+        dfs_index_remove_tree(&ns.index, dir, source);
+
+    // Files a storage node stored or removed, whichever worker it was for, are no longer what the
+    // cache holds. Removed trees drop everything, they are rare.
+    if (source == SRC_LOCAL)
+        return;
+    if (event == DFS_NOTIFY_ADD || event == DFS_NOTIFY_DEL)
+        dfs_cache_remove(&caching.cache, path);
+    else if (event == DFS_NOTIFY_DEL_DIR || event == DFS_NOTIFY_RESET)
+        dfs_cache_clear(&caching.cache);
+}
+
+// A storage node confirmed that it stored or removed the file at rel, as route_file sets it. The
+// index takes that in at once, a display right after the request must not wait for the node to
+// push the change; the push applies it again to no effect.
+void ns_confirmed(int slot, int opcode, const char *rel)
+{
+    if (!ns.started || slot < 0 || rel[0] == '/')
+        return; // Outside ~/smain, the index has nothing there
+    if (opcode == DFS_OP_UFILE)
+    {
+        // The node created the directories the file goes in
+        ns_update(SRC_NODE + slot, DFS_NOTIFY_ADD_DIR, "");
+        for (const char *slash = strchr(rel, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+        {
+            char dir[BUFFER_SIZE];
+            snprintf(dir, sizeof(dir), "%.*s", (int)(slash - rel), rel);
+            ns_update(SRC_NODE + slot, DFS_NOTIFY_ADD_DIR, dir);
+        }
+        ns_update(SRC_NODE + slot, DFS_NOTIFY_ADD, rel);
+    }
+    else if (opcode == DFS_OP_RMFILE)
+        ns_update(SRC_NODE + slot, DFS_NOTIFY_DEL, rel);
+}
+
+// Ask a storage server for its files and its changes from then on
+void ns_subscribe(struct subscription *sub, struct dfs_loop *loop)
+{
+    sub->synced = 0;
+    sub->carry_len = 0;
+    if ((sub->conn = dfs_conn_connect(loop, sub->host, sub->port, &subscription_ops, sub)) == NULL)
+        return;
+    dfs_conn_set_background(sub->conn); // Must not keep the worker's loop running
+    dfs_conn_send_request(sub->conn, DFS_OP_WATCH, 1, 0, NULL, 0);
+}
+
+// Subscribe again to servers that went away, and follow changes of the routing table
+void ns_retry(struct dfs_timer *timer)
+{
+    struct dfs_loop *loop = (struct dfs_loop *)timer->data;
+
+    routes_refresh(loop);
+    for (int slot = 0; slot < DFS_ROUTE_MAX_NODES; slot++)
+    {
+        if (routes.nodes[slot].used && ns.subs[slot].conn == NULL)
+            ns_subscribe(&ns.subs[slot], loop);
+    }
+    rebalance_tick();
+}
+
+// A frame of change records, or the error of a server that cannot watch its store
+void ns_sub_frame(struct dfs_conn *conn, struct dfs_hdr *hdr, char **argv)
+{
+    struct subscription *sub = (struct subscription *)conn->data;
+
+    (void)argv;
+    sub->hdr = *hdr;
+    if (hdr->status != 0)
+        fprintf(stderr, "Storage server %s:%d cannot report its changes\n", sub->host, sub->port);
+}
+
+// Change records arrived, apply the complete ones
+void ns_sub_body(struct dfs_conn *conn, const char *data, size_t len)
+{
+    struct subscription *sub = (struct subscription *)conn->data;
+
+    if (sub->hdr.status != 0)
+        return;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (data[i] != '\n')
+        {
+            if (sub->carry_len == sizeof(sub->carry) - 1)
+            {
+                dfs_conn_close(conn); // Not a record, subscribe again
+                return;
+            }
+            sub->carry[sub->carry_len++] = data[i];
+            continue;
+        }
+        sub->carry[sub->carry_len] = '\0';
+        ns_apply(sub, sub->carry);
+        sub->carry_len = 0;
+    }
+}
+
+// The last frame of a subscription only comes with an error, retried later
+void ns_sub_body_end(struct dfs_conn *conn)
+{
+    struct subscription *sub = (struct subscription *)conn->data;
+
+    if (!(sub->hdr.flags & DFS_F_MORE))
+        dfs_conn_close(conn);
+}
+
+// The subscription ended: what the server reported can no longer be trusted
+void ns_sub_close(struct dfs_conn *conn)
+{
+    struct subscription *sub = (struct subscription *)conn->data;
+
+    sub->conn = NULL;
+    sub->synced = 0;
+    dfs_index_remove_tree(&ns.index, ns.root, sub->source);
+}
+
+// Apply one change record: "<type> <path>" with type A (file added), D (file removed),
+// M (directory added), X (directory removed), R (forget everything) or S (caught up)
+void ns_apply(struct subscription *sub, char *record)
+{
+    static const char types[] = "ADMXR"; // Records of DFS_NOTIFY_ADD .. DFS_NOTIFY_RESET
+    const char *type;
+
+    if (record[0] == '\0' || record[1] != ' ')
+        return;
+    if (record[0] == 'S')
+    {
+        sub->synced = 1;
+        return;
+    }
+    if ((type = strchr(types, record[0])) == NULL)
+        return;
+    if (record[0] == 'R')
+        sub->synced = 0; // Until the server has reported everything again
+    ns_update(sub->source, (int)(type - types), record + 2);
+}
+
+// Key of the index for a directory or file path below ~/smain, returns 0 if the index cannot
+// answer for it (not below ~/smain, or not spelled the way the index spells paths)
+int ns_path(const char *path, char *key)
+{
+    size_t root_len = strlen(ns.root);
+    size_t len;
+
+    if (!ns.started)
+        return 0;
+    snprintf(key, BUFFER_SIZE, "%s", path);
+    expand_tilde(key);
+    len = strlen(key);
+    while (len > 1 && key[len - 1] == '/')
+        key[--len] = '\0';
+
+    if (strncmp(key, ns.root, root_len) != 0 || (key[root_len] != '\0' && key[root_len] != '/'))
+        return 0;
+    if (strstr(key, "//") != NULL || strstr(key, "/./") != NULL || strstr(key, "/../") != NULL ||
+        (len >= 2 && strcmp(key + len - 2, "/.") == 0) || (len >= 3 && strcmp(key + len - 3, "/..") == 0))
+        return 0;
+    return 1;
+}
+
+// Whether the .c file at path exists according to the index: 1 or 0, -1 if it cannot tell
+int ns_has_local(const char *path)
+{
+    char key[BUFFER_SIZE];
+    char *slash;
+
+    if (!ns.local_ready || !ns_path(path, key) || (slash = strrchr(key, '/')) == NULL)
+        return -1;
+    dfs_notify_poll(&ns.local); // Changes made up to now count
+    dfs_pack_poll(&pack);
+    *slash = '\0';
+    return dfs_index_has(&ns.index, key, slash + 1, SRC_LOCAL);
+}
+
+// Start moving files if the routing table changed and the index holds every node's files. Copies
+// of a replicated upload that failed after it succeeded are made up for by the periodic pass.
+void rebalance_tick(void)
+{
+    if (rebalance.enabled && dfs_now_ms() >= rebalance.next_pass)
+    {
+        rebalance.dirty = 1;
+        rebalance.next_pass = dfs_now_ms() + REBALANCE_PERIOD;
+    }
+    if (!rebalance.enabled || !rebalance.dirty || rebalance.move != NULL || dfs_now_ms() < rebalance.not_before)
+        return;
+    for (int slot = 0; slot < DFS_ROUTE_MAX_NODES; slot++)
+    {
+        const struct dfs_route_node *node = &routes.nodes[slot];
+        struct dfs_backend *backend;
+
+        if (node->used && !ns.subs[slot].synced)
+            return; // Files it holds could be missed or moved onto it twice
+        if (node->used && ((backend = dfs_pool_get(rebalance.loop, node->host, node->port)) == NULL ||
+                           dfs_backend_cost(backend) == INT64_MAX))
+            return; // Back, but its pooled connections are not yet
+    }
+    rebalance_scan();
+    rebalance_next();
+}
+
+// Plan a batch of moves: copies of files missing on the nodes the table places them on, and
+// copies on other nodes once all of those are there
+void rebalance_scan(void)
+{
+    size_t root_len = strlen(ns.root);
+    char path[BUFFER_SIZE]; // File relative to ~/smain
+
+    rebalance.count = rebalance.next = 0;
+    rebalance.progress = rebalance.failures = 0;
+    for (size_t i = 0; i < ns.index.dirs.size && rebalance.count < REBALANCE_BATCH; i++)
+    {
+        struct dfs_index_dir *d = ns.index.dirs.keys[i] != NULL ? (struct dfs_index_dir *)ns.index.dirs.values[i] : NULL;
+        const char *dir;
+
+        if (d == NULL)
+            continue;
+        dir = d->path[root_len] == '/' ? d->path + root_len + 1 : d->path + root_len; // Relative to ~/smain
+        for (size_t j = 0; j < d->count && rebalance.count < REBALANCE_BATCH; j++)
+        {
+            if (snprintf(path, BUFFER_SIZE, "%s%s%s", dir, dir[0] ? "/" : "", d->entries[j].name) < BUFFER_SIZE)
+                rebalance_plan(path, d->entries[j].sources >> SRC_NODE);
+        }
+    }
+    if (rebalance.count > 0)
+        printf("Rebalancing: %zu copies to make or drop\n", rebalance.count);
+}
+
+// Plan the moves of one file, held by the nodes of a mask of slots
+void rebalance_plan(const char *path, unsigned holders)
+{
+    int replicas[DFS_ROUTE_MAX_COPIES], count, from = -1;
+    unsigned wanted = 0, missing, todo;
+
+    for (int slot = 0; slot < DFS_ROUTE_MAX_NODES && from < 0; slot++)
+    {
+        if ((holders & (1u << slot)) && routes.nodes[slot].used)
+            from = slot;
+    }
+    if (from < 0 || (count = dfs_route_replicas(&routes, routes.nodes[from].type, path, replicas)) == 0)
+        return; // Only on Smain's disk, or on nodes the table no longer has
+    for (int i = 0; i < count; i++)
+        wanted |= 1u << replicas[i];
+
+    // Missing copies are made first, the others are dropped by a later pass once the index has them
+    missing = wanted & ~holders;
+    todo = missing != 0 ? missing : holders & ~wanted;
+    for (int slot = 0; slot < DFS_ROUTE_MAX_NODES && rebalance.count < REBALANCE_BATCH; slot++)
+    {
+        struct rebalance_move *m = &rebalance.moves[rebalance.count];
+
+        if (!(todo & (1u << slot)))
+            continue;
+        m->from = missing != 0 ? from : slot;
+        m->to = missing != 0 ? slot : -1;
+        snprintf(m->path, BUFFER_SIZE, "%s", path);
+        rebalance.count++;
+    }
+}
+
+// Make the next move of the batch that still applies, or wrap the batch up
+void rebalance_next(void)
+{
+    while (rebalance.next < rebalance.count)
+    {
+        struct rebalance_move *m = &rebalance.moves[rebalance.next++];
+        const struct dfs_route_node *from = &routes.nodes[m->from], *to = m->to >= 0 ? &routes.nodes[m->to] : NULL;
+        char key[BUFFER_SIZE]; // Directory of the file in the index
+        const char *name = strrchr(m->path, '/');
+        int replicas[DFS_ROUTE_MAX_COPIES], count;
+        unsigned holders, wanted = 0;
+        struct dfs_backend *backend;
+        const char *arg = rebalance.from_path;
+
+        // The table or the file may have changed since the batch was planned
+        if (snprintf(key, BUFFER_SIZE, "%s%s%.*s", ns.root, name ? "/" : "", name ? (int)(name - m->path) : 0,
+                     m->path) >= BUFFER_SIZE)
+            continue; // Not a directory the index can hold
+        name = name ? name + 1 : m->path;
+        holders = dfs_index_sources(&ns.index, key, name) >> SRC_NODE;
+        if (!from->used || (to != NULL && (!to->used || strcmp(from->type, to->type) != 0)))
+            continue;
+        count = dfs_route_replicas(&routes, from->type, m->path, replicas);
+        for (int i = 0; i < count; i++)
+            wanted |= 1u << replicas[i];
+        if (!(holders & (1u << m->from)) ||
+            (to != NULL ? !(wanted & ~holders & (1u << m->to)) : (wanted & (1u << m->from)) || (wanted & ~holders)))
+            continue;
+
+        if (node_path(from, m->path, rebalance.from_path) < 0 ||
+            (to != NULL && node_path(to, m->path, rebalance.to_path) < 0))
+            continue; // Cannot be named on one of the nodes, the move would never work
+        rebalance.move = m;
+        if (to == NULL)
+        {
+            // The copy is no longer wanted, every wanted one is there
+            rebalance.del.ops = &move_del_ops;
+            if ((backend = dfs_pool_get(rebalance.loop, from->host, from->port)) == NULL ||
+                dfs_pool_call(backend, &rebalance.del, DFS_OP_RMFILE, 1, &arg, 0) < 0)
+            {
+                rebalance.move = NULL;
+                rebalance.failures++;
+                continue;
+            }
+            return; // Continued by move_del_end
+        }
+
+        rebalance.get_ended = rebalance.get_ok = 0;
+        rebalance.put_started = rebalance.put_ended = rebalance.put_ok = 0;
+        rebalance.get.ops = &move_get_ops;
+        if ((backend = dfs_pool_get(rebalance.loop, from->host, from->port)) == NULL ||
+            dfs_pool_call(backend, &rebalance.get, DFS_OP_DFILE, 1, &arg, 0) < 0)
+        {
+            rebalance.move = NULL;
+            rebalance.failures++;
+            continue;
+        }
+        return; // Continued by the callbacks of the steps
+    }
+
+    if (rebalance.count > 0)
+        printf("Rebalancing: %d copies made or dropped, %d failed\n", rebalance.progress, rebalance.failures);
+    // Copies made let the next pass drop the ones no longer wanted, failed moves are tried again later
+    rebalance.dirty = rebalance.progress > 0 || rebalance.failures > 0;
+    if (rebalance.failures > 0)
+        rebalance.not_before = dfs_now_ms() + REBALANCE_RETRY;
+    rebalance.count = rebalance.next = 0;
+}
+
+// The reply to the fetch: a file goes on to the new node as it arrives
+void move_get_frame(struct dfs_call *call, struct dfs_hdr *hdr, char **argv)
+{
+    const struct dfs_route_node *to = &routes.nodes[rebalance.move->to];
+    uint64_t body_len = hdr->length - hdr->arglen;
+    const char *arg = rebalance.to_path;
+    struct dfs_backend *backend;
+
+    (void)argv;
+    if (hdr->status != 0)
+        return; // Gone meanwhile, its message is dropped
+    rebalance.put_started = 1;
+    rebalance.put.ops = &move_put_ops;
+    if ((backend = dfs_pool_get(rebalance.loop, to->host, to->port)) == NULL ||
+        dfs_pool_call(backend, &rebalance.put, DFS_OP_UFILE, 1, &arg, body_len) < 0)
+    {
+        rebalance.put_started = 0;
+        return;
+    }
+    if (body_len > 0)
+        dfs_call_splice(call, rebalance.put.link->conn); // Otherwise passed on by move_get_body
+}
+
+// Part of the file arrived without being spliced
+void move_get_body(struct dfs_call *call, const char *data, size_t len)
+{
+    (void)call;
+    if (rebalance.put_started && rebalance.put.link != NULL && rebalance.put.link->conn != NULL)
+        dfs_conn_write(rebalance.put.link->conn, data, len);
+}
+
+void move_get_end(struct dfs_call *call, int status, int failed)
+{
+    (void)call;
+    rebalance.get_ended = 1;
+    rebalance.get_ok = status == 0 && !failed;
+    if (!rebalance.get_ok && rebalance.put.link != NULL && rebalance.put.link->conn != NULL)
+        dfs_conn_close(rebalance.put.link->conn); // An upload missing part of its body cannot be completed
+    rebalance_step();
+}
+
+void move_put_end(struct dfs_call *call, int status, int failed)
+{
+    (void)call;
+    rebalance.put_ended = 1;
+    rebalance.put_ok = status == 0 && !failed;
+    rebalance_step();
+}
+
+void move_del_end(struct dfs_call *call, int status, int failed)
+{
+    (void)call;
+    rebalance_finish(status == 0 && !failed);
+}
+
+// Go on once the fetch and the upload are both over
+void rebalance_step(void)
+{
+    if (!rebalance.get_ended || (rebalance.put_started && !rebalance.put_ended))
+        return;
+    rebalance_finish(rebalance.get_ok && rebalance.put_ok);
+}
+
+// The move in progress is over, make the next one
+void rebalance_finish(int ok)
+{
+    int copied = rebalance.move->to >= 0;
+
+    if (ok)
+    {
+        if (copied)
+            printf("Rebalancing: copied %s to %s\n", rebalance.from_path, rebalance.to_path);
+        else
+            printf("Rebalancing: dropped %s\n", rebalance.from_path);
+        rebalance.progress++;
+    }
+    else
+    {
+        fprintf(stderr, "Rebalancing: could not %s %s\n", copied ? "copy" : "drop", rebalance.from_path);
+        rebalance.failures++;
+    }
+    rebalance.move = NULL;
+    rebalance_next();
+}
+
+// A file was journaled or removed from the journal, by any worker: the copy the cache holds is stale
+void journal_event(struct dfs_journal *j, const char *path)
+{
+    const char *below = strstr(path, "/smain/"); // Cached by the path route_file gives
+
+    (void)j;
+    dfs_cache_remove(&caching.cache, below != NULL ? below + strlen("/smain/") : path);
+}
+
+// Tick of every worker with -b: forward what the other workers journaled and what is due again,
+// and now and then remove the journal files this worker no longer needs
+void journal_tick(struct dfs_timer *timer)
+{
+    (void)timer;
+    forward_pump();
+    if (dfs_now_ms() < forwarder.next_tidy)
+        return;
+    forwarder.next_tidy = dfs_now_ms() + JOURNAL_TIDY;
+    dfs_journal_tidy(&journal);
+}
+
+// Send the pending uploads of the journal on, oldest first, while slots are free
+void forward_pump(void)
+{
+    static int pumping; // Uploads that end while they are started do not start others meanwhile
+    int64_t now = dfs_now_ms();
+
+    if (!forwarder.enabled || pumping || forwarder.busy == FORWARD_BATCH)
+        return;
+    pumping = 1;
+    dfs_journal_poll(&journal);
+    for (size_t i = 0; i < journal.count && forwarder.busy < FORWARD_BATCH; i++)
+    {
+        struct dfs_journal_entry *e = &journal.entries[i];
+        struct forward *f = NULL; // Free slot
+        int in_flight = 0;        // An older upload of the file is on its way, this one must not overtake it
+
+        if (!e->pending || e->not_before > now)
+            continue;
+        for (int k = 0; k < FORWARD_BATCH; k++)
+        {
+            if (forwarder.slots[k].busy)
+                in_flight |= strcmp(forwarder.slots[k].path, e->path) == 0;
+            else if (f == NULL)
+                f = &forwarder.slots[k];
+        }
+        if (!in_flight)
+            forward_start(f, e);
+    }
+    pumping = 0;
+}
+
+// Send a journaled upload to the storage nodes the routing table places the file on, and those
+// the index has it on, as for an upload of a client. Continued by forward_end.
+void forward_start(struct forward *f, struct dfs_journal_entry *e)
+{
+    char file_type[10] = "";        // File extension
+    char server_path[BUFFER_SIZE];  // The file on a node
+    const char *arg = server_path;
+    int replicas[DFS_ROUTE_MAX_COPIES], count, fd = -1;
+    unsigned holders = 0;
+    struct dfs_journal_entry found; // The newest upload of the file
+    struct dfs_backend *backend;
+
+    memset(f, 0, sizeof(*f));
+    f->busy = 1;
+    forwarder.busy++;
+    f->entry = *e; // e may move once calls end and the journal is synced
+    snprintf(f->path, BUFFER_SIZE, "%s", e->path);
+    f->entry.path = f->path;
+    f->pending = 1; // Held until every call is sent
+
+    sscanf(strrchr(f->path, '/') + 1, "%*[^.].%9s", file_type);
+    if ((count = route_file(file_type, f->path, replicas, &holders, f->rel)) > 0 &&
+        dfs_journal_find(&journal, f->path, &found, &fd) > 0 &&
+        (found.offset != f->entry.offset || strcmp(found.file, f->entry.file) != 0))
+    {
+        close(fd); // Superseded meanwhile
+        fd = -1;
+    }
+    if (count > 0 && fd >= 0)
+    {
+        f->needed = dfs_route_ring(&routes, file_type)->quorum;
+        for (int i = 0; i < count; i++)
+            holders |= 1u << replicas[i];
+        for (int slot = 0; slot < DFS_ROUTE_MAX_NODES; slot++)
+        {
+            const struct dfs_route_node *node = &routes.nodes[slot];
+            struct dfs_call *call = &f->calls[slot];
+
+            if (!(holders & (1u << slot)) || !node->used || node_path(node, f->rel, server_path) < 0)
+                continue;
+            call->ops = &forward_ops;
+            if ((backend = dfs_pool_get(forwarder.loop, node->host, node->port)) == NULL ||
+                dfs_pool_call(backend, call, DFS_OP_UFILE, 1, &arg, f->entry.size) < 0)
+                continue; // Counts as a copy that failed
+            f->pending++;
+            call->deadline = dfs_now_ms() + UPDATE_DEADLINE + f->entry.size / UPLOAD_MIN_RATE;
+
+            // The whole body is queued at once, so nothing else gets between the request and it
+            if (f->entry.size > 0)
+            {
+                int body = dup(fd);
+                if (body < 0)
+                    dfs_conn_close(call->link->conn); // Fails the copy
+                else
+                    dfs_conn_write_file(call->link->conn, body, f->entry.offset, f->entry.size);
+            }
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    if (--f->pending == 0)
+        forward_finish(f);
+}
+
+// A storage node answered a forwarded upload, or the removal of one
+void forward_end(struct dfs_call *call, int status, int failed)
+{
+    for (int k = 0; k < FORWARD_BATCH; k++)
+    {
+        struct forward *f = &forwarder.slots[k];
+
+        if (!f->busy || call < f->calls || call >= f->calls + DFS_ROUTE_MAX_NODES)
+            continue;
+        if (status == 0 && !failed)
+        {
+            f->stored |= 1u << (call - f->calls);
+            ns_confirmed((int)(call - f->calls), f->dropping ? DFS_OP_RMFILE : DFS_OP_UFILE, f->rel);
+        }
+        if (--f->pending == 0)
+            forward_finish(f);
+        return;
+    }
+}
+
+// Every node sent to answered: settle the upload in the journal once enough copies are stored,
+// or try it again later
+void forward_finish(struct forward *f)
+{
+    int copies = __builtin_popcount(f->stored);
+    struct dfs_journal_entry *e;
+
+    if (!f->dropping && f->needed > 0 && copies >= f->needed)
+    {
+        f->settling = 1; // Logged along with the others that end in this batch of events
+        return;
+    }
+    if (!f->dropping)
+        dfs_journal_poll(&journal);
+    if (!f->dropping && (e = dfs_journal_lookup(&journal, &f->entry)) != NULL)
+    {
+        int delay = e->tries < 10 ? FORWARD_RETRY_MIN << e->tries : FORWARD_RETRY_MAX;
+
+        if (delay > FORWARD_RETRY_MAX)
+            delay = FORWARD_RETRY_MAX;
+        e->tries++;
+        e->not_before = dfs_now_ms() + delay;
+        forwarder.retried++;
+        fprintf(stderr, "Could not forward %s (%d of %d copies stored), trying again in %d ms\n", f->path, copies,
+                f->needed, delay);
+    }
+    forward_free(f);
+}
+
+// Log the uploads stored on enough nodes as forwarded, with one sync for all that ended in the
+// batch of events just handled. Run by the loop before it waits for the next batch.
+void forward_settle(struct dfs_loop *loop)
 {
-    // Find the position of "/smain/" in the path
-    char *pos = strstr(path, "/smain/");
-    if (pos)
+    const struct dfs_journal_entry *entries[FORWARD_BATCH];
+    struct forward *settling[FORWARD_BATCH];
+    int done[FORWARD_BATCH];
+    size_t n = 0;
+
+    (void)loop;
+    for (int k = 0; k < FORWARD_BATCH; k++)
+    {
+        if (forwarder.slots[k].busy && forwarder.slots[k].settling)
+        {
+            settling[n] = &forwarder.slots[k];
+            entries[n++] = &forwarder.slots[k].entry;
+        }
+    }
+    if (n == 0)
+        return;
+    if (dfs_journal_forwarded(&journal, entries, n, done) < 0)
     {
-        // Move the position pointer to the end of "/smain/"
-        pos += strlen("/smain/");
-        // Temporary buffer to build the new path
-        char new_path[BUFFER_SIZE];
-        // Construct the new path by replacing "/smain/" with "/spdf/" and prepending the home directory
-        snprintf(new_path, BUFFER_SIZE, "%s/spdf/%s", getenv("HOME"), pos);
-        // Copy the new path back to the original path variable
-        strcpy(path, new_path);
+        // Pending still, the nodes get the same files again
+        for (size_t i = 0; i < n; i++)
+        {
+            settling[i]->settling = 0;
+            forward_free(settling[i]);
+        }
+        return;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        struct forward *f = settling[i];
+
+        f->settling = 0;
+        if (done[i])
+        {
+            // Copies that failed are made up for by the rebalancer, as for replicated uploads
+            printf("Forwarded %s to %d storage nodes\n", f->path, __builtin_popcount(f->stored));
+            forwarder.forwarded++;
+            forward_free(f);
+        }
+        else if (!dfs_journal_has(&journal, f->path))
+            forward_drop(f);
+        else
+            forward_free(f); // Superseded, the newer upload follows
     }
 }
 
-// Function to replace "/smain/" with "/stext/" in the path and update it to point to the Stext server
-void replace_smain_with_stext(char *path)
+// The file was removed while it was on its way: the copies it made go as well
+void forward_drop(struct forward *f)
 {
-    // Find the position of "/smain/" in the path
-    char *pos = strstr(path, "/smain/");
-    if (pos)
+    char server_path[BUFFER_SIZE];
+    const char *arg = server_path;
+    struct dfs_backend *backend;
+
+    printf("Removed while it was forwarded: %s, dropping %d copies\n", f->path, __builtin_popcount(f->stored));
+    f->dropping = 1;
+    f->pending = 1;
+    for (int slot = 0; slot < DFS_ROUTE_MAX_NODES; slot++)
     {
-        // Move the position pointer to the end of "/smain/"
-        pos += strlen("/smain/");
-        // Temporary buffer to build the new path
-        char new_path[BUFFER_SIZE];
-        // Construct the new path by replacing "/smain/" with "/stext/" and prepending the home directory
-        snprintf(new_path, BUFFER_SIZE, "%s/stext/%s", getenv("HOME"), pos);
-        // Copy the new path back to the original path variable
-        strcpy(path, new_path);
+        const struct dfs_route_node *node = &routes.nodes[slot];
+
+        if (!(f->stored & (1u << slot)) || !node->used || node_path(node, f->rel, server_path) < 0)
+            continue;
+        if ((backend = dfs_pool_get(forwarder.loop, node->host, node->port)) != NULL &&
+            dfs_pool_call(backend, &f->calls[slot], DFS_OP_RMFILE, 1, &arg, 0) == 0)
+        {
+            f->pending++;
+            f->calls[slot].deadline = dfs_now_ms() + UPDATE_DEADLINE;
+        }
     }
+    if (--f->pending == 0)
+        forward_finish(f); // Back there once they are over otherwise
+}
+
+// The slot is free for the next upload
+void forward_free(struct forward *f)
+{
+    f->busy = 0;
+    forwarder.busy--;
+    forward_pump();
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,230 +10,706 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include "dfs_proto.h"
+#include "dfs_loop.h"
+#include "dfs_server.h"
+#include "dfs_tar.h"
+#include "dfs_archive.h"
+#include "dfs_catalog.h"
+#include "dfs_route.h"
+#include "dfs_range.h"
+#include "dfs_uring.h"
+#include "dfs_commit.h"
 
 #define PORT 6061
 #define BUFFER_SIZE 1024
+#define MAX_RANGES_BODY (1024 * 1024) // Largest list of hash ranges a dtar may carry
 
-void handle_client(int client_sock);
-void ensure_directory_exists(char *path);
-void create_tarball(const char *filetype, const char *tarfile);
-
-int main()
+// State of one connection from Smain
+struct session
 {
-    int server_sock, client_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_size = sizeof(struct sockaddr_in);
-    pid_t child_pid;
-
-    // Creating a socket for communication
-    if ((server_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    struct dfs_conn *conn;      // Connection to Smain
+    uint32_t req_id;            // Id of the request being served
+    int opcode;                 // Opcode of the request being served
+    char filepath[BUFFER_SIZE]; // File named by the request
+    int upload_fd;              // File receiving an upload, -1 otherwise
+    struct dfs_uring_file *writer; // Or the upload written through io_uring with -u, which owns the file
+    struct dfs_commit *commit;  // Temporary file of a whole upload, moved into place once on disk
+    int upload_err;             // errno of a failed upload, answered once the body is drained
+    uint32_t upload_crc;        // CRC-32 of the upload received so far
+    int ranged;                 // The upload is a part of a file sent in ranges, or the download a range of the file
+    struct dfs_range_part part; // Where the part of a ranged upload goes, or the upload a stat asks about
+    uint64_t range_off;         // Range of a ranged download
+    uint64_t range_len;
+    struct dfs_tar tar;         // Archive being streamed by dtar
+    int tar_part;               // The dtar is one node's part of Smain's archive, without end blocks
+    char *ranges_text;          // Body of a dtar: the hash ranges of the files wanted
+    size_t ranges_len;          // Bytes of ranges_text in use
+    struct dfs_route_range *ranges; // Parsed ranges, NULL to send every file
+    int nranges;
+    int watching;               // The connection carries Smain's subscription to changes
+    int watch_synced;           // The current contents were reported
+    struct dfs_catalog_feed feed; // Changes of the catalog feeding the subscription
+    char watch_buf[BUFFER_SIZE * 4]; // Change records not sent yet
+    size_t watch_len;           // Bytes of watch_buf in use
+};
+
+// Lines of a listing, batched into reply frames
+struct listing
+{
+    struct dfs_conn *conn;     // Connection to Smain
+    uint32_t req_id;           // Id of the display request
+    const char *dirpath;       // Directory listed, as named by the request
+    char buf[BUFFER_SIZE * 4]; // Lines batched into a single reply frame
+    size_t len;                // Bytes of buf in use
+};
+
+void accept_client(struct dfs_loop *loop, int client_sock);
+void handle_client(struct dfs_conn *conn, struct dfs_hdr *hdr, char **argv);
+void client_body(struct dfs_conn *conn, const char *data, size_t len);
+void client_body_end(struct dfs_conn *conn);
+void client_drain(struct dfs_conn *conn);
+void client_close(struct dfs_conn *conn);
+void upload_room(struct dfs_uring_file *f);
+void upload_checkpointed(struct dfs_uring_file *f, int err);
+void upload_written(struct dfs_uring_file *f, int err);
+void finish_upload(struct session *s);
+void upload_committed(struct dfs_commit *c, int err);
+int send_file(struct dfs_conn *conn, int opcode, uint32_t req_id, const char *filepath, int ranged, uint64_t off,
+              uint64_t len);
+void send_tarball(struct session *s);
+int tarball_keep(const char *name, void *data);
+void send_listing(struct dfs_conn *conn, uint32_t req_id, const char *dirpath);
+void listing_add(struct listing *l, const char *name);
+void listing_entry(const struct dfs_catalog_entry *e, void *data);
+void start_watch(struct session *s);
+void watch_event(struct dfs_catalog_feed *f, int event, const char *path);
+void watch_record(struct session *s, char type, const char *path);
+void watch_flush(struct session *s);
+
+// Callbacks of connections from Smain
+const struct dfs_conn_ops client_ops = {NULL, handle_client, client_body, client_body_end, client_drain, client_close};
+
+struct dfs_archive archive; // Cached archive of the PDF files served by dtar
+struct dfs_catalog catalog; // Size, time and checksum of every stored file
+char store[BUFFER_SIZE];    // Directory holding the stored files
+int use_uring;              // -u: write uploads through io_uring where the kernel has it
+
+int main(int argc, char *argv[])
+{
+    struct dfs_server_opts opts; // Port, concurrency model and workers
+    int opt;
+
+    // Same options as Smain: -m epoll|fork, -w workers (0 = one per core), -a to pin workers.
+    // -p and -d run another instance of the server, on its own port with its own store.
+    // -u writes uploads through io_uring, so a worker goes on serving while they reach the disk.
+    // -g is how many milliseconds an upload waits for others to be synced along with it.
+    dfs_server_opts_init(&opts, PORT);
+    snprintf(store, BUFFER_SIZE, "%s/spdf", getenv("HOME"));
+    while ((opt = getopt(argc, argv, "m:w:ap:d:ug:")) != -1)
     {
-        perror("Socket creation failed"); // Print error message if socket creation fails
-        exit(EXIT_FAILURE);               // Exit the program with failure status
+        if (opt == 'p' && atoi(optarg) > 0 && atoi(optarg) <= 65535)
+            opts.port = atoi(optarg);
+        else if (opt == 'd' && optarg[0] != '\0')
+            snprintf(store, BUFFER_SIZE, "%s", optarg);
+        else if (opt == 'u')
+            use_uring = 1;
+        else if (opt == 'g' && atoi(optarg) >= 0 && optarg[0] >= '0' && optarg[0] <= '9')
+            dfs_commit_window(atoi(optarg));
+        else if (dfs_server_opt(&opts, opt, optarg) < 0)
+        {
+            fprintf(stderr, "Usage: %s [-m epoll|fork] [-w workers] [-a] [-p port] [-d store] [-u] [-g ms]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
     }
+    mkdir(store, S_IRWXU);
+    dfs_commit_sweep(store, 0); // Uploads cut short by the end of the last run never land
+
+    signal(SIGPIPE, SIG_IGN); // A vanished Smain must not kill the server
+
+    // Take over the catalog of the last run, the archive is only rebuilt along with it.
+    // Instances on other ports keep theirs apart.
+    char tag[32];
+    if (opts.port == PORT)
+        snprintf(tag, sizeof(tag), "pdf");
+    else
+        snprintf(tag, sizeof(tag), "pdf-%d", opts.port);
+    int rebuilt = dfs_catalog_open(&catalog, tag, store);
+    dfs_archive_init(&archive, tag, store, ".pdf", -1, rebuilt != 0);
+
+    printf("Server listening on port %d, storing in %s\n", opts.port, store); // Inform that server is ready to accept connections
 
-    // Configuring server address structure
-    server_addr.sin_family = AF_INET;         // Set address family to IPv4
-    server_addr.sin_addr.s_addr = INADDR_ANY; // Bind to any available network interface
-    server_addr.sin_port = htons(PORT);       // Set port number for communication
+    dfs_serve(&opts, accept_client); // Accept and serve clients in every worker
+    return 0;                        // Exit the program with success status
+}
+
+// Set up the state of a new connection from Smain
+void accept_client(struct dfs_loop *loop, int client_sock)
+{
+    struct session *s = (struct session *)calloc(1, sizeof(struct session));
+    if (s == NULL)
+    {
+        close(client_sock);
+        return;
+    }
+    s->upload_fd = -1;
 
-    // Binding the socket to the address and port
-    if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    if ((s->conn = dfs_conn_new(loop, client_sock, &client_ops, s)) == NULL)
     {
-        perror("Bind failed"); // Print error message if binding fails
-        close(server_sock);    // Close the socket
-        exit(EXIT_FAILURE);    // Exit the program with failure status
+        free(s);
+        return;
     }
+    s->conn->free_data = 1; // The session lives exactly as long as its connection
+}
 
-    // Listening for incoming client connections
-    if (listen(server_sock, 10) < 0)
+// A request header arrived: remember it and open the destination of an upload
+void handle_client(struct dfs_conn *conn, struct dfs_hdr *hdr, char **argv)
+{
+    struct session *s = (struct session *)conn->data;
+
+    s->req_id = hdr->req_id;
+    s->opcode = hdr->opcode;
+    s->upload_err = 0;
+    s->tar_part = hdr->opcode == DFS_OP_DTAR && strcmp(argv[1], "part") == 0;
+    snprintf(s->filepath, BUFFER_SIZE, "%s", argv[0]); // Parse the file path from the argument block
+    free(s->ranges_text);
+    s->ranges_text = NULL;
+    s->ranges_len = 0;
+    if (hdr->opcode == DFS_OP_DTAR && hdr->length > hdr->arglen)
     {
-        perror("Listen failed"); // Print error message if listening fails
-        close(server_sock);      // Close the socket
-        exit(EXIT_FAILURE);      // Exit the program with failure status
+        if (hdr->length - hdr->arglen > MAX_RANGES_BODY ||
+            (s->ranges_text = malloc(hdr->length - hdr->arglen)) == NULL)
+            s->upload_err = E2BIG; // Answered once the body has been drained
     }
 
-    printf("Server listening on port %d\n", PORT); // Inform that server is ready to accept connections
+    if (hdr->opcode != DFS_OP_PING)
+        printf("Received command: %d, for file path: %s\n", hdr->opcode, s->filepath);
 
-    while (1)
+    if (hdr->opcode == DFS_OP_UFILE)
     {
-        // Accepting a new client connection
-        if ((client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &addr_size)) < 0)
-        {
-            perror("Client accept failed"); // Print error message if accepting client fails
-            continue;                       // Continue to accept new connections
-        }
+        // Handle file upload
+        printf("Received file upload request for: %s\n", s->filepath);
 
-        // Forking a child process to handle the client
-        if ((child_pid = fork()) == 0)
+        // Ensure the directory where the file will be saved exists
+        if (dfs_make_parent_dirs(s->filepath) < 0)
+            perror("Failed to create directory");
+
+        // Open a temporary file for writing, the body is written as it arrives and the file moved
+        // into place once it is on disk. A part of a file sent in ranges goes to its place in the
+        // partial file, the commit has no body.
+        s->upload_crc = 0;
+        s->ranged = dfs_range_parse_part(argv[1], argv[2], argv[3], hdr->length - hdr->arglen, &s->part);
+        if (s->ranged < 0)
+            s->upload_err = EINVAL;
+        else if (s->ranged && s->part.commit)
+            return;
+        else if (s->ranged)
+            s->upload_fd = dfs_range_part_open(s->filepath, &s->part);
+        else if ((s->commit = dfs_commit_open(s->filepath)) != NULL)
+            s->upload_fd = s->commit->fd;
+        if (s->upload_fd < 0 && s->upload_err == 0)
         {
-            close(server_sock);         // Close the listening socket in the child process
-            handle_client(client_sock); // Handle client communication
-            exit(0);                    // Exit child process after handling client
+            s->upload_err = errno; // Saved before perror can change it
+            perror("File open error"); // Print error message if file open fails
         }
-        else
+        else if (s->upload_fd >= 0 && use_uring &&
+                 (s->writer = dfs_uring_open(conn->loop, s->upload_fd, s->ranged ? s->part.pos : 0,
+                                             hdr->length - hdr->arglen)) != NULL)
         {
-            close(client_sock); // Close the client socket in the parent process
-            // Reap any terminated child processes to avoid zombie processes
-            waitpid(-1, NULL, WNOHANG);
+            s->upload_fd = -1; // The writer took the file over, and syncs it
+            if (s->commit != NULL)
+                s->commit->fd = -1;
+            s->writer->on_room = upload_room;
+            s->writer->data = s;
         }
     }
-
-    close(server_sock); // Close the server socket (though this will never be reached)
-    return 0;           // Exit the program with success status
+    else if (hdr->opcode == DFS_OP_DFILE)
+    {
+        // A download may ask for a range of the file
+        s->ranged = dfs_range_parse(argv[1], argv[2], &s->range_off, &s->range_len);
+        if (s->ranged < 0)
+            s->upload_err = EINVAL;
+    }
+    else if (hdr->opcode == DFS_OP_STAT)
+    {
+        // A client resuming an upload asks how much of it arrived
+        if (dfs_range_parse_id(argv[1], argv[2], &s->part) < 0)
+            s->upload_err = EINVAL;
+    }
+    // Everything else is answered once the (normally empty) body has been drained
 }
 
-void handle_client(int client_sock)
+// Part of an upload arrived, append it to the file
+void client_body(struct dfs_conn *conn, const char *data, size_t len)
 {
-    char buffer[BUFFER_SIZE];
-    char command[BUFFER_SIZE], filepath[BUFFER_SIZE];
+    struct session *s = (struct session *)conn->data;
 
-    // Read the command from the client
-    bzero(buffer, BUFFER_SIZE);                 // Clear the buffer to ensure it is empty
-    read(client_sock, buffer, BUFFER_SIZE);     // Read the client data into the buffer
-    sscanf(buffer, "%s %s", command, filepath); // Parse command and file path from buffer
+    if (s->writer != NULL && s->upload_err == 0)
+    {
+        // Copied for the ring, which writes it while more arrives
+        if (dfs_uring_write(s->writer, data, len) < 0)
+        {
+            s->upload_err = errno; // Saved before perror can change it
+            perror("File write error");
+            return;
+        }
+        if (!s->ranged)
+            s->upload_crc = dfs_crc32(s->upload_crc, data, len);
+        else if ((s->part.pos += len) - s->part.synced >= DFS_RANGE_CHECKPOINT)
+        {
+            dfs_conn_pause_read(conn); // Until the checkpoint is recorded
+            s->writer->on_flushed = upload_checkpointed;
+            dfs_uring_flush(s->writer, 1);
+            return;
+        }
+        if (dfs_uring_busy(s->writer))
+            dfs_conn_pause_read(conn); // Resumed by upload_room
+    }
+    else if (s->upload_fd >= 0 && s->upload_err == 0 &&
+        (s->ranged ? dfs_range_part_write(s->upload_fd, s->filepath, &s->part, data, len)
+                   : dfs_write_full(s->upload_fd, data, len)) < 0)
+    {
+        s->upload_err = errno; // Saved before perror can change it
+        perror("File write error");
+    }
+    else if (s->upload_fd >= 0 && !s->ranged)
+    {
+        s->upload_crc = dfs_crc32(s->upload_crc, data, len); // Checksummed on the way, for the catalog (parts by the commit)
+    }
+    else if (s->ranges_text != NULL)
+    {
+        memcpy(s->ranges_text + s->ranges_len, data, len); // Allocated for the whole body
+        s->ranges_len += len;
+    }
+}
 
-    printf("Received command: %s, for file path: %s\n", command, filepath);
+// The request is complete: process the command received from Smain
+void client_body_end(struct dfs_conn *conn)
+{
+    struct session *s = (struct session *)conn->data;
+    char buffer[BUFFER_SIZE + PATH_MAX]; // Error message, room for a path and why
 
-    // Process the command received from the client
-    if (strcmp(command, "rmfile") == 0)
+    if (s->opcode == DFS_OP_PING)
+    {
+        // Health check of a pooled connection from Smain
+        dfs_conn_send_frame(conn, DFS_OP_PING, DFS_F_REPLY, 0, s->req_id, NULL, 0);
+    }
+    else if (s->opcode == DFS_OP_RMFILE)
     {
         // Handle file removal
-        if (remove(filepath) == 0) // Try to remove the specified file
+        if (remove(s->filepath) == 0) // Try to remove the specified file
         {
-            printf("File %s deleted successfully.\n", filepath);
+            printf("File %s deleted successfully.\n", s->filepath);
+            dfs_archive_remove(&archive, s->filepath);
+            dfs_catalog_remove(&catalog, s->filepath);
+            dfs_conn_send_frame(conn, DFS_OP_RMFILE, DFS_F_REPLY, 0, s->req_id, NULL, 0);
         }
         else
         {
+            int err = errno; // Saved before perror can change it
             perror("File deletion error"); // Print error message if file deletion fails
+            snprintf(buffer, sizeof(buffer), "File deletion error: %s", strerror(err));
+            dfs_conn_send_error(conn, DFS_OP_RMFILE, s->req_id, err, buffer);
         }
     }
-    else if (strcmp(command, "ufile") == 0)
+    else if (s->opcode == DFS_OP_UFILE)
     {
-        // Handle file upload
-        printf("Received file upload request for: %s\n", filepath);
-
-        // Ensure the directory where the file will be saved exists
-        ensure_directory_exists(filepath);
-
-        // Receive the file from the client and save it
-        FILE *fp = fopen(filepath, "wb"); // Open the file for writing in binary mode
-        if (fp == NULL)
+        // Written through the ring: the reply waits for the sync, other connections do not
+        if (s->writer != NULL && s->upload_err == 0)
         {
-            perror("File open error"); // Print error message if file open fails
-            close(client_sock);        // Close the client socket
+            s->writer->on_flushed = upload_written;
+            dfs_conn_hold(conn);
+            dfs_uring_flush(s->writer, s->ranged);
             return;
         }
-
-        int bytes_read;
-        while ((bytes_read = read(client_sock, buffer, BUFFER_SIZE)) > 0) // Read data from client
-        {
-            fwrite(buffer, sizeof(char), bytes_read, fp); // Write data to the file
-            if (bytes_read < BUFFER_SIZE)                 // Check if the end of the file is reached
-                break;
-        }
-
-        printf("File received successfully: %s\n", filepath);
-        fclose(fp); // Close the file after writing
+        finish_upload(s);
     }
-    else if (strcmp(command, "dtar") == 0)
+    else if (s->opcode == DFS_OP_DFILE)
     {
-        // Create and send a tarball of PDF files
-        snprintf(filepath, BUFFER_SIZE, "%s/pdf.tar", getenv("HOME")); // Define the path for the tarball
-        create_tarball(".pdf", filepath);                              // Create the tarball
-
-        // Send the tarball to the client
-        FILE *fp = fopen(filepath, "rb"); // Open the tarball for reading in binary mode
-        if (fp == NULL)
+        // Send the requested file back, or the range of it asked for
+        if (s->upload_err != 0)
+            dfs_conn_send_error(conn, DFS_OP_DFILE, s->req_id, s->upload_err, "Invalid range");
+        else
+            send_file(conn, DFS_OP_DFILE, s->req_id, s->filepath, s->ranged, s->range_off, s->range_len);
+    }
+    else if (s->opcode == DFS_OP_STAT)
+    {
+        // Bytes of the upload held from the offset on, where the client resumes its part
+        uint64_t held;
+        char held_text[24];
+        const char *held_arg = held_text;
+        if (s->upload_err == 0 && dfs_range_held(s->filepath, &s->part, s->part.offset, &held) < 0)
+            s->upload_err = errno;
+        if (s->upload_err != 0)
         {
-            perror("File open error"); // Print error message if file open fails
-            close(client_sock);        // Close the client socket
+            snprintf(buffer, sizeof(buffer), "Could not read the upload of %s: %s", s->filepath, strerror(s->upload_err));
+            dfs_conn_send_error(conn, DFS_OP_STAT, s->req_id, s->upload_err, buffer);
             return;
         }
-
-        int bytes_read;
-        while ((bytes_read = fread(buffer, sizeof(char), BUFFER_SIZE, fp)) > 0) // Read data from the tarball
+        snprintf(held_text, sizeof(held_text), "%llu", (unsigned long long)held);
+        dfs_conn_write_hdr_args(conn, DFS_OP_STAT, DFS_F_REPLY, 0, s->req_id, 1, &held_arg, 0);
+    }
+    else if (s->opcode == DFS_OP_WATCH)
+    {
+        // Smain keeps its namespace index current from the changes of the store
+        start_watch(s);
+    }
+    else if (s->opcode == DFS_OP_DISPLAY)
+    {
+        // List the .pdf files of the directory for Smain's display
+        send_listing(conn, s->req_id, s->filepath);
+    }
+    else if (s->opcode == DFS_OP_DTAR)
+    {
+        // A replica serves the files of the hash ranges Smain assigned to it
+        free(s->ranges);
+        s->ranges = NULL;
+        s->nranges = 0;
+        if (s->upload_err != 0 || (s->ranges_text != NULL &&
+                                   (s->nranges = dfs_route_ranges_parse(s->ranges_text, s->ranges_len, &s->ranges)) < 0))
         {
-            write(client_sock, buffer, bytes_read); // Send data to the client
+            dfs_conn_send_error(conn, DFS_OP_DTAR, s->req_id, EINVAL, "Invalid hash ranges");
+            return;
         }
+        int (*keep)(const char *, void *) = s->ranges_text != NULL ? tarball_keep : NULL;
 
-        fclose(fp); // Close the tarball file after sending
-        printf("Tarball %s sent to client.\n", filepath);
+        // Send the cached archive, or without it stream one built while it is sent
+        if (dfs_archive_send(&archive, conn, DFS_OP_DTAR, s->req_id, s->tar_part, keep, s) == 0)
+            return;
+        // Stream a tarball of the PDF files in the store, built while it is sent
+        dfs_tar_start(&s->tar, conn, DFS_OP_DTAR, s->req_id, store, ".pdf", -1);
+        s->tar.part = s->tar_part;
+        s->tar.keep = keep;
+        s->tar.keep_data = s;
+        dfs_conn_hold(conn); // Pipelined requests wait for the end of the archive
+        send_tarball(s);
     }
     else
     {
         // Handle unknown commands
-        printf("Unknown command: %s\n", command);
+        printf("Unknown command: %d\n", s->opcode);
+        dfs_conn_send_error(conn, s->opcode, s->req_id, EOPNOTSUPP, "Unknown command");
     }
 
-    close(client_sock); // Close the client socket after processing the request
 }
 
-void ensure_directory_exists(char *path)
+// Smain caught up with the archive queued so far, add the next members
+void client_drain(struct dfs_conn *conn)
+{
+    struct session *s = (struct session *)conn->data;
+
+    if (s->tar.active)
+        send_tarball(s);
+}
+
+// Connection closed, possibly in the middle of an upload or an archive
+void client_close(struct dfs_conn *conn)
 {
-    struct stat st = {0}; // Structure to hold file status information
-    char temp[BUFFER_SIZE];
-    char *dir_path = strdup(path);             // Duplicate path for manipulation
-    char *last_slash = strrchr(dir_path, '/'); // Find the last '/' in the path
+    struct session *s = (struct session *)conn->data;
+
+    if (s->upload_fd >= 0)
+        close(s->upload_fd);
+    if (s->writer != NULL)
+        dfs_uring_close(s->writer);
+    s->upload_fd = -1;
+    s->writer = NULL;
+    if (s->commit != NULL)
+        dfs_commit_close(s->commit); // A file on its way into place still lands
+    s->commit = NULL;
+    dfs_tar_abort(&s->tar);
+    if (s->watching)
+        dfs_catalog_feed_stop(&s->feed);
+    s->watching = 0;
+    free(s->ranges_text);
+    free(s->ranges);
+    s->ranges_text = NULL;
+    s->ranges = NULL;
+}
+
+// The ring caught up with an upload, take more of its body
+void upload_room(struct dfs_uring_file *f)
+{
+    struct session *s = (struct session *)f->data;
+
+    dfs_conn_resume_read(s->conn);
+}
+
+// The part written so far is on disk: record it as held and take the rest
+void upload_checkpointed(struct dfs_uring_file *f, int err)
+{
+    struct session *s = (struct session *)f->data;
+
+    if (err == 0 && dfs_range_checkpoint(f->fd, s->filepath, &s->part) < 0)
+        err = errno;
+    if (err != 0 && s->upload_err == 0)
+        s->upload_err = err; // Answered once the body has been drained
+    dfs_conn_resume_read(s->conn);
+}
+
+// The whole upload is on disk, or failed: reply and go on with the next request
+void upload_written(struct dfs_uring_file *f, int err)
+{
+    struct session *s = (struct session *)f->data;
+
+    if (err != 0 && s->upload_err == 0)
+        s->upload_err = err;
+    finish_upload(s);
+    if (s->commit == NULL)
+        dfs_conn_release(s->conn); // Otherwise once the file is in place
+}
 
-    if (last_slash)
+// Close the file of an upload and reply to it
+void finish_upload(struct session *s)
+{
+    char buffer[BUFFER_SIZE + PATH_MAX]; // Error message, room for a path and why
+
+    // Smain counts the copy towards its write quorum, so it must be on disk before the reply.
+    // A part is, once it is recorded as held. A whole file is synced along with the other uploads
+    // of its batch and moved into place, upload_committed replies. A writer synced it already.
+    int fd = s->writer != NULL ? s->writer->fd : s->upload_fd;
+    if (fd >= 0 && s->upload_err == 0 && s->ranged && dfs_range_checkpoint(fd, s->filepath, &s->part) < 0)
+        s->upload_err = errno;
+    if (s->writer != NULL)
+        dfs_uring_close(s->writer); // Closes the file once writes abandoned by an error are done
+    else if (s->upload_fd >= 0 && s->commit == NULL && close(s->upload_fd) < 0 && s->upload_err == 0)
+        s->upload_err = errno; // Delayed write errors surface on close
+    s->writer = NULL;
+    s->upload_fd = -1;
+    if (s->commit != NULL && s->upload_err == 0)
     {
-        *last_slash = '\0'; // Remove the filename to get the directory path
+        s->commit->crc = s->upload_crc;
+        dfs_conn_hold(s->conn); // Pipelined requests wait for the reply
+        dfs_commit_submit(s->conn->loop, s->commit, upload_committed, s);
+        return;
     }
+    if (s->commit != NULL)
+        dfs_commit_abort(s->commit);
+    s->commit = NULL;
 
-    snprintf(temp, sizeof(temp), "%s", dir_path); // Copy the directory path
+    struct stat st;
+    if (s->upload_err == 0 && s->ranged && s->part.commit &&
+        dfs_range_part_commit(s->filepath, &s->part, dfs_crc32, &s->upload_crc, &st) < 0)
+        s->upload_err = errno; // Parts missing, or none arrived
 
-    // Create directories as needed along the path
-    for (char *p = temp + 1; *p; p++)
+    if (s->upload_err == 0 && s->ranged && !s->part.commit)
     {
-        if (*p == '/')
-        {
-            *p = '\0';                 // Temporarily terminate the string at the current '/'
-            if (stat(temp, &st) == -1) // Check if the directory exists
-            {
-                if (mkdir(temp, S_IRWXU) != 0 && errno != EEXIST) // Create directory if it does not exist
-                {
-                    perror("Failed to create directory"); // Print error message if directory creation fails
-                }
-            }
-            *p = '/'; // Restore the original character
-        }
+        dfs_conn_send_frame(s->conn, DFS_OP_UFILE, DFS_F_REPLY, 0, s->req_id, NULL, 0);
     }
+    else if (s->upload_err == 0)
+    {
+        printf("File received successfully: %s\n", s->filepath);
+        dfs_catalog_put(&catalog, s->filepath, &st, s->upload_crc);
+        dfs_conn_send_frame(s->conn, DFS_OP_UFILE, DFS_F_REPLY, 0, s->req_id, NULL, 0);
+        dfs_archive_add(&archive, s->filepath); // Copies the file, the reply need not wait for that
+    }
+    else
+    {
+        snprintf(buffer, sizeof(buffer), "Could not store %s: %s", s->filepath, strerror(s->upload_err));
+        dfs_conn_send_error(s->conn, DFS_OP_UFILE, s->req_id, s->upload_err, buffer);
+    }
+}
+
+// A whole upload is in place and on disk, or failed: record and answer it
+void upload_committed(struct dfs_commit *c, int err)
+{
+    struct session *s = (struct session *)c->data;
+    char buffer[BUFFER_SIZE + PATH_MAX]; // Error message, room for a path and why
+    struct stat st;
 
-    // Ensure the final directory in the path is created
-    if (stat(temp, &st) == -1)
+    if (err == 0 && stat(c->path, &st) < 0)
+        err = errno; // Removed again meanwhile
+    if (err == 0)
     {
-        if (mkdir(temp, S_IRWXU) != 0 && errno != EEXIST)
+        printf("File received successfully: %s\n", c->path);
+        dfs_catalog_put(&catalog, c->path, &st, c->crc);
+    }
+    if (s != NULL)
+    {
+        // Smain may have gone away meanwhile, the file is stored all the same
+        s->commit = NULL;
+        if (err == 0)
+            dfs_conn_send_frame(s->conn, DFS_OP_UFILE, DFS_F_REPLY, 0, s->req_id, NULL, 0);
+        else
         {
-            perror("Failed to create directory"); // Print error message if directory creation fails
+            snprintf(buffer, sizeof(buffer), "Could not store %s: %s", c->path, strerror(err));
+            dfs_conn_send_error(s->conn, DFS_OP_UFILE, s->req_id, err, buffer);
         }
+        dfs_conn_release(s->conn);
     }
+    if (err == 0)
+        dfs_archive_add(&archive, c->path); // Copies the file, the reply need not wait for that
+}
 
-    free(dir_path); // Free the duplicated path memory
+// Queue a file, or len bytes of it from off on if ranged, as a single reply frame, or an error reply
+// if it cannot be opened
+int send_file(struct dfs_conn *conn, int opcode, uint32_t req_id, const char *filepath, int ranged, uint64_t off,
+              uint64_t len)
+{
+    char buffer[BUFFER_SIZE];
+    struct stat st;
+
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC); // Open the file for reading
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        int err = errno; // Saved before perror can change it
+        perror("File open error"); // Print error message if file open fails
+        snprintf(buffer, BUFFER_SIZE, "Could not open %s: %s", filepath, strerror(err));
+        dfs_conn_send_error(conn, opcode, req_id, err, buffer);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    // The reply header announces the size, the content is sent from the file as the socket takes it.
+    // A range is read in place, ranges of the same file sent over other connections do not contend.
+    if (ranged)
+    {
+        dfs_range_send(conn, opcode, req_id, fd, st.st_size, off, len);
+        return 0;
+    }
+    dfs_conn_write_hdr(conn, opcode, DFS_F_REPLY, 0, req_id, 0, st.st_size);
+    dfs_conn_write_file(conn, fd, 0, st.st_size); // The connection closes fd once it is sent
+    return 0;
 }
 
-void create_tarball(const char *filetype, const char *tarfile)
+// Queue the next members of the archive, called again from client_drain until it is complete
+void send_tarball(struct session *s)
 {
-    char command[BUFFER_SIZE];
-    char *home = getenv("HOME"); // Get the user's home directory
+    if (dfs_tar_pump(&s->tar))
+        dfs_conn_release(s->conn);
+}
 
-    if (strcmp(filetype, ".pdf") == 0)
+// Whether a file of the store, by its path below the store, goes into the dtar being served
+int tarball_keep(const char *name, void *data)
+{
+    struct session *s = (struct session *)data;
+
+    return dfs_route_ranges_has(s->ranges, s->nranges, name);
+}
+
+// Queue the .pdf files directly in a directory as lines of a multi-frame reply
+void send_listing(struct dfs_conn *conn, uint32_t req_id, const char *dirpath)
+{
+    char buffer[BUFFER_SIZE];
+    struct listing l;
+    struct dirent *entry;
+    DIR *dir;
+
+    l.conn = conn;
+    l.req_id = req_id;
+    l.dirpath = dirpath;
+    l.len = snprintf(l.buf, sizeof(l.buf), "PDF Files in %s:\n", dirpath);
+
+    // The catalog answers without reading the directory, which is read only without a catalog
+    if (dfs_catalog_list(&catalog, dirpath, listing_entry, &l) == 0)
     {
-        // Create a tarball of PDF files in the ~/spdf directory
-        snprintf(command, BUFFER_SIZE, "find %s/spdf -type f -name '*.pdf' -print | tar -cvf %s -T -", home, tarfile);
+        dfs_conn_send_frame(conn, DFS_OP_DISPLAY, DFS_F_REPLY, 0, req_id, l.buf, l.len);
+        return;
     }
-    else
+    if (errno == ENOENT || (dir = opendir(dirpath)) == NULL)
     {
-        // Handle unknown file types for tarball creation
-        printf("Unknown filetype for tarball creation: %s\n", filetype);
+        int err = errno; // Saved before perror can change it
+        perror("Could not open directory");
+        snprintf(buffer, BUFFER_SIZE, "Could not open directory %s: %s", dirpath, strerror(err));
+        dfs_conn_send_error(conn, DFS_OP_DISPLAY, req_id, err, buffer);
         return;
     }
+    while ((entry = readdir(dir)) != NULL)
+        listing_add(&l, entry->d_name);
+    closedir(dir);
+
+    dfs_conn_send_frame(conn, DFS_OP_DISPLAY, DFS_F_REPLY, 0, req_id, l.buf, l.len);
+}
+
+// Batch the line of name if it is a .pdf file
+void listing_add(struct listing *l, const char *name)
+{
+    char buffer[BUFFER_SIZE]; // One line of the listing
+    size_t name_len = strlen(name), suffix_len = strlen(".pdf");
+
+    if (name_len < suffix_len || strcmp(name + name_len - suffix_len, ".pdf") != 0)
+        return;
+
+    // Frames end with whole lines, Smain merges them with the other servers' lines
+    int line_len = snprintf(buffer, BUFFER_SIZE, "%s/%s\n", l->dirpath, name);
+    if (line_len >= BUFFER_SIZE)
+        return; // Too long to list
+    if (l->len + line_len > sizeof(l->buf))
+    {
+        dfs_conn_send_frame(l->conn, DFS_OP_DISPLAY, DFS_F_REPLY | DFS_F_MORE, 0, l->req_id, l->buf, l->len);
+        l->len = 0;
+    }
+    memcpy(l->buf + l->len, buffer, line_len);
+    l->len += line_len;
+}
+
+// An entry of the catalog in the directory listed
+void listing_entry(const struct dfs_catalog_entry *e, void *data)
+{
+    const char *name = strrchr(e->path, '/');
+
+    if (e->type == DFS_CATALOG_FILE)
+        listing_add((struct listing *)data, name != NULL ? name + 1 : e->path);
+}
+
+// Report the .pdf files and the directories of the store to Smain, then every change to them.
+// The reply never ends, the connection serves nothing else from now on.
+void start_watch(struct session *s)
+{
+    dfs_conn_hold(s->conn);
+    s->watching = 1;
+    if (dfs_catalog_feed_start(s->conn->loop, &s->feed, &catalog, watch_event, s) < 0)
+    {
+        s->watching = 0;
+        s->watch_len = 0;
+        dfs_conn_send_error(s->conn, DFS_OP_WATCH, s->req_id, ENOENT, "Could not follow the catalog");
+        dfs_conn_release(s->conn);
+    }
+}
 
-    printf("Executing tar command: %s\n", command); // Print the command to be executed
-    int result = system(command);                   // Execute the tar command
+// A change of the catalog, passed on as a record: "<type> <path>\n" with the path relative to the store
+void watch_event(struct dfs_catalog_feed *f, int event, const char *path)
+{
+    static const char types[] = "ADMXR"; // Records of DFS_NOTIFY_ADD .. DFS_NOTIFY_RESET
+    struct session *s = (struct session *)f->data;
+    size_t len = strlen(path), suffix_len = strlen(".pdf");
 
-    if (result != 0)
+    if (event == DFS_NOTIFY_SETTLED)
     {
-        printf("Tar command failed with exit code %d\n", result); // Print error message if tar command fails
+        // Smain trusts its view of this server once the catalog was reported
+        if (!s->watch_synced)
+            watch_record(s, 'S', "");
+        s->watch_synced = 1;
+        watch_flush(s);
+        return;
     }
+    if ((event == DFS_NOTIFY_ADD || event == DFS_NOTIFY_DEL) &&
+        (len < suffix_len || strcmp(path + len - suffix_len, ".pdf") != 0))
+        return;
+    watch_record(s, types[event], path);
+}
+
+// Batch a change record, records go out as whole lines
+void watch_record(struct session *s, char type, const char *path)
+{
+    size_t len = strlen(path) + 3;
+
+    if (strchr(path, '\n') != NULL || len > sizeof(s->watch_buf))
+        return; // Cannot be reported
+    if (s->watch_len + len > sizeof(s->watch_buf))
+        watch_flush(s);
+    snprintf(s->watch_buf + s->watch_len, sizeof(s->watch_buf) - s->watch_len, "%c %s\n", type, path);
+    s->watch_len += len;
+}
+
+// Send the batched change records
+void watch_flush(struct session *s)
+{
+    if (s->watch_len == 0)
+        return;
+    dfs_conn_send_frame(s->conn, DFS_OP_WATCH, DFS_F_REPLY | DFS_F_MORE, 0, s->req_id, s->watch_buf, s->watch_len);
+    s->watch_len = 0;
 }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,226 +10,836 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include "dfs_proto.h"
+#include "dfs_loop.h"
+#include "dfs_server.h"
+#include "dfs_tar.h"
+#include "dfs_archive.h"
+#include "dfs_catalog.h"
+#include "dfs_route.h"
+#include "dfs_range.h"
+#include "dfs_uring.h"
+#include "dfs_pack.h"
+#include "dfs_commit.h"
 
 #define PORT 6062        // Define the port number for the server
 #define BUFFER_SIZE 1024 // Define the buffer size for data transfer
+#define MAX_RANGES_BODY (1024 * 1024) // Largest list of hash ranges a dtar may carry
 
-void handle_client(int client_sock);                            // Function prototype to handle client requests
-void ensure_directory_exists(char *path);                       // Function prototype to ensure directory existence
-void create_tarball(const char *filetype, const char *tarfile); // Function prototype to create a tarball
-
-int main()
+// State of one connection from Smain
+struct session
 {
-    int server_sock, client_sock;                     // File descriptors for the server and client sockets
-    struct sockaddr_in server_addr, client_addr;      // Structures to hold server and client addresses
-    socklen_t addr_size = sizeof(struct sockaddr_in); // Size of the address structure
-    pid_t child_pid;                                  // Process ID for the child process
-
-    // Creating socket
-    if ((server_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    struct dfs_conn *conn;      // Connection to Smain
+    uint32_t req_id;            // Id of the request being served
+    int opcode;                 // Opcode of the request being served
+    char filepath[BUFFER_SIZE]; // File named by the request
+    int upload_fd;              // File receiving an upload, -1 otherwise
+    struct dfs_uring_file *writer; // Or the upload written through io_uring with -u, which owns the file
+    struct dfs_commit *commit;  // Temporary file of a whole upload, moved into place once on disk
+    char *pack_buf;             // Or the body of a small upload collected for the pack with -k
+    size_t pack_len;            // Bytes of pack_buf in use
+    int upload_err;             // errno of a failed upload, answered once the body is drained
+    uint32_t upload_crc;        // CRC-32 of the upload received so far
+    int ranged;                 // The upload is a part of a file sent in ranges, or the download a range of the file
+    struct dfs_range_part part; // Where the part of a ranged upload goes, or the upload a stat asks about
+    uint64_t range_off;         // Range of a ranged download
+    uint64_t range_len;
+    struct dfs_tar tar;         // Archive being streamed by dtar
+    int tar_part;               // The dtar is one node's part of Smain's archive, without end blocks
+    char *ranges_text;          // Body of a dtar: the hash ranges of the files wanted
+    size_t ranges_len;          // Bytes of ranges_text in use
+    struct dfs_route_range *ranges; // Parsed ranges, NULL to send every file
+    int nranges;
+    int watching;               // The connection carries Smain's subscription to changes
+    int watch_synced;           // The current contents were reported
+    struct dfs_catalog_feed feed; // Changes of the catalog feeding the subscription
+    char watch_buf[BUFFER_SIZE * 4]; // Change records not sent yet
+    size_t watch_len;           // Bytes of watch_buf in use
+};
+
+// Lines of a listing, batched into reply frames
+struct listing
+{
+    struct dfs_conn *conn;     // Connection to Smain
+    uint32_t req_id;           // Id of the display request
+    const char *dirpath;       // Directory listed, as named by the request
+    char buf[BUFFER_SIZE * 4]; // Lines batched into a single reply frame
+    size_t len;                // Bytes of buf in use
+};
+
+void accept_client(struct dfs_loop *loop, int client_sock);
+void handle_client(struct dfs_conn *conn, struct dfs_hdr *hdr, char **argv);  // Function prototype to handle client requests
+void client_body(struct dfs_conn *conn, const char *data, size_t len);
+void client_body_end(struct dfs_conn *conn);
+void client_drain(struct dfs_conn *conn);
+void client_close(struct dfs_conn *conn);
+void upload_room(struct dfs_uring_file *f);
+void upload_checkpointed(struct dfs_uring_file *f, int err);
+void upload_written(struct dfs_uring_file *f, int err);
+void finish_upload(struct session *s);
+void upload_committed(struct dfs_commit *c, int err);
+int store_packed(struct session *s, struct stat *st);
+int send_packed(struct session *s);
+void catalog_packed(const struct dfs_pack_object *o, void *data);
+void start_worker(struct dfs_loop *loop);
+void compact_pack(struct dfs_timer *timer);
+int send_file(struct dfs_conn *conn, int opcode, uint32_t req_id, const char *filepath, int ranged, uint64_t off,
+              uint64_t len);
+void send_tarball(struct session *s);                           // Function prototype to stream a tarball
+int tarball_keep(const char *name, void *data);                 // Function prototype to filter a replica's tarball
+void send_listing(struct dfs_conn *conn, uint32_t req_id, const char *dirpath); // Function prototype to list a directory
+void listing_add(struct listing *l, const char *name);
+void listing_entry(const struct dfs_catalog_entry *e, void *data);
+void listing_packed(const char *name, void *data);
+void start_watch(struct session *s); // Function prototype to report changes to Smain
+void watch_event(struct dfs_catalog_feed *f, int event, const char *path);
+void watch_record(struct session *s, char type, const char *path);
+void watch_flush(struct session *s);
+
+// Callbacks of connections from Smain
+const struct dfs_conn_ops client_ops = {NULL, handle_client, client_body, client_body_end, client_drain, client_close};
+
+struct dfs_archive archive; // Cached archive of the text files served by dtar
+struct dfs_catalog catalog; // Size, time and checksum of every stored file
+struct dfs_pack pack;       // Small files appended to segments with -k, instead of a file each
+struct dfs_timer compactor; // Compacts the pack of this worker's process now and then
+char store[BUFFER_SIZE];    // Directory holding the stored files
+int use_uring;              // -u: write uploads through io_uring where the kernel has it
+int use_pack;               // -k: pack small files
+
+int main(int argc, char *argv[])
+{
+    struct dfs_server_opts opts; // Port, concurrency model and workers
+    int opt;
+
+    // Same options as Smain: -m epoll|fork, -w workers (0 = one per core), -a to pin workers.
+    // -p and -d run another instance of the server, on its own port with its own store.
+    // -u writes uploads through io_uring, so a worker goes on serving while they reach the disk.
+    // -k packs files of up to 64 KiB into segments, which dtar sends as they are.
+    // -g is how many milliseconds an upload waits for others to be synced along with it.
+    dfs_server_opts_init(&opts, PORT);
+    snprintf(store, BUFFER_SIZE, "%s/stext", getenv("HOME"));
+    while ((opt = getopt(argc, argv, "m:w:ap:d:ukg:")) != -1)
     {
-        perror("Socket creation failed"); // Print error message if socket creation fails
-        exit(EXIT_FAILURE);               // Exit the program with a failure status
+        if (opt == 'p' && atoi(optarg) > 0 && atoi(optarg) <= 65535)
+            opts.port = atoi(optarg);
+        else if (opt == 'd' && optarg[0] != '\0')
+            snprintf(store, BUFFER_SIZE, "%s", optarg);
+        else if (opt == 'u')
+            use_uring = 1;
+        else if (opt == 'k')
+            use_pack = 1;
+        else if (opt == 'g' && atoi(optarg) >= 0 && optarg[0] >= '0' && optarg[0] <= '9')
+            dfs_commit_window(atoi(optarg));
+        else if (dfs_server_opt(&opts, opt, optarg) < 0)
+        {
+            fprintf(stderr, "Usage: %s [-m epoll|fork] [-w workers] [-a] [-p port] [-d store] [-u] [-k] [-g ms]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
     }
+    mkdir(store, S_IRWXU);
+    dfs_commit_sweep(store, 0); // Uploads cut short by the end of the last run never land
+
+    signal(SIGPIPE, SIG_IGN); // A vanished Smain must not kill the server
+
+    // Take over the catalog of the last run, the archive is only rebuilt along with it.
+    // Instances on other ports keep theirs apart.
+    char tag[32];
+    if (opts.port == PORT)
+        snprintf(tag, sizeof(tag), "txt");
+    else
+        snprintf(tag, sizeof(tag), "txt-%d", opts.port);
+    int rebuilt = dfs_catalog_open(&catalog, tag, store);
+    dfs_archive_init(&archive, tag, store, ".txt", -1, rebuilt != 0);
+
+    // A catalog rebuilt from the store lacks the packed files, the pack knows them
+    if (use_pack && dfs_pack_init(&pack, tag, store) == 0 && rebuilt != 0)
+        dfs_pack_each(&pack, catalog_packed, NULL);
 
-    // Binding socket to the port
-    server_addr.sin_family = AF_INET;         // Set the address family to IPv4
-    server_addr.sin_addr.s_addr = INADDR_ANY; // Bind to any available IP address on the host
-    server_addr.sin_port = htons(PORT);       // Convert the port number to network byte order
+    printf("Server listening on port %d, storing in %s\n", opts.port, store); // Print message indicating the server is ready
 
-    if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    opts.on_start = start_worker;
+    dfs_serve(&opts, accept_client); // Accept and serve clients in every worker
+    return 0;                        // Return 0 to indicate successful execution
+}
+
+// Set up the state of a new connection from Smain
+void accept_client(struct dfs_loop *loop, int client_sock)
+{
+    struct session *s = (struct session *)calloc(1, sizeof(struct session));
+    if (s == NULL)
+    {
+        close(client_sock);
+        return;
+    }
+    s->upload_fd = -1;
+
+    if ((s->conn = dfs_conn_new(loop, client_sock, &client_ops, s)) == NULL)
     {
-        perror("Bind failed"); // Print error message if binding fails
-        close(server_sock);    // Close the socket
-        exit(EXIT_FAILURE);    // Exit the program with a failure status
+        free(s);
+        return;
     }
+    s->conn->free_data = 1; // The session lives exactly as long as its connection
+}
 
-    // Listening for incoming connections
-    if (listen(server_sock, 10) < 0)
+// A request header arrived: remember it and open the destination of an upload
+void handle_client(struct dfs_conn *conn, struct dfs_hdr *hdr, char **argv)
+{
+    struct session *s = (struct session *)conn->data;
+
+    s->req_id = hdr->req_id;
+    s->opcode = hdr->opcode;
+    s->upload_err = 0;
+    s->tar_part = hdr->opcode == DFS_OP_DTAR && strcmp(argv[1], "part") == 0;
+    snprintf(s->filepath, BUFFER_SIZE, "%s", argv[0]); // Parse the file path from the argument block
+    free(s->ranges_text);
+    s->ranges_text = NULL;
+    s->ranges_len = 0;
+    if (hdr->opcode == DFS_OP_DTAR && hdr->length > hdr->arglen)
     {
-        perror("Listen failed"); // Print error message if listening fails
-        close(server_sock);      // Close the socket
-        exit(EXIT_FAILURE);      // Exit the program with a failure status
+        if (hdr->length - hdr->arglen > MAX_RANGES_BODY ||
+            (s->ranges_text = malloc(hdr->length - hdr->arglen)) == NULL)
+            s->upload_err = E2BIG; // Answered once the body has been drained
     }
 
-    printf("Server listening on port %d\n", PORT); // Print message indicating the server is ready
+    if (hdr->opcode != DFS_OP_PING)
+        printf("Received command: %d, for file path: %s\n", hdr->opcode, s->filepath);
 
-    while (1)
+    if (hdr->opcode == DFS_OP_UFILE)
     {
-        // Accepting client connection
-        if ((client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &addr_size)) < 0)
+        // Handle file upload
+        printf("Received file upload request for: %s\n", s->filepath);
+
+        // Ensure the directory where the file will be saved exists
+        if (dfs_make_parent_dirs(s->filepath) < 0)
+            perror("Failed to create directory");
+
+        // Open a temporary file for writing, the body is written as it arrives and the file moved
+        // into place once it is on disk. A part of a file sent in ranges goes to its place in the
+        // partial file, the commit has no body. A small file to pack is collected in memory instead.
+        s->upload_crc = 0;
+        s->ranged = dfs_range_parse_part(argv[1], argv[2], argv[3], hdr->length - hdr->arglen, &s->part);
+        if (s->ranged < 0)
+            s->upload_err = EINVAL;
+        else if (s->ranged && s->part.commit)
+            return;
+        else if (!s->ranged && pack.ready && hdr->length - hdr->arglen <= DFS_PACK_OBJECT_MAX &&
+                 (s->pack_buf = (char *)malloc(hdr->length - hdr->arglen + 1)) != NULL)
         {
-            perror("Client accept failed"); // Print error message if client acceptance fails
-            continue;                       // Continue to the next iteration to accept another connection
+            s->pack_len = 0;
+            return;
         }
-
-        // Creating a child process to handle the client
-        if ((child_pid = fork()) == 0)
+        else if (s->ranged)
+            s->upload_fd = dfs_range_part_open(s->filepath, &s->part);
+        else if ((s->commit = dfs_commit_open(s->filepath)) != NULL)
+            s->upload_fd = s->commit->fd;
+        if (s->upload_fd < 0 && s->upload_err == 0)
         {
-            // In the child process
-            close(server_sock);         // Close the server socket in the child process to avoid interference
-            handle_client(client_sock); // Handle the client's request
-            exit(0);                    // Exit the child process after handling the client
+            s->upload_err = errno; // Saved before perror can change it
+            perror("File open error"); // Print error message if file open fails
         }
-        else
+        else if (s->upload_fd >= 0 && use_uring &&
+                 (s->writer = dfs_uring_open(conn->loop, s->upload_fd, s->ranged ? s->part.pos : 0,
+                                             hdr->length - hdr->arglen)) != NULL)
         {
-            // In the parent process
-            close(client_sock);         // Close the client socket in the parent process
-            waitpid(-1, NULL, WNOHANG); // Reap any terminated child processes
+            s->upload_fd = -1; // The writer took the file over, and syncs it
+            if (s->commit != NULL)
+                s->commit->fd = -1;
+            s->writer->on_room = upload_room;
+            s->writer->data = s;
         }
     }
-
-    close(server_sock); // Close the server socket when the server is shutting down
-    return 0;           // Return 0 to indicate successful execution
+    else if (hdr->opcode == DFS_OP_DFILE)
+    {
+        // A download may ask for a range of the file
+        s->ranged = dfs_range_parse(argv[1], argv[2], &s->range_off, &s->range_len);
+        if (s->ranged < 0)
+            s->upload_err = EINVAL;
+    }
+    else if (hdr->opcode == DFS_OP_STAT)
+    {
+        // A client resuming an upload asks how much of it arrived
+        if (dfs_range_parse_id(argv[1], argv[2], &s->part) < 0)
+            s->upload_err = EINVAL;
+    }
+    // Everything else is answered once the (normally empty) body has been drained
 }
 
-void handle_client(int client_sock)
+// Part of an upload arrived, append it to the file
+void client_body(struct dfs_conn *conn, const char *data, size_t len)
 {
-    char buffer[BUFFER_SIZE];                         // Buffer to hold data during communication
-    char command[BUFFER_SIZE], filepath[BUFFER_SIZE]; // Buffers to hold command and file path
+    struct session *s = (struct session *)conn->data;
 
-    // Reading client command
-    bzero(buffer, BUFFER_SIZE);                 // Clear the buffer
-    read(client_sock, buffer, BUFFER_SIZE);     // Read data from client into buffer
-    sscanf(buffer, "%s %s", command, filepath); // Parse command and file path from buffer
+    if (s->pack_buf != NULL)
+    {
+        memcpy(s->pack_buf + s->pack_len, data, len); // Allocated for the whole body
+        s->pack_len += len;
+        s->upload_crc = dfs_crc32(s->upload_crc, data, len);
+    }
+    else if (s->writer != NULL && s->upload_err == 0)
+    {
+        // Copied for the ring, which writes it while more arrives
+        if (dfs_uring_write(s->writer, data, len) < 0)
+        {
+            s->upload_err = errno; // Saved before perror can change it
+            perror("File write error");
+            return;
+        }
+        if (!s->ranged)
+            s->upload_crc = dfs_crc32(s->upload_crc, data, len);
+        else if ((s->part.pos += len) - s->part.synced >= DFS_RANGE_CHECKPOINT)
+        {
+            dfs_conn_pause_read(conn); // Until the checkpoint is recorded
+            s->writer->on_flushed = upload_checkpointed;
+            dfs_uring_flush(s->writer, 1);
+            return;
+        }
+        if (dfs_uring_busy(s->writer))
+            dfs_conn_pause_read(conn); // Resumed by upload_room
+    }
+    else if (s->upload_fd >= 0 && s->upload_err == 0 &&
+        (s->ranged ? dfs_range_part_write(s->upload_fd, s->filepath, &s->part, data, len)
+                   : dfs_write_full(s->upload_fd, data, len)) < 0)
+    {
+        s->upload_err = errno; // Saved before perror can change it
+        perror("File write error");
+    }
+    else if (s->upload_fd >= 0 && !s->ranged)
+    {
+        s->upload_crc = dfs_crc32(s->upload_crc, data, len); // Checksummed on the way, for the catalog (parts by the commit)
+    }
+    else if (s->ranges_text != NULL)
+    {
+        memcpy(s->ranges_text + s->ranges_len, data, len); // Allocated for the whole body
+        s->ranges_len += len;
+    }
+}
 
-    printf("Received command: %s, for file path: %s\n", command, filepath); // Print received command and file path
+// The request is complete: process the command received from Smain
+void client_body_end(struct dfs_conn *conn)
+{
+    struct session *s = (struct session *)conn->data;
+    char buffer[BUFFER_SIZE + PATH_MAX]; // Error message, room for a path and why
 
-    if (strcmp(command, "rmfile") == 0)
+    if (s->opcode == DFS_OP_PING)
+    {
+        // Health check of a pooled connection from Smain
+        dfs_conn_send_frame(conn, DFS_OP_PING, DFS_F_REPLY, 0, s->req_id, NULL, 0);
+    }
+    else if (s->opcode == DFS_OP_RMFILE)
     {
-        // Handle file removal
-        if (remove(filepath) == 0) // Attempt to delete the file
+        // Handle file removal, of a packed file or else of the file itself
+        if (dfs_pack_remove(&pack, s->filepath) == 1 || remove(s->filepath) == 0)
         {
-            printf("File %s deleted successfully.\n", filepath); // Print success message
+            printf("File %s deleted successfully.\n", s->filepath);
+            dfs_archive_remove(&archive, s->filepath);
+            dfs_catalog_remove(&catalog, s->filepath);
+            dfs_conn_send_frame(conn, DFS_OP_RMFILE, DFS_F_REPLY, 0, s->req_id, NULL, 0);
         }
         else
         {
-            perror("File deletion error"); // Print error message if deletion fails
+            int err = errno; // Saved before perror can change it
+            perror("File deletion error"); // Print error message if file deletion fails
+            snprintf(buffer, sizeof(buffer), "File deletion error: %s", strerror(err));
+            dfs_conn_send_error(conn, DFS_OP_RMFILE, s->req_id, err, buffer);
         }
     }
-    else if (strcmp(command, "ufile") == 0)
+    else if (s->opcode == DFS_OP_UFILE)
     {
-        // Handle file upload
-        printf("Received file upload request for: %s\n", filepath); // Print message about file upload request
-
-        // Ensure the directory exists
-        ensure_directory_exists(filepath); // Create directories if needed
-
-        // Receiving file from Smain
-        FILE *fp = fopen(filepath, "wb"); // Open the file for writing in binary mode
-        if (fp == NULL)
+        // Written through the ring: the reply waits for the sync, other connections do not
+        if (s->writer != NULL && s->upload_err == 0)
         {
-            perror("File open error"); // Print error message if file opening fails
-            close(client_sock);        // Close the client socket
-            return;                    // Exit function
+            s->writer->on_flushed = upload_written;
+            dfs_conn_hold(conn);
+            dfs_uring_flush(s->writer, s->ranged);
+            return;
         }
-
-        int bytes_read;                                                   // Variable to store number of bytes read
-        while ((bytes_read = read(client_sock, buffer, BUFFER_SIZE)) > 0) // Read data from client
+        finish_upload(s);
+    }
+    else if (s->opcode == DFS_OP_DFILE)
+    {
+        // Send the requested file back, or the range of it asked for
+        if (s->upload_err != 0)
+            dfs_conn_send_error(conn, DFS_OP_DFILE, s->req_id, s->upload_err, "Invalid range");
+        else if (!send_packed(s))
+            send_file(conn, DFS_OP_DFILE, s->req_id, s->filepath, s->ranged, s->range_off, s->range_len);
+    }
+    else if (s->opcode == DFS_OP_STAT)
+    {
+        // Bytes of the upload held from the offset on, where the client resumes its part
+        uint64_t held;
+        char held_text[24];
+        const char *held_arg = held_text;
+        if (s->upload_err == 0 && dfs_range_held(s->filepath, &s->part, s->part.offset, &held) < 0)
+            s->upload_err = errno;
+        if (s->upload_err != 0)
         {
-            fwrite(buffer, sizeof(char), bytes_read, fp); // Write data to file
-            if (bytes_read < BUFFER_SIZE)                 // If less data was read than the buffer size
-                break;                                    // Exit loop
+            snprintf(buffer, sizeof(buffer), "Could not read the upload of %s: %s", s->filepath, strerror(s->upload_err));
+            dfs_conn_send_error(conn, DFS_OP_STAT, s->req_id, s->upload_err, buffer);
+            return;
         }
-
-        printf("File received successfully: %s\n", filepath); // Print success message
-        fclose(fp);                                           // Close the file
+        snprintf(held_text, sizeof(held_text), "%llu", (unsigned long long)held);
+        dfs_conn_write_hdr_args(conn, DFS_OP_STAT, DFS_F_REPLY, 0, s->req_id, 1, &held_arg, 0);
     }
-    else if (strcmp(command, "dtar") == 0)
+    else if (s->opcode == DFS_OP_WATCH)
     {
-        snprintf(filepath, BUFFER_SIZE, "%s/text.tar", getenv("HOME")); // Create tarball path
-        create_tarball(".txt", filepath);                               // Create tarball with .txt files
-
-        // Send the tarball to Smain
-        FILE *fp = fopen(filepath, "rb"); // Open the tarball file for reading in binary mode
-        if (fp == NULL)
+        // Smain keeps its namespace index current from the changes of the store
+        start_watch(s);
+    }
+    else if (s->opcode == DFS_OP_DISPLAY)
+    {
+        // List the .txt files of the directory for Smain's display
+        send_listing(conn, s->req_id, s->filepath);
+    }
+    else if (s->opcode == DFS_OP_DTAR)
+    {
+        // A replica serves the files of the hash ranges Smain assigned to it
+        free(s->ranges);
+        s->ranges = NULL;
+        s->nranges = 0;
+        if (s->upload_err != 0 || (s->ranges_text != NULL &&
+                                   (s->nranges = dfs_route_ranges_parse(s->ranges_text, s->ranges_len, &s->ranges)) < 0))
         {
-            perror("File open error"); // Print error message if file opening fails
-            close(client_sock);        // Close the client socket
-            return;                    // Exit function
+            dfs_conn_send_error(conn, DFS_OP_DTAR, s->req_id, EINVAL, "Invalid hash ranges");
+            return;
         }
+        int (*keep)(const char *, void *) = s->ranges_text != NULL ? tarball_keep : NULL;
 
-        int bytes_read;                                                         // Variable to store number of bytes read
-        while ((bytes_read = fread(buffer, sizeof(char), BUFFER_SIZE, fp)) > 0) // Read data from file
+        // The packed files go first, straight from their segments
+        if (pack.ready && dfs_pack_send(&pack, conn, DFS_OP_DTAR, s->req_id, -1, keep, s) < 0)
         {
-            write(client_sock, buffer, bytes_read); // Send data to client
+            dfs_conn_send_error(conn, DFS_OP_DTAR, s->req_id, EIO, "Could not read the packed files");
+            return;
         }
 
-        fclose(fp);                                      // Close the file
-        printf("Tarball %s sent to Smain.\n", filepath); // Print success message
+        // Send the cached archive, or without it stream one built while it is sent
+        if (dfs_archive_send(&archive, conn, DFS_OP_DTAR, s->req_id, s->tar_part, keep, s) == 0)
+            return;
+        // Stream a tarball of the text files in the store, built while it is sent
+        dfs_tar_start(&s->tar, conn, DFS_OP_DTAR, s->req_id, store, ".txt", -1);
+        s->tar.part = s->tar_part;
+        s->tar.keep = keep;
+        s->tar.keep_data = s;
+        dfs_conn_hold(conn); // Pipelined requests wait for the end of the archive
+        send_tarball(s);
     }
     else
     {
-        printf("Unknown command: %s\n", command); // Print unknown command message
+        // Handle unknown commands
+        printf("Unknown command: %d\n", s->opcode);
+        dfs_conn_send_error(conn, s->opcode, s->req_id, EOPNOTSUPP, "Unknown command");
     }
 
-    close(client_sock); // Close the client socket
 }
 
-void ensure_directory_exists(char *path)
+// Smain caught up with the archive queued so far, add the next members
+void client_drain(struct dfs_conn *conn)
+{
+    struct session *s = (struct session *)conn->data;
+
+    if (s->tar.active)
+        send_tarball(s);
+}
+
+// Connection closed, possibly in the middle of an upload or an archive
+void client_close(struct dfs_conn *conn)
+{
+    struct session *s = (struct session *)conn->data;
+
+    if (s->upload_fd >= 0)
+        close(s->upload_fd);
+    if (s->writer != NULL)
+        dfs_uring_close(s->writer);
+    s->upload_fd = -1;
+    s->writer = NULL;
+    if (s->commit != NULL)
+        dfs_commit_close(s->commit); // A file on its way into place still lands
+    s->commit = NULL;
+    free(s->pack_buf);
+    s->pack_buf = NULL;
+    dfs_tar_abort(&s->tar);
+    if (s->watching)
+        dfs_catalog_feed_stop(&s->feed);
+    s->watching = 0;
+    free(s->ranges_text);
+    free(s->ranges);
+    s->ranges_text = NULL;
+    s->ranges = NULL;
+}
+
+// The ring caught up with an upload, take more of its body
+void upload_room(struct dfs_uring_file *f)
+{
+    struct session *s = (struct session *)f->data;
+
+    dfs_conn_resume_read(s->conn);
+}
+
+// The part written so far is on disk: record it as held and take the rest
+void upload_checkpointed(struct dfs_uring_file *f, int err)
+{
+    struct session *s = (struct session *)f->data;
+
+    if (err == 0 && dfs_range_checkpoint(f->fd, s->filepath, &s->part) < 0)
+        err = errno;
+    if (err != 0 && s->upload_err == 0)
+        s->upload_err = err; // Answered once the body has been drained
+    dfs_conn_resume_read(s->conn);
+}
+
+// The whole upload is on disk, or failed: reply and go on with the next request
+void upload_written(struct dfs_uring_file *f, int err)
+{
+    struct session *s = (struct session *)f->data;
+
+    if (err != 0 && s->upload_err == 0)
+        s->upload_err = err;
+    finish_upload(s);
+    if (s->commit == NULL)
+        dfs_conn_release(s->conn); // Otherwise once the file is in place
+}
+
+// Close the file of an upload and reply to it
+void finish_upload(struct session *s)
 {
-    struct stat st = {0};                      // Structure to hold file status
-    char temp[BUFFER_SIZE];                    // Temporary buffer for path manipulation
-    char *dir_path = strdup(path);             // Duplicate the path to modify
-    char *last_slash = strrchr(dir_path, '/'); // Find the last '/' in the path
+    char buffer[BUFFER_SIZE + PATH_MAX]; // Error message, room for a path and why
+
+    // Smain counts the copy towards its write quorum, so it must be on disk before the reply.
+    // A part is, once it is recorded as held. A whole file is synced along with the other uploads
+    // of its batch and moved into place, upload_committed replies. A writer synced it already.
+    int fd = s->writer != NULL ? s->writer->fd : s->upload_fd;
+    if (fd >= 0 && s->upload_err == 0 && s->ranged && dfs_range_checkpoint(fd, s->filepath, &s->part) < 0)
+        s->upload_err = errno;
+    if (s->writer != NULL)
+        dfs_uring_close(s->writer); // Closes the file once writes abandoned by an error are done
+    else if (s->upload_fd >= 0 && s->commit == NULL && close(s->upload_fd) < 0 && s->upload_err == 0)
+        s->upload_err = errno; // Delayed write errors surface on close
+    s->writer = NULL;
+    s->upload_fd = -1;
+
+    struct stat st;
+    int packed = s->pack_buf != NULL && s->upload_err == 0 && store_packed(s, &st) == 0;
+    free(s->pack_buf);
+    s->pack_buf = NULL;
+    if (s->commit != NULL && s->upload_err == 0)
+    {
+        s->commit->crc = s->upload_crc;
+        dfs_conn_hold(s->conn); // Pipelined requests wait for the reply
+        dfs_commit_submit(s->conn->loop, s->commit, upload_committed, s);
+        return;
+    }
+    if (s->commit != NULL)
+        dfs_commit_abort(s->commit);
+    s->commit = NULL;
+    if (!packed && s->upload_err == 0 && s->ranged && s->part.commit &&
+        dfs_range_part_commit(s->filepath, &s->part, dfs_crc32, &s->upload_crc, &st) < 0)
+        s->upload_err = errno; // Parts missing, or none arrived
+
+    if (s->upload_err == 0 && s->ranged && !s->part.commit)
+    {
+        dfs_conn_send_frame(s->conn, DFS_OP_UFILE, DFS_F_REPLY, 0, s->req_id, NULL, 0);
+    }
+    else if (s->upload_err == 0)
+    {
+        printf("File received successfully: %s%s\n", s->filepath, packed ? " (packed)" : "");
+        if (!packed)
+            dfs_pack_remove(&pack, s->filepath); // A version packed before is stale, downloads look there first
+        dfs_catalog_put(&catalog, s->filepath, &st, s->upload_crc);
+        dfs_conn_send_frame(s->conn, DFS_OP_UFILE, DFS_F_REPLY, 0, s->req_id, NULL, 0);
+        if (!packed)
+            dfs_archive_add(&archive, s->filepath); // Copies the file, the reply need not wait for that
+    }
+    else
+    {
+        snprintf(buffer, sizeof(buffer), "Could not store %s: %s", s->filepath, strerror(s->upload_err));
+        dfs_conn_send_error(s->conn, DFS_OP_UFILE, s->req_id, s->upload_err, buffer);
+    }
+}
 
-    if (last_slash)
+// Store the body of a small upload in the pack, described in st. Returns 0, or -1 if the pack could
+// not take it: the body was written to a temporary file to commit the usual way then, or upload_err set.
+int store_packed(struct session *s, struct stat *st)
+{
+    if (dfs_pack_put(&pack, s->filepath, s->pack_buf, s->pack_len, s->upload_crc, st) == 0)
+    {
+        // The file of an older version, stored before it was small enough or without -k, is stale
+        if (unlink(s->filepath) == 0)
+            dfs_archive_remove(&archive, s->filepath);
+        return 0;
+    }
+    if ((s->commit = dfs_commit_open(s->filepath)) == NULL ||
+        dfs_write_full(s->commit->fd, s->pack_buf, s->pack_len) < 0)
     {
-        *last_slash = '\0'; // Strip the filename to get the directory path
+        s->upload_err = errno; // Saved before perror can change it
+        perror("File write error");
     }
+    return -1;
+}
 
-    snprintf(temp, sizeof(temp), "%s", dir_path); // Copy directory path to temporary buffer
+// A whole upload is in place and on disk, or failed: record and answer it
+void upload_committed(struct dfs_commit *c, int err)
+{
+    struct session *s = (struct session *)c->data;
+    char buffer[BUFFER_SIZE + PATH_MAX]; // Error message, room for a path and why
+    struct stat st;
 
-    // Iterate over the path and create directories as needed
-    for (char *p = temp + 1; *p; p++)
+    if (err == 0 && stat(c->path, &st) < 0)
+        err = errno; // Removed again meanwhile
+    if (err == 0)
     {
-        if (*p == '/')
+        printf("File received successfully: %s\n", c->path);
+        dfs_pack_remove(&pack, c->path); // A version packed before is stale, downloads look there first
+        dfs_catalog_put(&catalog, c->path, &st, c->crc);
+    }
+    if (s != NULL)
+    {
+        // Smain may have gone away meanwhile, the file is stored all the same
+        s->commit = NULL;
+        if (err == 0)
+            dfs_conn_send_frame(s->conn, DFS_OP_UFILE, DFS_F_REPLY, 0, s->req_id, NULL, 0);
+        else
         {
-            *p = '\0';                 // Temporarily terminate the string at the current '/'
-            if (stat(temp, &st) == -1) // Check if the directory exists
-            {
-                if (mkdir(temp, S_IRWXU) != 0 && errno != EEXIST) // Attempt to create the directory
-                {
-                    perror("Failed to create directory"); // Print error message if directory creation fails
-                }
-            }
-            *p = '/'; // Restore the original character
+            snprintf(buffer, sizeof(buffer), "Could not store %s: %s", c->path, strerror(err));
+            dfs_conn_send_error(s->conn, DFS_OP_UFILE, s->req_id, err, buffer);
         }
+        dfs_conn_release(s->conn);
     }
+    if (err == 0)
+        dfs_archive_add(&archive, c->path); // Copies the file, the reply need not wait for that
+}
 
-    // Ensure the final directory in the path is created
-    if (stat(temp, &st) == -1)
+// Queue the file of a download from the pack, or the range of it asked for. Returns 0 if the pack
+// does not hold it, the file is then looked for in the store.
+int send_packed(struct session *s)
+{
+    struct dfs_pack_object o;
+    char *data;
+    char total[24]; // Size of the whole file, the argument of a ranged reply
+    const char *arg = total;
+
+    if (dfs_pack_get(&pack, s->filepath, &o, &data) <= 0)
+        return 0;
+    if (!s->ranged)
     {
-        if (mkdir(temp, S_IRWXU) != 0 && errno != EEXIST)
-        {
-            perror("Failed to create directory"); // Print error message if directory creation fails
-        }
+        dfs_conn_write_hdr(s->conn, DFS_OP_DFILE, DFS_F_REPLY, 0, s->req_id, 0, o.size);
+        dfs_conn_write(s->conn, data, o.size);
+    }
+    else
+    {
+        uint64_t off = s->range_off < o.size ? s->range_off : o.size;
+        uint64_t len = s->range_len < o.size - off ? s->range_len : o.size - off;
+        snprintf(total, sizeof(total), "%llu", (unsigned long long)o.size);
+        dfs_conn_write_hdr_args(s->conn, DFS_OP_DFILE, DFS_F_REPLY, 0, s->req_id, 1, &arg, len);
+        dfs_conn_write(s->conn, data + off, len);
     }
+    free(data);
+    return 1;
+}
 
-    free(dir_path); // Free the duplicated path memory
+// Enter a packed file into a catalog rebuilt from the store
+void catalog_packed(const struct dfs_pack_object *o, void *data)
+{
+    struct stat st;
+
+    (void)data;
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFREG | 0644;
+    st.st_size = o->size;
+    st.st_mtime = o->mtime;
+    dfs_catalog_put(&catalog, o->path, &st, o->crc);
 }
 
-void create_tarball(const char *filetype, const char *tarfile)
+// Set up an epoll worker: with -k it compacts the pack now and then, whichever worker gets to it
+void start_worker(struct dfs_loop *loop)
 {
-    char command[BUFFER_SIZE];   // Buffer to hold the command for tarball creation
-    char *home = getenv("HOME"); // Get the user's home directory
+    if (pack.ready && dfs_timer_start(loop, &compactor, DFS_PACK_COMPACT_PERIOD, compact_pack, NULL) < 0)
+        perror("timerfd failed"); // The pack only grows then
+}
 
-    if (strcmp(filetype, ".txt") == 0)
+// Move the live files out of mostly dead segments, left behind by rmfile and replaced files
+void compact_pack(struct dfs_timer *timer)
+{
+    (void)timer;
+    dfs_pack_compact(&pack);
+}
+
+// Queue a file, or len bytes of it from off on if ranged, as a single reply frame, or an error reply
+// if it cannot be opened
+int send_file(struct dfs_conn *conn, int opcode, uint32_t req_id, const char *filepath, int ranged, uint64_t off,
+              uint64_t len)
+{
+    char buffer[BUFFER_SIZE];
+    struct stat st;
+
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC); // Open the file for reading
+    if (fd < 0 || fstat(fd, &st) < 0)
     {
-        // Create tarball of only .txt files in ~/stext directory
-        snprintf(command, BUFFER_SIZE, "find %s/stext -type f -name '*.txt' -print | tar -cvf %s -T -", home, tarfile);
+        int err = errno; // Saved before perror can change it
+        perror("File open error"); // Print error message if file open fails
+        snprintf(buffer, BUFFER_SIZE, "Could not open %s: %s", filepath, strerror(err));
+        dfs_conn_send_error(conn, opcode, req_id, err, buffer);
+        if (fd >= 0)
+            close(fd);
+        return -1;
     }
-    else
+
+    // The reply header announces the size, the content is sent from the file as the socket takes it.
+    // A range is read in place, ranges of the same file sent over other connections do not contend.
+    if (ranged)
     {
-        printf("Unknown filetype for tarball creation: %s\n", filetype); // Print unknown filetype message
-        return;                                                          // Exit function
+        dfs_range_send(conn, opcode, req_id, fd, st.st_size, off, len);
+        return 0;
     }
+    dfs_conn_write_hdr(conn, opcode, DFS_F_REPLY, 0, req_id, 0, st.st_size);
+    dfs_conn_write_file(conn, fd, 0, st.st_size); // The connection closes fd once it is sent
+    return 0;
+}
 
-    printf("Executing tar command: %s\n", command); // Print the tar command being executed
-    int result = system(command);                   // Execute the tar command
+// Queue the next members of the archive, called again from client_drain until it is complete
+void send_tarball(struct session *s)
+{
+    if (dfs_tar_pump(&s->tar))
+        dfs_conn_release(s->conn);
+}
 
-    if (result != 0)
+// Whether a file of the store, by its path below the store, goes into the dtar being served
+int tarball_keep(const char *name, void *data)
+{
+    struct session *s = (struct session *)data;
+
+    return dfs_route_ranges_has(s->ranges, s->nranges, name);
+}
+
+// Queue the .txt files directly in a directory as lines of a multi-frame reply
+void send_listing(struct dfs_conn *conn, uint32_t req_id, const char *dirpath)
+{
+    char buffer[BUFFER_SIZE];
+    struct listing l;
+    struct dirent *entry;
+    DIR *dir;
+
+    l.conn = conn;
+    l.req_id = req_id;
+    l.dirpath = dirpath;
+    l.len = snprintf(l.buf, sizeof(l.buf), "Text Files in %s:\n", dirpath);
+
+    // The catalog answers without reading the directory, which is read only without a catalog
+    if (dfs_catalog_list(&catalog, dirpath, listing_entry, &l) == 0)
+    {
+        dfs_conn_send_frame(conn, DFS_OP_DISPLAY, DFS_F_REPLY, 0, req_id, l.buf, l.len);
+        return;
+    }
+    if (errno == ENOENT || (dir = opendir(dirpath)) == NULL)
+    {
+        int err = errno; // Saved before perror can change it
+        perror("Could not open directory");
+        snprintf(buffer, BUFFER_SIZE, "Could not open directory %s: %s", dirpath, strerror(err));
+        dfs_conn_send_error(conn, DFS_OP_DISPLAY, req_id, err, buffer);
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL)
+        listing_add(&l, entry->d_name);
+    closedir(dir);
+    dfs_pack_list(&pack, dirpath, listing_packed, &l); // Packed files have no directory entry
+
+    dfs_conn_send_frame(conn, DFS_OP_DISPLAY, DFS_F_REPLY, 0, req_id, l.buf, l.len);
+}
+
+// Batch the line of name if it is a .txt file
+void listing_add(struct listing *l, const char *name)
+{
+    char buffer[BUFFER_SIZE]; // One line of the listing
+    size_t name_len = strlen(name), suffix_len = strlen(".txt");
+
+    if (name_len < suffix_len || strcmp(name + name_len - suffix_len, ".txt") != 0)
+        return;
+
+    // Frames end with whole lines, Smain merges them with the other servers' lines
+    int line_len = snprintf(buffer, BUFFER_SIZE, "%s/%s\n", l->dirpath, name);
+    if (line_len >= BUFFER_SIZE)
+        return; // Too long to list
+    if (l->len + line_len > sizeof(l->buf))
+    {
+        dfs_conn_send_frame(l->conn, DFS_OP_DISPLAY, DFS_F_REPLY | DFS_F_MORE, 0, l->req_id, l->buf, l->len);
+        l->len = 0;
+    }
+    memcpy(l->buf + l->len, buffer, line_len);
+    l->len += line_len;
+}
+
+// An entry of the catalog in the directory listed
+void listing_entry(const struct dfs_catalog_entry *e, void *data)
+{
+    const char *name = strrchr(e->path, '/');
+
+    if (e->type == DFS_CATALOG_FILE)
+        listing_add((struct listing *)data, name != NULL ? name + 1 : e->path);
+}
+
+// A packed file in the directory listed
+void listing_packed(const char *name, void *data)
+{
+    listing_add((struct listing *)data, name);
+}
+
+// Report the .txt files and the directories of the store to Smain, then every change to them.
+// The reply never ends, the connection serves nothing else from now on.
+void start_watch(struct session *s)
+{
+    dfs_conn_hold(s->conn);
+    s->watching = 1;
+    if (dfs_catalog_feed_start(s->conn->loop, &s->feed, &catalog, watch_event, s) < 0)
     {
-        printf("Tar command failed with exit code %d\n", result); // Print error message if tar command fails
+        s->watching = 0;
+        s->watch_len = 0;
+        dfs_conn_send_error(s->conn, DFS_OP_WATCH, s->req_id, ENOENT, "Could not follow the catalog");
+        dfs_conn_release(s->conn);
     }
 }
+
+// A change of the catalog, passed on as a record: "<type> <path>\n" with the path relative to the store
+void watch_event(struct dfs_catalog_feed *f, int event, const char *path)
+{
+    static const char types[] = "ADMXR"; // Records of DFS_NOTIFY_ADD .. DFS_NOTIFY_RESET
+    struct session *s = (struct session *)f->data;
+    size_t len = strlen(path), suffix_len = strlen(".txt");
+
+    if (event == DFS_NOTIFY_SETTLED)
+    {
+        // Smain trusts its view of this server once the catalog was reported
+        if (!s->watch_synced)
+            watch_record(s, 'S', "");
+        s->watch_synced = 1;
+        watch_flush(s);
+        return;
+    }
+    if ((event == DFS_NOTIFY_ADD || event == DFS_NOTIFY_DEL) &&
+        (len < suffix_len || strcmp(path + len - suffix_len, ".txt") != 0))
+        return;
+    watch_record(s, types[event], path);
+}
+
+// Batch a change record, records go out as whole lines
+void watch_record(struct session *s, char type, const char *path)
+{
+    size_t len = strlen(path) + 3;
+
+    if (strchr(path, '\n') != NULL || len > sizeof(s->watch_buf))
+        return; // Cannot be reported
+    if (s->watch_len + len > sizeof(s->watch_buf))
+        watch_flush(s);
+    snprintf(s->watch_buf + s->watch_len, sizeof(s->watch_buf) - s->watch_len, "%c %s\n", type, path);
+    s->watch_len += len;
+}
+
+// Send the batched change records
+void watch_flush(struct session *s)
+{
+    if (s->watch_len == 0)
+        return;
+    dfs_conn_send_frame(s->conn, DFS_OP_WATCH, DFS_F_REPLY | DFS_F_MORE, 0, s->req_id, s->watch_buf, s->watch_len);
+    s->watch_len = 0;
+}
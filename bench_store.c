@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+#include "dfs_xfer.h"
+
+// Throughput of a storage server (Spdf or Stext) for uploads and downloads,
+// talking to it directly the way Smain does. Compare a server run with and
+// without -u on many small files and on a few huge ones, e.g.
+//
+//   ./bench_store -n 20000 -s 4K -c 8
+//   ./bench_store -n 8 -s 512M -c 4
+//
+// Each connection pipelines its share of the requests, WINDOW of them at a
+// time, so the numbers show what the server sustains, not round trips.
+
+#define PORT 6061
+#define BUFFER_SIZE 1024
+#define WINDOW 8 // Requests a connection has outstanding
+
+// Function prototypes
+int connect_server(int port);
+uint64_t parse_size(const char *text);
+double now_seconds(void);
+int run_connection(int port, int conn, int nfiles, uint64_t size, const char *dir, int opcode);
+int receive_reply(int sock, uint64_t size, int opcode);
+double run_phase(int port, int conns, int nfiles, uint64_t size, const char *dir, int opcode);
+
+int main(int argc, char *argv[])
+{
+    int port = PORT, nfiles = 1000, conns = 4, opt;
+    uint64_t size = 64 * 1024;
+    const char *dir = "/tmp/bench_store";
+
+    while ((opt = getopt(argc, argv, "p:n:s:c:d:")) != -1)
+    {
+        if (opt == 'p' && atoi(optarg) > 0 && atoi(optarg) <= 65535)
+            port = atoi(optarg);
+        else if (opt == 'n' && atoi(optarg) > 0)
+            nfiles = atoi(optarg);
+        else if (opt == 's' && parse_size(optarg) > 0)
+            size = parse_size(optarg);
+        else if (opt == 'c' && atoi(optarg) > 0)
+            conns = atoi(optarg);
+        else if (opt == 'd' && optarg[0] == '/')
+            dir = optarg;
+        else
+        {
+            fprintf(stderr, "Usage: %s [-p port] [-n files] [-s size[K|M|G]] [-c connections] [-d server dir]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (conns > nfiles)
+        conns = nfiles;
+
+    double mb = (double)nfiles * size / (1024 * 1024);
+    const int opcodes[] = {DFS_OP_UFILE, DFS_OP_DFILE};
+    for (int i = 0; i < 2; i++)
+    {
+        double secs = run_phase(port, conns, nfiles, size, dir, opcodes[i]);
+        if (secs < 0)
+            exit(EXIT_FAILURE);
+        printf("%-8s %d x %llu bytes over %d connections: %.3f s, %.0f files/s, %.1f MB/s\n",
+               opcodes[i] == DFS_OP_UFILE ? "upload" : "download", nfiles, (unsigned long long)size, conns, secs,
+               nfiles / secs, mb / secs);
+    }
+    return 0;
+}
+
+// Connect to the storage server on port of this host
+int connect_server(int port)
+{
+    int sock;
+    struct sockaddr_in server_addr;
+
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        perror("Socket creation failed");
+        return -1;
+    }
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        perror("Connection to server failed");
+        close(sock);
+        return -1;
+    }
+    dfs_sock_tune(sock, DFS_SOCK_FRAMED);
+    return sock;
+}
+
+// Bytes given as a number with an optional K, M or G suffix, 0 if malformed
+uint64_t parse_size(const char *text)
+{
+    char *end;
+    uint64_t n = strtoull(text, &end, 10);
+
+    if (*end == 'K' || *end == 'k')
+        n <<= 10;
+    else if (*end == 'M' || *end == 'm')
+        n <<= 20;
+    else if (*end == 'G' || *end == 'g')
+        n <<= 30;
+    else if (*end != '\0')
+        return 0;
+    return n;
+}
+
+double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Upload or download every file of the phase, each connection in a process of its own.
+// Returns the seconds it took, -1 if a transfer failed.
+double run_phase(int port, int conns, int nfiles, uint64_t size, const char *dir, int opcode)
+{
+    double start = now_seconds();
+    int failed = 0, status;
+
+    for (int c = 0; c < conns; c++)
+    {
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("Fork failed");
+            return -1;
+        }
+        if (pid == 0)
+            _exit(run_connection(port, c, nfiles / conns + (c < nfiles % conns), size, dir, opcode) < 0);
+    }
+    while (wait(&status) > 0)
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    return failed ? -1 : now_seconds() - start;
+}
+
+// Transfer the nfiles files of connection conn, WINDOW requests outstanding at a time
+int run_connection(int port, int conn, int nfiles, uint64_t size, const char *dir, int opcode)
+{
+    size_t chunk = dfs_xfer_chunk(size);
+    char *data = (char *)malloc(chunk);
+    char path[BUFFER_SIZE];
+    const char *argv[] = {path};
+    int sock = connect_server(port), received = 0;
+
+    if (sock < 0 || data == NULL)
+        return -1;
+    for (size_t i = 0; i < chunk; i++)
+        data[i] = (char)(i * 131 + conn); // Not all zeros, which some file systems store sparsely
+
+    for (int i = 0; i < nfiles; i++)
+    {
+        snprintf(path, sizeof(path), "%s/c%d_%d.pdf", dir, conn, i);
+        if (dfs_send_request(sock, opcode, i + 1, 1, argv, opcode == DFS_OP_UFILE ? size : 0) < 0)
+            return -1;
+        for (uint64_t left = opcode == DFS_OP_UFILE ? size : 0; left > 0;)
+        {
+            size_t n = left < chunk ? (size_t)left : chunk;
+            if (dfs_write_full(sock, data, n) < 0)
+                return -1;
+            left -= n;
+        }
+        if (i + 1 - received >= WINDOW)
+        {
+            if (receive_reply(sock, size, opcode) < 0)
+                return -1;
+            received++;
+        }
+    }
+    for (; received < nfiles; received++)
+    {
+        if (receive_reply(sock, size, opcode) < 0)
+            return -1;
+    }
+    close(sock);
+    free(data);
+    return 0;
+}
+
+// Read the reply to the oldest request outstanding: an empty one for an upload, the file of
+// size bytes for a download
+int receive_reply(int sock, uint64_t size, int opcode)
+{
+    struct dfs_hdr hdr;
+    char args[DFS_MAX_ARGLEN + 1];
+    char message[BUFFER_SIZE];
+
+    if (dfs_recv_frame(sock, &hdr, args) < 0)
+    {
+        perror("Failed to receive reply");
+        return -1;
+    }
+    if (hdr.status != 0)
+    {
+        uint64_t len = hdr.length - hdr.arglen < sizeof(message) - 1 ? hdr.length - hdr.arglen : 0;
+        message[0] = '\0';
+        if (len > 0 && dfs_read_full(sock, message, len) == 0)
+            message[len] = '\0';
+        fprintf(stderr, "Request failed: %s\n", message);
+        return -1;
+    }
+    if (opcode == DFS_OP_DFILE && hdr.length - hdr.arglen != size)
+    {
+        fprintf(stderr, "Download of %llu bytes, expected %llu\n",
+                (unsigned long long)(hdr.length - hdr.arglen), (unsigned long long)size);
+        return -1;
+    }
+    return dfs_skip(sock, hdr.length - hdr.arglen);
+}
@@ -2,41 +2,64 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/sendfile.h>
+#include "dfs_xfer.h"
 
 #define PORT 6060
 #define BUFFER_SIZE 1024
+#define RANGE_MIN (8 * 1024 * 1024) // Files from this size on move in ranges over several connections
+#define STREAMS 4                   // Connections the rest of such a file is spread over
+#define RETRIES 5                   // Connections a range is tried over before the transfer fails
 
 // Function prototypes
-void upload_file(int sock, const char *filename, const char *destination_path);
-void download_file(int sock, const char *filename);
-void download_tarball(int sock, const char *tarfile);
+int connect_server(void);
+void upload_file(int sock, uint32_t req_id, const char *filename, const char *destination_path);
+int upload_part(int sock, uint64_t *offset, uint64_t end, void *ctx);
+int send_body(int sock, int fd, off_t offset, uint64_t remaining);
+int download_range(int sock, uint64_t *offset, uint64_t end, void *ctx);
+int receive_range(int sock, uint32_t req_id, const char *out_path, int *fd, uint64_t *offset, uint64_t *total);
+int receive_status(int sock, uint32_t req_id, char *arg);
+int transfer_ranges(uint64_t start, uint64_t total, int (*transfer)(int, uint64_t *, uint64_t, void *), void *ctx);
+void download_file(int sock, uint32_t req_id, const char *filename);
+void download_tarball(int sock, uint32_t req_id, const char *tarfile, int compress);
+void simple_request(int sock, uint32_t req_id, int opcode, const char *path);
+int receive_reply(int sock, uint32_t req_id, const char *out_path);
+void write_body(void *ctx, const char *data, size_t len);
+
+// What the connections of a ranged transfer share
+struct ranged_file
+{
+    const char *filename;         // File named in the requests
+    const char *destination_path; // Destination of an upload
+    const char *out_path;         // Output of a download
+    char id[24];                  // Id of an upload
+    int fd;                       // File an upload is read from
+    uint64_t total;               // Size of the whole file
+};
+
+// Where write_body puts the body of a reply frame
+struct body_out
+{
+    FILE *fp;         // Stream it is written to, stderr for error messages
+    int fd;           // Otherwise the file it goes into at *offset, -1 to drop it
+    uint64_t *offset; // Moved along as it is written
+    int err;          // errno of the first failed write
+};
 
 int main()
 {
     int sock;
-    struct sockaddr_in server_addr;
     char buffer[BUFFER_SIZE];
     char command[BUFFER_SIZE], filename[BUFFER_SIZE], destination_path[BUFFER_SIZE];
-
-    // Creating socket
-    // SOCK_STREAM indicates that this will be a TCP socket
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-    {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
-    }
-
-    // Configuring server address struct
-    server_addr.sin_family = AF_INET;                       // IPv4
-    server_addr.sin_port = htons(PORT);                     // Port number
-    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr); // Localhost
+    uint32_t next_req_id = 1; // Id of the next request sent to the server
 
     // Connecting to the server
-    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    if ((sock = connect_server()) < 0)
     {
-        perror("Connection to server failed");
-        close(sock);
         exit(EXIT_FAILURE);
     }
 
@@ -45,7 +68,11 @@ int main()
     {
         // Taking user input for command
         printf("Enter command (ufile/dfile/rmfile/dtar/display/exit): ");
-        fgets(buffer, BUFFER_SIZE, stdin);
+        if (fgets(buffer, BUFFER_SIZE, stdin) == NULL)
+        {
+            break; // End of input
+        }
+        command[0] = filename[0] = destination_path[0] = '\0';
         sscanf(buffer, "%s %s %s", command, filename, destination_path);
 
         // Exit the loop and close connection if 'exit' command is received
@@ -54,23 +81,32 @@ int main()
             break;
         }
 
-        // Sending command to the server
-        write(sock, buffer, strlen(buffer));
-
-        // Handle different commands
+        // Handle different commands, each one is sent to the server as a single request frame
         if (strcmp(command, "ufile") == 0)
         {
-            upload_file(sock, filename, destination_path);
+            upload_file(sock, next_req_id++, filename, destination_path);
         }
         else if (strcmp(command, "dfile") == 0)
         {
-            download_file(sock, filename);
+            download_file(sock, next_req_id++, filename);
         }
         else if (strcmp(command, "dtar") == 0)
         {
-            download_tarball(sock, filename); // filename here will be the filetype
+            // filename here will be the filetype, "dtar .txt --compress" asks for a gzip compressed tarball
+            download_tarball(sock, next_req_id++, filename, strcmp(destination_path, "--compress") == 0);
+        }
+        else if (strcmp(command, "rmfile") == 0)
+        {
+            simple_request(sock, next_req_id++, DFS_OP_RMFILE, filename);
+        }
+        else if (strcmp(command, "display") == 0)
+        {
+            simple_request(sock, next_req_id++, DFS_OP_DISPLAY, filename);
+        }
+        else if (command[0] != '\0')
+        {
+            printf("Unknown command: %s\n", command);
         }
-        // Additional command handling like rmfile, display could be added here
     }
 
     // Close the socket
@@ -78,47 +114,230 @@ int main()
     return 0;
 }
 
+// Function to open a connection to the server. Returns the socket, or -1.
+int connect_server(void)
+{
+    int sock;
+    struct sockaddr_in server_addr;
+
+    // Creating socket
+    // SOCK_STREAM indicates that this will be a TCP socket
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    // Configuring server address struct
+    server_addr.sin_family = AF_INET;                       // IPv4
+    server_addr.sin_port = htons(PORT);                     // Port number
+    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr); // Localhost
+
+    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        perror("Connection to server failed");
+        close(sock);
+        return -1;
+    }
+    dfs_sock_tune(sock, DFS_SOCK_FRAMED);
+    return sock;
+}
+
 // Function to upload a file to the server
-void upload_file(int sock, const char *filename, const char *destination_path)
+void upload_file(int sock, uint32_t req_id, const char *filename, const char *destination_path)
 {
     // Open the file in binary read mode
     FILE *fp = fopen(filename, "rb");
-    if (fp == NULL)
+    struct stat st; // Size of the file, announced in the request header
+    if (fp == NULL || fstat(fileno(fp), &st) < 0)
     {
         perror("File open error");
+        if (fp)
+            fclose(fp);
         return;
     }
 
-    // Prepare a buffer for file data and command
-    char buffer[BUFFER_SIZE];
+    // A large file goes in parts over several connections at once, then the upload is committed
+    // on this one: the server moves the parts into place as a whole. The id names this version of
+    // the file, so uploading it again resumes where an upload that failed left off.
+    if (st.st_size >= RANGE_MIN)
+    {
+        struct ranged_file rf = {filename, destination_path, NULL, "", fileno(fp), (uint64_t)st.st_size};
+        uint64_t version[] = {st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+        uint64_t hash = 14695981039346656037ULL; // FNV-1a
+        char total[24];
+        for (size_t i = 0; i < sizeof(version); i++)
+            hash = (hash ^ ((unsigned char *)version)[i]) * 1099511628211ULL;
+        snprintf(rf.id, sizeof(rf.id), "%016llx", (unsigned long long)hash);
+        snprintf(total, sizeof(total), "%llu", (unsigned long long)rf.total);
+        int failed = transfer_ranges(0, rf.total, upload_part, &rf);
+        fclose(fp);
+        if (failed)
+        {
+            fprintf(stderr, "Upload of %s failed\n", filename);
+            return;
+        }
+        const char *argv[] = {filename, destination_path, rf.id, total, total};
+        if (dfs_send_request(sock, DFS_OP_UFILE, req_id, 5, argv, 0) < 0)
+        {
+            perror("Failed to send request");
+            exit(EXIT_FAILURE);
+        }
+        if (receive_reply(sock, req_id, NULL) == 0)
+        {
+            printf("File %s uploaded successfully.\n", filename);
+        }
+        return;
+    }
 
-    // Send an initial command to the server indicating a file transfer with its destination
-    snprintf(buffer, BUFFER_SIZE, "ufile %s", destination_path);
-    if (write(sock, buffer, strlen(buffer)) < 0)
+    // Send the request header with the filename and its destination, in the first packet of the body
+    const char *argv[] = {filename, destination_path};
+    dfs_sock_cork(sock, 1);
+    if (dfs_send_request(sock, DFS_OP_UFILE, req_id, 2, argv, st.st_size) < 0)
     {
         perror("Failed to send initial file transfer command");
         fclose(fp);
-        return;
+        exit(EXIT_FAILURE); // The connection is unusable
+    }
+
+    // Send exactly the announced number of bytes to the server
+    if (send_body(sock, fileno(fp), 0, st.st_size) < 0)
+    {
+        perror("Failed to send file data");
+        fclose(fp);
+        exit(EXIT_FAILURE);
     }
+    dfs_sock_cork(sock, 0);
+
+    fclose(fp);
 
-    // Read file data and send it to the server
-    int bytes_read;
-    while ((bytes_read = fread(buffer, sizeof(char), BUFFER_SIZE, fp)) > 0)
+    // Wait for the server to confirm the upload
+    if (receive_reply(sock, req_id, NULL) == 0)
     {
-        if (write(sock, buffer, bytes_read) != bytes_read)
+        printf("File %s uploaded successfully.\n", filename);
+    }
+}
+
+// Send the part of a ranged upload from offset to end over a connection of its own, starting
+// where the server's copy of it ends. Returns the status reported by the server, -1 if the
+// connection was lost.
+int upload_part(int sock, uint64_t *offset, uint64_t end, void *ctx)
+{
+    struct ranged_file *rf = (struct ranged_file *)ctx;
+    char off[24], total[24], held[24];
+    const char *argv[] = {rf->filename, rf->destination_path, rf->id, off, total};
+    int status;
+
+    snprintf(off, sizeof(off), "%llu", (unsigned long long)*offset);
+    snprintf(total, sizeof(total), "%llu", (unsigned long long)rf->total);
+    if (dfs_send_request(sock, DFS_OP_STAT, 1, 4, argv, 0) < 0 || (status = receive_status(sock, 1, held)) < 0)
+        return -1;
+    if (status != 0)
+        return status;
+    if (strtoull(held, NULL, 10) > 0)
+    {
+        printf("Resuming upload of %s at byte %llu\n", rf->filename, (unsigned long long)(*offset + strtoull(held, NULL, 10)));
+    }
+    *offset += strtoull(held, NULL, 10);
+    if (*offset >= end)
+        return 0; // Arrived before the connection was lost
+
+    snprintf(off, sizeof(off), "%llu", (unsigned long long)*offset);
+    dfs_sock_cork(sock, 1);
+    if (dfs_send_request(sock, DFS_OP_UFILE, 2, 5, argv, end - *offset) < 0 ||
+        send_body(sock, rf->fd, *offset, end - *offset) < 0)
+        return -1;
+    dfs_sock_cork(sock, 0);
+    return receive_status(sock, 2, held);
+}
+
+// Send remaining bytes of fd from offset on as a request body. Returns -1 if the socket fails.
+int send_body(int sock, int fd, off_t offset, uint64_t remaining)
+{
+    char buffer[DFS_XFER_MIN];
+
+    // Hand the file to the kernel, it goes from the page cache to the socket without a copy
+    while (remaining > 0)
+    {
+        ssize_t sent = sendfile(sock, fd, &offset, remaining < (1 << 30) ? remaining : (1 << 30));
+        if (sent <= 0)
         {
-            perror("Failed to send file data");
-            break;
+            if (sent < 0 && errno == EINTR)
+                continue;
+            break; // File shrank or cannot be sent this way, copy the rest below
         }
+        remaining -= (uint64_t)sent;
     }
 
-    if (ferror(fp))
+    // Read file data and send exactly the announced number of bytes
+    while (remaining > 0)
     {
-        perror("Error reading from file");
+        size_t want = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+        ssize_t bytes_read = pread(fd, buffer, want, offset);
+        if (bytes_read < 0)
+        {
+            perror("Error reading from file");
+            bytes_read = 0;
+        }
+        if ((size_t)bytes_read < want)
+        {
+            memset(buffer + bytes_read, 0, want - bytes_read); // File shrank while being sent
+        }
+        if (dfs_write_full(sock, buffer, want) < 0)
+        {
+            return -1;
+        }
+        offset += want;
+        remaining -= want;
     }
+    return 0;
+}
 
-    fclose(fp);
-    printf("File %s uploaded successfully.\n", filename);
+// Spread the bytes of a file from start to total over STREAMS connections, each made by a child
+// process of its own that runs transfer on its range. A range whose connection is lost, or whose
+// storage server could not be reached, goes on over a new connection from where transfer got to.
+// Returns 0 once every range succeeded.
+int transfer_ranges(uint64_t start, uint64_t total, int (*transfer)(int, uint64_t *, uint64_t, void *), void *ctx)
+{
+    uint64_t step = (total - start + STREAMS - 1) / STREAMS;
+    int failed = 0;
+    pid_t pid;
+
+    fflush(stdout); // Not written again by the children
+    for (uint64_t offset = start; offset < total; offset += step)
+    {
+        uint64_t end = total - offset < step ? total : offset + step;
+        if ((pid = fork()) == 0)
+        {
+            int status = -1;
+            for (int attempt = 0; attempt < RETRIES && (status < 0 || status == EHOSTUNREACH || status == ETIMEDOUT); attempt++)
+            {
+                int sock;
+                if (attempt > 0)
+                {
+                    fprintf(stderr, "Transfer interrupted, trying again from byte %llu\n", (unsigned long long)offset);
+                    sleep(attempt); // Give a flaky link or a restarting server time
+                }
+                if ((sock = connect_server()) >= 0)
+                {
+                    status = transfer(sock, &offset, end, ctx);
+                    close(sock);
+                }
+            }
+            fflush(stdout);
+            _exit(status == 0 ? 0 : 1);
+        }
+        failed |= pid < 0;
+    }
+
+    // Wait for all of them, a range that failed fails the transfer
+    int status;
+    while ((pid = wait(&status)) > 0 || (pid < 0 && errno == EINTR))
+    {
+        if (pid > 0 && (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+            failed = 1;
+    }
+    return failed;
 }
 
 #include <stdio.h>
@@ -129,13 +348,11 @@ void upload_file(int sock, const char *filename, const char *destination_path)
 
 #define BUFFER_SIZE 1024
 
-void download_file(int sock, const char *filename);
-void download_tarball(int sock, const char *filetype);
+void download_file(int sock, uint32_t req_id, const char *filename);
+void download_tarball(int sock, uint32_t req_id, const char *filetype, int compress);
 
-void download_file(int sock, const char *filename)
+void download_file(int sock, uint32_t req_id, const char *filename)
 {
-    char buffer[BUFFER_SIZE];
-
     // Extract just the filename from the full path
     // Find the last occurrence of '/' in the filename
     const char *base_filename = strrchr(filename, '/');
@@ -148,55 +365,241 @@ void download_file(int sock, const char *filename)
         base_filename = filename; // No '/' found, so use the whole string
     }
 
-    // Open the file for writing in the current directory (PWD)
-    FILE *fp = fopen(base_filename, "wb");
-    if (fp == NULL)
+    // Request the start of the file and write the reply into the current directory (PWD). The
+    // reply tells the size of the file, the rest of a large one comes over several connections.
+    struct ranged_file rf = {filename, NULL, base_filename, "", -1, 0};
+    char length[24];
+    snprintf(length, sizeof(length), "%d", RANGE_MIN);
+    const char *argv[] = {filename, "0", length};
+    uint64_t offset = 0;
+    int status = EHOSTUNREACH;
+    for (int attempt = 0; attempt < RETRIES && (status == EHOSTUNREACH || status == ETIMEDOUT); attempt++)
     {
-        perror("File open error");
+        if (attempt > 0)
+        {
+            sleep(attempt); // The storage server may be back
+        }
+        if (dfs_send_request(sock, DFS_OP_DFILE, req_id, 3, argv, 0) < 0)
+        {
+            perror("Failed to send request");
+            exit(EXIT_FAILURE);
+        }
+        if ((status = receive_range(sock, req_id, base_filename, &rf.fd, &offset, &rf.total)) < 0)
+        {
+            perror("Connection to server lost");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (status != 0)
+    {
+        return;
+    }
+    if (rf.total > RANGE_MIN && transfer_ranges(RANGE_MIN, rf.total, download_range, &rf) != 0)
+    {
+        fprintf(stderr, "Download of %s failed\n", filename);
+        close(rf.fd);
+        unlink(base_filename);
         return;
     }
+    close(rf.fd);
+    printf("File %s downloaded successfully.\n", base_filename);
+}
+
+// Fetch the range of a ranged download from offset to end over a connection of its own, moving
+// offset along as the bytes arrive. Returns the status reported by the server, -1 if the
+// connection was lost.
+int download_range(int sock, uint64_t *offset, uint64_t end, void *ctx)
+{
+    struct ranged_file *rf = (struct ranged_file *)ctx;
+    char off[24], len[24];
+    const char *argv[] = {rf->filename, off, len};
+    uint64_t total;
+
+    snprintf(off, sizeof(off), "%llu", (unsigned long long)*offset);
+    snprintf(len, sizeof(len), "%llu", (unsigned long long)(end - *offset));
+    if (dfs_send_request(sock, DFS_OP_DFILE, 1, 3, argv, 0) < 0)
+    {
+        return -1;
+    }
+    return receive_range(sock, 1, rf->out_path, &rf->fd, offset, &total);
+}
+
+// Receive the reply to a ranged dfile and write its body at offset into out_path, which is
+// created in *fd unless already open there, moving offset along. total receives the size of the
+// whole file. Returns the status reported by the server, -1 if the connection was lost.
+int receive_range(int sock, uint32_t req_id, const char *out_path, int *fd, uint64_t *offset, uint64_t *total)
+{
+    char args[DFS_MAX_ARGLEN + 1];
+    struct dfs_hdr hdr;
 
-    int bytes_read;
-    // Read data from the socket and write it to the file
-    while ((bytes_read = read(sock, buffer, BUFFER_SIZE)) > 0)
+    if (dfs_recv_frame(sock, &hdr, args) < 0 || hdr.req_id != req_id)
     {
-        fwrite(buffer, sizeof(char), bytes_read, fp);
-        // If less data than the buffer size is read, assume it's the end of the file
-        if (bytes_read < BUFFER_SIZE)
-            break;
+        return -1;
     }
 
-    fclose(fp);
-    printf("File %s downloaded successfully.\n", base_filename);
+    // Failed requests carry an error message instead of data
+    struct body_out out = {hdr.status != 0 ? stderr : NULL, -1, offset, 0};
+    int status = hdr.status;
+    *total = strtoull(args, NULL, 10);
+    if (status == 0 && *fd < 0)
+    {
+        *fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (*fd < 0 || ftruncate(*fd, *total) < 0)
+        {
+            perror("File open error");
+            status = errno;
+        }
+    }
+    if (status == 0)
+        out.fd = *fd;
+    if (dfs_recv_body(sock, hdr.length - hdr.arglen, write_body, &out) < 0)
+    {
+        return -1;
+    }
+    if (status == 0)
+        status = out.err;
+    if (hdr.status != 0)
+        fprintf(stderr, "\n");
+    if (status != 0)
+    {
+        fprintf(stderr, "Request failed: %s\n", strerror(status));
+    }
+    return status;
 }
 
-void download_tarball(int sock, const char *filetype)
+void download_tarball(int sock, uint32_t req_id, const char *filetype, int compress)
 {
-    char buffer[BUFFER_SIZE];
     char tarfile[BUFFER_SIZE];
+    const char *args[2] = {filetype, "gzip"};
 
     // Determine the tarfile name based on the filetype
-    // Create tarfile name by appending ".tar" to the appropriate type
-    snprintf(tarfile, BUFFER_SIZE, "%s.tar", filetype[0] == 'p' ? "pdf" : (filetype[0] == 't' ? "text" : "cfiles"));
+    // Create tarfile name by appending ".tar" (".tar.gz" compressed) to the appropriate type
+    snprintf(tarfile, BUFFER_SIZE, "%s.tar%s", filetype[1] == 'p' ? "pdf" : (filetype[1] == 't' ? "text" : "cfiles"),
+             compress ? ".gz" : "");
 
-    // Open the tar file for writing in the current directory (PWD)
-    FILE *fp = fopen(tarfile, "wb");
-    if (fp == NULL)
+    // Request the tarball and write the reply into the current directory (PWD)
+    if (dfs_send_request(sock, DFS_OP_DTAR, req_id, compress ? 2 : 1, args, 0) < 0)
     {
-        perror("Tar file open error");
-        return;
+        perror("Failed to send request");
+        exit(EXIT_FAILURE);
     }
 
-    int bytes_read;
-    // Read data from the socket and write it to the tar file
-    while ((bytes_read = read(sock, buffer, BUFFER_SIZE)) > 0)
+    if (receive_reply(sock, req_id, tarfile) == 0)
     {
-        fwrite(buffer, sizeof(char), bytes_read, fp);
-        // If less data than the buffer size is read, assume it's the end of the file
-        if (bytes_read < BUFFER_SIZE)
-            break;
+        printf("Tarball %s downloaded successfully.\n", tarfile);
     }
+}
 
-    fclose(fp);
-    printf("Tarball %s downloaded successfully.\n", tarfile);
+// Send a request without a body (rmfile, display) and print the reply
+void simple_request(int sock, uint32_t req_id, int opcode, const char *path)
+{
+    if (dfs_send_request(sock, opcode, req_id, 1, &path, 0) < 0)
+    {
+        perror("Failed to send request");
+        exit(EXIT_FAILURE);
+    }
+
+    if (receive_reply(sock, req_id, NULL) == 0 && opcode == DFS_OP_RMFILE)
+    {
+        printf("File %s removed successfully.\n", path);
+    }
+}
+
+// Receive all reply frames of a request. The body is written to out_path, or to
+// stdout when out_path is NULL. Returns the status reported by the server.
+int receive_reply(int sock, uint32_t req_id, const char *out_path)
+{
+    char args[DFS_MAX_ARGLEN + 1];
+    struct dfs_hdr hdr;
+    FILE *fp = NULL; // Output file, opened on the first successful frame
+    int status = 0;
+
+    do
+    {
+        if (dfs_recv_frame(sock, &hdr, args) < 0)
+        {
+            perror("Connection to server lost");
+            exit(EXIT_FAILURE);
+        }
+        if (hdr.req_id != req_id)
+        {
+            fprintf(stderr, "Unexpected reply for request %u\n", hdr.req_id);
+            exit(EXIT_FAILURE);
+        }
+
+        // Failed requests carry an error message instead of data
+        if (hdr.status != 0)
+        {
+            status = hdr.status;
+        }
+        else if (fp == NULL)
+        {
+            fp = out_path ? fopen(out_path, "wb") : stdout;
+            if (fp == NULL)
+            {
+                perror("File open error");
+                status = errno;
+            }
+        }
+
+        // Read the frame body, writing data to the output and errors to stderr
+        struct body_out out = {hdr.status != 0 ? stderr : fp, -1, NULL, 0};
+        if (dfs_recv_body(sock, hdr.length - hdr.arglen, write_body, &out) < 0)
+        {
+            perror("Connection to server lost");
+            exit(EXIT_FAILURE);
+        }
+        if (hdr.status != 0)
+            fprintf(stderr, "\n");
+    } while (hdr.flags & DFS_F_MORE);
+
+    if (fp != NULL && fp != stdout)
+    {
+        fclose(fp);
+    }
+    if (status != 0)
+    {
+        fprintf(stderr, "Request failed: %s\n", strerror(status));
+    }
+    return status;
+}
+
+// Receive the single reply frame of a request of a ranged transfer, with its first argument into
+// arg (24 bytes). Returns the status reported by the server, -1 if the connection was lost or the
+// reply is malformed.
+int receive_status(int sock, uint32_t req_id, char *arg)
+{
+    char args[DFS_MAX_ARGLEN + 1];
+    struct dfs_hdr hdr;
+
+    // The argument is a byte count, one that does not fit is not a reply to this request either
+    if (dfs_recv_frame(sock, &hdr, args) < 0 || hdr.req_id != req_id || snprintf(arg, 24, "%s", args) >= 24)
+    {
+        return -1;
+    }
+
+    // Failed requests carry an error message
+    struct body_out out = {stderr, -1, NULL, 0};
+    if (dfs_recv_body(sock, hdr.length - hdr.arglen, write_body, &out) < 0)
+    {
+        return -1;
+    }
+    if (hdr.status != 0)
+    {
+        fprintf(stderr, "\nRequest failed: %s\n", strerror(hdr.status));
+    }
+    return hdr.status;
+}
+
+// Write a chunk of a reply body where out says, see struct body_out
+void write_body(void *ctx, const char *data, size_t len)
+{
+    struct body_out *out = (struct body_out *)ctx;
+
+    if (out->fp != NULL)
+        fwrite(data, sizeof(char), len, out->fp);
+    else if (out->fd >= 0 && out->err == 0 && pwrite(out->fd, data, len, *out->offset) != (ssize_t)len)
+        out->err = errno ? errno : EIO;
+    else if (out->fd >= 0 && out->err == 0)
+        *out->offset += len;
 }
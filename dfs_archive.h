@@ -0,0 +1,612 @@
+#ifndef DFS_ARCHIVE_H
+#define DFS_ARCHIVE_H
+
+// Cached archives for dtar, kept up to date as files are stored and removed.
+//
+// A server keeps one tar archive per file type under $HOME/.dfs_archive.
+// <tag>.tar holds the members back to back, without the end blocks, and
+// <tag>.log records which of them are current:
+//
+//   A <offset> <length> <path>   member appended at offset, replaces any older one of path
+//   D <path>                     path was removed
+//
+// ufile appends the stored file as a new member and rmfile logs the removal.
+// Replaced and removed members stay in the archive file as dead space until
+// it outweighs the live members; a compaction then copies the live members
+// into a fresh archive and log.
+//
+// The generation of an archive is the number of log bytes applied. Every
+// process keeps an index of the live members with the generation it
+// reflects, and takes <tag>.lock before using or changing the archive to
+// apply whatever the log gained meanwhile (or reload it after a compaction
+// replaced it). dtar then sends the live ranges of the archive file with
+// sendfile: no walk of the store and nothing is rebuilt.
+//
+// The archive is rebuilt from a walk of the store when the server starts,
+// files may have changed while it was down, unless the server vouches for
+// the store (the backends do while their catalog is intact) and the archive
+// left behind is usable. If the archive cannot be kept, dtar falls back to
+// walking the store with dfs_tar.
+
+#include <limits.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "dfs_loop.h"
+#include "dfs_tar.h"
+
+#define DFS_ARCHIVE_DIR ".dfs_archive"                 // Directory below $HOME holding the archives
+#define DFS_ARCHIVE_COMPACT_MIN (16 * 1024 * 1024)     // Dead bytes tolerated regardless of live bytes
+#define DFS_ARCHIVE_COPY_MAX (1 << 30)                 // Bytes handed to one copy_file_range call
+
+// One member of the archive file
+struct dfs_archive_member
+{
+    uint64_t offset; // Start of the member's header blocks in the archive file
+    uint64_t length; // Header blocks, contents and padding
+    char *path;      // Absolute path of the archived file
+    int live;        // Still the current version of path
+};
+
+struct dfs_archive
+{
+    char root[PATH_MAX];                // Directory archived, canonical
+    char suffix[16];                    // Only files whose name ends in this are archived
+    int max_depth;                      // Subdirectory levels below root, -1 for all
+    char tar_path[PATH_MAX];            // Archive file
+    char log_path[PATH_MAX];            // Log of its members
+    char lock_path[PATH_MAX];           // Lock serializing all users of the archive
+    int lock_fd;                        // Lock file opened by this process
+    pid_t lock_pid;                     // Process lock_fd was opened by, locks are per open file
+    int tar_fd;                         // Archive file as of log_ino
+    ino_t log_ino;                      // Log the index was built from
+    uint64_t generation;                // Log bytes applied to the index
+    struct dfs_archive_member *members; // Members in archive order
+    size_t count;                       // Members in use
+    size_t cap;                         // Members allocated
+    size_t *slots;                      // Open addressing table of path -> member index + 1
+    size_t nslots;                      // Size of slots, a power of two
+    uint64_t live_bytes;                // Bytes of live members
+    uint64_t dead_bytes;                // Bytes of replaced and removed members
+    int ready;                          // Set up successfully
+};
+
+// Hash of a path for the member table
+static inline size_t dfs_archive_hash(const char *path)
+{
+    size_t hash = 14695981039346656037ULL; // FNV-1a
+
+    while (*path)
+        hash = (hash ^ (unsigned char)*path++) * 1099511628211ULL;
+    return hash;
+}
+
+// Slot of path in the member table: the one holding it, or the empty slot it would go into
+static inline size_t *dfs_archive_slot(struct dfs_archive *a, const char *path)
+{
+    size_t i = dfs_archive_hash(path) & (a->nslots - 1);
+
+    while (a->slots[i] != 0 && strcmp(a->members[a->slots[i] - 1].path, path) != 0)
+        i = (i + 1) & (a->nslots - 1);
+    return &a->slots[i];
+}
+
+// Forget the index, the next sync reloads the log from the start
+static inline void dfs_archive_reset(struct dfs_archive *a)
+{
+    for (size_t i = 0; i < a->count; i++)
+        free(a->members[i].path);
+    free(a->members);
+    free(a->slots);
+    a->members = NULL;
+    a->slots = NULL;
+    a->count = a->cap = a->nslots = 0;
+    a->live_bytes = a->dead_bytes = 0;
+    a->generation = 0;
+}
+
+// Mark the current member of path dead, if there is one
+static inline void dfs_archive_kill(struct dfs_archive *a, const char *path)
+{
+    size_t *slot;
+
+    if (a->nslots == 0 || *(slot = dfs_archive_slot(a, path)) == 0)
+        return;
+    struct dfs_archive_member *m = &a->members[*slot - 1];
+    if (m->live)
+    {
+        m->live = 0;
+        a->live_bytes -= m->length;
+        a->dead_bytes += m->length;
+    }
+}
+
+// Add a member to the index, replacing the current one of the same path
+static inline int dfs_archive_insert(struct dfs_archive *a, uint64_t offset, uint64_t length, const char *path)
+{
+    if (a->count == a->cap)
+    {
+        size_t cap = a->cap ? a->cap * 2 : 256;
+        struct dfs_archive_member *members = realloc(a->members, cap * sizeof(*members));
+        if (members == NULL)
+            return -1;
+        a->members = members;
+        a->cap = cap;
+    }
+    if ((a->count + 1) * 2 > a->nslots)
+    {
+        // Grow the table, later members of a path win over earlier ones
+        size_t nslots = a->nslots ? a->nslots * 2 : 512;
+        size_t *slots = calloc(nslots, sizeof(*slots));
+        if (slots == NULL)
+            return -1;
+        free(a->slots);
+        a->slots = slots;
+        a->nslots = nslots;
+        for (size_t i = 0; i < a->count; i++)
+            *dfs_archive_slot(a, a->members[i].path) = i + 1;
+    }
+
+    struct dfs_archive_member *m = &a->members[a->count];
+    if ((m->path = strdup(path)) == NULL)
+        return -1;
+    dfs_archive_kill(a, path);
+    m->offset = offset;
+    m->length = length;
+    m->live = 1;
+    a->live_bytes += length;
+    *dfs_archive_slot(a, path) = ++a->count;
+    return 0;
+}
+
+// Apply one log record (without its newline)
+static inline int dfs_archive_apply(struct dfs_archive *a, char *record)
+{
+    unsigned long long offset, length;
+    int used = 0;
+
+    if (record[0] == 'A' && sscanf(record, "A %llu %llu %n", &offset, &length, &used) == 2 && used > 0)
+        return dfs_archive_insert(a, offset, length, record + used);
+    if (record[0] == 'D' && record[1] == ' ')
+    {
+        dfs_archive_kill(a, record + 2);
+        return 0;
+    }
+    return -1;
+}
+
+// Bring the index up to the current log. Called with the lock held, returns -1 if the
+// archive is unusable.
+static inline int dfs_archive_sync(struct dfs_archive *a)
+{
+    char buffer[PATH_MAX + 64];
+    size_t used = 0;
+    struct stat st;
+    int log_fd;
+
+    if (!a->ready || (log_fd = open(a->log_path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    if (fstat(log_fd, &st) < 0)
+    {
+        close(log_fd);
+        return -1;
+    }
+
+    // A compaction or rebuild replaced both files: start over with the new ones
+    if (st.st_ino != a->log_ino || (uint64_t)st.st_size < a->generation)
+    {
+        int tar_fd = open(a->tar_path, O_RDWR | O_CLOEXEC);
+        if (tar_fd < 0)
+        {
+            close(log_fd);
+            return -1;
+        }
+        if (a->tar_fd >= 0)
+            close(a->tar_fd);
+        a->tar_fd = tar_fd;
+        a->log_ino = st.st_ino;
+        dfs_archive_reset(a);
+    }
+
+    // Apply the complete records added since the last sync
+    while (a->generation + used < (uint64_t)st.st_size)
+    {
+        ssize_t n = pread(log_fd, buffer + used, sizeof(buffer) - 1 - used, a->generation + used);
+        if (n <= 0)
+            break;
+        used += n;
+
+        char *start = buffer, *nl;
+        while ((nl = memchr(start, '\n', buffer + used - start)) != NULL)
+        {
+            *nl = '\0';
+            if (dfs_archive_apply(a, start) < 0)
+            {
+                fprintf(stderr, "Archive log %s is damaged\n", a->log_path);
+                dfs_archive_reset(a);
+                a->log_ino = 0;
+                close(log_fd);
+                return -1;
+            }
+            a->generation += nl + 1 - start;
+            start = nl + 1;
+        }
+        used -= start - buffer;
+        memmove(buffer, start, used);
+        if (used == sizeof(buffer) - 1)
+            break; // No newline in a whole buffer, the rest is garbage
+    }
+    close(log_fd);
+    return 0;
+}
+
+// Take the archive lock (LOCK_SH or LOCK_EX)
+static inline int dfs_archive_lock(struct dfs_archive *a, int how)
+{
+    // flock belongs to the open file, a forked worker needs its own to exclude its siblings
+    if (a->lock_pid != getpid())
+    {
+        if (a->lock_fd >= 0)
+            close(a->lock_fd);
+        a->lock_fd = open(a->lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        a->lock_pid = getpid();
+    }
+    if (a->lock_fd < 0)
+        return -1;
+    while (flock(a->lock_fd, how) < 0)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+static inline void dfs_archive_unlock(struct dfs_archive *a)
+{
+    flock(a->lock_fd, LOCK_UN);
+}
+
+// Copy len bytes between files, in the kernel where possible. Returns the bytes copied.
+static inline uint64_t dfs_archive_copy(int in_fd, uint64_t in_off, int out_fd, uint64_t out_off, uint64_t len)
+{
+    char buffer[65536];
+    uint64_t done = 0;
+    int fallback = 0;
+
+    while (done < len)
+    {
+        size_t chunk = len - done > DFS_ARCHIVE_COPY_MAX ? DFS_ARCHIVE_COPY_MAX : (size_t)(len - done);
+        ssize_t n = -1;
+
+        if (!fallback)
+        {
+            loff_t in_pos = in_off + done, out_pos = out_off + done;
+            n = copy_file_range(in_fd, &in_pos, out_fd, &out_pos, chunk, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+                fallback = 1; // Not supported between these files, copy through a buffer
+        }
+        if (fallback)
+        {
+            n = pread(in_fd, buffer, chunk > sizeof(buffer) ? sizeof(buffer) : chunk, in_off + done);
+            if (n > 0 && pwrite(out_fd, buffer, n, out_off + done) != n)
+                n = -1;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+// Append a file as a member at offset of out_fd and its record to log_fd, storing the member
+// length in *length. The announced size is kept even if the file shrinks meanwhile. Returns 0,
+// 1 if the name cannot be logged (the file is left out) or -1 on failure.
+static inline int dfs_archive_write_member(int out_fd, uint64_t offset, int log_fd, int fd,
+                                           const struct stat *st, const char *path, uint64_t *length)
+{
+    unsigned char headers[DFS_TAR_HEADERS_MAX];
+    char record[PATH_MAX + 64];
+    uint64_t size = (uint64_t)st->st_size;
+    size_t hlen = dfs_tar_headers(headers, st, path + 1);
+    int rlen;
+
+    *length = hlen + size + dfs_tar_padding(size);
+    rlen = snprintf(record, sizeof(record), "A %llu %llu %s\n", (unsigned long long)offset,
+                    (unsigned long long)*length, path);
+    if (strchr(path, '\n') != NULL || rlen >= (int)sizeof(record))
+        return 1;
+    if (pwrite(out_fd, headers, hlen, offset) != (ssize_t)hlen)
+        return -1;
+    dfs_archive_copy(fd, 0, out_fd, offset + hlen, size);
+    if (ftruncate(out_fd, offset + *length) < 0) // Zero padding, and whatever the file lost meanwhile
+        return -1;
+    return dfs_write_full(log_fd, record, rlen) < 0 ? -1 : 0;
+}
+
+// Write a fresh archive and log next to the current ones, then put them in place. With
+// from_store the members come from a walk of the store, otherwise the live members of
+// the current archive are copied. Called with the lock held exclusively.
+static inline int dfs_archive_rewrite(struct dfs_archive *a, int from_store)
+{
+    char tar_tmp[PATH_MAX + 8], log_tmp[PATH_MAX + 8];
+    uint64_t offset = 0, length;
+    int tar_fd, log_fd, ok = 1;
+
+    snprintf(tar_tmp, sizeof(tar_tmp), "%s.tmp", a->tar_path);
+    snprintf(log_tmp, sizeof(log_tmp), "%s.tmp", a->log_path);
+    tar_fd = open(tar_tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    log_fd = open(log_tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    if (tar_fd >= 0 && log_fd >= 0 && from_store)
+    {
+        struct dfs_tar walk;
+        struct stat st;
+        int fd, rc;
+
+        dfs_tar_start(&walk, NULL, 0, 0, a->root, a->suffix, a->max_depth);
+        while (ok && (fd = dfs_tar_next(&walk, &st)) >= 0)
+        {
+            if ((rc = dfs_archive_write_member(tar_fd, offset, log_fd, fd, &st, walk.path, &length)) < 0)
+                ok = 0;
+            if (rc == 0)
+                offset += length;
+            close(fd);
+        }
+        dfs_tar_abort(&walk);
+    }
+    else if (tar_fd >= 0 && log_fd >= 0)
+    {
+        char record[PATH_MAX + 64];
+
+        for (size_t i = 0; ok && i < a->count; i++)
+        {
+            struct dfs_archive_member *m = &a->members[i];
+            if (!m->live)
+                continue;
+            int rlen = snprintf(record, sizeof(record), "A %llu %llu %s\n", (unsigned long long)offset,
+                                (unsigned long long)m->length, m->path);
+            if (dfs_archive_copy(a->tar_fd, m->offset, tar_fd, offset, m->length) != m->length ||
+                dfs_write_full(log_fd, record, rlen) < 0)
+                ok = 0;
+            offset += m->length;
+        }
+    }
+
+    // The log goes last: whoever sees the new log finds the new archive in place
+    if (tar_fd < 0 || log_fd < 0 || !ok || fsync(tar_fd) < 0 || fsync(log_fd) < 0 ||
+        rename(tar_tmp, a->tar_path) < 0 || rename(log_tmp, a->log_path) < 0)
+    {
+        perror("Could not write archive");
+        unlink(tar_tmp);
+        unlink(log_tmp);
+        ok = 0;
+    }
+    if (tar_fd >= 0)
+        close(tar_fd);
+    if (log_fd >= 0)
+        close(log_fd);
+    return ok && dfs_archive_sync(a) == 0 ? 0 : -1;
+}
+
+// Set up the archive <tag> of the files below root whose names end in suffix (max_depth as for
+// dfs_tar_start). With rebuild, or without a usable archive on disk, it is rebuilt from the store.
+// Call once before the workers start. Returns -1 if it cannot be kept, dtar then walks the store
+// itself.
+static inline int dfs_archive_init(struct dfs_archive *a, const char *tag, const char *root,
+                                   const char *suffix, int max_depth, int rebuild)
+{
+    char dir[PATH_MAX];
+
+    memset(a, 0, sizeof(*a));
+    a->lock_fd = -1;
+    a->tar_fd = -1;
+    a->max_depth = max_depth;
+    snprintf(a->suffix, sizeof(a->suffix), "%s", suffix);
+
+    // Stored paths are compared with members, so both use the canonical form of root
+    mkdir(root, S_IRWXU);
+    if (realpath(root, a->root) == NULL)
+    {
+        perror("Could not resolve archive root");
+        return -1;
+    }
+    snprintf(dir, sizeof(dir), "%s/%s", getenv("HOME"), DFS_ARCHIVE_DIR);
+    if (mkdir(dir, S_IRWXU) < 0 && errno != EEXIST)
+    {
+        perror("Could not create archive directory");
+        return -1;
+    }
+    snprintf(a->tar_path, sizeof(a->tar_path), "%.4000s/%s.tar", dir, tag);
+    snprintf(a->log_path, sizeof(a->log_path), "%.4000s/%s.log", dir, tag);
+    snprintf(a->lock_path, sizeof(a->lock_path), "%.4000s/%s.lock", dir, tag);
+
+    a->ready = 1;
+    if (dfs_archive_lock(a, LOCK_EX) < 0)
+    {
+        a->ready = 0;
+        return -1;
+    }
+    if ((rebuild || dfs_archive_sync(a) < 0) && dfs_archive_rewrite(a, 1) < 0)
+        a->ready = 0;
+    else
+        printf("Archive of %s files ready: %zu members, %llu bytes\n", a->suffix, a->count,
+               (unsigned long long)a->live_bytes);
+    dfs_archive_unlock(a);
+    return a->ready ? 0 : -1;
+}
+
+// Canonical form of path into out, also for a path that no longer exists. Returns 1 if the
+// archive covers it: below root, within max_depth and with the suffix.
+static inline int dfs_archive_covers(struct dfs_archive *a, const char *path, char *out)
+{
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    size_t root_len = strlen(a->root), len, suffix_len = strlen(a->suffix);
+    int depth = 0;
+
+    if (!a->ready || slash == NULL || (size_t)(slash - path) >= sizeof(dir))
+        return 0;
+    memcpy(dir, path, slash - path);
+    dir[slash - path] = '\0';
+    if (realpath(dir[0] ? dir : "/", out) == NULL || strlen(out) + strlen(slash) >= PATH_MAX)
+        return 0;
+    strcat(out, slash);
+
+    len = strlen(out);
+    if (strncmp(out, a->root, root_len) != 0 || out[root_len] != '/' || len < suffix_len ||
+        strcmp(out + len - suffix_len, a->suffix) != 0)
+        return 0;
+    for (const char *p = out + root_len + 1; *p; p++)
+        depth += *p == '/';
+    return a->max_depth < 0 || depth <= a->max_depth;
+}
+
+// Bring the archive in line with a failed update: rebuild it, or give it up for everyone
+static inline void dfs_archive_recover(struct dfs_archive *a)
+{
+    if (dfs_archive_rewrite(a, 1) < 0)
+    {
+        fprintf(stderr, "Archive of %s files disabled until restart\n", a->suffix);
+        unlink(a->log_path); // Every process falls back to walking the store
+    }
+}
+
+// The file at path was stored: append it as the new member of its path
+static inline void dfs_archive_add(struct dfs_archive *a, const char *path)
+{
+    char canonical[PATH_MAX];
+    struct stat st, tar_st, log_st;
+    uint64_t length;
+    int fd, log_fd, rc = -1;
+
+    if (!dfs_archive_covers(a, path, canonical) || dfs_archive_lock(a, LOCK_EX) < 0)
+        return;
+    if (dfs_archive_sync(a) < 0)
+    {
+        dfs_archive_unlock(a);
+        return;
+    }
+
+    fd = open(canonical, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        // Gone or not a regular file any more, it has no place in the archive either
+        if (fd >= 0)
+            close(fd);
+        dfs_archive_unlock(a);
+        return;
+    }
+
+    // The member goes at the end of the archive file, its record at the end of the log
+    log_fd = open(a->log_path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (log_fd >= 0 && fstat(a->tar_fd, &tar_st) == 0 && fstat(log_fd, &log_st) == 0)
+    {
+        rc = dfs_archive_write_member(a->tar_fd, tar_st.st_size, log_fd, fd, &st, canonical, &length);
+        if (rc < 0 && ftruncate(log_fd, log_st.st_size) == 0) // Drop a partial record
+            rc = -2;
+    }
+    if (rc == -2)
+    {
+        perror("Could not update archive");
+        dfs_archive_recover(a);
+    }
+    else if (rc < 0)
+    {
+        perror("Could not update archive");
+        unlink(a->log_path);
+    }
+    close(fd);
+    if (log_fd >= 0)
+        close(log_fd);
+
+    // Apply the record and compact once most of the archive is dead
+    if (dfs_archive_sync(a) == 0 && a->dead_bytes > DFS_ARCHIVE_COMPACT_MIN && a->dead_bytes > a->live_bytes)
+        dfs_archive_rewrite(a, 0);
+    dfs_archive_unlock(a);
+}
+
+// The file at path was removed: log that its member is dead
+static inline void dfs_archive_remove(struct dfs_archive *a, const char *path)
+{
+    char canonical[PATH_MAX], record[PATH_MAX + 4];
+    size_t *slot;
+
+    if (!dfs_archive_covers(a, path, canonical) || dfs_archive_lock(a, LOCK_EX) < 0)
+        return;
+    if (dfs_archive_sync(a) == 0 && a->nslots > 0 && *(slot = dfs_archive_slot(a, canonical)) != 0 &&
+        a->members[*slot - 1].live)
+    {
+        int log_fd = open(a->log_path, O_WRONLY | O_APPEND | O_CLOEXEC);
+        int rlen = snprintf(record, sizeof(record), "D %s\n", canonical);
+        if (log_fd < 0 || dfs_write_full(log_fd, record, rlen) < 0)
+        {
+            perror("Could not update archive");
+            unlink(a->log_path);
+        }
+        if (log_fd >= 0)
+            close(log_fd);
+        if (dfs_archive_sync(a) == 0 && a->dead_bytes > DFS_ARCHIVE_COMPACT_MIN && a->dead_bytes > a->live_bytes)
+            dfs_archive_rewrite(a, 0);
+    }
+    dfs_archive_unlock(a);
+}
+
+// Queue the archive as a single reply frame: the live ranges of the archive file, then the end
+// blocks unless it is a part of a longer archive. keep, unless NULL, picks the members sent by
+// their path below the root. Returns -1 without sending anything if the archive is unusable.
+static inline int dfs_archive_send(struct dfs_archive *a, struct dfs_conn *conn, uint8_t opcode, uint32_t req_id,
+                                   int part, int (*keep)(const char *name, void *data), void *keep_data)
+{
+    uint64_t start = 0, len = 0, total = 0;
+    size_t root_len = strlen(a->root);
+    int fd;
+
+    if (!a->ready || dfs_archive_lock(a, LOCK_SH) < 0)
+        return -1;
+    if (dfs_archive_sync(a) < 0 || (fd = dup(a->tar_fd)) < 0)
+    {
+        dfs_archive_unlock(a);
+        return -1;
+    }
+
+    // Members are only appended, so what is live now stays readable through fd
+    if (keep == NULL)
+        total = a->live_bytes;
+    for (size_t i = 0; i < a->count && keep != NULL; i++)
+    {
+        struct dfs_archive_member *m = &a->members[i];
+        if (m->live && keep(m->path + root_len + 1, keep_data))
+            total += m->length;
+    }
+    dfs_conn_write_hdr(conn, opcode, DFS_F_REPLY, 0, req_id, 0, total + (part ? 0 : sizeof(dfs_tar_zeros)));
+    for (size_t i = 0; i < a->count; i++)
+    {
+        struct dfs_archive_member *m = &a->members[i];
+        if (!m->live || (keep != NULL && !keep(m->path + root_len + 1, keep_data)))
+            continue;
+        if (len > 0 && start + len == m->offset)
+        {
+            len += m->length; // Adjacent live members go out as one range
+            continue;
+        }
+        if (len > 0)
+            dfs_conn_write_file_range(conn, fd, start, len);
+        start = m->offset;
+        len = m->length;
+    }
+    printf("Archive of %s files queued: %llu bytes, generation %llu\n", a->suffix, (unsigned long long)total,
+           (unsigned long long)a->generation);
+    dfs_archive_unlock(a);
+
+    if (len > 0)
+        dfs_conn_write_file(conn, fd, start, len); // The last range closes fd
+    else
+        close(fd);
+    if (!part)
+        dfs_conn_write(conn, dfs_tar_zeros, sizeof(dfs_tar_zeros));
+    return 0;
+}
+
+#endif
@@ -0,0 +1,293 @@
+#ifndef DFS_CACHE_H
+#define DFS_CACHE_H
+
+// Memory-capped cache of whole files, evicted least recently used first.
+//
+// Reads are skewed: a few hundred files take most of them. Plain LRU would
+// let a single pass over many cold files (a mirror, a backup) push every hot
+// one out, so new files are admitted the TinyLFU way: a count-min sketch
+// estimates how often each key was asked for lately, and a file only gets in
+// if it was asked for more often than every entry it would evict. The sketch
+// counts misses too, so a file earns its place by being asked for again. Its
+// counters are halved every few times the table size additions, which lets
+// old popularity fade.
+//
+// Entries are dropped when their file changes or goes away. Generations count
+// those invalidations, a fill started before one of its key is not put. They
+// are kept per bucket of key hashes: a write to one file must not spoil the
+// fills of all the others, which under steady uploads would never complete.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dfs_index.h"
+
+#define DFS_CACHE_ROWS 4          // Hash rows of the sketch
+#define DFS_CACHE_COUNT_MAX 15    // Counters saturate there
+#define DFS_CACHE_SAMPLE 10       // Sketch additions between agings, per counter of a row
+#define DFS_CACHE_OVERHEAD 64     // Bytes charged per entry on top of its key and data
+#define DFS_CACHE_GENERATIONS 1024 // Buckets of keys whose invalidations are counted apart, a power of two
+
+struct dfs_cache_entry
+{
+    char *key;                    // Owned by the entry
+    char *data;                   // Contents of the file
+    size_t len;                   // Bytes of data
+    struct dfs_cache_entry *prev; // Next more recently used
+    struct dfs_cache_entry *next; // Next less recently used
+};
+
+struct dfs_cache_stats
+{
+    unsigned long hits;           // Lookups answered from the cache
+    unsigned long misses;         // Lookups that were not
+    unsigned long admitted;       // Files put into the cache
+    unsigned long rejected;       // Files the admission policy kept out
+    unsigned long evicted;        // Entries dropped to make room
+    unsigned long invalidated;    // Entries dropped because their file changed
+};
+
+struct dfs_cache
+{
+    size_t capacity;              // Bytes the entries may take, 0 disables the cache
+    size_t max_object;            // Largest file cached
+    size_t used;                  // Bytes the entries take
+    size_t count;                 // Entries
+    struct dfs_map keys;          // Key -> the entry (as a pointer)
+    struct dfs_cache_entry *head; // Most recently used
+    struct dfs_cache_entry *tail; // Least recently used
+    uint8_t *sketch;              // DFS_CACHE_ROWS rows of width counters, allocated on first use
+    size_t width;                 // Counters per row, a power of two
+    size_t additions;             // Sketch additions since it was last aged
+    unsigned long generation;     // Invalidations of every key so far
+    unsigned long generations[DFS_CACHE_GENERATIONS]; // Invalidations of the keys of each hash bucket
+    struct dfs_cache_stats stats;
+};
+
+// Set up a cache of capacity bytes for files up to max_object bytes
+static inline void dfs_cache_init(struct dfs_cache *c, size_t capacity, size_t max_object)
+{
+    memset(c, 0, sizeof(*c));
+    c->capacity = capacity;
+    c->max_object = max_object < capacity ? max_object : capacity;
+
+    // About a counter per small file that fits, but not too few to tell keys apart
+    c->width = 1024;
+    while (c->width < capacity / 4096 && c->width < ((size_t)1 << 24))
+        c->width *= 2;
+}
+
+static inline size_t dfs_cache_charge(const char *key, size_t len)
+{
+    return DFS_CACHE_OVERHEAD + strlen(key) + 1 + len;
+}
+
+// Counter of key in row, derived from the key's hash by double hashing
+static inline uint8_t *dfs_cache_counter(struct dfs_cache *c, size_t hash, int row)
+{
+    size_t h = hash + (size_t)row * ((hash >> 32) | 1);
+
+    return &c->sketch[(size_t)row * c->width + (h & (c->width - 1))];
+}
+
+// Estimated number of recent lookups of the key with hash
+static inline unsigned dfs_cache_frequency(struct dfs_cache *c, size_t hash)
+{
+    unsigned freq = DFS_CACHE_COUNT_MAX;
+
+    if (c->sketch == NULL)
+        return 0;
+    for (int row = 0; row < DFS_CACHE_ROWS; row++)
+    {
+        uint8_t n = *dfs_cache_counter(c, hash, row);
+        if (n < freq)
+            freq = n;
+    }
+    return freq;
+}
+
+// Count a lookup of the key with hash, aging the sketch now and then
+static inline void dfs_cache_record(struct dfs_cache *c, size_t hash)
+{
+    unsigned freq;
+
+    if (c->sketch == NULL && (c->sketch = (uint8_t *)calloc(DFS_CACHE_ROWS, c->width)) == NULL)
+        return; // Admission then takes whatever fits
+    freq = dfs_cache_frequency(c, hash);
+    if (freq < DFS_CACHE_COUNT_MAX)
+    {
+        // Conservative update: only the counters at the minimum go up
+        for (int row = 0; row < DFS_CACHE_ROWS; row++)
+        {
+            uint8_t *n = dfs_cache_counter(c, hash, row);
+            if (*n == freq)
+                (*n)++;
+        }
+    }
+    if (++c->additions >= DFS_CACHE_SAMPLE * c->width)
+    {
+        for (size_t i = 0; i < DFS_CACHE_ROWS * c->width; i++)
+            c->sketch[i] >>= 1;
+        c->additions = 0;
+    }
+}
+
+static inline void dfs_cache_unlink(struct dfs_cache *c, struct dfs_cache_entry *e)
+{
+    if (e->prev != NULL)
+        e->prev->next = e->next;
+    else
+        c->head = e->next;
+    if (e->next != NULL)
+        e->next->prev = e->prev;
+    else
+        c->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static inline void dfs_cache_push(struct dfs_cache *c, struct dfs_cache_entry *e)
+{
+    e->prev = NULL;
+    e->next = c->head;
+    if (c->head != NULL)
+        c->head->prev = e;
+    else
+        c->tail = e;
+    c->head = e;
+}
+
+static inline void dfs_cache_drop(struct dfs_cache *c, struct dfs_cache_entry *e)
+{
+    dfs_cache_unlink(c, e);
+    dfs_map_del(&c->keys, e->key);
+    c->used -= dfs_cache_charge(e->key, e->len);
+    c->count--;
+    free(e->data);
+    free(e->key);
+    free(e);
+}
+
+// The entry of key, NULL on a miss. Counts the lookup either way.
+static inline struct dfs_cache_entry *dfs_cache_get(struct dfs_cache *c, const char *key)
+{
+    size_t *value;
+    struct dfs_cache_entry *e;
+
+    if (c->capacity == 0)
+        return NULL;
+    dfs_cache_record(c, dfs_map_hash(key));
+    if ((value = dfs_map_get(&c->keys, key)) == NULL)
+    {
+        c->stats.misses++;
+        return NULL;
+    }
+    e = (struct dfs_cache_entry *)*value;
+    dfs_cache_unlink(c, e);
+    dfs_cache_push(c, e);
+    c->stats.hits++;
+    return e;
+}
+
+// Whether a file of len bytes at key would be admitted: it fits in the free
+// space, or it was asked for more often than each entry that would make room
+// for it
+static inline int dfs_cache_admits(struct dfs_cache *c, const char *key, size_t len)
+{
+    size_t need, freed;
+    unsigned freq;
+
+    if (c->capacity == 0 || len > c->max_object)
+        return 0;
+    need = dfs_cache_charge(key, len);
+    if (c->used + need <= c->capacity)
+        return 1;
+    freq = dfs_cache_frequency(c, dfs_map_hash(key));
+    freed = c->capacity - c->used;
+    for (struct dfs_cache_entry *e = c->tail; e != NULL && freed < need; e = e->prev)
+    {
+        if (dfs_cache_frequency(c, dfs_map_hash(e->key)) >= freq)
+            return 0;
+        freed += dfs_cache_charge(e->key, e->len);
+    }
+    return freed >= need;
+}
+
+// Whether to keep a copy of a file of len bytes at key while it is fetched,
+// counting the files of a size the cache takes that it turns away
+static inline int dfs_cache_wants(struct dfs_cache *c, const char *key, size_t len)
+{
+    if (dfs_cache_admits(c, key, len))
+        return 1;
+    if (c->capacity > 0 && len <= c->max_object)
+        c->stats.rejected++;
+    return 0;
+}
+
+// Offer the len bytes of data (allocated with malloc) as the contents of key.
+// The cache takes data over if it admits it and frees it otherwise. Returns 1
+// if admitted.
+static inline int dfs_cache_put(struct dfs_cache *c, const char *key, char *data, size_t len)
+{
+    size_t *value;
+    struct dfs_cache_entry *e = NULL;
+
+    if ((value = dfs_map_get(&c->keys, key)) != NULL)
+        dfs_cache_drop(c, (struct dfs_cache_entry *)*value); // Replaced by the newer contents
+    if (!dfs_cache_wants(c, key, len))
+    {
+        free(data);
+        return 0;
+    }
+    while (c->tail != NULL && c->used + dfs_cache_charge(key, len) > c->capacity)
+    {
+        dfs_cache_drop(c, c->tail);
+        c->stats.evicted++;
+    }
+    if ((e = (struct dfs_cache_entry *)calloc(1, sizeof(*e))) == NULL || (e->key = strdup(key)) == NULL ||
+        dfs_map_put(&c->keys, e->key, (size_t)e) < 0)
+    {
+        if (e != NULL)
+            free(e->key);
+        free(e);
+        free(data);
+        return 0;
+    }
+    e->data = data;
+    e->len = len;
+    dfs_cache_push(c, e);
+    c->used += dfs_cache_charge(key, len);
+    c->count++;
+    c->stats.admitted++;
+    return 1;
+}
+
+// Generation of key: changes whenever key is invalidated, and now and then when another key is
+static inline unsigned long dfs_cache_generation(const struct dfs_cache *c, const char *key)
+{
+    return c->generation + c->generations[dfs_map_hash(key) & (DFS_CACHE_GENERATIONS - 1)];
+}
+
+// Drop the entry of key, if any: its file changed or was removed
+static inline void dfs_cache_remove(struct dfs_cache *c, const char *key)
+{
+    size_t *value;
+
+    c->generations[dfs_map_hash(key) & (DFS_CACHE_GENERATIONS - 1)]++;
+    if ((value = dfs_map_get(&c->keys, key)) == NULL)
+        return;
+    dfs_cache_drop(c, (struct dfs_cache_entry *)*value);
+    c->stats.invalidated++;
+}
+
+// Drop every entry, for changes that cannot be told apart by key
+static inline void dfs_cache_clear(struct dfs_cache *c)
+{
+    c->generation++;
+    while (c->tail != NULL)
+    {
+        dfs_cache_drop(c, c->tail);
+        c->stats.invalidated++;
+    }
+}
+
+#endif
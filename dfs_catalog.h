@@ -0,0 +1,994 @@
+#ifndef DFS_CATALOG_H
+#define DFS_CATALOG_H
+
+// Persistent catalog of the files held by a storage server.
+//
+// The catalog lists every directory and regular file below the store with
+// its size, modification time and CRC-32, so the server answers for its
+// store without walking it. It lives under $HOME/.dfs_catalog:
+//
+//   <tag>.cat   the base: a header, fixed size records sorted by path, then
+//               the paths. Every process maps it read-only and searches it
+//               in place.
+//   <tag>.jnl   the journal of the changes since the base was written:
+//
+//     + <seq> <size> <mtime> <crc> <type> <path>   path was stored (type 0 file, 1 directory)
+//     - <seq> <path>                               path was removed
+//
+// Paths are relative to the store. ufile and rmfile append to the journal;
+// each process applies it to an overlay kept in memory on top of the base,
+// taking <tag>.lock like the archive does. Once the journal holds more than
+// a fraction of the base, both are folded into a fresh base and the journal
+// starts over.
+//
+// Opening the catalog checks the header of the base (magic, file size and
+// checksum of the header) and replays the journal up to its last complete
+// record, so startup does not depend on the number of files. The store is
+// walked only when there is no usable base; changes made to the store behind
+// the server's back are not seen until then.
+//
+// A feed reports the whole catalog to a subscriber, then follows the journal
+// and reports each change with the DFS_NOTIFY_* events of dfs_notify.
+
+#include <dirent.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dfs_loop.h"
+#include "dfs_index.h"
+#include "dfs_notify.h"
+
+#define DFS_CATALOG_DIR ".dfs_catalog" // Directory below $HOME holding the catalogs
+#define DFS_CATALOG_MAGIC "DFSCAT1"    // First bytes of a base, names its layout
+#define DFS_CATALOG_FOLD_MIN 4096      // Journal records always tolerated before a fold
+#define DFS_CATALOG_FOLD_SHARE 8       // Otherwise folded once it holds 1/8 as many records as the base
+#define DFS_CATALOG_MAX_DEPTH 64       // Deepest directory nesting walked by a rebuild
+
+#define DFS_CATALOG_FILE 0    // Record of a regular file
+#define DFS_CATALOG_SUBDIR 1  // Record of a directory
+#define DFS_CATALOG_GONE (-1) // Overlay entry of a removed path
+
+// Start of the base, in host byte order
+struct dfs_catalog_header
+{
+    char magic[8];    // DFS_CATALOG_MAGIC
+    uint64_t count;   // Records
+    uint64_t seq;     // Last journal record folded in
+    uint64_t strings; // Offset of the paths in the file
+    uint64_t size;    // Size of the whole file
+    uint64_t check;   // FNV-1a of the fields above
+};
+
+// One record of the base
+struct dfs_catalog_record
+{
+    uint64_t path;  // Offset of the NUL terminated path from the start of the paths
+    uint64_t size;  // Bytes of the file
+    int64_t mtime;  // Modification time, seconds
+    uint32_t crc;   // CRC-32 of the contents
+    uint32_t type;  // DFS_CATALOG_FILE or DFS_CATALOG_SUBDIR
+};
+
+// A path as the catalog currently sees it
+struct dfs_catalog_entry
+{
+    const char *path; // Relative to the store
+    uint64_t size;
+    int64_t mtime;
+    uint32_t crc;
+    int type;         // DFS_CATALOG_FILE, DFS_CATALOG_SUBDIR or DFS_CATALOG_GONE
+};
+
+struct dfs_catalog
+{
+    char root[PATH_MAX];                // Store catalogued, canonical
+    char dir[PATH_MAX];                 // Directory of the catalog files
+    char base_path[PATH_MAX];           // Sorted base
+    char journal_path[PATH_MAX];        // Changes since the base
+    char lock_path[PATH_MAX];           // Lock serializing all users of the catalog
+    int lock_fd;                        // Lock file opened by this process
+    pid_t lock_pid;                     // Process lock_fd was opened by, locks are per open file
+    unsigned char *map;                 // Base mapped read-only, NULL if none
+    size_t map_len;                     // Bytes mapped
+    ino_t base_ino;                     // Base that is mapped
+    ino_t journal_ino;                  // Journal the overlay was built from
+    uint64_t journal_off;               // Journal bytes applied to the overlay
+    uint64_t seq;                       // Last record applied
+    struct dfs_catalog_entry *overlay;  // Paths changed by the journal, owning their paths
+    size_t overlay_count;               // Overlay entries in use
+    size_t overlay_cap;                 // Overlay entries allocated
+    struct dfs_map overlay_map;         // Path -> position in overlay
+    int ready;                          // Set up successfully
+};
+
+// Called for each entry listed
+typedef void (*dfs_catalog_fn)(const struct dfs_catalog_entry *e, void *data);
+
+// CRC-32 (as in zlib) of data, continuing from crc (0 to start)
+static inline uint32_t dfs_crc32(uint32_t crc, const void *data, size_t len)
+{
+    static uint32_t table[256];
+    const unsigned char *p = (const unsigned char *)data;
+
+    if (table[1] == 0)
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    while (len--)
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static inline uint64_t dfs_catalog_check(const struct dfs_catalog_header *h)
+{
+    const unsigned char *p = (const unsigned char *)h;
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+
+    for (size_t i = 0; i < offsetof(struct dfs_catalog_header, check); i++)
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    return hash;
+}
+
+static inline const struct dfs_catalog_header *dfs_catalog_header(const struct dfs_catalog *c)
+{
+    return (const struct dfs_catalog_header *)c->map;
+}
+
+// Records of the base
+static inline size_t dfs_catalog_count(const struct dfs_catalog *c)
+{
+    return c->map != NULL ? dfs_catalog_header(c)->count : 0;
+}
+
+static inline const struct dfs_catalog_record *dfs_catalog_record(const struct dfs_catalog *c, size_t i)
+{
+    return (const struct dfs_catalog_record *)(c->map + sizeof(struct dfs_catalog_header)) + i;
+}
+
+static inline const char *dfs_catalog_path(const struct dfs_catalog *c, size_t i)
+{
+    const struct dfs_catalog_header *h = dfs_catalog_header(c);
+    uint64_t off = dfs_catalog_record(c, i)->path;
+
+    // The last byte of the file is a NUL, any offset inside the paths yields a string
+    return off < h->size - h->strings ? (const char *)c->map + h->strings + off : "";
+}
+
+// Position of the first record whose path does not sort before key
+static inline size_t dfs_catalog_lower(const struct dfs_catalog *c, const char *key)
+{
+    size_t lo = 0, hi = dfs_catalog_count(c);
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(dfs_catalog_path(c, mid), key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Entry of the base record at position i
+static inline void dfs_catalog_base_entry(const struct dfs_catalog *c, size_t i, struct dfs_catalog_entry *e)
+{
+    const struct dfs_catalog_record *r = dfs_catalog_record(c, i);
+
+    e->path = dfs_catalog_path(c, i);
+    e->size = r->size;
+    e->mtime = r->mtime;
+    e->crc = r->crc;
+    e->type = r->type == DFS_CATALOG_SUBDIR ? DFS_CATALOG_SUBDIR : DFS_CATALOG_FILE;
+}
+
+// Forget the overlay, the next sync reads the journal from the start
+static inline void dfs_catalog_reset(struct dfs_catalog *c)
+{
+    for (size_t i = 0; i < c->overlay_count; i++)
+        free((char *)c->overlay[i].path);
+    free(c->overlay);
+    dfs_map_free(&c->overlay_map);
+    c->overlay = NULL;
+    c->overlay_count = c->overlay_cap = 0;
+    c->journal_ino = 0;
+    c->journal_off = 0;
+}
+
+// Record a change of e->path in the overlay
+static inline int dfs_catalog_set(struct dfs_catalog *c, const struct dfs_catalog_entry *e)
+{
+    size_t *pos = dfs_map_get(&c->overlay_map, e->path);
+    struct dfs_catalog_entry *slot;
+
+    if (pos != NULL)
+    {
+        slot = &c->overlay[*pos];
+        const char *path = slot->path;
+        *slot = *e;
+        slot->path = path;
+        return 0;
+    }
+    if (c->overlay_count == c->overlay_cap)
+    {
+        size_t cap = c->overlay_cap ? c->overlay_cap * 2 : 64;
+        struct dfs_catalog_entry *overlay = realloc(c->overlay, cap * sizeof(*overlay));
+        if (overlay == NULL)
+            return -1;
+        c->overlay = overlay;
+        c->overlay_cap = cap;
+    }
+    slot = &c->overlay[c->overlay_count];
+    *slot = *e;
+    if ((slot->path = strdup(e->path)) == NULL)
+        return -1;
+    if (dfs_map_put(&c->overlay_map, slot->path, c->overlay_count) < 0)
+    {
+        free((char *)slot->path);
+        return -1;
+    }
+    c->overlay_count++;
+    return 0;
+}
+
+// Parse a journal record (without its newline) into e, returns its sequence number or 0 if damaged
+static inline uint64_t dfs_catalog_parse(char *record, struct dfs_catalog_entry *e)
+{
+    unsigned long long seq, size;
+    long long mtime;
+    unsigned int crc;
+    int type, used = 0;
+
+    memset(e, 0, sizeof(*e));
+    if (record[0] == '+' && sscanf(record, "+ %llu %llu %lld %u %d %n", &seq, &size, &mtime, &crc, &type, &used) == 5 &&
+        used > 0 && (type == DFS_CATALOG_FILE || type == DFS_CATALOG_SUBDIR) && record[used] != '\0')
+    {
+        e->path = record + used;
+        e->size = size;
+        e->mtime = mtime;
+        e->crc = crc;
+        e->type = type;
+        return seq;
+    }
+    if (record[0] == '-' && sscanf(record, "- %llu %n", &seq, &used) == 1 && used > 0 && record[used] != '\0')
+    {
+        e->path = record + used;
+        e->type = DFS_CATALOG_GONE;
+        return seq;
+    }
+    return 0;
+}
+
+// Pass the complete records of fd between *off and end to fn, advancing *off past each one
+// taken. Stops at the first record fn refuses (returns -1 then).
+static inline int dfs_catalog_replay(int fd, uint64_t *off, uint64_t end, int (*fn)(void *arg, char *record),
+                                     void *arg)
+{
+    char buffer[PATH_MAX + 128];
+    size_t used = 0;
+
+    while (*off + used < end)
+    {
+        size_t want = sizeof(buffer) - 1 - used;
+        if (want > end - *off - used)
+            want = end - *off - used;
+        ssize_t n = pread(fd, buffer + used, want, *off + used);
+        if (n <= 0)
+            break;
+        used += n;
+
+        char *start = buffer, *nl;
+        while ((nl = memchr(start, '\n', buffer + used - start)) != NULL)
+        {
+            *nl = '\0';
+            if (fn(arg, start) < 0)
+                return -1;
+            *off += nl + 1 - start;
+            start = nl + 1;
+        }
+        used -= start - buffer;
+        memmove(buffer, start, used);
+        if (used == sizeof(buffer) - 1)
+            return -1; // No newline in a whole buffer, the rest is garbage
+    }
+    return 0;
+}
+
+static inline int dfs_catalog_apply(void *arg, char *record)
+{
+    struct dfs_catalog *c = (struct dfs_catalog *)arg;
+    struct dfs_catalog_entry e;
+    uint64_t seq = dfs_catalog_parse(record, &e);
+
+    if (seq == 0 || dfs_catalog_set(c, &e) < 0)
+        return -1;
+    if (seq > c->seq)
+        c->seq = seq;
+    return 0;
+}
+
+// Map the base at base_path, returns -1 if there is none or its header does not hold up
+static inline int dfs_catalog_map(struct dfs_catalog *c)
+{
+    const struct dfs_catalog_header *h;
+    struct stat st;
+    int fd;
+
+    if (c->map != NULL)
+        munmap(c->map, c->map_len);
+    c->map = NULL;
+    c->base_ino = 0;
+    if ((fd = open(c->base_path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*h) + 1 ||
+        (c->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        c->map = NULL;
+        close(fd);
+        return -1;
+    }
+    close(fd); // The mapping stays valid
+    c->map_len = st.st_size;
+    h = dfs_catalog_header(c);
+
+    // Checked without reading the records: their number must add up with the size of the file
+    if (memcmp(h->magic, DFS_CATALOG_MAGIC, sizeof(DFS_CATALOG_MAGIC)) != 0 || h->check != dfs_catalog_check(h) ||
+        h->size != (uint64_t)st.st_size || h->count > (h->size - sizeof(*h)) / sizeof(struct dfs_catalog_record) ||
+        h->strings < sizeof(*h) + h->count * sizeof(struct dfs_catalog_record) || h->strings >= h->size ||
+        c->map[h->size - 1] != '\0')
+    {
+        fprintf(stderr, "Catalog %s is damaged\n", c->base_path);
+        munmap(c->map, c->map_len);
+        c->map = NULL;
+        return -1;
+    }
+    c->base_ino = st.st_ino;
+    return 0;
+}
+
+// Bring the overlay up to the current base and journal. Called with the lock held, returns -1
+// if the catalog is unusable.
+static inline int dfs_catalog_sync(struct dfs_catalog *c)
+{
+    struct stat base_st, st;
+    int fd;
+
+    if (!c->ready || stat(c->base_path, &base_st) < 0)
+        return -1;
+
+    // A fold or rebuild replaced the base, the journal was replaced with it
+    if (base_st.st_ino != c->base_ino || c->map == NULL)
+    {
+        dfs_catalog_reset(c);
+        if (dfs_catalog_map(c) < 0)
+            return -1;
+        c->seq = dfs_catalog_header(c)->seq;
+    }
+
+    if ((fd = open(c->journal_path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (st.st_ino != c->journal_ino || (uint64_t)st.st_size < c->journal_off)
+    {
+        dfs_catalog_reset(c);
+        c->journal_ino = st.st_ino;
+        c->seq = dfs_catalog_header(c)->seq;
+    }
+    if (dfs_catalog_replay(fd, &c->journal_off, st.st_size, dfs_catalog_apply, c) < 0)
+    {
+        fprintf(stderr, "Catalog journal %s is damaged\n", c->journal_path);
+        close(fd);
+        dfs_catalog_reset(c);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// Take the catalog lock (LOCK_SH or LOCK_EX)
+static inline int dfs_catalog_lock(struct dfs_catalog *c, int how)
+{
+    // flock belongs to the open file, a forked worker needs its own to exclude its siblings
+    if (c->lock_pid != getpid())
+    {
+        if (c->lock_fd >= 0)
+            close(c->lock_fd);
+        c->lock_fd = open(c->lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        c->lock_pid = getpid();
+    }
+    if (c->lock_fd < 0)
+        return -1;
+    while (flock(c->lock_fd, how) < 0)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+static inline void dfs_catalog_unlock(struct dfs_catalog *c)
+{
+    flock(c->lock_fd, LOCK_UN);
+}
+
+// The current entry of path, 0 if the catalog has none
+static inline int dfs_catalog_find(const struct dfs_catalog *c, const char *path, struct dfs_catalog_entry *e)
+{
+    size_t *pos = dfs_map_get(&c->overlay_map, path);
+    size_t i;
+
+    if (pos != NULL)
+    {
+        *e = c->overlay[*pos];
+        return e->type != DFS_CATALOG_GONE;
+    }
+    i = dfs_catalog_lower(c, path);
+    if (i == dfs_catalog_count(c) || strcmp(dfs_catalog_path(c, i), path) != 0)
+        return 0;
+    dfs_catalog_base_entry(c, i, e);
+    return 1;
+}
+
+static inline int dfs_catalog_entry_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct dfs_catalog_entry *)a)->path, ((const struct dfs_catalog_entry *)b)->path);
+}
+
+// Write entries (sorted by path) as a fresh base with an empty journal, then put them in place.
+// Called with the lock held exclusively.
+static inline int dfs_catalog_write(struct dfs_catalog *c, const struct dfs_catalog_entry *entries, size_t n,
+                                    uint64_t seq)
+{
+    char base_tmp[PATH_MAX + 8], journal_tmp[PATH_MAX + 8];
+    struct dfs_catalog_header h;
+    uint64_t off = 0;
+    int base_fd, journal_fd, ok = 1;
+    FILE *out = NULL;
+
+    snprintf(base_tmp, sizeof(base_tmp), "%s.tmp", c->base_path);
+    snprintf(journal_tmp, sizeof(journal_tmp), "%s.tmp", c->journal_path);
+    base_fd = open(base_tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (base_fd >= 0 && (out = fdopen(base_fd, "w")) == NULL)
+        close(base_fd);
+    journal_fd = open(journal_tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DFS_CATALOG_MAGIC, sizeof(DFS_CATALOG_MAGIC));
+    h.count = n;
+    h.seq = seq;
+    h.strings = sizeof(h) + n * sizeof(struct dfs_catalog_record);
+    h.size = h.strings;
+    for (size_t i = 0; i < n; i++)
+        h.size += strlen(entries[i].path) + 1;
+    h.size += 1; // Final NUL, so a damaged offset still finds the end of a string
+    h.check = dfs_catalog_check(&h);
+
+    if (out == NULL || fwrite(&h, sizeof(h), 1, out) != 1)
+        ok = 0;
+    for (size_t i = 0; ok && i < n; i++)
+    {
+        struct dfs_catalog_record r;
+
+        memset(&r, 0, sizeof(r));
+        r.path = off;
+        r.size = entries[i].size;
+        r.mtime = entries[i].mtime;
+        r.crc = entries[i].crc;
+        r.type = entries[i].type;
+        off += strlen(entries[i].path) + 1;
+        if (fwrite(&r, sizeof(r), 1, out) != 1)
+            ok = 0;
+    }
+    for (size_t i = 0; ok && i < n; i++)
+    {
+        if (fwrite(entries[i].path, strlen(entries[i].path) + 1, 1, out) != 1)
+            ok = 0;
+    }
+
+    // The journal goes last: whoever sees the new journal finds the new base in place
+    if (out == NULL || journal_fd < 0 || !ok || fputc('\0', out) == EOF || fflush(out) != 0 ||
+        fsync(fileno(out)) < 0 || fsync(journal_fd) < 0 || rename(base_tmp, c->base_path) < 0 ||
+        rename(journal_tmp, c->journal_path) < 0)
+    {
+        perror("Could not write catalog");
+        unlink(base_tmp);
+        unlink(journal_tmp);
+        ok = 0;
+    }
+    if (out != NULL)
+        fclose(out);
+    if (journal_fd >= 0)
+        close(journal_fd);
+    return ok ? 0 : -1;
+}
+
+// Fold the journal into a fresh base. Called with the lock held exclusively and the overlay synced.
+static inline int dfs_catalog_fold(struct dfs_catalog *c)
+{
+    size_t base = dfs_catalog_count(c), n = 0, j = 0;
+    struct dfs_catalog_entry *changed = malloc((c->overlay_count + 1) * sizeof(*changed));
+    struct dfs_catalog_entry *merged = malloc((base + c->overlay_count + 1) * sizeof(*merged));
+    int rc = -1;
+
+    if (changed != NULL && merged != NULL)
+    {
+        memcpy(changed, c->overlay, c->overlay_count * sizeof(*changed));
+        qsort(changed, c->overlay_count, sizeof(*changed), dfs_catalog_entry_cmp);
+
+        // Merge the sorted base with the sorted changes, a change replaces the record of its path
+        for (size_t i = 0; i < base || j < c->overlay_count;)
+        {
+            struct dfs_catalog_entry e;
+            int cmp;
+
+            if (i < base)
+                dfs_catalog_base_entry(c, i, &e);
+            cmp = i == base ? 1 : j == c->overlay_count ? -1 : strcmp(e.path, changed[j].path);
+            if (cmp >= 0)
+            {
+                e = changed[j++];
+                i += cmp == 0;
+            }
+            else
+            {
+                i++;
+            }
+            if (e.type != DFS_CATALOG_GONE)
+                merged[n++] = e;
+        }
+        rc = dfs_catalog_write(c, merged, n, c->seq);
+    }
+    free(changed);
+    free(merged);
+    return rc == 0 && dfs_catalog_sync(c) == 0 ? 0 : -1;
+}
+
+// Entries collected by a walk of the store
+struct dfs_catalog_scan
+{
+    struct dfs_catalog_entry *entries;
+    size_t count;
+    size_t cap;
+    char buffer[65536]; // Contents being checksummed
+};
+
+// Add the directory rel (relative to the store) and everything below it to the scan
+static inline void dfs_catalog_walk(struct dfs_catalog *c, struct dfs_catalog_scan *scan, const char *rel, int depth)
+{
+    char path[PATH_MAX], sub[PATH_MAX];
+    struct dirent *entry;
+    DIR *dir;
+
+    if (snprintf(path, sizeof(path), "%s%s%s", c->root, rel[0] ? "/" : "", rel) >= (int)sizeof(path) ||
+        (dir = opendir(path)) == NULL)
+        return;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        struct dfs_catalog_entry e;
+        struct stat st;
+        ssize_t n;
+        int fd;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            dfs_notify_join(sub, rel, entry->d_name) < 0 || strchr(entry->d_name, '\n') != NULL ||
+            fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+        if (!S_ISREG(st.st_mode) && !(S_ISDIR(st.st_mode) && depth < DFS_CATALOG_MAX_DEPTH))
+            continue;
+
+        memset(&e, 0, sizeof(e));
+        e.mtime = st.st_mtime;
+        e.type = S_ISDIR(st.st_mode) ? DFS_CATALOG_SUBDIR : DFS_CATALOG_FILE;
+        if (e.type == DFS_CATALOG_FILE)
+        {
+            if ((fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+                continue;
+            while ((n = read(fd, scan->buffer, sizeof(scan->buffer))) > 0)
+            {
+                e.crc = dfs_crc32(e.crc, scan->buffer, n);
+                e.size += n;
+            }
+            close(fd);
+        }
+        if (scan->count == scan->cap)
+        {
+            size_t cap = scan->cap ? scan->cap * 2 : 256;
+            struct dfs_catalog_entry *entries = realloc(scan->entries, cap * sizeof(*entries));
+            if (entries == NULL)
+                continue;
+            scan->entries = entries;
+            scan->cap = cap;
+        }
+        if ((e.path = strdup(sub)) == NULL)
+            continue;
+        scan->entries[scan->count++] = e;
+
+        if (e.type == DFS_CATALOG_SUBDIR)
+            dfs_catalog_walk(c, scan, sub, depth + 1);
+    }
+    closedir(dir);
+}
+
+// Rebuild the catalog from a walk of the store. Called with the lock held exclusively.
+static inline int dfs_catalog_rebuild(struct dfs_catalog *c)
+{
+    struct dfs_catalog_scan scan;
+    int rc;
+
+    memset(&scan, 0, offsetof(struct dfs_catalog_scan, buffer));
+    dfs_catalog_walk(c, &scan, "", 0);
+    qsort(scan.entries, scan.count, sizeof(*scan.entries), dfs_catalog_entry_cmp);
+    rc = dfs_catalog_write(c, scan.entries, scan.count, c->seq);
+    for (size_t i = 0; i < scan.count; i++)
+        free((char *)scan.entries[i].path);
+    free(scan.entries);
+    return rc == 0 && dfs_catalog_sync(c) == 0 ? 0 : -1;
+}
+
+// Set up the catalog <tag> of the store at root. Call once before the workers start. Returns 1
+// if it had to be rebuilt from a walk of the store, 0 if the one on disk was taken over, -1 if
+// there is none (the server then walks the store itself).
+static inline int dfs_catalog_open(struct dfs_catalog *c, const char *tag, const char *root)
+{
+    struct stat st;
+    int rebuilt = 0;
+
+    memset(c, 0, sizeof(*c));
+    c->lock_fd = -1;
+    mkdir(root, S_IRWXU);
+    if (realpath(root, c->root) == NULL)
+    {
+        perror("Could not resolve catalog root");
+        return -1;
+    }
+    snprintf(c->dir, sizeof(c->dir), "%s/%s", getenv("HOME"), DFS_CATALOG_DIR);
+    if (mkdir(c->dir, S_IRWXU) < 0 && errno != EEXIST)
+    {
+        perror("Could not create catalog directory");
+        return -1;
+    }
+    snprintf(c->base_path, sizeof(c->base_path), "%.4000s/%s.cat", c->dir, tag);
+    snprintf(c->journal_path, sizeof(c->journal_path), "%.4000s/%s.jnl", c->dir, tag);
+    snprintf(c->lock_path, sizeof(c->lock_path), "%.4000s/%s.lock", c->dir, tag);
+
+    c->ready = 1;
+    if (dfs_catalog_lock(c, LOCK_EX) < 0)
+    {
+        c->ready = 0;
+        return -1;
+    }
+    if (dfs_catalog_sync(c) < 0)
+    {
+        rebuilt = 1;
+        if (dfs_catalog_rebuild(c) < 0)
+            c->ready = 0;
+    }
+    else if (stat(c->journal_path, &st) == 0 && (uint64_t)st.st_size > c->journal_off &&
+             truncate(c->journal_path, c->journal_off) < 0)
+    {
+        c->ready = 0; // A torn last record would swallow the next one
+    }
+    if (c->ready)
+        printf("Catalog of %s ready: %zu records, %zu journalled%s\n", c->root, dfs_catalog_count(c),
+               c->overlay_count, rebuilt ? ", rebuilt from the store" : "");
+    dfs_catalog_unlock(c);
+    return c->ready ? rebuilt : -1;
+}
+
+// Path of path relative to the store in out, also for a path that no longer exists. Returns
+// 0, or -1 if it is not below the store.
+static inline int dfs_catalog_relative(const struct dfs_catalog *c, const char *path, char *out)
+{
+    char dir[PATH_MAX], canonical[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    size_t len = strlen(c->root);
+
+    if (slash == NULL || slash[1] == '\0' || (size_t)(slash - path) >= sizeof(dir))
+        return -1;
+    memcpy(dir, path, slash - path);
+    dir[slash - path] = '\0';
+    if (realpath(dir[0] ? dir : "/", canonical) == NULL)
+        return -1;
+    if (strcmp(slash + 1, ".") == 0 || strcmp(slash + 1, "..") == 0)
+        return -1;
+
+    if (strcmp(canonical, c->root) == 0)
+    {
+        snprintf(out, PATH_MAX, "%s", slash + 1);
+        return 0;
+    }
+    if (strncmp(canonical, c->root, len) != 0 || canonical[len] != '/')
+        return -1;
+    return snprintf(out, PATH_MAX, "%s/%s", canonical + len + 1, slash + 1) < PATH_MAX ? 0 : -1;
+}
+
+// Append records to the journal and apply them. Called with the lock held exclusively and the
+// overlay synced.
+static inline void dfs_catalog_append(struct dfs_catalog *c, const char *records, size_t len)
+{
+    size_t base = dfs_catalog_count(c);
+    int fd = open(c->journal_path, O_WRONLY | O_APPEND | O_CLOEXEC);
+
+    if (fd < 0 || dfs_write_full(fd, records, len) < 0)
+    {
+        // Nobody can trust the catalog any more, it is rebuilt on the next start
+        perror("Could not update catalog");
+        unlink(c->base_path);
+    }
+    if (fd >= 0)
+        close(fd);
+
+    if (dfs_catalog_sync(c) == 0 && c->overlay_count > DFS_CATALOG_FOLD_MIN &&
+        c->overlay_count > base / DFS_CATALOG_FOLD_SHARE)
+        dfs_catalog_fold(c);
+}
+
+// The file at path was stored with the contents whose CRC-32 is crc: record it, along with the
+// directories leading to it
+static inline void dfs_catalog_put(struct dfs_catalog *c, const char *path, const struct stat *st, uint32_t crc)
+{
+    char rel[PATH_MAX], records[PATH_MAX * 2];
+    struct dfs_catalog_entry e;
+    size_t len = 0;
+
+    if (!c->ready || dfs_catalog_relative(c, path, rel) < 0 || strchr(rel, '\n') != NULL ||
+        dfs_catalog_lock(c, LOCK_EX) < 0)
+        return;
+    if (dfs_catalog_sync(c) < 0)
+    {
+        dfs_catalog_unlock(c);
+        return;
+    }
+
+    // Directories the catalog does not know yet come first, so they are known before their files
+    for (char *p = strchr(rel, '/'); p != NULL; p = strchr(p + 1, '/'))
+    {
+        *p = '\0';
+        if (!dfs_catalog_find(c, rel, &e) && len + strlen(rel) + 64 < sizeof(records))
+            len += snprintf(records + len, sizeof(records) - len, "+ %llu 0 0 0 %d %s\n",
+                            (unsigned long long)++c->seq, DFS_CATALOG_SUBDIR, rel);
+        *p = '/';
+    }
+    if (len + strlen(rel) + 96 < sizeof(records))
+    {
+        len += snprintf(records + len, sizeof(records) - len, "+ %llu %llu %lld %u %d %s\n",
+                        (unsigned long long)++c->seq, (unsigned long long)st->st_size, (long long)st->st_mtime,
+                        crc, DFS_CATALOG_FILE, rel);
+        dfs_catalog_append(c, records, len);
+    }
+    dfs_catalog_unlock(c);
+}
+
+// The file at path was removed
+static inline void dfs_catalog_remove(struct dfs_catalog *c, const char *path)
+{
+    char rel[PATH_MAX], record[PATH_MAX + 32];
+    struct dfs_catalog_entry e;
+
+    if (!c->ready || dfs_catalog_relative(c, path, rel) < 0 || dfs_catalog_lock(c, LOCK_EX) < 0)
+        return;
+    if (dfs_catalog_sync(c) == 0 && dfs_catalog_find(c, rel, &e))
+    {
+        int len = snprintf(record, sizeof(record), "- %llu %s\n", (unsigned long long)++c->seq, rel);
+        dfs_catalog_append(c, record, len);
+    }
+    dfs_catalog_unlock(c);
+}
+
+// Pass the entries directly in the directory at path to fn, in no particular order. Returns 0,
+// or -1 with errno ENOENT if the catalog has no such directory, EIO if it is unusable.
+static inline int dfs_catalog_list(struct dfs_catalog *c, const char *path, dfs_catalog_fn fn, void *data)
+{
+    char canonical[PATH_MAX], prefix[PATH_MAX + 1], key[PATH_MAX + 1];
+    const char *rel = "";
+    struct dfs_catalog_entry e;
+    size_t plen, i, len = strlen(c->root);
+
+    if (!c->ready || dfs_catalog_lock(c, LOCK_SH) < 0)
+    {
+        errno = EIO;
+        return -1;
+    }
+    if (dfs_catalog_sync(c) < 0)
+    {
+        dfs_catalog_unlock(c);
+        errno = EIO;
+        return -1;
+    }
+    if (realpath(path, canonical) == NULL || strncmp(canonical, c->root, len) != 0 ||
+        (canonical[len] != '\0' && canonical[len] != '/') ||
+        (canonical[len] == '/' && (!dfs_catalog_find(c, rel = canonical + len + 1, &e) || e.type != DFS_CATALOG_SUBDIR)))
+    {
+        dfs_catalog_unlock(c);
+        errno = ENOENT;
+        return -1;
+    }
+    plen = snprintf(prefix, sizeof(prefix), "%s%s", rel, rel[0] ? "/" : "");
+
+    // The paths below the directory are one run of the base, skip over the subdirectories' runs
+    for (i = dfs_catalog_lower(c, prefix); i < dfs_catalog_count(c);)
+    {
+        const char *p = dfs_catalog_path(c, i);
+        const char *slash;
+
+        if (strncmp(p, prefix, plen) != 0)
+            break;
+        if ((slash = strchr(p + plen, '/')) != NULL)
+        {
+            snprintf(key, sizeof(key), "%.*s0", (int)(slash - p), p); // '0' follows '/'
+            i = dfs_catalog_lower(c, key);
+            continue;
+        }
+        if (dfs_map_get(&c->overlay_map, p) == NULL) // Changed entries come from the overlay
+        {
+            dfs_catalog_base_entry(c, i, &e);
+            fn(&e, data);
+        }
+        i++;
+    }
+    for (i = 0; i < c->overlay_count; i++)
+    {
+        const struct dfs_catalog_entry *o = &c->overlay[i];
+        if (o->type != DFS_CATALOG_GONE && strncmp(o->path, prefix, plen) == 0 && strchr(o->path + plen, '/') == NULL)
+            fn(o, data);
+    }
+    dfs_catalog_unlock(c);
+    return 0;
+}
+
+struct dfs_catalog_feed;
+
+// Called with a DFS_NOTIFY_* event and the path it concerns, relative to the store
+typedef void (*dfs_catalog_feed_fn)(struct dfs_catalog_feed *f, int event, const char *path);
+
+// Subscription to a catalog
+struct dfs_catalog_feed
+{
+    struct dfs_watch watch;   // inotify on the catalog directory, -1 once stopped
+    struct dfs_catalog *cat;  // Catalog followed
+    ino_t journal_ino;        // Journal being followed
+    uint64_t journal_off;     // Journal bytes reported
+    dfs_catalog_feed_fn fn;   // Receiver of the reports
+    void *data;               // Owner specific state
+};
+
+// Report the whole catalog. Called with the lock held and the overlay synced.
+static inline void dfs_catalog_feed_all(struct dfs_catalog_feed *f)
+{
+    struct dfs_catalog *c = f->cat;
+    struct dfs_catalog_entry e;
+
+    f->fn(f, DFS_NOTIFY_ADD_DIR, "");
+    for (size_t i = 0; i < dfs_catalog_count(c); i++)
+    {
+        if (dfs_map_get(&c->overlay_map, dfs_catalog_path(c, i)) != NULL)
+            continue;
+        dfs_catalog_base_entry(c, i, &e);
+        f->fn(f, e.type == DFS_CATALOG_SUBDIR ? DFS_NOTIFY_ADD_DIR : DFS_NOTIFY_ADD, e.path);
+    }
+    for (size_t i = 0; i < c->overlay_count; i++)
+    {
+        if (c->overlay[i].type != DFS_CATALOG_GONE)
+            f->fn(f, c->overlay[i].type == DFS_CATALOG_SUBDIR ? DFS_NOTIFY_ADD_DIR : DFS_NOTIFY_ADD,
+                  c->overlay[i].path);
+    }
+    f->journal_ino = c->journal_ino;
+    f->journal_off = c->journal_off;
+}
+
+// Report one journal record
+static inline int dfs_catalog_feed_record(void *arg, char *record)
+{
+    struct dfs_catalog_feed *f = (struct dfs_catalog_feed *)arg;
+    struct dfs_catalog_entry e;
+
+    if (dfs_catalog_parse(record, &e) == 0)
+        return -1;
+    f->fn(f, e.type == DFS_CATALOG_GONE ? DFS_NOTIFY_DEL : e.type == DFS_CATALOG_SUBDIR ? DFS_NOTIFY_ADD_DIR
+                                                                                         : DFS_NOTIFY_ADD,
+          e.path);
+    return 0;
+}
+
+// The catalog directory changed: report the journal records added since the last call
+static void dfs_catalog_feed_ready(struct dfs_watch *watch, uint32_t events)
+{
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct dfs_catalog_feed *f = (struct dfs_catalog_feed *)watch;
+    struct dfs_catalog *c = f->cat;
+    int fd;
+
+    (void)events;
+    while (read(f->watch.fd, buffer, sizeof(buffer)) > 0)
+        ; // Only the fact that something changed matters
+    if (dfs_catalog_lock(c, LOCK_SH) < 0)
+        return;
+    if (dfs_catalog_sync(c) < 0)
+    {
+        dfs_catalog_unlock(c);
+        return;
+    }
+
+    if (c->journal_ino != f->journal_ino)
+    {
+        // Folded meanwhile, the records not reported yet are in the base now: report it all again
+        f->fn(f, DFS_NOTIFY_RESET, "");
+        dfs_catalog_feed_all(f);
+    }
+    else if (c->journal_off > f->journal_off && (fd = open(c->journal_path, O_RDONLY | O_CLOEXEC)) >= 0)
+    {
+        dfs_catalog_replay(fd, &f->journal_off, c->journal_off, dfs_catalog_feed_record, f);
+        close(fd);
+    }
+    dfs_catalog_unlock(c);
+    f->fn(f, DFS_NOTIFY_SETTLED, "");
+}
+
+// Report the catalog through fn before returning, then every change to it. Returns -1 if the
+// catalog cannot be followed.
+static inline int dfs_catalog_feed_start(struct dfs_loop *loop, struct dfs_catalog_feed *f, struct dfs_catalog *c,
+                                         dfs_catalog_feed_fn fn, void *data)
+{
+    struct epoll_event ev;
+
+    memset(f, 0, sizeof(*f));
+    f->cat = c;
+    f->fn = fn;
+    f->data = data;
+    f->watch.handler = dfs_catalog_feed_ready;
+    if (!c->ready || (f->watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+    {
+        f->watch.fd = -1;
+        return -1;
+    }
+
+    // Watched before it is read, so no record appended meanwhile is missed
+    ev.events = EPOLLIN;
+    ev.data.ptr = &f->watch;
+    if (inotify_add_watch(f->watch.fd, c->dir, IN_MODIFY | IN_MOVED_TO | IN_ONLYDIR) < 0 ||
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, f->watch.fd, &ev) < 0 || dfs_catalog_lock(c, LOCK_SH) < 0)
+    {
+        close(f->watch.fd);
+        f->watch.fd = -1;
+        return -1;
+    }
+    if (dfs_catalog_sync(c) < 0)
+    {
+        dfs_catalog_unlock(c);
+        close(f->watch.fd);
+        f->watch.fd = -1;
+        return -1;
+    }
+    dfs_catalog_feed_all(f);
+    dfs_catalog_unlock(c);
+    f->fn(f, DFS_NOTIFY_SETTLED, "");
+    return 0;
+}
+
+// Stop following the catalog. The structure must stay allocated until the loop finished its
+// current batch.
+static inline void dfs_catalog_feed_stop(struct dfs_catalog_feed *f)
+{
+    if (f->watch.fd >= 0)
+        close(f->watch.fd); // Also leaves the epoll set
+    f->watch.fd = -1;
+}
+
+#endif
@@ -0,0 +1,438 @@
+#ifndef DFS_COMMIT_H
+#define DFS_COMMIT_H
+
+// Atomic, durable uploads by group commit, for Smain's .c files and the
+// storage servers.
+//
+// An upload is written to a temporary file next to its destination,
+// ".<name>.<pid>-<n>.up", and moved into place with rename(2) once it is on
+// disk, so a reader sees the old file or the new one whole, never a torn
+// one. Temporary files never end in the suffix of a stored type, so
+// listings and archives do not see them.
+//
+// Syncing every file on its own costs a journal commit per upload. Here the
+// uploads finished on a worker are committed together by a thread of its
+// own: writeback of every file of a batch is started first, then each is
+// synced with fdatasync, the first of which commits the journal for all of
+// them, then all are renamed and their directories synced once each. While
+// other uploads of the process are being received, or the last batch had
+// company, the first upload of a batch waits at most the window (-g
+// milliseconds) for others; a lone upload goes at once. Uploads finished while a batch is being synced form
+// the next one, which goes as soon as the first lands. Owners reply from
+// on_done, once their batch is durable.
+//
+// The thread hands batches back through an eventfd, callbacks run on the
+// loop's thread, never from within a dfs_commit_* call. Where the thread
+// cannot run, batches are committed on the loop. Uploads submitted and not
+// called back yet keep the loop running, so a forked child does not exit
+// with its batch half way. Temporary files left by a process that died are
+// removed by dfs_commit_sweep as the server starts. Needs threads: link with
+// -pthread.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include "dfs_loop.h"
+
+#define DFS_COMMIT_WINDOW 2   // Default milliseconds the first upload of a batch waits for others
+#define DFS_COMMIT_BATCH 256  // Uploads of a batch, which goes at once when full
+#define DFS_COMMIT_SWEEP_DEPTH 32 // Directories below the root dfs_commit_sweep looks into
+
+// An upload on its way into place
+struct dfs_commit
+{
+    int fd;                    // The temporary file, closed by the commit; -1 if the owner synced and closed it
+    char tmp[PATH_MAX];        // Its name
+    char path[PATH_MAX];       // Destination
+    uint32_t crc;              // CRC-32 of the contents, kept for the owner
+    int err;                   // errno of the failure
+    void (*on_done)(struct dfs_commit *c, int err); // The file is in place and on disk, or failed
+    void *data;                // Owner specific state, NULL once it let go
+    struct dfs_commit *next;   // Link in a batch
+};
+
+// The committer of a process
+struct dfs_committer
+{
+    int started;               // 1 set up, -1 committing on the loop
+    pid_t pid;                 // Process it belongs to, a forked child starts its own
+    int window;                // Milliseconds the first upload of a batch waits, 0 for none
+    int busy;                  // A batch is being committed
+    int open;                  // Uploads being written, not submitted yet
+    int pending;               // Uploads submitted, owners not called back yet
+    struct dfs_loop *loop;     // Loop the owners are called back on
+    size_t last;               // Uploads of the last batch
+    struct dfs_commit *waiting; // Uploads for the next batch, in order
+    struct dfs_commit *waiting_tail;
+    int nwaiting;
+    struct dfs_timer timer;    // Ends the window of the next batch
+    int timer_armed;
+    pthread_mutex_t lock;      // Guards todo and done
+    pthread_cond_t wake;       // Signalled when a batch is handed over
+    struct dfs_commit *todo;   // Batch handed to the thread
+    struct dfs_commit *done;   // Batch the thread committed
+    struct dfs_watch watch;    // eventfd the thread signals the loop through
+    uint64_t batches;          // Batches and uploads committed, for the log
+    uint64_t uploads;
+};
+
+static struct dfs_committer dfs_committer = {.window = DFS_COMMIT_WINDOW};
+
+// Set the window of every batch, before the first upload
+static inline void dfs_commit_window(int ms)
+{
+    dfs_committer.window = ms;
+}
+
+// Create the temporary file of an upload to path. Returns the commit, whose fd the owner writes,
+// or NULL with errno.
+static inline struct dfs_commit *dfs_commit_open(const char *path)
+{
+    static unsigned long seq; // Uploads of this process so far
+    struct dfs_commit *c = (struct dfs_commit *)calloc(1, sizeof(*c));
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash != NULL ? (int)(slash - path + 1) : 0;
+
+    if (c == NULL)
+        return NULL;
+    if (snprintf(c->path, sizeof(c->path), "%s", path) >= (int)sizeof(c->path) ||
+        snprintf(c->tmp, sizeof(c->tmp), "%.*s.%s.%d-%lu.up", dir_len, path, path + dir_len, (int)getpid(),
+                 ++seq) >= (int)sizeof(c->tmp))
+    {
+        free(c);
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    if ((c->fd = open(c->tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666)) < 0)
+    {
+        int err = errno;
+        free(c);
+        errno = err;
+        return NULL;
+    }
+    dfs_committer.open++;
+    return c;
+}
+
+// Give up an upload not submitted: its temporary file goes away
+static inline void dfs_commit_abort(struct dfs_commit *c)
+{
+    dfs_committer.open--;
+    if (c->fd >= 0)
+        close(c->fd);
+    unlink(c->tmp);
+    free(c);
+}
+
+// Sync and move a batch into place, setting err of the uploads that failed
+static inline void dfs_commit_run(struct dfs_commit *batch)
+{
+    // Writeback of every file first, so the syncs wait for the disk together
+    for (struct dfs_commit *c = batch; c != NULL; c = c->next)
+    {
+        if (c->fd >= 0 && c->err == 0)
+            sync_file_range(c->fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+    for (struct dfs_commit *c = batch; c != NULL; c = c->next)
+    {
+        if (c->fd >= 0 && c->err == 0 && fdatasync(c->fd) < 0)
+            c->err = errno;
+        if (c->fd >= 0 && close(c->fd) < 0 && c->err == 0)
+            c->err = errno; // Delayed write errors surface on close
+        c->fd = -1;
+        if (c->err == 0 && rename(c->tmp, c->path) < 0)
+            c->err = errno;
+        if (c->err != 0)
+            unlink(c->tmp);
+    }
+
+    // The renames are durable once their directories are synced, each directory once
+    for (struct dfs_commit *c = batch; c != NULL; c = c->next)
+    {
+        const char *slash = strrchr(c->path, '/');
+        size_t dir_len = slash != NULL ? (size_t)(slash - c->path) : 0;
+        struct dfs_commit *prev = batch;
+        char dir[PATH_MAX];
+        int fd, err = 0;
+
+        if (c->err != 0)
+            continue;
+        while (prev != c && (prev->err != 0 || strncmp(prev->path, c->path, dir_len + 1) != 0 ||
+                             strchr(prev->path + dir_len + 1, '/') != NULL))
+            prev = prev->next;
+        if (prev != c)
+            continue; // Synced for an upload before this one
+        snprintf(dir, sizeof(dir), "%.*s", dir_len > 0 ? (int)dir_len : 1, slash != NULL ? c->path : ".");
+        if ((fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 || fsync(fd) < 0)
+            err = errno;
+        if (fd >= 0)
+            close(fd);
+        for (struct dfs_commit *same = c; err != 0 && same != NULL; same = same->next)
+        {
+            if (same->err == 0 && strncmp(same->path, c->path, dir_len + 1) == 0 &&
+                strchr(same->path + dir_len + 1, '/') == NULL)
+                same->err = err; // In place, but perhaps not after a crash
+        }
+    }
+}
+
+// The thread: commits the batches handed to it, one at a time
+static void *dfs_commit_thread(void *arg)
+{
+    struct dfs_committer *k = (struct dfs_committer *)arg;
+    uint64_t one = 1;
+
+    for (;;)
+    {
+        struct dfs_commit *batch;
+
+        pthread_mutex_lock(&k->lock);
+        while (k->todo == NULL)
+            pthread_cond_wait(&k->wake, &k->lock);
+        batch = k->todo;
+        k->todo = NULL;
+        pthread_mutex_unlock(&k->lock);
+
+        dfs_commit_run(batch);
+
+        pthread_mutex_lock(&k->lock);
+        k->done = batch;
+        pthread_mutex_unlock(&k->lock);
+        if (write(k->watch.fd, &one, sizeof(one)) < 0)
+            perror("eventfd write failed");
+    }
+    return NULL;
+}
+
+static void dfs_commit_finish(struct dfs_commit *batch);
+static void dfs_commit_event(struct dfs_watch *watch, uint32_t events);
+
+// Hand the uploads waiting to the thread as the next batch
+static inline void dfs_commit_dispatch(void)
+{
+    struct dfs_committer *k = &dfs_committer;
+    struct dfs_commit *batch = k->waiting;
+
+    k->waiting = k->waiting_tail = NULL;
+    k->nwaiting = 0;
+    if (k->timer_armed)
+    {
+        struct itimerspec off;
+        memset(&off, 0, sizeof(off));
+        timerfd_settime(k->timer.watch.fd, 0, &off, NULL); // The batch goes now, not at the end of the window
+        k->timer_armed = 0;
+    }
+    k->busy = 1;
+    if (k->started < 0)
+    {
+        // No thread: committed here, the owners hear of it from the loop as usual
+        uint64_t one = 1;
+        dfs_commit_run(batch);
+        k->done = batch;
+        if (k->watch.fd < 0 || write(k->watch.fd, &one, sizeof(one)) < 0)
+            dfs_commit_event(NULL, 0);
+        return;
+    }
+    pthread_mutex_lock(&k->lock);
+    k->todo = batch;
+    pthread_cond_signal(&k->wake);
+    pthread_mutex_unlock(&k->lock);
+}
+
+// A batch landed: the next one goes, then the owners hear of theirs
+static void dfs_commit_finish(struct dfs_commit *batch)
+{
+    struct dfs_committer *k = &dfs_committer;
+    size_t count = 0;
+
+    k->busy = 0;
+    if (k->waiting != NULL)
+        dfs_commit_dispatch(); // Finished while this batch was synced, they waited long enough
+    for (struct dfs_commit *c = batch, *next; c != NULL; c = next)
+    {
+        next = c->next;
+        count++;
+        c->on_done(c, c->err);
+        free(c);
+    }
+    k->pending -= (int)count;
+    if (k->pending == 0)
+        k->loop->nwatches--; // Nothing on its way, the loop may end
+    k->last = count;
+    k->batches++;
+    k->uploads += count;
+    if (count > 1)
+        printf("Committed %zu uploads together (%.1f per batch so far)\n", count, (double)k->uploads / k->batches);
+}
+
+// The thread handed a batch back
+static void dfs_commit_event(struct dfs_watch *watch, uint32_t events)
+{
+    struct dfs_committer *k = &dfs_committer;
+    struct dfs_commit *batch;
+    uint64_t count;
+
+    (void)events;
+    if (watch != NULL && read(watch->fd, &count, sizeof(count)) < 0)
+        return;
+    if (k->started > 0)
+        pthread_mutex_lock(&k->lock);
+    batch = k->done;
+    k->done = NULL;
+    if (k->started > 0)
+        pthread_mutex_unlock(&k->lock);
+    if (batch != NULL)
+        dfs_commit_finish(batch);
+}
+
+// The window of the next batch ended
+static void dfs_commit_timer(struct dfs_timer *timer)
+{
+    struct dfs_committer *k = &dfs_committer;
+
+    (void)timer;
+    k->timer_armed = 0;
+    if (!k->busy && k->waiting != NULL)
+        dfs_commit_dispatch();
+}
+
+// Set up the committer of this process on the loop, committing on the loop if the thread cannot run
+static inline void dfs_commit_start(struct dfs_loop *loop)
+{
+    struct dfs_committer *k = &dfs_committer;
+    struct epoll_event ev;
+    pthread_t thread;
+
+    if (k->started != 0 && k->pid == getpid())
+        return;
+    k->started = -1;
+    k->pid = getpid();
+    k->loop = loop;
+    k->busy = 0;
+    k->pending = 0;
+    k->waiting = k->waiting_tail = NULL;
+    k->nwaiting = 0;
+    k->timer_armed = 0;
+    if (dfs_timer_start(loop, &k->timer, 0, dfs_commit_timer, NULL) < 0)
+        k->timer.watch.fd = -1; // Batches then go without waiting
+    k->watch.handler = dfs_commit_event;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &k->watch;
+    if ((k->watch.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0 &&
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, k->watch.fd, &ev) < 0)
+    {
+        close(k->watch.fd);
+        k->watch.fd = -1; // Owners are then called back from within dfs_commit_submit
+    }
+    pthread_mutex_init(&k->lock, NULL);
+    pthread_cond_init(&k->wake, NULL);
+    if (k->watch.fd < 0 || pthread_create(&thread, NULL, dfs_commit_thread, k) != 0)
+    {
+        perror("Could not start the committer, uploads are committed on the loop");
+        return;
+    }
+    pthread_detach(thread);
+    k->started = 1;
+}
+
+// Commit the upload once its file is written: on_done follows on the loop once it is in place and
+// on disk, or failed. The commit is freed after on_done.
+static inline void dfs_commit_submit(struct dfs_loop *loop, struct dfs_commit *c,
+                                     void (*on_done)(struct dfs_commit *c, int err), void *data)
+{
+    struct dfs_committer *k = &dfs_committer;
+
+    dfs_commit_start(loop);
+    c->on_done = on_done;
+    c->data = data;
+    c->next = NULL;
+    if (k->waiting_tail != NULL)
+        k->waiting_tail->next = c;
+    else
+        k->waiting = c;
+    k->waiting_tail = c;
+    k->nwaiting++;
+    k->open--;
+    if (k->pending++ == 0)
+        loop->nwatches++; // Keeps the loop running until the owners are called back
+
+    // The first upload of a batch starts its window, unless it looks like no other will join it. A
+    // full batch goes at once.
+    if (k->busy)
+        return;
+    if (k->window <= 0 || (k->open <= 0 && k->last <= 1) || k->nwaiting >= DFS_COMMIT_BATCH ||
+        k->timer.watch.fd < 0)
+        dfs_commit_dispatch();
+    else if (!k->timer_armed)
+    {
+        dfs_timer_arm(&k->timer, k->window);
+        k->timer_armed = 1;
+    }
+}
+
+// Remove the temporary files below root whose process is gone, left by a crash or a kill in the
+// middle of an upload. Files of processes still running are theirs to finish.
+static inline void dfs_commit_sweep(const char *root, int depth)
+{
+    struct dirent *entry;
+    DIR *dir = opendir(root);
+
+    if (dir == NULL)
+        return;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        const char *name = entry->d_name, *tail;
+        size_t len = strlen(name);
+        char path[PATH_MAX];
+        struct stat st;
+        long pid;
+
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+            snprintf(path, sizeof(path), "%s/%s", root, name) >= (int)sizeof(path) ||
+            fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+        {
+            if (depth < DFS_COMMIT_SWEEP_DEPTH)
+                dfs_commit_sweep(path, depth + 1);
+            continue;
+        }
+
+        // ".<name>.<pid>-<n>.up": the pid is the last dot separated part before the suffix
+        if (!S_ISREG(st.st_mode) || name[0] != '.' || len < 4 || strcmp(name + len - 3, ".up") != 0)
+            continue;
+        tail = name + len - 3;
+        while (tail > name && tail[-1] != '.')
+            tail--;
+        if (tail == name + 1 || sscanf(tail, "%ld-", &pid) != 1 || pid <= 0 ||
+            (kill((pid_t)pid, 0) == 0 || errno != ESRCH))
+            continue;
+        if (unlinkat(dirfd(dir), name, 0) == 0)
+            printf("Removed %s, left by an upload that never finished\n", path);
+    }
+    closedir(dir);
+}
+
+// The owner lets go of the upload: one not submitted is given up, a submitted one still goes into
+// place and on_done follows with data NULL
+static inline void dfs_commit_close(struct dfs_commit *c)
+{
+    if (c->on_done == NULL)
+        dfs_commit_abort(c);
+    else
+        c->data = NULL;
+}
+
+#endif
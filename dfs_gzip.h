@@ -0,0 +1,334 @@
+#ifndef DFS_GZIP_H
+#define DFS_GZIP_H
+
+// Parallel gzip compression of a reply stream, in the style of pigz.
+//
+// The input is cut into blocks of DFS_GZIP_BLOCK bytes, each compressed on
+// its own by a pool of threads, one per core, into a complete gzip member.
+// Members are handed back in input order, so the output is a multi-member
+// gzip stream: gunzip, zcat and tar -z read it as the concatenated input.
+// Blocks share no dictionary, which costs a little ratio for never waiting
+// on each other.
+//
+// The pool's threads only compress. They hand finished blocks to the event
+// loop through an eventfd, and the loop passes them on in order, so owners
+// are called back on the loop's thread only. A producer stops adding input
+// while dfs_gzip_busy, and is told to go on through on_progress.
+//
+// Needs zlib and threads: link with -lz -pthread.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <zlib.h>
+#include "dfs_loop.h"
+
+#define DFS_GZIP_BLOCK (128 * 1024) // Input bytes compressed into one member
+#define DFS_GZIP_AHEAD 2            // Blocks in flight per thread before the producer waits
+#define DFS_GZIP_LEVEL 6            // zlib compression level
+
+struct dfs_gzip;
+
+// One block on its way through the pool
+struct dfs_gzip_job
+{
+    struct dfs_gzip *z;         // Stream the block belongs to
+    uint64_t seq;               // Position of the block in the stream
+    unsigned char *in;          // Input bytes
+    size_t in_len;
+    unsigned char *out;         // The gzip member
+    size_t out_len;
+    int failed;                 // zlib could not compress it
+    struct dfs_gzip_job *next;  // Link in the pool's queues, or the stream's finished blocks
+};
+
+// Threads compressing the blocks of every stream of a process
+struct dfs_gzip_pool
+{
+    int started;                // Threads and eventfd are set up
+    int threads;                // Threads compressing
+    pthread_mutex_t lock;       // Guards the queues
+    pthread_cond_t wake;        // Signalled when a block is queued
+    struct dfs_gzip_job *todo;  // Blocks to compress, oldest first
+    struct dfs_gzip_job *todo_tail;
+    struct dfs_gzip_job *done;  // Blocks compressed, in no particular order
+    struct dfs_watch watch;     // eventfd the threads signal the loop through
+};
+
+// A compressed stream
+struct dfs_gzip
+{
+    void (*emit)(struct dfs_gzip *z, const void *data, size_t len); // Next member of the output
+    void (*on_progress)(struct dfs_gzip *z); // Room for more input
+    void (*on_end)(struct dfs_gzip *z, int failed); // The whole output was emitted, or compression failed
+    void *data;                 // Owner specific state
+    unsigned char *block;       // Block being filled
+    size_t block_len;
+    uint64_t submitted;         // Blocks handed to the pool
+    uint64_t emitted;           // Blocks passed to emit
+    struct dfs_gzip_job *ready; // Blocks compressed ahead of their turn, by seq
+    int outstanding;            // Blocks still in the pool
+    int ending;                 // All input was given
+    int closed;                 // The owner let go, freed once the pool returns its blocks
+    int delivering;             // Callbacks are running, closing must wait for them
+    int queued;                 // In the list of streams the loop is about to deliver
+    struct dfs_gzip *next_queued;
+    int failed;
+};
+
+static struct dfs_gzip_pool dfs_gzip_pool;
+
+static void *dfs_gzip_thread(void *arg)
+{
+    struct dfs_gzip_pool *pool = (struct dfs_gzip_pool *)arg;
+    uint64_t one = 1;
+
+    for (;;)
+    {
+        struct dfs_gzip_job *job;
+        z_stream zs;
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->todo == NULL)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        job = pool->todo;
+        if ((pool->todo = job->next) == NULL)
+            pool->todo_tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        // windowBits 15 + 16 wraps the deflate stream in a gzip header and trailer
+        memset(&zs, 0, sizeof(zs));
+        job->failed = 1;
+        if (deflateInit2(&zs, DFS_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK)
+        {
+            size_t cap = deflateBound(&zs, job->in_len);
+            if ((job->out = (unsigned char *)malloc(cap)) != NULL)
+            {
+                zs.next_in = job->in;
+                zs.avail_in = job->in_len;
+                zs.next_out = job->out;
+                zs.avail_out = cap;
+                job->failed = deflate(&zs, Z_FINISH) != Z_STREAM_END;
+                job->out_len = cap - zs.avail_out;
+            }
+            deflateEnd(&zs);
+        }
+        free(job->in);
+        job->in = NULL;
+
+        pthread_mutex_lock(&pool->lock);
+        job->next = pool->done;
+        pool->done = job;
+        pthread_mutex_unlock(&pool->lock);
+        if (write(pool->watch.fd, &one, sizeof(one)) < 0)
+            perror("eventfd write failed");
+    }
+    return NULL;
+}
+
+static inline void dfs_gzip_free(struct dfs_gzip *z)
+{
+    while (z->ready != NULL)
+    {
+        struct dfs_gzip_job *job = z->ready;
+        z->ready = job->next;
+        free(job->out);
+        free(job);
+    }
+    free(z->block);
+    free(z);
+}
+
+// Whether the producer should wait for on_progress before adding more input
+static inline int dfs_gzip_busy(const struct dfs_gzip *z)
+{
+    return z->submitted - z->emitted >= (uint64_t)dfs_gzip_pool.threads * DFS_GZIP_AHEAD;
+}
+
+// Pass a stream's blocks on in order, and tell the owner how far it got
+static inline void dfs_gzip_deliver(struct dfs_gzip *z)
+{
+    z->delivering = 1;
+    while (!z->closed && z->ready != NULL && z->ready->seq == z->emitted)
+    {
+        struct dfs_gzip_job *job = z->ready;
+        z->ready = job->next;
+        z->emitted++;
+        z->failed |= job->failed;
+        if (!z->failed)
+            z->emit(z, job->out, job->out_len);
+        free(job->out);
+        free(job);
+        if (z->failed)
+        {
+            z->on_end(z, 1);
+            break;
+        }
+    }
+    if (!z->closed && !z->failed && z->ending && z->emitted == z->submitted)
+        z->on_end(z, 0);
+    else if (!z->closed && !z->failed && !dfs_gzip_busy(z))
+        z->on_progress(z);
+    z->delivering = 0;
+    if (z->closed && z->outstanding == 0)
+        dfs_gzip_free(z);
+}
+
+// Blocks came back from the pool
+static void dfs_gzip_event(struct dfs_watch *watch, uint32_t events)
+{
+    struct dfs_gzip_pool *pool = &dfs_gzip_pool;
+    struct dfs_gzip_job *done;
+    struct dfs_gzip *streams = NULL; // Streams that got blocks back
+    uint64_t count;
+
+    (void)watch;
+    (void)events;
+    if (read(pool->watch.fd, &count, sizeof(count)) < 0)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    done = pool->done;
+    pool->done = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    // Sort each block into its stream, then let the streams that got blocks go on
+    for (struct dfs_gzip_job *job = done, *next; job != NULL; job = next)
+    {
+        struct dfs_gzip *z = job->z;
+        struct dfs_gzip_job **pp = &z->ready;
+
+        next = job->next;
+        z->outstanding--;
+        while (*pp != NULL && (*pp)->seq < job->seq)
+            pp = &(*pp)->next;
+        job->next = *pp;
+        *pp = job;
+        if (!z->queued)
+        {
+            z->queued = 1;
+            z->next_queued = streams;
+            streams = z;
+        }
+    }
+    while (streams != NULL)
+    {
+        struct dfs_gzip *z = streams;
+        streams = z->next_queued;
+        z->queued = 0;
+        dfs_gzip_deliver(z);
+    }
+}
+
+// Start the pool's threads, once per process (threads do not survive fork)
+static inline int dfs_gzip_pool_start(struct dfs_loop *loop)
+{
+    struct dfs_gzip_pool *pool = &dfs_gzip_pool;
+    struct epoll_event ev;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (pool->started)
+        return 0;
+    if ((pool->watch.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        return -1;
+    pool->watch.handler = dfs_gzip_event;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &pool->watch;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, pool->watch.fd, &ev) < 0)
+    {
+        close(pool->watch.fd);
+        return -1;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    for (long i = 0; i < (ncpu > 0 ? ncpu : 1); i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, dfs_gzip_thread, pool) != 0)
+            break;
+        pthread_detach(thread);
+        pool->threads++;
+    }
+    pool->started = pool->threads > 0;
+    return pool->started ? 0 : -1;
+}
+
+// Start a compressed stream on the loop, NULL if the pool cannot run. The owner sets the
+// callbacks and data before giving input.
+static inline struct dfs_gzip *dfs_gzip_new(struct dfs_loop *loop)
+{
+    if (dfs_gzip_pool_start(loop) < 0)
+        return NULL;
+    return (struct dfs_gzip *)calloc(1, sizeof(struct dfs_gzip));
+}
+
+// Hand the block being filled to the pool
+static inline int dfs_gzip_submit(struct dfs_gzip *z)
+{
+    struct dfs_gzip_pool *pool = &dfs_gzip_pool;
+    struct dfs_gzip_job *job = (struct dfs_gzip_job *)calloc(1, sizeof(struct dfs_gzip_job));
+
+    if (job == NULL)
+        return -1;
+    job->z = z;
+    job->seq = z->submitted++;
+    job->in = z->block;
+    job->in_len = z->block_len;
+    z->block = NULL;
+    z->block_len = 0;
+    z->outstanding++;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->todo_tail != NULL)
+        pool->todo_tail->next = job;
+    else
+        pool->todo = job;
+    pool->todo_tail = job;
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+// Add input to the stream. Returns -1 if out of memory, the stream is then unusable.
+static inline int dfs_gzip_write(struct dfs_gzip *z, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    while (len > 0)
+    {
+        size_t n = DFS_GZIP_BLOCK - z->block_len;
+        if (z->block == NULL && (z->block = (unsigned char *)malloc(DFS_GZIP_BLOCK)) == NULL)
+            return -1;
+        if (n > len)
+            n = len;
+        memcpy(z->block + z->block_len, p, n);
+        z->block_len += n;
+        p += n;
+        len -= n;
+        if (z->block_len == DFS_GZIP_BLOCK && dfs_gzip_submit(z) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// All input was given: on_end follows once the last member is emitted
+static inline int dfs_gzip_end(struct dfs_gzip *z)
+{
+    if ((z->block_len > 0 || z->submitted == 0) && dfs_gzip_submit(z) < 0)
+        return -1; // An empty stream still gets a member, gzip has no empty stream
+    z->ending = 1;
+    return 0;
+}
+
+// Let go of a stream, whether or not it ended. No callback follows.
+static inline void dfs_gzip_close(struct dfs_gzip *z)
+{
+    z->closed = 1;
+    if (z->outstanding == 0 && !z->delivering && !z->queued)
+        dfs_gzip_free(z);
+}
+
+#endif
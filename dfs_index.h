@@ -0,0 +1,304 @@
+#ifndef DFS_INDEX_H
+#define DFS_INDEX_H
+
+// In-memory index of a namespace held by several sources.
+//
+// The index maps directories to the files in them. Each directory and file
+// is tagged with the source that holds it (Smain's own disk, Spdf, Stext),
+// so listing a directory, or checking whether a file exists, is a couple of
+// hash lookups. Sources report additions and removals as they happen; one
+// that restarts its reports first clears what it reported before.
+//
+// Directories and files are kept with the set of sources that have them, a
+// replicated file is held by several. A file no source holds any more is
+// dropped, and so is a directory no source has that holds no files.
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DFS_INDEX_SOURCES 32 // Sources an index can tell apart (bits of a mask)
+
+// Open addressing table from strings (owned by the caller) to numbers
+struct dfs_map
+{
+    const char **keys; // NULL for a free slot
+    size_t *values;
+    size_t size;       // Slots, a power of two
+    size_t count;      // Slots in use
+};
+
+// One file of a directory
+struct dfs_index_entry
+{
+    char *name;       // Name within the directory
+    unsigned sources; // Mask of the sources holding the file
+};
+
+struct dfs_index_dir
+{
+    char *path;                      // Absolute path without trailing slash
+    unsigned sources;                // Mask of the sources that have this directory
+    struct dfs_index_entry *entries; // Files, in no particular order
+    size_t count;                    // Entries in use
+    size_t cap;                      // Entries allocated
+    struct dfs_map names;            // Name -> position in entries
+};
+
+struct dfs_index
+{
+    struct dfs_map dirs; // Path -> the directory (as a pointer)
+};
+
+static inline size_t dfs_map_hash(const char *key)
+{
+    size_t hash = 14695981039346656037ULL; // FNV-1a
+
+    while (*key)
+        hash = (hash ^ (unsigned char)*key++) * 1099511628211ULL;
+    return hash;
+}
+
+// Slot holding key, or the free slot it would go into
+static inline size_t dfs_map_slot(const struct dfs_map *m, const char *key)
+{
+    size_t i = dfs_map_hash(key) & (m->size - 1);
+
+    while (m->keys[i] != NULL && strcmp(m->keys[i], key) != 0)
+        i = (i + 1) & (m->size - 1);
+    return i;
+}
+
+// Value of key, NULL if absent
+static inline size_t *dfs_map_get(const struct dfs_map *m, const char *key)
+{
+    size_t i;
+
+    if (m->size == 0)
+        return NULL;
+    i = dfs_map_slot(m, key);
+    return m->keys[i] != NULL ? &m->values[i] : NULL;
+}
+
+// Insert or update key, returns -1 if out of memory
+static inline int dfs_map_put(struct dfs_map *m, const char *key, size_t value)
+{
+    size_t i;
+
+    if ((m->count + 1) * 2 > m->size)
+    {
+        struct dfs_map grown;
+
+        grown.size = m->size ? m->size * 2 : 16;
+        grown.count = m->count;
+        grown.keys = (const char **)calloc(grown.size, sizeof(char *));
+        grown.values = (size_t *)calloc(grown.size, sizeof(size_t));
+        if (grown.keys == NULL || grown.values == NULL)
+        {
+            free(grown.keys);
+            free(grown.values);
+            return -1;
+        }
+        for (size_t j = 0; j < m->size; j++)
+        {
+            if (m->keys[j] == NULL)
+                continue;
+            i = dfs_map_slot(&grown, m->keys[j]);
+            grown.keys[i] = m->keys[j];
+            grown.values[i] = m->values[j];
+        }
+        free(m->keys);
+        free(m->values);
+        *m = grown;
+    }
+
+    i = dfs_map_slot(m, key);
+    if (m->keys[i] == NULL)
+        m->count++;
+    m->keys[i] = key;
+    m->values[i] = value;
+    return 0;
+}
+
+// Remove key, shifting back the entries that probed past it
+static inline void dfs_map_del(struct dfs_map *m, const char *key)
+{
+    size_t i, j;
+
+    if (m->size == 0 || m->keys[i = dfs_map_slot(m, key)] == NULL)
+        return;
+    m->keys[i] = NULL;
+    m->count--;
+    for (j = (i + 1) & (m->size - 1); m->keys[j] != NULL; j = (j + 1) & (m->size - 1))
+    {
+        size_t home = dfs_map_hash(m->keys[j]) & (m->size - 1);
+
+        // Move the entry into the hole unless its home lies cyclically in (i, j]
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j))
+        {
+            m->keys[i] = m->keys[j];
+            m->values[i] = m->values[j];
+            m->keys[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+static inline void dfs_map_free(struct dfs_map *m)
+{
+    free(m->keys);
+    free(m->values);
+    memset(m, 0, sizeof(*m));
+}
+
+// The directory at path, NULL if the index has none
+static inline struct dfs_index_dir *dfs_index_dir(const struct dfs_index *ix, const char *path)
+{
+    size_t *value = dfs_map_get(&ix->dirs, path);
+    return value != NULL ? (struct dfs_index_dir *)*value : NULL;
+}
+
+// The directory at path, created if needed
+static inline struct dfs_index_dir *dfs_index_dir_get(struct dfs_index *ix, const char *path)
+{
+    struct dfs_index_dir *d = dfs_index_dir(ix, path);
+
+    if (d != NULL)
+        return d;
+    if ((d = (struct dfs_index_dir *)calloc(1, sizeof(*d))) == NULL || (d->path = strdup(path)) == NULL ||
+        dfs_map_put(&ix->dirs, d->path, (size_t)d) < 0)
+    {
+        if (d != NULL)
+            free(d->path);
+        free(d);
+        return NULL;
+    }
+    return d;
+}
+
+// Drop a directory nobody has and that holds nothing
+static inline void dfs_index_dir_prune(struct dfs_index *ix, struct dfs_index_dir *d)
+{
+    if (d->sources != 0 || d->count != 0)
+        return;
+    dfs_map_del(&ix->dirs, d->path);
+    dfs_map_free(&d->names);
+    free(d->entries);
+    free(d->path);
+    free(d);
+}
+
+// Remove the entry at position i of a directory
+static inline void dfs_index_dir_drop(struct dfs_index_dir *d, size_t i)
+{
+    dfs_map_del(&d->names, d->entries[i].name);
+    free(d->entries[i].name);
+    if (i != --d->count)
+    {
+        // The last entry fills the gap
+        d->entries[i] = d->entries[d->count];
+        dfs_map_put(&d->names, d->entries[i].name, i);
+    }
+}
+
+// Record that source has the directory at path
+static inline void dfs_index_add_dir(struct dfs_index *ix, const char *path, int source)
+{
+    struct dfs_index_dir *d = dfs_index_dir_get(ix, path);
+
+    if (d != NULL)
+        d->sources |= 1u << source;
+}
+
+// Record that source holds the file name in the directory at path
+static inline void dfs_index_add(struct dfs_index *ix, const char *path, const char *name, int source)
+{
+    struct dfs_index_dir *d = dfs_index_dir_get(ix, path);
+    size_t *pos;
+
+    if (d == NULL)
+        return;
+    if ((pos = dfs_map_get(&d->names, name)) != NULL)
+    {
+        d->entries[*pos].sources |= 1u << source;
+        return;
+    }
+    if (d->count == d->cap)
+    {
+        size_t cap = d->cap ? d->cap * 2 : 8;
+        struct dfs_index_entry *entries = (struct dfs_index_entry *)realloc(d->entries, cap * sizeof(*entries));
+        if (entries == NULL)
+            return;
+        d->entries = entries;
+        d->cap = cap;
+    }
+    if ((d->entries[d->count].name = strdup(name)) == NULL)
+        return;
+    d->entries[d->count].sources = 1u << source;
+    if (dfs_map_put(&d->names, d->entries[d->count].name, d->count) < 0)
+    {
+        free(d->entries[d->count].name);
+        return;
+    }
+    d->count++;
+}
+
+// Record that source no longer holds the file name in the directory at path
+static inline void dfs_index_remove(struct dfs_index *ix, const char *path, const char *name, int source)
+{
+    struct dfs_index_dir *d = dfs_index_dir(ix, path);
+    size_t *pos;
+
+    if (d == NULL || (pos = dfs_map_get(&d->names, name)) == NULL)
+        return;
+    if ((d->entries[*pos].sources &= ~(1u << source)) != 0)
+        return; // Other sources still hold it
+    dfs_index_dir_drop(d, *pos);
+    dfs_index_dir_prune(ix, d);
+}
+
+// Forget what source reported for the directories at and below path ("" for all of them)
+static inline void dfs_index_remove_tree(struct dfs_index *ix, const char *path, int source)
+{
+    size_t len = strlen(path);
+
+    for (size_t i = 0; i < ix->dirs.size;)
+    {
+        struct dfs_index_dir *d = ix->dirs.keys[i] != NULL ? (struct dfs_index_dir *)ix->dirs.values[i] : NULL;
+
+        if (d == NULL || strncmp(d->path, path, len) != 0 || (d->path[len] != '\0' && d->path[len] != '/'))
+        {
+            i++;
+            continue;
+        }
+        for (size_t j = d->count; j-- > 0;)
+        {
+            if ((d->entries[j].sources &= ~(1u << source)) == 0)
+                dfs_index_dir_drop(d, j);
+        }
+        d->sources &= ~(1u << source);
+        if (d->sources == 0 && d->count == 0)
+            dfs_index_dir_prune(ix, d); // Slot i may now hold a shifted entry, look at it again
+        else
+            i++;
+    }
+}
+
+// Whether source holds the file name in the directory at path
+static inline int dfs_index_has(const struct dfs_index *ix, const char *path, const char *name, int source)
+{
+    struct dfs_index_dir *d = dfs_index_dir(ix, path);
+    size_t *pos;
+
+    return d != NULL && (pos = dfs_map_get(&d->names, name)) != NULL && (d->entries[*pos].sources & (1u << source));
+}
+
+// Mask of the sources holding the file name in the directory at path, 0 if none does
+static inline unsigned dfs_index_sources(const struct dfs_index *ix, const char *path, const char *name)
+{
+    struct dfs_index_dir *d = dfs_index_dir(ix, path);
+    size_t *pos;
+
+    return d != NULL && (pos = dfs_map_get(&d->names, name)) != NULL ? d->entries[*pos].sources : 0;
+}
+
+#endif
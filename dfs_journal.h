@@ -0,0 +1,840 @@
+#ifndef DFS_JOURNAL_H
+#define DFS_JOURNAL_H
+
+// Write-back journal of uploads, for Smain run with -b.
+//
+// An upload relayed to the storage nodes holds its client until they stored
+// the file, so a slow or restarting node shows in every upload of its
+// files. With the journal Smain writes the body to its own disk instead,
+// makes it durable and answers right away. A forwarder sends the journaled
+// files on to the storage nodes in the background and tries again until
+// they take them; until then downloads are served from the journal, and
+// listings and archives add the journaled files to what the nodes have.
+//
+// The journal lives under $HOME/.dfs_journal:
+//
+//   <pid>.<n>  data files, each appended to by one process only: the bodies
+//              of its uploads one after the other, up to DFS_JOURNAL_FILE_MAX
+//              bytes, then it starts the next one
+//   log        the log of the journaled files:
+//
+//     A <file> <offset> <size> <crc> <path>   path was stored at offset of data file file
+//     F <file> <offset> <path>                that body reached the storage nodes
+//     D <path>                                path was removed before it did
+//
+// Paths are absolute. A body is on disk before its record, and its record
+// before the client is answered, so a crash loses no acknowledged upload and
+// the next start forwards whatever is pending. F records are synced as well,
+// those of the uploads forwarded together at once: a body sent again after
+// a crash would bring back a file removed or replaced since. A newer upload
+// of a path supersedes a pending older one, which is then never forwarded.
+//
+// Like the pack, every process keeps an index of the pending files with the
+// log bytes it applied, and takes journal.lock to apply whatever the log
+// gained meanwhile. A data file without pending bodies is removed by the
+// process it belongs to, or by any once that process is gone; the log is
+// rewritten with the pending records once most of it is forwarded.
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "dfs_loop.h"
+#include "dfs_index.h"
+#include "dfs_catalog.h"
+#include "dfs_range.h"
+
+#define DFS_JOURNAL_DIR ".dfs_journal"               // Directory below $HOME holding the journal
+#define DFS_JOURNAL_FILE_MAX (64 * 1024 * 1024)      // Data files are not appended to past this size
+#define DFS_JOURNAL_FLUSH (8 * 1024 * 1024)          // Bytes of a body written before their writeback is started
+#define DFS_JOURNAL_LOG_MIN 4096                     // Log records always tolerated before a rewrite
+#define DFS_JOURNAL_NAME_MAX 32                      // Bytes of a data file name
+
+// A journaled upload
+struct dfs_journal_entry
+{
+    char file[DFS_JOURNAL_NAME_MAX]; // Data file holding the body
+    uint64_t offset;                 // Where the body starts in it
+    uint64_t size;                   // Bytes of the body
+    uint32_t crc;                    // CRC-32 of the body
+    char *path;                      // Absolute path of the file
+    int pending;                     // Not forwarded, superseded or removed yet
+    int tries;                       // Attempts of the forwarder that failed
+    int64_t not_before;              // dfs_now_ms() before which the forwarder does not try again
+};
+
+// A data file as seen by this process
+struct dfs_journal_file
+{
+    char name[DFS_JOURNAL_NAME_MAX];
+    int fd;                          // Read-only, -1 until first read or once nothing in it is pending
+    size_t pending;                  // Pending bodies in it
+    int own;                         // Appended to by this process
+    size_t writing;                  // Uploads of this process still writing to it
+};
+
+// An upload being written to the journal
+struct dfs_journal_write
+{
+    char file[DFS_JOURNAL_NAME_MAX]; // Data file it is written to
+    int fd;                          // A descriptor of that file of its own, -1 when not writing
+    uint64_t offset;                 // Where the body goes in it
+    uint64_t size;                   // Bytes of the body
+    uint64_t written;                // Bytes of it written so far
+    uint64_t flushed;                // Bytes whose writeback was started
+    uint32_t crc;                    // CRC-32 of them
+};
+
+struct dfs_journal
+{
+    char dir[PATH_MAX];                 // Directory of the data files and the log
+    char log_path[PATH_MAX];            // Log of the journaled files
+    char lock_path[PATH_MAX];           // Lock serializing all users of the journal
+    int lock_fd;                        // Lock file opened by this process
+    pid_t lock_pid;                     // Process lock_fd was opened by, locks are per open file
+    int log_fd;                         // Log the index was built from, read with pread only
+    ino_t log_ino;                      // Its inode, a rewrite puts another one in place
+    uint64_t generation;                // Log bytes applied to the index
+    uint64_t records;                   // Log records applied
+    struct dfs_journal_entry *entries;  // Uploads in log order
+    size_t count;                       // Entries in use
+    size_t cap;                         // Entries allocated
+    size_t pending;                     // Pending entries
+    struct dfs_map paths;               // Path -> position of its pending entry in entries
+    struct dfs_journal_file *files;     // Data files with pending bodies, or this process's own
+    size_t nfiles;
+    pid_t tail_pid;                     // Process the tail belongs to, a forked worker starts its own
+    char tail[DFS_JOURNAL_NAME_MAX];    // Data file this process appends to, "" if none
+    uint64_t tail_end;                  // Its bytes, those of bodies still being written included
+    unsigned next_tail;                 // Number of the next data file this process starts
+    void (*on_change)(struct dfs_journal *j, const char *path); // path was journaled or removed, may be NULL
+    void *data;                         // Owner specific state
+    int ready;                          // Set up successfully
+};
+
+// Take the journal lock (LOCK_SH or LOCK_EX)
+static inline int dfs_journal_lock(struct dfs_journal *j, int how)
+{
+    // flock belongs to the open file, a forked worker needs its own to exclude its siblings
+    if (j->lock_pid != getpid())
+    {
+        if (j->lock_fd >= 0)
+            close(j->lock_fd);
+        j->lock_fd = open(j->lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        j->lock_pid = getpid();
+    }
+    if (j->lock_fd < 0)
+        return -1;
+    while (flock(j->lock_fd, how) < 0)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+static inline void dfs_journal_unlock(struct dfs_journal *j)
+{
+    flock(j->lock_fd, LOCK_UN);
+}
+
+// Data file name, added if it is new and add is set. NULL if there is none or out of memory.
+static inline struct dfs_journal_file *dfs_journal_file(struct dfs_journal *j, const char *name, int add)
+{
+    for (size_t i = 0; i < j->nfiles; i++)
+    {
+        if (strcmp(j->files[i].name, name) == 0)
+            return &j->files[i];
+    }
+    if (!add)
+        return NULL;
+    struct dfs_journal_file *files =
+        (struct dfs_journal_file *)realloc(j->files, (j->nfiles + 1) * sizeof(*files));
+    if (files == NULL)
+        return NULL;
+    j->files = files;
+    struct dfs_journal_file *f = &files[j->nfiles++];
+    memset(f, 0, sizeof(*f));
+    snprintf(f->name, sizeof(f->name), "%s", name);
+    f->fd = -1;
+    return f;
+}
+
+// Path of a data file. Names are shorter than DFS_JOURNAL_NAME_MAX, dfs_journal_init leaves
+// room for them after the directory.
+static inline void dfs_journal_file_path(const struct dfs_journal *j, const char *name, char *out)
+{
+    snprintf(out, PATH_MAX, "%.4000s/%.*s", j->dir, DFS_JOURNAL_NAME_MAX - 1, name);
+}
+
+// Forget the index, the next sync reloads the log from the start. This process's own data files
+// are kept, uploads may still be writing to them.
+static inline void dfs_journal_reset(struct dfs_journal *j)
+{
+    size_t kept = 0;
+
+    for (size_t i = 0; i < j->count; i++)
+        free(j->entries[i].path);
+    for (size_t i = 0; i < j->nfiles; i++)
+    {
+        struct dfs_journal_file *f = &j->files[i];
+        f->pending = 0;
+        if (f->own)
+        {
+            j->files[kept++] = *f;
+            continue;
+        }
+        if (f->fd >= 0)
+            close(f->fd);
+    }
+    j->nfiles = kept;
+    free(j->entries);
+    dfs_map_free(&j->paths);
+    j->entries = NULL;
+    j->count = j->cap = j->pending = 0;
+    j->generation = j->records = 0;
+}
+
+// The entry at pos is no longer pending
+static inline void dfs_journal_settle(struct dfs_journal *j, size_t pos)
+{
+    struct dfs_journal_entry *e = &j->entries[pos];
+    struct dfs_journal_file *f = dfs_journal_file(j, e->file, 0);
+
+    e->pending = 0;
+    j->pending--;
+    dfs_map_del(&j->paths, e->path);
+
+    // A data file name may be used again once its file is gone, so nothing of it is kept open
+    if (f != NULL && --f->pending == 0 && f->fd >= 0)
+    {
+        close(f->fd);
+        f->fd = -1;
+    }
+}
+
+// Add a journaled upload to the index, superseding the pending one of the same path
+static inline int dfs_journal_insert(struct dfs_journal *j, const struct dfs_journal_entry *e)
+{
+    struct dfs_journal_file *f = dfs_journal_file(j, e->file, 1);
+    size_t *pos;
+
+    if (f == NULL)
+        return -1;
+    if (j->count == j->cap)
+    {
+        size_t cap = j->cap ? j->cap * 2 : 256;
+        struct dfs_journal_entry *entries = (struct dfs_journal_entry *)realloc(j->entries, cap * sizeof(*entries));
+        if (entries == NULL)
+            return -1;
+        j->entries = entries;
+        j->cap = cap;
+    }
+    struct dfs_journal_entry *slot = &j->entries[j->count];
+    *slot = *e;
+    if ((slot->path = strdup(e->path)) == NULL)
+        return -1;
+    if ((pos = dfs_map_get(&j->paths, e->path)) != NULL)
+        dfs_journal_settle(j, *pos);
+    if (dfs_map_put(&j->paths, slot->path, j->count) < 0)
+    {
+        free(slot->path);
+        return -1;
+    }
+    slot->pending = 1;
+    slot->tries = 0;
+    slot->not_before = 0;
+    f->pending++;
+    j->count++;
+    j->pending++;
+    if (j->on_change != NULL)
+        j->on_change(j, slot->path);
+    return 0;
+}
+
+// Apply one log record (without its newline)
+static inline int dfs_journal_apply(void *arg, char *record)
+{
+    struct dfs_journal *j = (struct dfs_journal *)arg;
+    struct dfs_journal_entry e;
+    char file[DFS_JOURNAL_NAME_MAX];
+    unsigned long long offset, size;
+    unsigned int crc;
+    size_t *pos;
+    int used = 0;
+
+    memset(&e, 0, sizeof(e));
+    j->records++;
+    if (record[0] == 'A' &&
+        sscanf(record, "A %31s %llu %llu %u %n", file, &offset, &size, &crc, &used) == 4 && used > 0 &&
+        record[used] == '/')
+    {
+        snprintf(e.file, sizeof(e.file), "%s", file);
+        e.offset = offset;
+        e.size = size;
+        e.crc = crc;
+        e.path = record + used;
+        return dfs_journal_insert(j, &e);
+    }
+    if (record[0] == 'F' && sscanf(record, "F %31s %llu %n", file, &offset, &used) == 2 && used > 0 &&
+        record[used] == '/')
+    {
+        // Only the body forwarded is settled, a newer one of the path is still to go
+        pos = dfs_map_get(&j->paths, record + used);
+        if (pos != NULL && j->entries[*pos].offset == offset && strcmp(j->entries[*pos].file, file) == 0)
+            dfs_journal_settle(j, *pos);
+        return 0;
+    }
+    if (record[0] == 'D' && record[1] == ' ')
+    {
+        if ((pos = dfs_map_get(&j->paths, record + 2)) != NULL)
+        {
+            dfs_journal_settle(j, *pos);
+            if (j->on_change != NULL)
+                j->on_change(j, record + 2);
+        }
+        return 0;
+    }
+    return -1;
+}
+
+// Bring the index up to the current log. Called with the lock held, returns -1 if the
+// journal is unusable.
+static inline int dfs_journal_sync(struct dfs_journal *j)
+{
+    struct stat st;
+
+    if (!j->ready || stat(j->log_path, &st) < 0)
+        return -1;
+
+    // A rewrite replaced the log: start over with the new one
+    if (j->log_fd < 0 || st.st_ino != j->log_ino || (uint64_t)st.st_size < j->generation)
+    {
+        dfs_journal_reset(j);
+        if (j->log_fd >= 0)
+            close(j->log_fd);
+        if ((j->log_fd = open(j->log_path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(j->log_fd, &st) < 0)
+            return -1;
+        j->log_ino = st.st_ino;
+    }
+
+    // Apply the complete records added since the last sync
+    if (dfs_catalog_replay(j->log_fd, &j->generation, st.st_size, dfs_journal_apply, j) < 0)
+    {
+        fprintf(stderr, "Journal log %s is damaged\n", j->log_path);
+        dfs_journal_reset(j);
+        close(j->log_fd);
+        j->log_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Append records to the log, made durable if sync is set, dropping what was written of them if
+// that fails. Called with the lock held exclusively.
+static inline int dfs_journal_log(struct dfs_journal *j, const char *records, size_t len, int sync)
+{
+    struct stat st;
+    int fd = open(j->log_path, O_WRONLY | O_APPEND | O_CLOEXEC), err;
+
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0)
+    {
+        err = errno; // Nothing written yet, and no size to go back to
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    if (dfs_write_full(fd, records, len) < 0 || (sync && fdatasync(fd) < 0))
+    {
+        err = errno;
+        if (ftruncate(fd, st.st_size) < 0)
+            perror("Could not repair journal log");
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// Write the log afresh with the records of the pending uploads and put it in place. Called with
+// the lock held exclusively.
+static inline int dfs_journal_rewrite(struct dfs_journal *j)
+{
+    char tmp[PATH_MAX + 8], record[PATH_MAX + 128];
+    int fd, ok = 1;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", j->log_path);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+        return -1;
+    for (size_t i = 0; ok && i < j->count; i++)
+    {
+        struct dfs_journal_entry *e = &j->entries[i];
+        if (!e->pending)
+            continue;
+        int rlen = snprintf(record, sizeof(record), "A %s %llu %llu %u %s\n", e->file, (unsigned long long)e->offset,
+                            (unsigned long long)e->size, (unsigned int)e->crc, e->path);
+        ok = dfs_write_full(fd, record, rlen) == 0;
+    }
+    if (!ok || fsync(fd) < 0 || rename(tmp, j->log_path) < 0)
+    {
+        perror("Could not rewrite journal log");
+        unlink(tmp);
+        ok = 0;
+    }
+    close(fd);
+
+    // The rename is durable with the directory. Until it is, a crash may bring back the old log,
+    // which holds every record of the new one.
+    if (ok && ((fd = open(j->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0 || fsync(fd) < 0))
+    {
+        perror("Could not sync journal directory");
+        ok = 0;
+    }
+    if (fd >= 0)
+        close(fd);
+    return ok && dfs_journal_sync(j) == 0 ? 0 : -1;
+}
+
+// Remove the data files without pending bodies. Called with the lock held exclusively, before
+// the workers start: no other process appends to any of them.
+static inline void dfs_journal_tidy_all(struct dfs_journal *j)
+{
+    char path[PATH_MAX];
+    struct dirent *entry;
+    DIR *dir = opendir(j->dir);
+
+    if (dir == NULL)
+        return;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        struct dfs_journal_file *f = dfs_journal_file(j, entry->d_name, 0);
+        int pid, used = 0;
+        unsigned n;
+
+        if (sscanf(entry->d_name, "%d.%u%n", &pid, &n, &used) != 2 || entry->d_name[used] != '\0' ||
+            used >= DFS_JOURNAL_NAME_MAX || (f != NULL && f->pending > 0))
+            continue;
+        dfs_journal_file_path(j, entry->d_name, path);
+        unlink(path);
+    }
+    closedir(dir);
+}
+
+// Set up the journal. Call once before the workers start. Returns -1 if it cannot be used,
+// uploads are then relayed as usual.
+static inline int dfs_journal_init(struct dfs_journal *j)
+{
+    char dir[PATH_MAX];
+    struct stat st;
+    int fd;
+
+    memset(j, 0, sizeof(*j));
+    j->lock_fd = -1;
+    j->log_fd = -1;
+    snprintf(dir, sizeof(dir), "%s", getenv("HOME"));
+    if (snprintf(j->dir, sizeof(j->dir), "%.4000s/%s", dir, DFS_JOURNAL_DIR) > 4000)
+    {
+        fprintf(stderr, "Journal directory below %s: %s\n", dir, strerror(ENAMETOOLONG));
+        return -1;
+    }
+    if (mkdir(j->dir, S_IRWXU) < 0 && errno != EEXIST)
+    {
+        perror("Could not create journal directory");
+        return -1;
+    }
+    snprintf(j->log_path, sizeof(j->log_path), "%.4000s/log", j->dir);
+    snprintf(j->lock_path, sizeof(j->lock_path), "%.4000s/journal.lock", j->dir);
+    if ((fd = open(j->log_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600)) < 0)
+    {
+        perror("Could not create journal log");
+        return -1;
+    }
+    close(fd);
+
+    j->ready = 1;
+    if (dfs_journal_lock(j, LOCK_EX) < 0)
+    {
+        j->ready = 0;
+        return -1;
+    }
+    if (dfs_journal_sync(j) < 0)
+    {
+        fprintf(stderr, "Journal %s is unusable, uploads are relayed as usual\n", j->dir);
+        j->ready = 0;
+    }
+    else
+    {
+        // A record torn by a crash would be glued to the next one appended
+        if (stat(j->log_path, &st) == 0 && (uint64_t)st.st_size > j->generation &&
+            truncate(j->log_path, j->generation) < 0)
+            perror("Could not repair journal log");
+        if (j->records > j->pending)
+            dfs_journal_rewrite(j);
+        dfs_journal_tidy_all(j);
+        printf("Journal ready: %zu uploads to forward\n", j->pending);
+    }
+    dfs_journal_unlock(j);
+    return j->ready ? 0 : -1;
+}
+
+// Whether path has a pending upload, as of the last sync of this process
+static inline int dfs_journal_has(const struct dfs_journal *j, const char *path)
+{
+    return j->ready && dfs_map_get(&j->paths, path) != NULL;
+}
+
+// The pending entry of path if it is still the body e describes, as of the last sync. NULL if it
+// was forwarded, superseded or removed.
+static inline struct dfs_journal_entry *dfs_journal_lookup(struct dfs_journal *j, const struct dfs_journal_entry *e)
+{
+    size_t *pos = j->ready ? dfs_map_get(&j->paths, e->path) : NULL;
+
+    if (pos == NULL || j->entries[*pos].offset != e->offset || strcmp(j->entries[*pos].file, e->file) != 0)
+        return NULL;
+    return &j->entries[*pos];
+}
+
+// Apply what other processes changed since the last sync
+static inline void dfs_journal_poll(struct dfs_journal *j)
+{
+    if (!j->ready || dfs_journal_lock(j, LOCK_SH) < 0)
+        return;
+    dfs_journal_sync(j);
+    dfs_journal_unlock(j);
+}
+
+// Start writing an upload of size bytes to the journal, at the end of this process's data file.
+// Returns -1 with errno set if it cannot be journaled.
+static inline int dfs_journal_begin(struct dfs_journal *j, uint64_t size, struct dfs_journal_write *w)
+{
+    char name[DFS_JOURNAL_NAME_MAX], path[PATH_MAX];
+    struct dfs_journal_file *f;
+    int fd;
+
+    w->fd = -1;
+    if (!j->ready)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (j->tail_pid != getpid())
+    {
+        j->tail_pid = getpid(); // Inherited from the process that set the journal up
+        j->tail[0] = '\0';
+    }
+
+    // A full data file is left to its pending bodies, the next one is started
+    if (j->tail[0] != '\0' && j->tail_end > 0 && j->tail_end + size > DFS_JOURNAL_FILE_MAX)
+        j->tail[0] = '\0';
+    if (j->tail[0] == '\0')
+    {
+        // Whatever has the name was left behind by a process with the same pid, the next one is taken
+        do
+        {
+            snprintf(name, sizeof(name), "%d.%u", (int)getpid(), j->next_tail++);
+            dfs_journal_file_path(j, name, path);
+        } while ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600)) < 0 && errno == EEXIST);
+        if (fd < 0)
+            return -1;
+        close(fd);
+        if ((f = dfs_journal_file(j, name, 1)) == NULL)
+        {
+            unlink(path);
+            errno = ENOMEM;
+            return -1;
+        }
+        f->own = 1;
+        snprintf(j->tail, sizeof(j->tail), "%s", name);
+        j->tail_end = 0;
+    }
+
+    dfs_journal_file_path(j, j->tail, path);
+    if ((f = dfs_journal_file(j, j->tail, 0)) == NULL || (w->fd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+        return -1;
+    snprintf(w->file, sizeof(w->file), "%s", j->tail);
+    w->offset = j->tail_end;
+    w->size = size;
+    w->written = w->flushed = 0;
+    w->crc = 0;
+    j->tail_end += size;
+    f->writing++;
+    return 0;
+}
+
+// Write the next len bytes of the body. Returns -1 with errno set if they cannot be.
+static inline int dfs_journal_write(struct dfs_journal_write *w, const void *data, size_t len)
+{
+    if (w->written + len > w->size)
+    {
+        errno = EFBIG;
+        return -1;
+    }
+    if (dfs_pwrite_full(w->fd, data, len, w->offset + w->written) < 0)
+        return -1;
+    w->written += len;
+    w->crc = dfs_crc32(w->crc, data, len);
+
+    // The disk starts on a large body while it arrives, leaving less for the commit to wait for
+    if (w->written - w->flushed >= DFS_JOURNAL_FLUSH)
+    {
+        sync_file_range(w->fd, w->offset + w->flushed, w->written - w->flushed, SYNC_FILE_RANGE_WRITE);
+        w->flushed = w->written;
+    }
+    return 0;
+}
+
+// The upload no longer writes to its data file
+static inline void dfs_journal_end(struct dfs_journal *j, struct dfs_journal_write *w)
+{
+    struct dfs_journal_file *f = dfs_journal_file(j, w->file, 0);
+
+    if (f != NULL && f->writing > 0)
+        f->writing--;
+    if (w->fd >= 0)
+        close(w->fd);
+    w->fd = -1;
+}
+
+// Give up an upload being written, its bytes become dead space of the data file
+static inline void dfs_journal_abort(struct dfs_journal *j, struct dfs_journal_write *w)
+{
+    dfs_journal_end(j, w);
+}
+
+// Journal the whole body written as the file at path, superseding a pending upload of it.
+// Returns 0 once it is on disk, -1 with errno set if it cannot be: the upload failed.
+static inline int dfs_journal_commit(struct dfs_journal *j, struct dfs_journal_write *w, const char *path)
+{
+    char record[PATH_MAX + 128];
+    int rlen, err = 0;
+
+    // The body is on disk before the record pointing at it
+    if (w->written != w->size)
+        err = EIO;
+    else if (strchr(path, '\n') != NULL || path[0] != '/')
+        err = EINVAL;
+    else if ((rlen = snprintf(record, sizeof(record), "A %s %llu %llu %u %s\n", w->file, (unsigned long long)w->offset,
+                              (unsigned long long)w->size, (unsigned int)w->crc, path)) >= (int)sizeof(record))
+        err = ENAMETOOLONG;
+    else if (fdatasync(w->fd) < 0 || dfs_journal_lock(j, LOCK_EX) < 0)
+        err = errno;
+    else
+    {
+        if (dfs_journal_sync(j) < 0)
+            err = EIO;
+        else if (dfs_journal_log(j, record, rlen, 1) < 0)
+            err = errno;
+        dfs_journal_sync(j);
+        dfs_journal_unlock(j);
+    }
+    if (err != 0)
+        fprintf(stderr, "Could not journal %s: %s\n", path, strerror(err));
+    dfs_journal_end(j, w);
+    errno = err;
+    return err != 0 ? -1 : 0;
+}
+
+// A descriptor of its own of the data file holding the body of pending upload e, -1 if it cannot
+// be opened. Called with the lock held: data files are only removed under the exclusive lock,
+// once nothing in them is pending.
+static inline int dfs_journal_open(struct dfs_journal *j, const struct dfs_journal_entry *e)
+{
+    char file_path[PATH_MAX];
+    struct dfs_journal_file *f = dfs_journal_file(j, e->file, 0);
+
+    if (f == NULL)
+        return -1;
+    if (f->fd < 0)
+    {
+        dfs_journal_file_path(j, f->name, file_path);
+        f->fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    }
+    return f->fd >= 0 ? dup(f->fd) : -1;
+}
+
+// Log that the file at path was removed. Returns 1 if it had a pending upload, 0 if not, -1 if
+// the journal is unusable.
+static inline int dfs_journal_remove(struct dfs_journal *j, const char *path)
+{
+    char record[PATH_MAX + 4];
+    int rc = 0;
+
+    if (!j->ready || dfs_journal_lock(j, LOCK_EX) < 0)
+        return -1;
+    if (dfs_journal_sync(j) < 0)
+        rc = -1;
+    else if (dfs_map_get(&j->paths, path) != NULL && snprintf(record, sizeof(record), "D %s\n", path) < (int)sizeof(record))
+    {
+        // Durable, a removed file must not be forwarded after a crash
+        rc = dfs_journal_log(j, record, strlen(record), 1) < 0 ? -1 : 1;
+        if (rc < 0)
+            perror("Could not update journal");
+        dfs_journal_sync(j);
+    }
+    dfs_journal_unlock(j);
+    return rc;
+}
+
+// The pending upload of path into *e (its path pointing into the index, valid until the next
+// sync) with a descriptor of its data file of its own in *fd, for the caller to read the body at
+// e->offset. Returns 1, 0 if path has none or -1 if it cannot be read.
+static inline int dfs_journal_find(struct dfs_journal *j, const char *path, struct dfs_journal_entry *e, int *fd)
+{
+    size_t *pos;
+    int rc = 0;
+
+    if (!j->ready || dfs_journal_lock(j, LOCK_SH) < 0)
+        return 0;
+    if (dfs_journal_sync(j) < 0)
+        rc = -1;
+    else if ((pos = dfs_map_get(&j->paths, path)) != NULL)
+    {
+        *e = j->entries[*pos];
+        rc = (*fd = dfs_journal_open(j, e)) >= 0 ? 1 : -1;
+    }
+    dfs_journal_unlock(j);
+    return rc;
+}
+
+// Call fn with every pending upload, oldest first, after taking in the changes of other processes.
+// fn runs with the lock held and may call dfs_journal_open, the entry is valid during the call
+// only. Returns -1 if the journal is unusable.
+static inline int dfs_journal_each(struct dfs_journal *j,
+                                   void (*fn)(struct dfs_journal *j, const struct dfs_journal_entry *e, void *data),
+                                   void *data)
+{
+    int rc = 0;
+
+    if (!j->ready || dfs_journal_lock(j, LOCK_SH) < 0)
+        return -1;
+    if (dfs_journal_sync(j) < 0)
+        rc = -1;
+    for (size_t i = 0; rc == 0 && i < j->count; i++)
+    {
+        if (j->entries[i].pending)
+            fn(j, &j->entries[i], data);
+    }
+    dfs_journal_unlock(j);
+    return rc;
+}
+
+// Call fn with the name of every file directly in directory dir (absolute, without a trailing
+// slash) with a pending upload, as of the last sync of this process
+static inline void dfs_journal_list(const struct dfs_journal *j, const char *dir,
+                                    void (*fn)(const struct dfs_journal_entry *e, const char *name, void *data),
+                                    void *data)
+{
+    size_t len = strlen(dir);
+
+    for (size_t i = 0; j->ready && i < j->count; i++)
+    {
+        const char *path = j->entries[i].path;
+        if (j->entries[i].pending && strncmp(path, dir, len) == 0 && path[len] == '/' &&
+            strchr(path + len + 1, '/') == NULL)
+            fn(&j->entries[i], path + len + 1, data);
+    }
+}
+
+// Log that the bodies of n uploads reached the storage nodes, with a single sync. done[i] is set
+// to 1 for those logged, to 0 for those a newer upload superseded or that were removed meanwhile
+// (tell them apart with dfs_journal_has). Returns -1 if the journal is unusable or the records
+// cannot be made durable, none of them counts as logged then.
+static inline int dfs_journal_forwarded(struct dfs_journal *j, const struct dfs_journal_entry *const *entries,
+                                        size_t n, int *done)
+{
+    char *records = (char *)malloc(n * (PATH_MAX + 64) + 1);
+    size_t len = 0;
+    int rc = 0;
+
+    for (size_t i = 0; i < n; i++)
+        done[i] = 0;
+    if (records == NULL || !j->ready || dfs_journal_lock(j, LOCK_EX) < 0)
+    {
+        free(records);
+        return -1;
+    }
+    if (dfs_journal_sync(j) < 0)
+        rc = -1;
+    for (size_t i = 0; rc == 0 && i < n; i++)
+    {
+        const struct dfs_journal_entry *e = entries[i];
+        if (dfs_journal_lookup(j, e) == NULL)
+            continue;
+        int rlen = snprintf(records + len, PATH_MAX + 64, "F %s %llu %s\n", e->file, (unsigned long long)e->offset,
+                            e->path);
+        if (rlen >= PATH_MAX + 64)
+            continue; // No path of the journal is that long
+        len += rlen;
+        done[i] = 1;
+    }
+    if (rc == 0 && len > 0 && dfs_journal_log(j, records, len, 1) < 0)
+    {
+        perror("Could not update journal");
+        rc = -1;
+    }
+    if (rc < 0)
+    {
+        for (size_t i = 0; i < n; i++)
+            done[i] = 0;
+    }
+    dfs_journal_sync(j);
+    dfs_journal_unlock(j);
+    free(records);
+    return rc;
+}
+
+// Housekeeping of a process, run from a timer: remove its data files nothing in is pending or
+// still being written, the one it appends to included, and those of processes that are gone,
+// and rewrite the log if most of its records are of settled uploads
+static inline void dfs_journal_tidy(struct dfs_journal *j)
+{
+    char path[PATH_MAX];
+    int pid;
+
+    if (!j->ready || dfs_journal_lock(j, LOCK_EX) < 0)
+        return;
+    if (dfs_journal_sync(j) < 0)
+    {
+        dfs_journal_unlock(j);
+        return;
+    }
+    for (size_t i = 0; i < j->nfiles;)
+    {
+        struct dfs_journal_file *f = &j->files[i];
+        if (f->pending > 0 || f->writing > 0)
+        {
+            i++;
+            continue;
+        }
+        // The file of another process is looked at again until it or the process is gone. One
+        // that reuses the pid of a process gone cannot take the name of a file still there.
+        int gone = f->own || (sscanf(f->name, "%d.", &pid) == 1 && kill(pid, 0) < 0 && errno == ESRCH);
+        dfs_journal_file_path(j, f->name, path);
+        if (!gone && access(path, F_OK) == 0)
+        {
+            i++;
+            continue;
+        }
+        if (gone)
+        {
+            unlink(path);
+            if (strcmp(f->name, j->tail) == 0)
+                j->tail[0] = '\0'; // The next upload starts a file of its own
+        }
+        if (f->fd >= 0)
+            close(f->fd);
+        j->files[i] = j->files[--j->nfiles];
+    }
+    if (j->records > DFS_JOURNAL_LOG_MIN && j->records > j->pending * 2 && dfs_journal_rewrite(j) == 0)
+        printf("Journal log rewritten: %zu uploads to forward\n", j->pending);
+    dfs_journal_unlock(j);
+}
+
+#endif
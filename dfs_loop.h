@@ -0,0 +1,1002 @@
+#ifndef DFS_LOOP_H
+#define DFS_LOOP_H
+
+// Edge-triggered epoll reactor and non-blocking framed connections.
+//
+// A dfs_conn owns one socket, parses incoming frames (see dfs_proto.h) and
+// queues outgoing data. Handlers are told about each frame header, about
+// its body as it arrives and about the end of the body, so uploads are
+// processed while they stream in. Output is queued as memory buffers or
+// file ranges and written whenever the socket accepts more. File ranges go
+// from the page cache to the socket with sendfile(2); files sendfile cannot
+// read from fall back to pread + write. A frame body can also be moved from
+// one connection to another through a pipe with splice(2): the bytes never
+// reach user space and the pipe bounds what is in transit, so a slow
+// receiver holds back the sender through TCP. Buffers are sized to the data
+// written into them (see dfs_xfer.h), and consecutive ones leave in one
+// gathered write, a frame header together with its body.
+//
+// Flow control: a handler feeding one connection from another pauses the
+// source once the destination has DFS_OUT_HIGH bytes queued, and resumes it
+// from the destination's on_drain callback (below DFS_OUT_LOW). A handler
+// that answers a request asynchronously holds the connection so the next
+// request is not started before the current reply is queued.
+//
+// Background connections and timers (pooled links to other servers and
+// their housekeeping) do not keep the loop running; it returns once only
+// background work is left.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "dfs_xfer.h"
+
+#define DFS_IN_SIZE 65536          // Input buffer of a connection (header + arguments must fit)
+#define DFS_OUT_IOV 64             // Queued buffers gathered into one write
+#define DFS_SENDFILE_MAX (1 << 20) // Bytes handed to one sendfile call, keeps other connections served
+#define DFS_PIPE_SIZE (256 * 1024) // Capacity requested for splice pipes
+#define DFS_OUT_HIGH (1024 * 1024) // Pause whoever feeds a connection above this many queued bytes
+#define DFS_OUT_LOW (256 * 1024)   // Resume feeding once the queue drains below this
+#define DFS_MAX_EVENTS 256         // Events handled per epoll_wait call
+
+// Kinds of queued output
+#define DFS_OUT_BUF 0  // Bytes in memory
+#define DFS_OUT_FILE 1 // A range of an open file, the descriptor is closed once sent
+#define DFS_OUT_PIPE 2 // Body bytes spliced from another connection
+
+// States of the frame parser
+#define DFS_IN_HDR 0  // Waiting for a header and its argument block
+#define DFS_IN_BODY 1 // Delivering body bytes to the handler
+
+struct dfs_loop;
+struct dfs_conn;
+
+// Anything registered with the reactor starts with a watch
+struct dfs_watch
+{
+    int fd;                                                      // Descriptor polled by epoll
+    void (*handler)(struct dfs_watch *watch, uint32_t events);   // Called with the ready events
+};
+
+struct dfs_out
+{
+    struct dfs_out *next; // Next item in the queue
+    int kind;             // DFS_OUT_*
+    char *data;           // Buffer contents (DFS_OUT_BUF)
+    size_t cap;           // Size of the buffer
+    size_t len, off;      // Bytes in the buffer and bytes already written
+    int fd;               // File to send (DFS_OUT_FILE)
+    off_t pos;            // Next file offset to send
+    uint64_t left;        // File bytes still to send
+    int copy;             // sendfile is not usable for this file, copy through a buffer
+    int keep_fd;          // fd is closed by a later item or by the caller, not by this one
+    int pipe[2];          // Pipe the bytes travel through (DFS_OUT_PIPE)
+    uint64_t in_pipe;     // Bytes read from the source and not yet written
+    struct dfs_conn *src; // Connection the bytes come from, NULL once all were read
+    struct dfs_conn *dst; // Connection whose queue holds the item
+};
+
+// Callbacks of a connection, any of them may be NULL
+struct dfs_conn_ops
+{
+    void (*on_connect)(struct dfs_conn *conn, int err);                           // Outgoing connect finished
+    void (*on_frame)(struct dfs_conn *conn, struct dfs_hdr *hdr, char **argv);    // A frame header arrived
+    void (*on_body)(struct dfs_conn *conn, const char *data, size_t len);         // Part of the frame body
+    void (*on_body_end)(struct dfs_conn *conn);                                   // The frame body is complete
+    void (*on_drain)(struct dfs_conn *conn);                                      // Queued output fell below DFS_OUT_LOW
+    void (*on_close)(struct dfs_conn *conn);                                      // Connection closed or failed
+};
+
+struct dfs_conn
+{
+    struct dfs_watch watch;         // Registration with the reactor
+    struct dfs_loop *loop;          // Reactor the connection belongs to
+    const struct dfs_conn_ops *ops; // Callbacks
+    void *data;                     // Owner specific state
+    int connecting;                 // Outgoing connect still in progress
+    int closed;                     // Closed, freed after the current event batch
+    int read_paused;                // Reading stopped by flow control
+    int held;                       // Next frame must wait for the current reply
+    int want_drain;                 // Call on_drain once the queue is short again
+    int close_when_flushed;         // Close once the output queue is empty
+    int free_data;                  // Free data together with the connection
+    int background;                 // Does not keep the loop running
+    int in_parse;                   // dfs_conn_parse is running for this connection
+    struct dfs_out *splice_out;     // Item moving the current body to another connection
+    int in_state;                   // DFS_IN_HDR or DFS_IN_BODY
+    struct dfs_hdr hdr;             // Header of the frame being received
+    uint64_t body_left;             // Body bytes of that frame not yet delivered
+    uint64_t in_bytes;              // Bytes received so far, spliced ones included
+    size_t in_len, in_off;          // Bytes in the input buffer and bytes consumed
+    unsigned char in[DFS_IN_SIZE];  // Input buffer
+    struct dfs_out *out_head;       // Output queue
+    struct dfs_out *out_tail;
+    uint64_t out_bytes;             // Bytes still queued
+    struct dfs_conn *next_dead;     // Link in the loop's list of closed connections
+};
+
+// A listening socket whose new connections are handed to on_accept
+struct dfs_listener
+{
+    struct dfs_watch watch;                            // Registration with the reactor
+    struct dfs_loop *loop;                             // Reactor the listener belongs to
+    void (*on_accept)(struct dfs_loop *loop, int fd);  // Called with each accepted socket
+};
+
+// A periodic timer run by the reactor
+struct dfs_timer
+{
+    struct dfs_watch watch;                // Registration of the timerfd
+    void (*fn)(struct dfs_timer *timer);   // Called on every expiry
+    void *data;                            // Owner specific state
+};
+
+struct dfs_loop
+{
+    int epfd;              // epoll instance
+    int nconns;            // Open connections, background ones excepted
+    int nwatches;          // Other registered watches (listeners, ...)
+    struct dfs_conn *dead; // Connections closed during the current batch
+    void (*before_wait)(struct dfs_loop *loop); // Called once a batch is handled, before waiting for the next
+};
+
+static void dfs_conn_flush(struct dfs_conn *conn);
+static void dfs_conn_parse(struct dfs_conn *conn);
+static void dfs_conn_read(struct dfs_conn *conn);
+static void dfs_conn_close(struct dfs_conn *conn);
+
+// Release an output item and whatever it holds open
+static inline void dfs_out_free(struct dfs_out *out)
+{
+    if (out->kind == DFS_OUT_FILE && !out->keep_fd)
+        close(out->fd);
+    if (out->kind == DFS_OUT_PIPE)
+    {
+        close(out->pipe[0]);
+        close(out->pipe[1]);
+    }
+    free(out->data);
+    free(out);
+}
+
+// Put a descriptor into non-blocking mode
+static inline int dfs_set_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static inline int dfs_loop_init(struct dfs_loop *loop)
+{
+    memset(loop, 0, sizeof(*loop));
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    return loop->epfd < 0 ? -1 : 0;
+}
+
+// Register a watch that keeps the loop running (listening sockets and the like)
+static inline int dfs_loop_add_watch(struct dfs_loop *loop, struct dfs_watch *watch, uint32_t events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = watch;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, watch->fd, &ev) < 0)
+        return -1;
+    loop->nwatches++;
+    return 0;
+}
+
+// Milliseconds on the monotonic clock
+static inline int64_t dfs_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void dfs_timer_event(struct dfs_watch *watch, uint32_t events)
+{
+    struct dfs_timer *timer = (struct dfs_timer *)watch;
+    uint64_t expirations;
+
+    (void)events;
+    if (read(watch->fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+        timer->fn(timer);
+}
+
+// Call fn every interval_ms milliseconds, or not before dfs_timer_arm if it is 0.
+// Timers run in the background.
+static inline int dfs_timer_start(struct dfs_loop *loop, struct dfs_timer *timer, int interval_ms,
+                                  void (*fn)(struct dfs_timer *timer), void *data)
+{
+    struct itimerspec its;
+    struct epoll_event ev;
+
+    timer->fn = fn;
+    timer->data = data;
+    if ((timer->watch.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        return -1;
+    timer->watch.handler = dfs_timer_event;
+
+    its.it_interval.tv_sec = interval_ms / 1000;
+    its.it_interval.tv_nsec = (long)(interval_ms % 1000) * 1000000;
+    its.it_value = its.it_interval;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &timer->watch;
+    if (timerfd_settime(timer->watch.fd, 0, &its, NULL) < 0 ||
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, timer->watch.fd, &ev) < 0)
+    {
+        close(timer->watch.fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Call the timer's fn once, delay_ms milliseconds from now, instead of periodically
+static inline void dfs_timer_arm(struct dfs_timer *timer, int delay_ms)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = delay_ms / 1000;
+    its.it_value.tv_nsec = (long)(delay_ms % 1000) * 1000000;
+    if (delay_ms <= 0)
+        its.it_value.tv_nsec = 1; // A zero expiry would disarm the timer
+    timerfd_settime(timer->watch.fd, 0, &its, NULL);
+}
+
+// Accept every pending connection of a listener
+static void dfs_listener_event(struct dfs_watch *watch, uint32_t events)
+{
+    struct dfs_listener *listener = (struct dfs_listener *)watch;
+    int fd;
+
+    (void)events;
+    while ((fd = accept4(watch->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+        listener->on_accept(listener->loop, fd);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+        perror("Client accept failed"); // Out of descriptors and the like, retried on the next event
+    }
+}
+
+// Accept connections of a listening socket from the loop
+static inline int dfs_loop_listen(struct dfs_loop *loop, struct dfs_listener *listener, int fd,
+                                  void (*on_accept)(struct dfs_loop *loop, int fd))
+{
+    dfs_set_nonblock(fd);
+    listener->watch.fd = fd;
+    listener->watch.handler = dfs_listener_event;
+    listener->loop = loop;
+    listener->on_accept = on_accept;
+    return dfs_loop_add_watch(loop, &listener->watch, EPOLLIN);
+}
+
+// Dispatch events until no connection or watch is left
+static inline void dfs_loop_run(struct dfs_loop *loop)
+{
+    struct epoll_event events[DFS_MAX_EVENTS];
+
+    while (loop->nconns > 0 || loop->nwatches > 0)
+    {
+        if (loop->before_wait != NULL)
+            loop->before_wait(loop);
+        int n = epoll_wait(loop->epfd, events, DFS_MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait failed");
+            return;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            struct dfs_watch *watch = (struct dfs_watch *)events[i].data.ptr;
+            watch->handler(watch, events[i].events);
+        }
+
+        // Connections closed in this batch may still have had events queued above
+        while (loop->dead != NULL)
+        {
+            struct dfs_conn *conn = loop->dead;
+            loop->dead = conn->next_dead;
+            if (conn->free_data)
+                free(conn->data);
+            free(conn);
+        }
+    }
+}
+
+// Handle readiness of a connection
+static void dfs_conn_event(struct dfs_watch *watch, uint32_t events)
+{
+    struct dfs_conn *conn = (struct dfs_conn *)watch;
+
+    if (conn->closed)
+        return;
+
+    if (conn->connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        getsockopt(conn->watch.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        conn->connecting = 0;
+        if (conn->ops->on_connect)
+            conn->ops->on_connect(conn, err);
+        if (err != 0)
+        {
+            dfs_conn_close(conn);
+            return;
+        }
+    }
+
+    // While a body is spliced, readable input is the business of the receiving connection
+    if (!conn->closed && conn->splice_out && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        dfs_conn_flush(conn->splice_out->dst);
+    else if (!conn->closed && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        dfs_conn_read(conn);
+    if (!conn->closed && (events & EPOLLOUT))
+        dfs_conn_flush(conn);
+}
+
+// Wrap an accepted or connected socket into a connection
+static inline struct dfs_conn *dfs_conn_new(struct dfs_loop *loop, int fd, const struct dfs_conn_ops *ops, void *data)
+{
+    struct epoll_event ev;
+    struct dfs_conn *conn = (struct dfs_conn *)calloc(1, sizeof(struct dfs_conn));
+
+    if (conn == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    conn->watch.fd = fd;
+    conn->watch.handler = dfs_conn_event;
+    conn->loop = loop;
+    conn->ops = ops;
+    conn->data = data;
+
+    // Interest in both directions is registered once, edge triggered
+    dfs_set_nonblock(fd);
+    dfs_sock_tune(fd, DFS_SOCK_FRAMED);
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = &conn->watch;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        perror("epoll_ctl failed");
+        close(fd);
+        free(conn);
+        return NULL;
+    }
+    loop->nconns++;
+    return conn;
+}
+
+// Start a non-blocking connect, on_connect reports the outcome
+static inline struct dfs_conn *dfs_conn_connect(struct dfs_loop *loop, const char *ip, int port,
+                                                const struct dfs_conn_ops *ops, void *data)
+{
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+    {
+        perror("Socket creation failed");
+        return NULL;
+    }
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, ip, &addr.sin_addr);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+    {
+        perror("Connection to server failed");
+        close(fd);
+        return NULL;
+    }
+
+    struct dfs_conn *conn = dfs_conn_new(loop, fd, ops, data);
+    if (conn != NULL)
+        conn->connecting = 1;
+    return conn;
+}
+
+// Close a connection, drop its queued output and tell the owner. The connection (and
+// its data, with free_data set) stays readable until the current event batch ends.
+static void dfs_conn_close(struct dfs_conn *conn)
+{
+    if (conn->closed)
+        return;
+    conn->closed = 1;
+
+    struct dfs_conn *src = NULL; // Source of an unfinished splice into this connection
+    struct dfs_conn *dst = NULL; // Receiver of an unfinished splice from this connection
+
+    epoll_ctl(conn->loop->epfd, EPOLL_CTL_DEL, conn->watch.fd, NULL);
+    close(conn->watch.fd);
+    while (conn->out_head != NULL)
+    {
+        struct dfs_out *out = conn->out_head;
+        conn->out_head = out->next;
+        if (out->kind == DFS_OUT_PIPE && out->src != NULL)
+        {
+            // The source delivers the rest of its body to its own handlers again
+            src = out->src;
+            src->splice_out = NULL;
+            src->body_left = out->left;
+        }
+        dfs_out_free(out);
+    }
+    conn->out_tail = NULL;
+    conn->out_bytes = 0;
+    if (!conn->background)
+        conn->loop->nconns--;
+
+    // A splice from this connection stops short of the end of its body
+    if (conn->splice_out != NULL)
+    {
+        dst = conn->splice_out->dst;
+        conn->splice_out->src = NULL;
+        conn->splice_out = NULL;
+    }
+
+    if (conn->ops->on_close)
+        conn->ops->on_close(conn);
+
+    // Freed by the loop once no event of this batch can refer to it any more
+    conn->next_dead = conn->loop->dead;
+    conn->loop->dead = conn;
+
+    // The source of an unfinished splice resumes now that our owner let go of us
+    if (src != NULL)
+    {
+        dfs_conn_parse(src);
+        dfs_conn_read(src);
+    }
+    if (dst != NULL)
+        dfs_conn_flush(dst); // Sends what the pipe holds, then gives up on the body
+}
+
+// Let the loop finish even while this connection is open
+static inline void dfs_conn_set_background(struct dfs_conn *conn)
+{
+    if (conn->background)
+        return;
+    conn->background = 1;
+    conn->loop->nconns--;
+}
+
+// Append an item to the output queue
+static inline void dfs_conn_enqueue(struct dfs_conn *conn, struct dfs_out *out)
+{
+    if (conn->out_tail)
+        conn->out_tail->next = out;
+    else
+        conn->out_head = out;
+    conn->out_tail = out;
+}
+
+// Write as much queued output as the socket takes
+static void dfs_conn_flush(struct dfs_conn *conn)
+{
+    char buffer[DFS_XFER_MIN];     // Staging buffer for file ranges
+    struct dfs_conn *done = NULL;  // Splice source whose body has been read completely
+    struct dfs_conn *broken = NULL; // Splice source that failed
+
+    if (conn->closed || conn->connecting)
+        return;
+
+    while (conn->out_head != NULL)
+    {
+        struct dfs_out *out = conn->out_head;
+        ssize_t n;
+
+        if (out->kind == DFS_OUT_PIPE)
+        {
+            // Fill the pipe from the source while it has room
+            if (out->src != NULL && out->left > 0 && out->in_pipe < DFS_PIPE_SIZE)
+            {
+                size_t want = DFS_PIPE_SIZE - out->in_pipe;
+                if (want > out->left)
+                    want = (size_t)out->left;
+                ssize_t got = splice(out->src->watch.fd, NULL, out->pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (got > 0)
+                {
+                    out->src->in_bytes += (uint64_t)got;
+                    out->left -= (uint64_t)got;
+                    out->in_pipe += (uint64_t)got;
+                }
+                else if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                {
+                    broken = out->src; // Source closed or failed in the middle of the body
+                    out->src->splice_out = NULL;
+                    out->src = NULL;
+                }
+                if (out->src != NULL && out->left == 0)
+                {
+                    done = out->src; // The source can go on with its next frame
+                    out->src->splice_out = NULL;
+                    out->src->body_left = 0;
+                    out->src = NULL;
+                }
+            }
+
+            if (out->in_pipe == 0)
+            {
+                if (out->left > 0 && out->src != NULL)
+                    break; // Wait until the source has more
+                if (out->left > 0)
+                {
+                    dfs_conn_close(conn); // The body can no longer be completed
+                    break;
+                }
+                conn->out_head = out->next;
+                if (conn->out_head == NULL)
+                    conn->out_tail = NULL;
+                dfs_out_free(out);
+                continue;
+            }
+
+            // Drain the pipe into this connection
+            n = splice(out->pipe[0], NULL, conn->watch.fd, NULL, (size_t)out->in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0)
+            {
+                out->in_pipe -= (uint64_t)n;
+                continue;
+            }
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                dfs_conn_close(conn);
+            break; // Wait for EPOLLOUT
+        }
+
+        if (out->kind == DFS_OUT_BUF)
+        {
+            // This buffer and the ones queued after it go in one call. A file range right behind
+            // them is sent next, MSG_MORE lets the last bytes share its first packet.
+            struct iovec iov[DFS_OUT_IOV];
+            struct msghdr msg;
+            struct dfs_out *next = out;
+            int count = 0;
+
+            for (; next != NULL && next->kind == DFS_OUT_BUF && count < DFS_OUT_IOV; next = next->next)
+            {
+                iov[count].iov_base = next->data + next->off;
+                iov[count++].iov_len = next->len - next->off;
+            }
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            n = sendmsg(conn->watch.fd, &msg, next != NULL && next->kind == DFS_OUT_FILE ? MSG_MORE : 0);
+            if (n > 0)
+            {
+                // Drop the buffers written whole, the rest of a partly written one goes next
+                conn->out_bytes -= (uint64_t)n;
+                while (n > 0)
+                {
+                    size_t k = out->len - out->off < (size_t)n ? out->len - out->off : (size_t)n;
+                    out->off += k;
+                    n -= (ssize_t)k;
+                    if (out->off == out->len)
+                    {
+                        conn->out_head = out->next;
+                        if (conn->out_head == NULL)
+                            conn->out_tail = NULL;
+                        dfs_out_free(out);
+                        out = conn->out_head;
+                    }
+                }
+                continue;
+            }
+        }
+        else if (!out->copy)
+        {
+            // Zero copy: the kernel moves the range from the page cache to the socket
+            off_t pos = out->pos;
+            size_t want = out->left < DFS_SENDFILE_MAX ? (size_t)out->left : DFS_SENDFILE_MAX;
+            n = sendfile(conn->watch.fd, out->fd, &pos, want);
+            if (n > 0)
+            {
+                out->pos += n;
+                out->left -= (uint64_t)n;
+            }
+            else if (n == 0 || errno == EINVAL || errno == ENOSYS || errno == EOVERFLOW)
+            {
+                out->copy = 1; // Shrunk file or unsupported file type: the copy below tells them apart
+                continue;
+            }
+        }
+        else
+        {
+            // Read the next part of the file and send what the socket takes
+            size_t want = out->left < sizeof(buffer) ? (size_t)out->left : sizeof(buffer);
+            ssize_t got = pread(out->fd, buffer, want, out->pos);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+            {
+                // Failed or shrunk file: the client sees a short frame rather than wrong bytes
+                dfs_conn_close(conn);
+                break;
+            }
+            n = write(conn->watch.fd, buffer, (size_t)got);
+            if (n > 0)
+            {
+                out->pos += n;
+                out->left -= (uint64_t)n;
+            }
+        }
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                dfs_conn_close(conn);
+            break; // Wait for EPOLLOUT
+        }
+        conn->out_bytes -= (uint64_t)n;
+
+        // Drop the item once it is fully written
+        if (out->kind == DFS_OUT_FILE && out->left == 0)
+        {
+            conn->out_head = out->next;
+            if (conn->out_head == NULL)
+                conn->out_tail = NULL;
+            dfs_out_free(out);
+        }
+    }
+
+    if (!conn->closed && conn->out_head == NULL && conn->close_when_flushed)
+        dfs_conn_close(conn);
+    if (!conn->closed && conn->want_drain && conn->out_bytes < DFS_OUT_LOW)
+    {
+        conn->want_drain = 0;
+        if (conn->ops->on_drain)
+            conn->ops->on_drain(conn);
+    }
+
+    // Splice sources continue last, nothing above may touch the queue after this
+    if (broken != NULL)
+        dfs_conn_close(broken);
+    if (done != NULL)
+    {
+        dfs_conn_parse(done);
+        dfs_conn_read(done);
+    }
+}
+
+// Queue bytes without sending them yet, copying them into the tail buffer where possible.
+// New buffers are sized to the bytes still to copy. Returns -1 if out of memory, the
+// connection is then closed.
+static inline int dfs_conn_append(struct dfs_conn *conn, const void *data, size_t len)
+{
+    const char *p = (const char *)data;
+
+    while (len > 0)
+    {
+        struct dfs_out *tail = conn->out_tail;
+        if (tail == NULL || tail->kind != DFS_OUT_BUF || tail->len == tail->cap)
+        {
+            tail = (struct dfs_out *)calloc(1, sizeof(struct dfs_out));
+            if (tail != NULL)
+                tail->cap = dfs_xfer_chunk(len);
+            if (tail == NULL || (tail->data = (char *)malloc(tail->cap)) == NULL)
+            {
+                free(tail);
+                dfs_conn_close(conn);
+                return -1;
+            }
+            tail->kind = DFS_OUT_BUF;
+            dfs_conn_enqueue(conn, tail);
+        }
+
+        size_t n = tail->cap - tail->len;
+        if (n > len)
+            n = len;
+        memcpy(tail->data + tail->len, p, n);
+        tail->len += n;
+        conn->out_bytes += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Queue bytes for sending and write what the socket takes
+static inline void dfs_conn_write(struct dfs_conn *conn, const void *data, size_t len)
+{
+    if (!conn->closed && dfs_conn_append(conn, data, len) == 0)
+        dfs_conn_flush(conn);
+}
+
+// Queue len bytes of a file starting at pos. With keep_fd the descriptor stays open,
+// otherwise it is closed once the range is sent or dropped.
+static inline void dfs_conn_queue_file(struct dfs_conn *conn, int fd, off_t pos, uint64_t len, int keep_fd)
+{
+    struct dfs_out *out;
+
+    if (conn->closed || len == 0 || (out = (struct dfs_out *)calloc(1, sizeof(struct dfs_out))) == NULL)
+    {
+        if (!keep_fd)
+            close(fd);
+        if (!conn->closed && len > 0)
+            dfs_conn_close(conn); // Out of memory, the announced frame cannot be completed
+        return;
+    }
+    out->kind = DFS_OUT_FILE;
+    out->fd = fd;
+    out->pos = pos;
+    out->left = len;
+    out->keep_fd = keep_fd;
+    conn->out_bytes += len;
+    dfs_conn_enqueue(conn, out);
+    dfs_conn_flush(conn);
+}
+
+// Queue len bytes of a file starting at pos, the connection takes over the descriptor
+static inline void dfs_conn_write_file(struct dfs_conn *conn, int fd, off_t pos, uint64_t len)
+{
+    dfs_conn_queue_file(conn, fd, pos, len, 0);
+}
+
+// Queue several ranges of one file in a row. The descriptor must stay open until a
+// later range queued with dfs_conn_write_file, which closes it, is sent or dropped.
+static inline void dfs_conn_write_file_range(struct dfs_conn *conn, int fd, off_t pos, uint64_t len)
+{
+    dfs_conn_queue_file(conn, fd, pos, len, 1);
+}
+
+// Queue a frame header. One with a payload waits for it: whatever queues the payload
+// sends both.
+static inline void dfs_conn_write_hdr(struct dfs_conn *conn, uint8_t opcode, uint16_t flags, uint16_t status,
+                                      uint32_t req_id, uint32_t arglen, uint64_t length)
+{
+    struct dfs_hdr hdr = {DFS_VERSION, opcode, flags, status, req_id, arglen, length};
+    unsigned char wire[DFS_HDR_SIZE];
+
+    dfs_pack_hdr(&hdr, wire);
+    if (length > 0 && !conn->closed)
+        dfs_conn_append(conn, wire, DFS_HDR_SIZE);
+    else
+        dfs_conn_write(conn, wire, DFS_HDR_SIZE);
+}
+
+// Queue a complete frame with an in-memory body
+static inline void dfs_conn_send_frame(struct dfs_conn *conn, uint8_t opcode, uint16_t flags, uint16_t status,
+                                       uint32_t req_id, const void *body, uint64_t bodylen)
+{
+    dfs_conn_write_hdr(conn, opcode, flags, status, req_id, 0, bodylen);
+    if (bodylen > 0)
+        dfs_conn_write(conn, body, bodylen);
+}
+
+// Queue a final error reply
+static inline void dfs_conn_send_error(struct dfs_conn *conn, uint8_t opcode, uint32_t req_id, int err, const char *msg)
+{
+    dfs_conn_send_frame(conn, opcode, DFS_F_REPLY, (uint16_t)(err ? err : EIO), req_id, msg, strlen(msg));
+}
+
+// Queue a frame header and its arguments, the caller queues bodylen body bytes after it
+// (they leave together)
+static inline int dfs_conn_write_hdr_args(struct dfs_conn *conn, uint8_t opcode, uint16_t flags, uint16_t status,
+                                          uint32_t req_id, int argc, const char **argv, uint64_t bodylen)
+{
+    char args[DFS_MAX_ARGLEN];
+    int arglen = dfs_pack_args(args, sizeof(args), argc, argv);
+
+    if (arglen < 0)
+        return -1;
+    dfs_conn_write_hdr(conn, opcode, flags, status, req_id, (uint32_t)arglen, (uint64_t)arglen + bodylen);
+    if (bodylen > 0 && !conn->closed)
+        dfs_conn_append(conn, args, (size_t)arglen);
+    else
+        dfs_conn_write(conn, args, (size_t)arglen);
+    return 0;
+}
+
+// Queue a request header and its arguments, the caller queues bodylen body bytes after it
+static inline int dfs_conn_send_request(struct dfs_conn *conn, uint8_t opcode, uint32_t req_id, int argc,
+                                        const char **argv, uint64_t bodylen)
+{
+    return dfs_conn_write_hdr_args(conn, opcode, 0, 0, req_id, argc, argv, bodylen);
+}
+
+// True once the connection has enough queued output that its feeder should pause
+static inline int dfs_conn_congested(struct dfs_conn *conn)
+{
+    if (conn->out_bytes < DFS_OUT_HIGH)
+        return 0;
+    conn->want_drain = 1;
+    return 1;
+}
+
+// Deliver buffered input to the handlers
+static void dfs_conn_parse(struct dfs_conn *conn)
+{
+    char args[DFS_MAX_ARGLEN + 1];
+    char *argv[DFS_MAX_ARGS];
+
+    if (conn->in_parse)
+        return; // Called from a handler, the running loop below picks up the change
+    conn->in_parse = 1;
+
+    while (!conn->closed && !conn->read_paused)
+    {
+        size_t avail = conn->in_len - conn->in_off;
+        unsigned char *p = conn->in + conn->in_off;
+
+        if (conn->in_state == DFS_IN_HDR)
+        {
+            // A new frame waits until the previous reply has been queued
+            if (conn->held || avail < DFS_HDR_SIZE)
+                break;
+            if (dfs_unpack_hdr(p, &conn->hdr) < 0)
+            {
+                fprintf(stderr, "Invalid frame received, closing connection\n");
+                dfs_conn_close(conn);
+                return;
+            }
+            if (avail < DFS_HDR_SIZE + conn->hdr.arglen)
+                break;
+
+            memcpy(args, p + DFS_HDR_SIZE, conn->hdr.arglen);
+            dfs_split_args(args, conn->hdr.arglen, argv, DFS_MAX_ARGS);
+            conn->in_off += DFS_HDR_SIZE + conn->hdr.arglen;
+            conn->body_left = conn->hdr.length - conn->hdr.arglen;
+            conn->in_state = DFS_IN_BODY;
+            if (conn->ops->on_frame)
+                conn->ops->on_frame(conn, &conn->hdr, argv);
+        }
+        else if (conn->body_left > 0)
+        {
+            if (avail == 0 || conn->splice_out != NULL)
+                break;
+            size_t n = avail < conn->body_left ? avail : (size_t)conn->body_left;
+            conn->in_off += n;
+            conn->body_left -= n;
+            if (conn->ops->on_body)
+                conn->ops->on_body(conn, (const char *)p, n);
+        }
+        else
+        {
+            conn->in_state = DFS_IN_HDR;
+            if (conn->ops->on_body_end)
+                conn->ops->on_body_end(conn);
+        }
+    }
+
+    conn->in_parse = 0;
+
+    // Move unconsumed input to the front of the buffer
+    if (!conn->closed && conn->in_off > 0)
+    {
+        memmove(conn->in, conn->in + conn->in_off, conn->in_len - conn->in_off);
+        conn->in_len -= conn->in_off;
+        conn->in_off = 0;
+    }
+}
+
+// Read until the socket is drained, the buffer is full or reading is paused
+static void dfs_conn_read(struct dfs_conn *conn)
+{
+    while (!conn->closed && !conn->read_paused && !conn->connecting && conn->splice_out == NULL)
+    {
+        if (conn->in_len == sizeof(conn->in))
+            break; // Full: resumed by dfs_conn_release once the handler catches up
+
+        ssize_t n = read(conn->watch.fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len);
+        if (n > 0)
+        {
+            conn->in_len += (size_t)n;
+            conn->in_bytes += (uint64_t)n;
+            dfs_conn_parse(conn);
+        }
+        else if (n == 0)
+        {
+            dfs_conn_close(conn); // Peer closed the connection
+        }
+        else if (errno != EINTR)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                dfs_conn_close(conn);
+            break;
+        }
+    }
+}
+
+// Move the rest of the current frame body of src to dst through a pipe, bypassing
+// src's handlers. Called from src's on_frame; src continues with on_body_end once
+// the whole body has been read. Returns -1 if the body is delivered as usual.
+static inline int dfs_conn_splice(struct dfs_conn *src, struct dfs_conn *dst)
+{
+    size_t avail = src->in_len - src->in_off;
+    struct dfs_out *out;
+
+    if (dst->closed)
+        return -1;
+
+    // Whatever is already buffered is copied
+    if (avail > src->body_left)
+        avail = (size_t)src->body_left;
+    if (avail > 0)
+    {
+        dfs_conn_write(dst, src->in + src->in_off, avail);
+        src->in_off += avail;
+        src->body_left -= avail;
+    }
+    if (src->body_left == 0 || dst->closed)
+        return 0;
+
+    if ((out = (struct dfs_out *)calloc(1, sizeof(struct dfs_out))) == NULL)
+        return -1;
+    if (pipe2(out->pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        free(out);
+        return -1;
+    }
+    fcntl(out->pipe[1], F_SETPIPE_SZ, DFS_PIPE_SIZE); // Best effort, the default pipe is 64 KB
+
+    out->kind = DFS_OUT_PIPE;
+    out->left = src->body_left;
+    out->src = src;
+    out->dst = dst;
+    src->splice_out = out;
+    dfs_conn_enqueue(dst, out);
+    dfs_conn_flush(dst);
+    return 0;
+}
+
+// Stop delivering input, used while the consumer of a body is congested
+static inline void dfs_conn_pause_read(struct dfs_conn *conn)
+{
+    conn->read_paused = 1;
+}
+
+// Continue delivering input, buffered data first, then whatever the socket holds
+static inline void dfs_conn_resume_read(struct dfs_conn *conn)
+{
+    if (conn->closed || !conn->read_paused)
+        return;
+    conn->read_paused = 0;
+    dfs_conn_parse(conn);
+    dfs_conn_read(conn); // Edge triggered: data that arrived meanwhile raised no new event
+}
+
+// Keep the next request waiting until dfs_conn_release
+static inline void dfs_conn_hold(struct dfs_conn *conn)
+{
+    conn->held = 1;
+}
+
+// Stop taking requests and close once everything queued so far is written
+static inline void dfs_conn_finish(struct dfs_conn *conn)
+{
+    conn->held = 1;
+    conn->close_when_flushed = 1;
+    dfs_conn_flush(conn);
+}
+
+// The current reply is queued, go on with the next request
+static inline void dfs_conn_release(struct dfs_conn *conn)
+{
+    if (conn->closed || !conn->held)
+        return;
+    conn->held = 0;
+    dfs_conn_parse(conn);
+    dfs_conn_read(conn);
+}
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef DFS_NOTIFY_H
+#define DFS_NOTIFY_H
+
+// Recursive inotify watch over a directory tree.
+//
+// A dfs_notify reports every directory and regular file below a root once
+// when it starts, then each one that appears or disappears, with paths
+// relative to the root ("" is the root itself). Subdirectories are watched
+// and scanned as they are created or moved in; one that is removed or
+// moved away is reported as a whole. If the kernel's event queue overflows,
+// the owner is told to forget everything and the tree is reported again.
+//
+// Changes are picked up from the loop, and dfs_notify_poll picks them up on
+// demand: every change made before the call has been reported when it
+// returns, so a view kept from the reports can be trusted right then.
+//
+// The inotify descriptor runs in the background, it never keeps a loop
+// alive on its own.
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include "dfs_loop.h"
+
+#define DFS_NOTIFY_ADD 0     // A regular file appeared
+#define DFS_NOTIFY_DEL 1     // A file disappeared
+#define DFS_NOTIFY_ADD_DIR 2 // A directory appeared
+#define DFS_NOTIFY_DEL_DIR 3 // A directory and everything below it disappeared
+#define DFS_NOTIFY_RESET 4   // Forget everything, the whole tree is reported again
+#define DFS_NOTIFY_SETTLED 5 // Everything read so far has been reported
+
+#define DFS_NOTIFY_MASK (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_ONLYDIR | IN_DONT_FOLLOW)
+#define DFS_NOTIFY_MAX_DEPTH 64 // Deepest directory nesting that is watched
+
+struct dfs_notify;
+
+// Called with a DFS_NOTIFY_* event and the path it concerns, relative to the root
+typedef void (*dfs_notify_fn)(struct dfs_notify *n, int event, const char *path);
+
+struct dfs_notify
+{
+    struct dfs_watch watch; // Registration of the inotify descriptor, -1 once stopped
+    char root[PATH_MAX];    // Directory watched
+    char **dirs;            // Path relative to root of each watch descriptor, NULL if unused
+    int ndirs;              // Size of dirs
+    dfs_notify_fn fn;       // Receiver of the reports
+    void *data;             // Owner specific state
+};
+
+// Path of name in the directory rel, relative to the root
+static inline int dfs_notify_join(char *out, const char *rel, const char *name)
+{
+    int len = snprintf(out, PATH_MAX, "%s%s%s", rel, rel[0] ? "/" : "", name);
+    return len < PATH_MAX ? 0 : -1;
+}
+
+// Watch the directory rel and report it with everything below it
+static inline void dfs_notify_scan(struct dfs_notify *n, const char *rel, int depth)
+{
+    char path[PATH_MAX];
+    char sub[PATH_MAX];
+    struct dirent *entry;
+    DIR *dir;
+    int wd;
+
+    if (snprintf(path, sizeof(path), "%s%s%s", n->root, rel[0] ? "/" : "", rel) >= (int)sizeof(path))
+        return;
+
+    // Watched before it is read, so nothing created meanwhile is missed
+    if ((wd = inotify_add_watch(n->watch.fd, path, DFS_NOTIFY_MASK)) < 0)
+        return; // Gone again, or out of watches
+    if (wd >= n->ndirs)
+    {
+        int ndirs = wd * 2 + 16;
+        char **dirs = (char **)realloc(n->dirs, ndirs * sizeof(char *));
+        if (dirs == NULL)
+            return;
+        memset(dirs + n->ndirs, 0, (ndirs - n->ndirs) * sizeof(char *));
+        n->dirs = dirs;
+        n->ndirs = ndirs;
+    }
+    free(n->dirs[wd]);
+    n->dirs[wd] = strdup(rel);
+    n->fn(n, DFS_NOTIFY_ADD_DIR, rel);
+
+    if ((dir = opendir(path)) == NULL)
+        return;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        struct stat st;
+        int type = entry->d_type;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            dfs_notify_join(sub, rel, entry->d_name) < 0)
+            continue;
+        if (type == DT_UNKNOWN && fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+
+        if (type == DT_DIR && depth < DFS_NOTIFY_MAX_DEPTH)
+            dfs_notify_scan(n, sub, depth + 1);
+        else if (type == DT_REG)
+            n->fn(n, DFS_NOTIFY_ADD, sub);
+    }
+    closedir(dir);
+}
+
+// Stop watching the directory rel and everything below it
+static inline void dfs_notify_forget(struct dfs_notify *n, const char *rel)
+{
+    size_t len = strlen(rel);
+
+    for (int wd = 0; wd < n->ndirs; wd++)
+    {
+        if (n->dirs[wd] != NULL && strncmp(n->dirs[wd], rel, len) == 0 &&
+            (n->dirs[wd][len] == '\0' || n->dirs[wd][len] == '/'))
+        {
+            inotify_rm_watch(n->watch.fd, wd);
+            free(n->dirs[wd]);
+            n->dirs[wd] = NULL;
+        }
+    }
+}
+
+// Report one event read from the kernel
+static inline void dfs_notify_event(struct dfs_notify *n, const struct inotify_event *ev)
+{
+    char path[PATH_MAX];
+    const char *rel;
+
+    if (ev->mask & IN_Q_OVERFLOW)
+    {
+        // Events were lost: start over from a fresh scan
+        n->fn(n, DFS_NOTIFY_RESET, "");
+        dfs_notify_scan(n, "", 0);
+        return;
+    }
+    if (ev->wd < 0 || ev->wd >= n->ndirs || (rel = n->dirs[ev->wd]) == NULL)
+        return; // A directory that is no longer watched
+    if (ev->mask & IN_IGNORED)
+    {
+        free(n->dirs[ev->wd]); // The directory itself was removed
+        n->dirs[ev->wd] = NULL;
+        return;
+    }
+    if (ev->len == 0 || dfs_notify_join(path, rel, ev->name) < 0)
+        return;
+
+    if (ev->mask & IN_ISDIR)
+    {
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+        {
+            int depth = 1;
+            for (const char *p = path; *p; p++)
+                depth += *p == '/';
+            if (depth <= DFS_NOTIFY_MAX_DEPTH)
+                dfs_notify_scan(n, path, depth);
+        }
+        else
+        {
+            // A directory moved away keeps its watches, they would report under the old path
+            dfs_notify_forget(n, path);
+            n->fn(n, DFS_NOTIFY_DEL_DIR, path);
+        }
+    }
+    else if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+    {
+        struct stat st;
+        char full[PATH_MAX * 2];
+
+        // Only regular files count, symbolic links and the like are left out like by dtar
+        snprintf(full, sizeof(full), "%s/%s", n->root, path);
+        if (lstat(full, &st) == 0 && S_ISREG(st.st_mode))
+            n->fn(n, DFS_NOTIFY_ADD, path);
+    }
+    else
+    {
+        n->fn(n, DFS_NOTIFY_DEL, path);
+    }
+}
+
+// Report every change made so far
+static inline void dfs_notify_poll(struct dfs_notify *n)
+{
+    char buffer[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    int any = 0;
+
+    while (n->watch.fd >= 0 && (len = read(n->watch.fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (char *p = buffer; p < buffer + len;)
+        {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            dfs_notify_event(n, ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        any = 1;
+    }
+    if (any)
+        n->fn(n, DFS_NOTIFY_SETTLED, "");
+}
+
+static void dfs_notify_ready(struct dfs_watch *watch, uint32_t events)
+{
+    (void)events;
+    dfs_notify_poll((struct dfs_notify *)watch);
+}
+
+// Watch the tree below root and report its current contents through fn before returning.
+// Returns -1 if root cannot be watched.
+static inline int dfs_notify_start(struct dfs_loop *loop, struct dfs_notify *n, const char *root,
+                                   dfs_notify_fn fn, void *data)
+{
+    struct epoll_event ev;
+
+    memset(n, 0, sizeof(*n));
+    n->fn = fn;
+    n->data = data;
+    snprintf(n->root, sizeof(n->root), "%s", root);
+    if ((n->watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+        return -1;
+    n->watch.handler = dfs_notify_ready;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &n->watch;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, n->watch.fd, &ev) < 0)
+    {
+        close(n->watch.fd);
+        n->watch.fd = -1;
+        return -1;
+    }
+
+    dfs_notify_scan(n, "", 0);
+    if (n->ndirs == 0)
+    {
+        perror("Could not watch directory");
+        close(n->watch.fd);
+        n->watch.fd = -1;
+        return -1;
+    }
+    n->fn(n, DFS_NOTIFY_SETTLED, "");
+    return 0;
+}
+
+// Stop watching. The structure must stay allocated until the loop finished its current batch.
+static inline void dfs_notify_stop(struct dfs_notify *n)
+{
+    if (n->watch.fd >= 0)
+        close(n->watch.fd); // Also leaves the epoll set
+    n->watch.fd = -1;
+    for (int wd = 0; wd < n->ndirs; wd++)
+        free(n->dirs[wd]);
+    free(n->dirs);
+    n->dirs = NULL;
+    n->ndirs = 0;
+}
+
+#endif
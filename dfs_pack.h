@@ -0,0 +1,962 @@
+#ifndef DFS_PACK_H
+#define DFS_PACK_H
+
+// Packed storage of small files, for servers run with -k.
+//
+// A store of many small files spends more on inodes and directory entries
+// than on the files themselves, and walking it for a dtar dominates the
+// archive's time. Packing appends every file of up to DFS_PACK_OBJECT_MAX
+// bytes to a segment file instead, as a tar member: its header blocks, the
+// contents and the padding. Reading a file is one pread at its place, and a
+// dtar sends the live ranges of the segments one after the other, as they
+// are, with sendfile.
+//
+// A pack lives under $HOME/.dfs_pack/<tag>:
+//
+//   seg.<n>   segments, appended to until DFS_PACK_SEGMENT_MAX bytes, then
+//             the next one is started
+//   index     the log of where every file is:
+//
+//     A <seg> <offset> <length> <size> <mtime> <crc> <path>   path was stored as the member at offset
+//     D <path>                                               path was removed
+//     S <seg>                                                the segment was compacted away
+//
+// Paths are absolute and canonical. A member becomes visible once the
+// segment holding it and then its record are on disk, so a crash loses at
+// most uploads that were not acknowledged yet. Like the archive, every
+// process keeps an index of the live files with the log bytes it applied,
+// and takes <tag>.lock to apply whatever the log gained meanwhile.
+//
+// Removed and replaced files stay in their segment as dead space. The
+// compaction, run in the background from a timer, copies the live members
+// of a segment that is mostly dead to the end of the current one, logs
+// their new places and drops the old segment. Once the log holds many more
+// records than live files it is rewritten with one record per file.
+//
+// The pack is where its files are, nothing rebuilds it from elsewhere. An
+// unusable pack is reported and left alone, and the server stores files
+// the usual way until it is repaired.
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "dfs_loop.h"
+#include "dfs_index.h"
+#include "dfs_notify.h"
+#include "dfs_archive.h"
+#include "dfs_catalog.h"
+
+#define DFS_PACK_DIR ".dfs_pack"                    // Directory below $HOME holding the packs
+#define DFS_PACK_OBJECT_MAX (64 * 1024)             // Largest file packed, larger ones get a file of their own
+#define DFS_PACK_SEGMENT_MAX (64 * 1024 * 1024)     // Segments are not appended to past this size
+#define DFS_PACK_COMPACT_MIN (4 * 1024 * 1024)      // Dead bytes a segment keeps regardless of its live bytes
+#define DFS_PACK_LOG_MIN 4096                       // Log records always tolerated before a rewrite
+#define DFS_PACK_LOG_SHARE 2                        // Otherwise rewritten at twice as many records as live files
+#define DFS_PACK_COMPACT_PERIOD 1000                // Milliseconds between compaction passes of a server
+
+// Where a file of the pack is
+struct dfs_pack_object
+{
+    uint32_t seg;    // Segment holding the member
+    uint64_t offset; // Start of the member's header blocks in the segment
+    uint64_t length; // Header blocks, contents and padding
+    uint64_t size;   // Bytes of the file
+    int64_t mtime;   // When it was stored, seconds
+    uint32_t crc;    // CRC-32 of the contents
+    char *path;      // Absolute path of the file
+    int live;        // Still the current version of path
+};
+
+// A segment as seen by this process
+struct dfs_pack_segment
+{
+    uint32_t id;
+    int fd;          // Opened read-write, -1 until first used
+    uint64_t live;   // Bytes of live members
+    uint64_t dead;   // Bytes of replaced and removed members
+};
+
+// A run of adjacent members, sent or read as one range
+struct dfs_pack_span
+{
+    uint32_t seg;
+    int fd;          // Descriptor of the segment, shared by its spans
+    int last;        // The last span of the segment, which owns fd
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct dfs_pack
+{
+    char root[PATH_MAX];                // Directory whose files are packed, canonical
+    char dir[PATH_MAX];                 // Directory of the segments and the log
+    char log_path[PATH_MAX];            // Log of the members
+    char lock_path[PATH_MAX];           // Lock serializing all users of the pack
+    int lock_fd;                        // Lock file opened by this process
+    pid_t lock_pid;                     // Process lock_fd was opened by, locks are per open file
+    int log_fd;                         // Log the index was built from, read with pread only
+    ino_t log_ino;                      // Its inode, a rewrite puts another one in place
+    uint64_t generation;                // Log bytes applied to the index
+    uint64_t records;                   // Log records applied
+    struct dfs_pack_object *objects;    // Members in log order
+    size_t count;                       // Members in use
+    size_t cap;                         // Members allocated
+    size_t live_count;                  // Live members
+    struct dfs_map paths;               // Path -> position of its live member in objects
+    struct dfs_pack_segment *segs;      // Segments not compacted away, by id
+    size_t nsegs;
+    uint32_t next_seg;                  // Id of the next segment started
+    void (*on_change)(struct dfs_pack *p, int event, const char *path); // DFS_NOTIFY_ADD or _DEL of a file, may be NULL
+    void *data;                         // Owner specific state
+    int ready;                          // Set up successfully
+};
+
+// Take the pack lock (LOCK_SH or LOCK_EX)
+static inline int dfs_pack_lock(struct dfs_pack *p, int how)
+{
+    // flock belongs to the open file, a forked worker needs its own to exclude its siblings
+    if (p->lock_pid != getpid())
+    {
+        if (p->lock_fd >= 0)
+            close(p->lock_fd);
+        p->lock_fd = open(p->lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        p->lock_pid = getpid();
+    }
+    if (p->lock_fd < 0)
+        return -1;
+    while (flock(p->lock_fd, how) < 0)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+static inline void dfs_pack_unlock(struct dfs_pack *p)
+{
+    flock(p->lock_fd, LOCK_UN);
+}
+
+static inline void dfs_pack_seg_path(const struct dfs_pack *p, uint32_t id, char *out)
+{
+    snprintf(out, PATH_MAX, "%.4000s/seg.%u", p->dir, id);
+}
+
+// Segment id, added if it is new and add is set. NULL if there is none or out of memory.
+static inline struct dfs_pack_segment *dfs_pack_seg(struct dfs_pack *p, uint32_t id, int add)
+{
+    size_t i;
+
+    for (i = 0; i < p->nsegs && p->segs[i].id <= id; i++)
+    {
+        if (p->segs[i].id == id)
+            return &p->segs[i];
+    }
+    if (!add)
+        return NULL;
+    struct dfs_pack_segment *segs = (struct dfs_pack_segment *)realloc(p->segs, (p->nsegs + 1) * sizeof(*segs));
+    if (segs == NULL)
+        return NULL;
+    p->segs = segs;
+    memmove(&segs[i + 1], &segs[i], (p->nsegs - i) * sizeof(*segs)); // Kept sorted by id
+    p->nsegs++;
+    memset(&segs[i], 0, sizeof(*segs));
+    segs[i].id = id;
+    segs[i].fd = -1;
+    if (id >= p->next_seg)
+        p->next_seg = id + 1;
+    return &segs[i];
+}
+
+// Descriptor of a segment, opened on first use. -1 if it cannot be.
+static inline int dfs_pack_seg_fd(struct dfs_pack *p, struct dfs_pack_segment *s)
+{
+    char path[PATH_MAX];
+
+    if (s->fd < 0)
+    {
+        dfs_pack_seg_path(p, s->id, path);
+        s->fd = open(path, O_RDWR | O_CLOEXEC);
+    }
+    return s->fd;
+}
+
+// Forget the index, the next sync reloads the log from the start
+static inline void dfs_pack_reset(struct dfs_pack *p)
+{
+    for (size_t i = 0; i < p->count; i++)
+    {
+        if (p->objects[i].live && p->on_change != NULL)
+            p->on_change(p, DFS_NOTIFY_DEL, p->objects[i].path); // Reported again by the reload
+        free(p->objects[i].path);
+    }
+    for (size_t i = 0; i < p->nsegs; i++)
+    {
+        if (p->segs[i].fd >= 0)
+            close(p->segs[i].fd);
+    }
+    free(p->objects);
+    free(p->segs);
+    dfs_map_free(&p->paths);
+    p->objects = NULL;
+    p->segs = NULL;
+    p->count = p->cap = p->nsegs = p->live_count = 0;
+    p->generation = p->records = 0;
+}
+
+// Mark the live member of path dead, if there is one. Returns whether there was.
+static inline int dfs_pack_kill(struct dfs_pack *p, const char *path)
+{
+    size_t *pos = dfs_map_get(&p->paths, path);
+
+    if (pos == NULL)
+        return 0;
+    struct dfs_pack_object *o = &p->objects[*pos];
+    struct dfs_pack_segment *s = dfs_pack_seg(p, o->seg, 0);
+    o->live = 0;
+    p->live_count--;
+    if (s != NULL)
+    {
+        s->live -= o->length;
+        s->dead += o->length;
+    }
+    dfs_map_del(&p->paths, path);
+    return 1;
+}
+
+// Add a member to the index, replacing the live one of the same path
+static inline int dfs_pack_insert(struct dfs_pack *p, const struct dfs_pack_object *o)
+{
+    struct dfs_pack_segment *s = dfs_pack_seg(p, o->seg, 1);
+    int replaced;
+
+    if (s == NULL)
+        return -1;
+    if (p->count == p->cap)
+    {
+        size_t cap = p->cap ? p->cap * 2 : 256;
+        struct dfs_pack_object *objects = (struct dfs_pack_object *)realloc(p->objects, cap * sizeof(*objects));
+        if (objects == NULL)
+            return -1;
+        p->objects = objects;
+        p->cap = cap;
+    }
+    struct dfs_pack_object *slot = &p->objects[p->count];
+    *slot = *o;
+    if ((slot->path = strdup(o->path)) == NULL)
+        return -1;
+    replaced = dfs_pack_kill(p, o->path);
+    if (dfs_map_put(&p->paths, slot->path, p->count) < 0)
+    {
+        free(slot->path);
+        return -1;
+    }
+    slot->live = 1;
+    s->live += o->length;
+    p->count++;
+    p->live_count++;
+    if (!replaced && p->on_change != NULL)
+        p->on_change(p, DFS_NOTIFY_ADD, slot->path);
+    return 0;
+}
+
+// Apply one log record (without its newline)
+static inline int dfs_pack_apply(void *arg, char *record)
+{
+    struct dfs_pack *p = (struct dfs_pack *)arg;
+    struct dfs_pack_object o;
+    unsigned long long offset, length, size;
+    long long mtime;
+    unsigned int seg, crc;
+    int used = 0;
+
+    memset(&o, 0, sizeof(o));
+    p->records++;
+    if (record[0] == 'A' &&
+        sscanf(record, "A %u %llu %llu %llu %lld %u %n", &seg, &offset, &length, &size, &mtime, &crc, &used) == 6 &&
+        used > 0 && record[used] == '/' && size <= length)
+    {
+        o.seg = seg;
+        o.offset = offset;
+        o.length = length;
+        o.size = size;
+        o.mtime = mtime;
+        o.crc = crc;
+        o.path = record + used;
+        return dfs_pack_insert(p, &o);
+    }
+    if (record[0] == 'D' && record[1] == ' ')
+    {
+        if (dfs_pack_kill(p, record + 2) && p->on_change != NULL)
+            p->on_change(p, DFS_NOTIFY_DEL, record + 2);
+        return 0;
+    }
+    if (record[0] == 'S' && sscanf(record, "S %u", &seg) == 1)
+    {
+        // Its members live on elsewhere, what refers to it is dead
+        struct dfs_pack_segment *s = dfs_pack_seg(p, seg, 0);
+        if (seg >= p->next_seg)
+            p->next_seg = seg + 1;
+        if (s == NULL)
+            return 0;
+        if (s->fd >= 0)
+            close(s->fd);
+        size_t i = s - p->segs;
+        memmove(&p->segs[i], &p->segs[i + 1], (p->nsegs - i - 1) * sizeof(*p->segs));
+        p->nsegs--;
+        return 0;
+    }
+    return -1;
+}
+
+// Bring the index up to the current log. Called with the lock held, returns -1 if the
+// pack is unusable.
+static inline int dfs_pack_sync(struct dfs_pack *p)
+{
+    struct stat st;
+
+    if (!p->ready || stat(p->log_path, &st) < 0)
+        return -1;
+
+    // A rewrite replaced the log: start over with the new one
+    if (p->log_fd < 0 || st.st_ino != p->log_ino || (uint64_t)st.st_size < p->generation)
+    {
+        uint32_t next_seg = p->next_seg;
+        dfs_pack_reset(p);
+        p->next_seg = next_seg; // Ids are never used twice
+        if (p->log_fd >= 0)
+            close(p->log_fd);
+        if ((p->log_fd = open(p->log_path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(p->log_fd, &st) < 0)
+            return -1;
+        p->log_ino = st.st_ino;
+    }
+
+    // Apply the complete records added since the last sync
+    if (dfs_catalog_replay(p->log_fd, &p->generation, st.st_size, dfs_pack_apply, p) < 0)
+    {
+        fprintf(stderr, "Pack log %s is damaged\n", p->log_path);
+        dfs_pack_reset(p);
+        close(p->log_fd);
+        p->log_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Remove the segments nobody refers to: left behind by a put or a compaction that failed, or
+// without live members when the log was rewritten. Ids are never used twice, so the next one
+// is past all of them. Called with the lock held exclusively, before the workers start.
+static inline void dfs_pack_tidy(struct dfs_pack *p)
+{
+    char path[PATH_MAX];
+    struct dirent *entry;
+    unsigned int id;
+    int used;
+    DIR *dir = opendir(p->dir);
+
+    if (dir == NULL)
+        return;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        used = 0;
+        if (sscanf(entry->d_name, "seg.%u%n", &id, &used) != 1 || entry->d_name[used] != '\0')
+            continue;
+        if (id >= p->next_seg)
+            p->next_seg = id + 1;
+        if (dfs_pack_seg(p, id, 0) == NULL)
+        {
+            dfs_pack_seg_path(p, id, path);
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+// Set up the pack <tag> of the files below root. Call once before the workers start. Returns -1
+// if it cannot be used, files are then stored the usual way.
+static inline int dfs_pack_init(struct dfs_pack *p, const char *tag, const char *root)
+{
+    char dir[PATH_MAX];
+    struct stat st;
+    int fd;
+
+    memset(p, 0, sizeof(*p));
+    p->lock_fd = -1;
+    p->log_fd = -1;
+
+    // Stored paths are compared with members, so both use the canonical form of root
+    mkdir(root, S_IRWXU);
+    if (realpath(root, p->root) == NULL)
+    {
+        perror("Could not resolve pack root");
+        return -1;
+    }
+    snprintf(dir, sizeof(dir), "%s/%s", getenv("HOME"), DFS_PACK_DIR);
+    snprintf(p->dir, sizeof(p->dir), "%.4000s/%s", dir, tag);
+    if ((mkdir(dir, S_IRWXU) < 0 && errno != EEXIST) || (mkdir(p->dir, S_IRWXU) < 0 && errno != EEXIST))
+    {
+        perror("Could not create pack directory");
+        return -1;
+    }
+    snprintf(p->log_path, sizeof(p->log_path), "%.4000s/index", p->dir);
+    snprintf(p->lock_path, sizeof(p->lock_path), "%.4000s/%s.lock", dir, tag);
+    if ((fd = open(p->log_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600)) < 0)
+    {
+        perror("Could not create pack log");
+        return -1;
+    }
+    close(fd);
+
+    p->ready = 1;
+    if (dfs_pack_lock(p, LOCK_EX) < 0)
+    {
+        p->ready = 0;
+        return -1;
+    }
+    if (dfs_pack_sync(p) < 0)
+    {
+        fprintf(stderr, "Pack %s is unusable, files are stored the usual way\n", p->dir);
+        p->ready = 0;
+    }
+    else
+    {
+        // A record torn by a crash would be glued to the next one appended
+        if (stat(p->log_path, &st) == 0 && (uint64_t)st.st_size > p->generation &&
+            truncate(p->log_path, p->generation) < 0)
+            perror("Could not repair pack log");
+        dfs_pack_tidy(p);
+        printf("Pack of %s ready: %zu files in %zu segments\n", p->root, p->live_count, p->nsegs);
+    }
+    dfs_pack_unlock(p);
+    return p->ready ? 0 : -1;
+}
+
+// Canonical form of path into out, also for a file that does not exist yet. Returns 1 if the
+// pack covers it: below root.
+static inline int dfs_pack_covers(struct dfs_pack *p, const char *path, char *out)
+{
+    char dir[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    size_t root_len = strlen(p->root);
+
+    if (!p->ready || slash == NULL || slash[1] == '\0' || (size_t)(slash - path) >= sizeof(dir))
+        return 0;
+    memcpy(dir, path, slash - path);
+    dir[slash - path] = '\0';
+    if (realpath(dir[0] ? dir : "/", out) == NULL || strlen(out) + strlen(slash) >= PATH_MAX)
+        return 0;
+    strcat(out, slash);
+    return strncmp(out, p->root, root_len) == 0 && out[root_len] == '/';
+}
+
+// Whether the file at canonical path is in the pack, as of the last sync of this process
+static inline int dfs_pack_has(const struct dfs_pack *p, const char *canonical)
+{
+    return p->ready && dfs_map_get(&p->paths, canonical) != NULL;
+}
+
+// Apply what other processes changed since the last sync, reporting it to on_change
+static inline void dfs_pack_poll(struct dfs_pack *p)
+{
+    if (!p->ready || dfs_pack_lock(p, LOCK_SH) < 0)
+        return;
+    dfs_pack_sync(p);
+    dfs_pack_unlock(p);
+}
+
+// Segment a member of length bytes is appended to, its end in *end: the newest one, unless
+// the member would grow it past DFS_PACK_SEGMENT_MAX, then the next one. Called with the lock
+// held exclusively. NULL if there is none.
+static inline struct dfs_pack_segment *dfs_pack_tail(struct dfs_pack *p, uint64_t length, uint64_t *end)
+{
+    struct dfs_pack_segment *s = p->nsegs > 0 ? &p->segs[p->nsegs - 1] : NULL;
+    char path[PATH_MAX];
+    struct stat st;
+    int fd;
+
+    if (s != NULL && s->id + 1 == p->next_seg && dfs_pack_seg_fd(p, s) >= 0 && fstat(s->fd, &st) == 0 &&
+        ((uint64_t)st.st_size + length <= DFS_PACK_SEGMENT_MAX || st.st_size == 0))
+    {
+        *end = st.st_size;
+        return s;
+    }
+
+    // Whatever has the next id was left behind by a failure, nothing refers to it
+    dfs_pack_seg_path(p, p->next_seg, path);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+        return NULL;
+    if ((s = dfs_pack_seg(p, p->next_seg, 1)) == NULL)
+    {
+        close(fd);
+        unlink(path);
+        errno = ENOMEM;
+        return NULL;
+    }
+    s->fd = fd;
+    *end = 0;
+    return s;
+}
+
+// Append records to the log and make them durable, dropping what was written of them if that
+// fails. Called with the lock held exclusively.
+static inline int dfs_pack_log(struct dfs_pack *p, const char *records, size_t len)
+{
+    struct stat st;
+    int fd = open(p->log_path, O_WRONLY | O_APPEND | O_CLOEXEC), err;
+
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0)
+    {
+        err = errno; // Nothing written yet, and no size to go back to
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    if (dfs_write_full(fd, records, len) < 0 || fdatasync(fd) < 0)
+    {
+        err = errno;
+        if (ftruncate(fd, st.st_size) < 0)
+            perror("Could not repair pack log");
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// Store len bytes of data, whose CRC-32 is crc, as the file at path, replacing the version the
+// pack held, and describe it in *st. Returns 0 once the file is on disk, -1 with errno set if it
+// cannot be packed: the caller stores it the usual way.
+static inline int dfs_pack_put(struct dfs_pack *p, const char *path, const void *data, size_t len, uint32_t crc,
+                               struct stat *st)
+{
+    char canonical[PATH_MAX], record[PATH_MAX + 128];
+    unsigned char headers[DFS_TAR_HEADERS_MAX];
+    struct dfs_pack_segment *s;
+    struct iovec iov[3];
+    uint64_t end, length;
+    size_t hlen;
+    int rlen, err = 0;
+
+    if (!dfs_pack_covers(p, path, canonical) || strchr(canonical, '\n') != NULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (dfs_pack_lock(p, LOCK_EX) < 0)
+        return -1;
+    if (dfs_pack_sync(p) < 0)
+    {
+        dfs_pack_unlock(p);
+        errno = EIO;
+        return -1;
+    }
+
+    // The member as tar would write it for a file of this server's user stored now
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFREG | 0644;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_size = len;
+    st->st_mtime = time(NULL);
+    hlen = dfs_tar_headers(headers, st, canonical + 1);
+    length = hlen + len + dfs_tar_padding(len);
+    iov[0].iov_base = headers;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    iov[2].iov_base = (void *)dfs_tar_zeros;
+    iov[2].iov_len = dfs_tar_padding(len);
+
+    // The member is on disk before the record pointing at it
+    errno = 0;
+    if ((s = dfs_pack_tail(p, length, &end)) == NULL ||
+        pwritev(s->fd, iov, 3, end) != (ssize_t)length || fdatasync(s->fd) < 0)
+        err = errno ? errno : EIO;
+    else if ((rlen = snprintf(record, sizeof(record), "A %u %llu %llu %zu %lld %u %s\n", s->id,
+                              (unsigned long long)end, (unsigned long long)length, len, (long long)st->st_mtime,
+                              (unsigned int)crc, canonical)) >= (int)sizeof(record))
+        err = ENAMETOOLONG;
+    else if (dfs_pack_log(p, record, rlen) < 0)
+        err = errno;
+    if (err != 0)
+        fprintf(stderr, "Could not pack %s: %s\n", canonical, strerror(err));
+    dfs_pack_sync(p);
+    dfs_pack_unlock(p);
+    errno = err;
+    return err != 0 ? -1 : 0;
+}
+
+// Log that the file at path was removed. Returns 1 if the pack held it, 0 if not, -1 if the
+// pack is unusable.
+static inline int dfs_pack_remove(struct dfs_pack *p, const char *path)
+{
+    char canonical[PATH_MAX], record[PATH_MAX + 4];
+    int rc = 0;
+
+    if (!p->ready)
+        return -1;
+    if (!dfs_pack_covers(p, path, canonical))
+        return 0;
+    if (dfs_pack_lock(p, LOCK_EX) < 0)
+        return -1;
+    if (dfs_pack_sync(p) < 0)
+        rc = -1;
+    else if (dfs_map_get(&p->paths, canonical) != NULL)
+    {
+        int rlen = snprintf(record, sizeof(record), "D %s\n", canonical);
+        rc = dfs_pack_log(p, record, rlen) < 0 ? -1 : 1;
+        if (rc < 0)
+            perror("Could not update pack");
+        dfs_pack_sync(p);
+    }
+    dfs_pack_unlock(p);
+    return rc;
+}
+
+// Read the file at path, with a single pread, into *data (malloc'ed, the caller frees it) and
+// where it is into *o (without the path). Returns 1, 0 if the pack does not hold it or -1 if it
+// cannot be read.
+static inline int dfs_pack_get(struct dfs_pack *p, const char *path, struct dfs_pack_object *o, char **data)
+{
+    char canonical[PATH_MAX];
+    struct dfs_pack_segment *s;
+    size_t *pos;
+    int rc = 0;
+
+    if (!dfs_pack_covers(p, path, canonical) || dfs_pack_lock(p, LOCK_SH) < 0)
+        return 0;
+    if (dfs_pack_sync(p) < 0)
+        rc = -1;
+    else if ((pos = dfs_map_get(&p->paths, canonical)) != NULL)
+    {
+        // Members are never written twice, and segments are only dropped under the exclusive lock
+        *o = p->objects[*pos];
+        o->path = NULL;
+        uint64_t start = o->offset + o->length - o->size - dfs_tar_padding(o->size);
+        if ((s = dfs_pack_seg(p, o->seg, 0)) == NULL || dfs_pack_seg_fd(p, s) < 0 ||
+            (*data = (char *)malloc(o->size > 0 ? o->size : 1)) == NULL)
+            rc = -1;
+        else if (pread(s->fd, *data, o->size, start) != (ssize_t)o->size)
+        {
+            free(*data);
+            rc = -1;
+        }
+        else
+            rc = 1;
+    }
+    dfs_pack_unlock(p);
+    return rc;
+}
+
+// Call fn for every file of the pack, as of the last sync of this process
+static inline void dfs_pack_each(struct dfs_pack *p, void (*fn)(const struct dfs_pack_object *o, void *data),
+                                 void *data)
+{
+    for (size_t i = 0; i < p->count; i++)
+    {
+        if (p->objects[i].live)
+            fn(&p->objects[i], data);
+    }
+}
+
+// Call fn with the name of every packed file directly in directory dir, after taking in the
+// changes of other processes
+static inline void dfs_pack_list(struct dfs_pack *p, const char *dir, void (*fn)(const char *name, void *data),
+                                 void *data)
+{
+    char canonical[PATH_MAX];
+    size_t len;
+
+    if (!p->ready || realpath(dir, canonical) == NULL)
+        return;
+    dfs_pack_poll(p);
+    len = strlen(canonical);
+    for (size_t i = 0; i < p->count; i++)
+    {
+        const char *path = p->objects[i].path;
+        if (p->objects[i].live && strncmp(path, canonical, len) == 0 && path[len] == '/' &&
+            strchr(path + len + 1, '/') == NULL)
+            fn(path + len + 1, data);
+    }
+}
+
+static inline int dfs_pack_span_cmp(const void *a, const void *b)
+{
+    const struct dfs_pack_span *x = (const struct dfs_pack_span *)a, *y = (const struct dfs_pack_span *)b;
+
+    if (x->seg != y->seg)
+        return x->seg < y->seg ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static inline void dfs_pack_spans_free(struct dfs_pack_span *spans, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        if (spans[i].last)
+            close(spans[i].fd);
+    }
+    free(spans);
+}
+
+// The members of the files below root, within max_depth levels of subdirectories (-1 for all)
+// and picked by keep (by their path below root) unless it is NULL, as runs of adjacent members
+// in segment order. The runs hold descriptors of their own, the members stay readable whatever
+// the pack does meanwhile. Returns the number of runs in *spans and their bytes in *total, or
+// -1 if the pack is unusable.
+static inline ssize_t dfs_pack_snapshot(struct dfs_pack *p, int max_depth, int (*keep)(const char *name, void *data),
+                                        void *keep_data, struct dfs_pack_span **spans, uint64_t *total)
+{
+    struct dfs_pack_span *out = NULL;
+    size_t root_len = strlen(p->root), n = 0, runs = 0;
+    int failed = 0;
+
+    if (!p->ready || dfs_pack_lock(p, LOCK_SH) < 0)
+        return -1;
+    if (dfs_pack_sync(p) < 0 ||
+        (p->live_count > 0 && (out = (struct dfs_pack_span *)malloc(p->live_count * sizeof(*out))) == NULL))
+    {
+        dfs_pack_unlock(p);
+        return -1;
+    }
+    *total = 0;
+    for (size_t i = 0; i < p->count; i++)
+    {
+        struct dfs_pack_object *o = &p->objects[i];
+        const char *name = o->path + root_len + 1;
+        int depth = 0;
+
+        for (const char *c = name; *c; c++)
+            depth += *c == '/';
+        if (!o->live || (max_depth >= 0 && depth > max_depth) || (keep != NULL && !keep(name, keep_data)))
+            continue;
+        out[n].seg = o->seg;
+        out[n].offset = o->offset;
+        out[n].length = o->length;
+        *total += o->length;
+        n++;
+    }
+
+    // Adjacent members go out as one range, each segment with a descriptor of its own
+    if (n > 0)
+        qsort(out, n, sizeof(*out), dfs_pack_span_cmp);
+    for (size_t i = 0; i < n && !failed; i++)
+    {
+        if (runs > 0 && out[runs - 1].seg == out[i].seg && out[runs - 1].offset + out[runs - 1].length == out[i].offset)
+        {
+            out[runs - 1].length += out[i].length;
+            continue;
+        }
+        if (runs > 0 && out[runs - 1].seg == out[i].seg)
+        {
+            out[runs] = out[i];
+            out[runs].fd = out[runs - 1].fd;
+            out[runs - 1].last = 0;
+            out[runs++].last = 1;
+            continue;
+        }
+        struct dfs_pack_segment *s = dfs_pack_seg(p, out[i].seg, 0);
+        out[runs] = out[i];
+        out[runs].last = 1;
+        if (s == NULL || dfs_pack_seg_fd(p, s) < 0 || (out[runs].fd = dup(s->fd)) < 0)
+            failed = 1;
+        else
+            runs++;
+    }
+    dfs_pack_unlock(p);
+    if (failed)
+    {
+        dfs_pack_spans_free(out, runs);
+        return -1;
+    }
+    *spans = out;
+    return (ssize_t)runs;
+}
+
+// Queue the members dfs_pack_snapshot picks as one DFS_F_MORE frame of an archive reply, the
+// caller queues the rest of the archive and its end. Nothing is queued without members.
+// Returns -1 if the pack is unusable.
+static inline int dfs_pack_send(struct dfs_pack *p, struct dfs_conn *conn, uint8_t opcode, uint32_t req_id,
+                                int max_depth, int (*keep)(const char *name, void *data), void *keep_data)
+{
+    struct dfs_pack_span *spans;
+    uint64_t total;
+    ssize_t n = dfs_pack_snapshot(p, max_depth, keep, keep_data, &spans, &total);
+
+    if (n < 0)
+        return -1;
+    if (n > 0)
+    {
+        dfs_conn_write_hdr(conn, opcode, DFS_F_REPLY | DFS_F_MORE, 0, req_id, 0, total);
+        for (ssize_t i = 0; i < n; i++)
+        {
+            if (spans[i].last)
+                dfs_conn_write_file(conn, spans[i].fd, spans[i].offset, spans[i].length); // Closes the fd
+            else
+                dfs_conn_write_file_range(conn, spans[i].fd, spans[i].offset, spans[i].length);
+        }
+        printf("Pack of %s queued: %llu bytes in %zd ranges\n", p->root, (unsigned long long)total, n);
+    }
+    free(spans);
+    return 0;
+}
+
+// Append a record to a growing buffer of records, freed by the caller
+static inline int dfs_pack_record(char **buf, size_t *len, size_t *cap, const char *record, size_t rlen)
+{
+    if (*len + rlen > *cap)
+    {
+        size_t want = *cap ? *cap * 2 : 65536;
+        while (want < *len + rlen)
+            want *= 2;
+        char *grown = (char *)realloc(*buf, want);
+        if (grown == NULL)
+            return -1;
+        *buf = grown;
+        *cap = want;
+    }
+    memcpy(*buf + *len, record, rlen);
+    *len += rlen;
+    return 0;
+}
+
+// Write the log afresh with one record per file and put it in place. Called with the lock held
+// exclusively.
+static inline int dfs_pack_rewrite(struct dfs_pack *p)
+{
+    char tmp[PATH_MAX + 8], record[PATH_MAX + 128];
+    int fd, ok = 1;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", p->log_path);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+        return -1;
+    for (size_t i = 0; ok && i < p->count; i++)
+    {
+        struct dfs_pack_object *o = &p->objects[i];
+        if (!o->live)
+            continue;
+        int rlen = snprintf(record, sizeof(record), "A %u %llu %llu %llu %lld %u %s\n", o->seg,
+                            (unsigned long long)o->offset, (unsigned long long)o->length,
+                            (unsigned long long)o->size, (long long)o->mtime, (unsigned int)o->crc, o->path);
+        ok = dfs_write_full(fd, record, rlen) == 0;
+    }
+    if (!ok || fsync(fd) < 0 || rename(tmp, p->log_path) < 0)
+    {
+        perror("Could not rewrite pack log");
+        unlink(tmp);
+        ok = 0;
+    }
+    close(fd);
+    return ok && dfs_pack_sync(p) == 0 ? 0 : -1;
+}
+
+// Move the live members of segment id to the newest segment and drop it. Called with the lock
+// held exclusively.
+static inline int dfs_pack_move(struct dfs_pack *p, uint32_t id)
+{
+    char path[PATH_MAX], record[PATH_MAX + 128], *records = NULL;
+    struct dfs_pack_segment *s = dfs_pack_seg(p, id, 0), *tail = NULL;
+    size_t len = 0, cap = 0;
+    uint64_t end, moved = 0;
+    int from, ok = 1;
+
+    if (s == NULL || (from = dfs_pack_seg_fd(p, s)) < 0)
+        return -1;
+    for (size_t i = 0; ok && i < p->count; i++)
+    {
+        struct dfs_pack_object *o = &p->objects[i];
+        if (!o->live || o->seg != id)
+            continue;
+
+        // A segment filled up is synced before the next one is started
+        struct dfs_pack_segment *next = dfs_pack_tail(p, o->length, &end);
+        if (next != tail && tail != NULL && fdatasync(tail->fd) < 0)
+            ok = 0;
+        if ((tail = next) == NULL || dfs_archive_copy(from, o->offset, tail->fd, end, o->length) != o->length)
+        {
+            ok = 0;
+            break;
+        }
+        int rlen = snprintf(record, sizeof(record), "A %u %llu %llu %llu %lld %u %s\n", tail->id,
+                            (unsigned long long)end, (unsigned long long)o->length, (unsigned long long)o->size,
+                            (long long)o->mtime, (unsigned int)o->crc, o->path);
+        ok = dfs_pack_record(&records, &len, &cap, record, rlen) == 0;
+        moved += o->length;
+    }
+
+    // The members are on disk in their new place before the log says so, the old segment goes last
+    int rlen = snprintf(record, sizeof(record), "S %u\n", id);
+    if (!ok || (tail != NULL && fdatasync(tail->fd) < 0) || dfs_pack_record(&records, &len, &cap, record, rlen) < 0 ||
+        dfs_pack_log(p, records, len) < 0)
+    {
+        perror("Could not compact pack");
+        free(records);
+        return -1;
+    }
+    free(records);
+    dfs_pack_seg_path(p, id, path);
+    unlink(path);
+    printf("Pack of %s compacted: segment %u dropped, %llu bytes moved\n", p->root, id, (unsigned long long)moved);
+    return dfs_pack_sync(p);
+}
+
+// One pass of the compaction, run from a timer: drop the segments without live members and
+// move the members of the one with the most dead bytes if it is mostly dead, then rewrite the
+// log if most of its records are of dead members. Returns 1 if it changed anything.
+static inline int dfs_pack_compact(struct dfs_pack *p)
+{
+    int changed = 0;
+
+    if (!p->ready || dfs_pack_lock(p, LOCK_EX) < 0)
+        return 0;
+    if (dfs_pack_sync(p) < 0)
+    {
+        dfs_pack_unlock(p);
+        return 0;
+    }
+
+    // The newest segment is appended to, it stays whatever it holds
+    for (int again = 1; again;)
+    {
+        struct dfs_pack_segment *victim = NULL;
+
+        again = 0;
+        for (size_t i = 0; i < p->nsegs; i++)
+        {
+            struct dfs_pack_segment *s = &p->segs[i];
+            if (s->id + 1 == p->next_seg)
+                continue;
+            if (s->live == 0)
+            {
+                victim = s; // Costs nothing to drop
+                break;
+            }
+            if (s->dead > DFS_PACK_COMPACT_MIN && s->dead > s->live && (victim == NULL || s->dead > victim->dead))
+                victim = s;
+        }
+        if (victim == NULL)
+            break;
+        again = victim->live == 0; // One segment with members to move per pass, the lock is held meanwhile
+        if (dfs_pack_move(p, victim->id) < 0)
+            break;
+        changed = 1;
+    }
+    if (p->records > DFS_PACK_LOG_MIN && p->records > p->live_count * DFS_PACK_LOG_SHARE && dfs_pack_rewrite(p) == 0)
+    {
+        printf("Pack log of %s rewritten: %zu files\n", p->root, p->live_count);
+        changed = 1;
+    }
+    dfs_pack_unlock(p);
+    return changed;
+}
+
+#endif
@@ -0,0 +1,524 @@
+#ifndef DFS_POOL_H
+#define DFS_POOL_H
+
+// Persistent, pipelined connections from Smain to the storage servers.
+//
+// A dfs_backend keeps DFS_POOL_LINKS connections open to one server, opened
+// as soon as the backend is first looked up. A request travels as a
+// dfs_call on the least loaded connection. Any number of calls may be in
+// flight on a connection; the server answers them in order and replies are
+// matched to their call by request id.
+//
+// Idle connections are health checked with PING. A connection that fails,
+// or whose health check goes unanswered, is closed and reopened with
+// exponential backoff. The calls that were in flight on it fail.
+//
+// A call may carry a deadline for the start of its reply. A call still
+// unanswered at its deadline fails with ETIMEDOUT; a stand-in takes its
+// place on the connection and swallows the late reply, so the connection
+// and the calls behind it are not disturbed. A connection whose server sends
+// nothing for DFS_STALL_TIMEOUT while calls wait on it is closed, which fails
+// them: a stalled server cannot hold its callers forever.
+//
+// Each backend keeps a moving average of how long its replies take to
+// start, for requests without a body (those wait for their sender as well); with the calls in flight it makes dfs_backend_cost, which callers
+// use to choose among servers holding the same data. The last few of those
+// times also give dfs_backend_p95, for callers deciding when a reply is late.
+//
+// Pooled connections and their timer run in the background: they never
+// keep a loop alive on their own.
+
+#include <stddef.h>
+#include "dfs_loop.h"
+
+#define DFS_POOL_LINKS 4          // Connections kept open to each backend
+#define DFS_POOL_MAX_BACKENDS 16  // Backends a process can talk to
+#define DFS_POOL_TICK 250         // Milliseconds between housekeeping passes
+#define DFS_PING_IDLE 2000        // Idle milliseconds before a connection is health checked
+#define DFS_PING_TIMEOUT 3000     // Milliseconds a connect or health check may take
+#define DFS_RECONNECT_MIN 100     // First reconnect delay in milliseconds, doubled per failure
+#define DFS_RECONNECT_MAX 5000    // Upper bound of the reconnect delay
+#define DFS_STALL_TIMEOUT 15000   // Milliseconds a connection with calls in flight may go without input
+#define DFS_LATENCY_INIT 1000     // Microseconds assumed for a backend before its first reply
+#define DFS_LATENCY_SAMPLES 64    // Reply times dfs_backend_p95 is taken over
+
+struct dfs_call;
+struct dfs_link;
+struct dfs_backend;
+
+// Callbacks of a call
+struct dfs_call_ops
+{
+    void (*on_frame)(struct dfs_call *call, struct dfs_hdr *hdr, char **argv); // A reply frame header arrived
+    void (*on_body)(struct dfs_call *call, const char *data, size_t len);      // Part of that frame's body
+    void (*on_end)(struct dfs_call *call, int status, int failed);             // Last frame done or the call failed
+};
+
+// One request in flight. The owner embeds it in its own state and gets
+// exactly one on_end, after which the pool no longer refers to the call.
+struct dfs_call
+{
+    const struct dfs_call_ops *ops; // Callbacks
+    struct dfs_link *link;          // Connection carrying the call, NULL once ended
+    struct dfs_call *next;          // Next call in flight on the same connection
+    uint32_t req_id;                // Id of the request on that connection
+    struct dfs_hdr hdr;             // Reply frame being received
+    int64_t deadline;               // dfs_now_ms() by which the reply must start, 0 for none
+    int64_t sent_us;                // dfs_now_us() when the request was sent
+    int timed;                      // The time to the reply tells how fast the server is: the request had no body
+    int answered;                   // A reply frame arrived
+};
+
+// One pooled connection
+struct dfs_link
+{
+    struct dfs_backend *backend;   // Server the connection goes to
+    struct dfs_conn *conn;         // NULL while disconnected
+    int up;                        // Connect finished
+    struct dfs_call *head;         // Calls in flight, oldest first
+    struct dfs_call *tail;
+    int inflight;                  // Number of calls in flight
+    struct dfs_call *current;      // Call whose reply frame is being received
+    int64_t last_active;           // When a request was last sent or a reply byte received
+    int64_t last_input;            // When the server last sent anything, or was given work while idle
+    uint64_t seen_bytes;           // conn->in_bytes when last_input was taken
+    int64_t retry_at;              // When to reconnect after a failure
+    int backoff;                   // Current reconnect delay
+    struct dfs_call ping;          // Health check
+    int ping_pending;              // The health check is in flight
+};
+
+struct dfs_backend
+{
+    struct dfs_loop *loop;                 // Reactor running the connections
+    char ip[64];                           // Address of the server
+    int port;
+    uint32_t next_req_id;                  // Id of the next request
+    int64_t latency_us;                    // Moving average of the time to a reply's first frame
+    uint32_t samples[DFS_LATENCY_SAMPLES]; // Latest of those times, health checks left out
+    unsigned nsamples;                     // Times recorded, the oldest is overwritten
+    struct dfs_link links[DFS_POOL_LINKS]; // The pooled connections
+    struct dfs_timer timer;                // Housekeeping: reconnects and health checks
+};
+
+static struct dfs_backend *dfs_backends[DFS_POOL_MAX_BACKENDS]; // Backends of this process
+static int dfs_nbackends;
+
+static void dfs_link_connect(struct dfs_conn *conn, int err);
+static void dfs_link_frame(struct dfs_conn *conn, struct dfs_hdr *hdr, char **argv);
+static void dfs_link_body(struct dfs_conn *conn, const char *data, size_t len);
+static void dfs_link_body_end(struct dfs_conn *conn);
+static void dfs_link_close(struct dfs_conn *conn);
+
+// Callbacks of pooled connections
+static const struct dfs_conn_ops dfs_link_ops = {dfs_link_connect, dfs_link_frame, dfs_link_body,
+                                                 dfs_link_body_end, NULL, dfs_link_close};
+
+// Microseconds on the monotonic clock
+static inline int64_t dfs_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Start (re)connecting a link
+static inline void dfs_link_open(struct dfs_link *link)
+{
+    struct dfs_backend *b = link->backend;
+
+    link->up = 0;
+    link->last_active = dfs_now_ms();
+    link->seen_bytes = 0;
+    link->conn = dfs_conn_connect(b->loop, b->ip, b->port, &dfs_link_ops, link);
+    if (link->conn != NULL)
+        dfs_conn_set_background(link->conn);
+    else
+        link->retry_at = link->last_active + link->backoff;
+}
+
+static void dfs_link_connect(struct dfs_conn *conn, int err)
+{
+    struct dfs_link *link = (struct dfs_link *)conn->data;
+
+    if (err != 0)
+        return; // Failed, handled by dfs_link_close
+    link->up = 1;
+    link->backoff = DFS_RECONNECT_MIN;
+    link->last_active = dfs_now_ms();
+}
+
+// Take a call off its link's list
+static inline void dfs_link_unlink(struct dfs_link *link, struct dfs_call *call)
+{
+    struct dfs_call **pp = &link->head;
+
+    while (*pp != NULL && *pp != call)
+        pp = &(*pp)->next;
+    if (*pp == NULL)
+        return;
+    *pp = call->next;
+    if (link->tail == call)
+    {
+        link->tail = NULL;
+        for (struct dfs_call *c = link->head; c != NULL; c = c->next)
+            link->tail = c;
+    }
+    if (link->current == call)
+        link->current = NULL;
+    call->next = NULL;
+    call->link = NULL;
+    link->inflight--;
+}
+
+static void dfs_link_frame(struct dfs_conn *conn, struct dfs_hdr *hdr, char **argv)
+{
+    struct dfs_link *link = (struct dfs_link *)conn->data;
+    struct dfs_call *call = link->head;
+
+    (void)argv;
+    link->last_active = dfs_now_ms();
+
+    // Replies come back in order, the id tells which call a frame belongs to
+    while (call != NULL && call->req_id != hdr->req_id)
+        call = call->next;
+    if (call == NULL || !(hdr->flags & DFS_F_REPLY))
+    {
+        fprintf(stderr, "Unexpected frame from %s:%d, closing connection\n", link->backend->ip, link->backend->port);
+        dfs_conn_close(conn);
+        return;
+    }
+
+    link->current = call;
+    call->hdr = *hdr;
+    if (!call->answered && call->timed)
+    {
+        // Weight 1/8, so a few slow replies show but one outlier does not dominate. Health
+        // checks count too, they keep the average of idle servers current.
+        struct dfs_backend *b = link->backend;
+        int64_t elapsed = dfs_now_us() - call->sent_us;
+        b->latency_us += (elapsed - b->latency_us) / 8;
+        if (call != &link->ping)
+            b->samples[b->nsamples++ % DFS_LATENCY_SAMPLES] = elapsed < UINT32_MAX ? (uint32_t)elapsed : UINT32_MAX;
+    }
+    call->answered = 1;
+    if (call->ops->on_frame)
+        call->ops->on_frame(call, hdr, argv);
+}
+
+static void dfs_link_body(struct dfs_conn *conn, const char *data, size_t len)
+{
+    struct dfs_link *link = (struct dfs_link *)conn->data;
+
+    link->last_active = dfs_now_ms();
+    if (link->current != NULL && link->current->ops->on_body)
+        link->current->ops->on_body(link->current, data, len);
+}
+
+static void dfs_link_body_end(struct dfs_conn *conn)
+{
+    struct dfs_link *link = (struct dfs_link *)conn->data;
+    struct dfs_call *call = link->current;
+
+    if (call == NULL || (call->hdr.flags & DFS_F_MORE))
+        return; // More frames follow for this call
+    dfs_link_unlink(link, call);
+    call->ops->on_end(call, call->hdr.status, 0);
+}
+
+// The connection failed: fail its calls and reconnect later
+static void dfs_link_close(struct dfs_conn *conn)
+{
+    struct dfs_link *link = (struct dfs_link *)conn->data;
+    struct dfs_call *calls = link->head;
+
+    if (link->up)
+        fprintf(stderr, "Connection to %s:%d lost\n", link->backend->ip, link->backend->port);
+    link->conn = NULL;
+    link->up = 0;
+    link->head = link->tail = link->current = NULL;
+    link->inflight = 0;
+    link->ping_pending = 0;
+    link->retry_at = dfs_now_ms() + link->backoff;
+    link->backoff = link->backoff * 2 < DFS_RECONNECT_MAX ? link->backoff * 2 : DFS_RECONNECT_MAX;
+
+    // The list is detached first: a failing call may start another one
+    while (calls != NULL)
+    {
+        struct dfs_call *call = calls;
+        calls = call->next;
+        call->next = NULL;
+        call->link = NULL;
+        call->ops->on_end(call, EHOSTUNREACH, 1);
+    }
+}
+
+static void dfs_ping_end(struct dfs_call *call, int status, int failed)
+{
+    struct dfs_link *link = (struct dfs_link *)((char *)call - offsetof(struct dfs_link, ping));
+
+    (void)status;
+    (void)failed;
+    link->ping_pending = 0;
+}
+
+static const struct dfs_call_ops dfs_ping_ops = {NULL, NULL, dfs_ping_end};
+
+static void dfs_sink_end(struct dfs_call *call, int status, int failed)
+{
+    (void)status;
+    (void)failed;
+    free(call);
+}
+
+// Stand-ins of expired calls, they discard the reply
+static const struct dfs_call_ops dfs_sink_ops = {NULL, NULL, dfs_sink_end};
+
+// Fail a call whose reply did not start by its deadline. A stand-in takes its place
+// on the link so the late reply is recognized and dropped.
+static inline void dfs_link_expire(struct dfs_link *link, struct dfs_call *call)
+{
+    struct dfs_call *sink = (struct dfs_call *)calloc(1, sizeof(*sink));
+    struct dfs_call **pp = &link->head;
+
+    if (sink == NULL)
+        return; // Tried again on the next tick
+    while (*pp != call)
+        pp = &(*pp)->next;
+    sink->ops = &dfs_sink_ops;
+    sink->link = link;
+    sink->req_id = call->req_id;
+    sink->sent_us = call->sent_us; // The late reply still counts towards the latency
+    sink->timed = call->timed;
+    sink->next = call->next;
+    *pp = sink;
+    if (link->tail == call)
+        link->tail = sink;
+
+    call->next = NULL;
+    call->link = NULL;
+    call->ops->on_end(call, ETIMEDOUT, 1);
+}
+
+// Queue a request on a link
+static inline void dfs_link_send(struct dfs_link *link, struct dfs_call *call, uint8_t opcode, int argc,
+                                 const char **argv, uint64_t bodylen)
+{
+    call->link = link;
+    call->next = NULL;
+    call->req_id = ++link->backend->next_req_id;
+    call->answered = 0;
+    call->sent_us = dfs_now_us();
+    call->timed = bodylen == 0;
+    if (link->tail)
+        link->tail->next = call;
+    else
+        link->head = call;
+    link->tail = call;
+    link->last_active = dfs_now_ms();
+    if (link->inflight++ == 0)
+        link->last_input = link->last_active; // Silence while idle was no stall
+    dfs_conn_send_request(link->conn, opcode, call->req_id, argc, argv, bodylen);
+}
+
+// The link waits for its server, not for us: its requests went out in full and
+// nothing holds back reading the replies
+static inline int dfs_link_waiting(const struct dfs_link *link)
+{
+    const struct dfs_conn *conn = link->conn;
+
+    return !conn->read_paused && conn->out_head == NULL && (conn->splice_out == NULL || conn->splice_out->in_pipe == 0);
+}
+
+// Housekeeping: reconnect failed links, health check idle ones, recycle stuck ones
+static void dfs_backend_tick(struct dfs_timer *timer)
+{
+    struct dfs_backend *b = (struct dfs_backend *)timer->data;
+    int64_t now = dfs_now_ms();
+
+    for (int i = 0; i < DFS_POOL_LINKS; i++)
+    {
+        struct dfs_link *link = &b->links[i];
+
+        // Give up on calls that are still waiting for their reply at their deadline
+        for (struct dfs_call *call = link->head; call != NULL && link->conn != NULL;)
+        {
+            struct dfs_call *next = call->next;
+            if (call->deadline != 0 && !call->answered && now >= call->deadline)
+                dfs_link_expire(link, call);
+            call = next;
+        }
+
+        if (link->conn != NULL && link->conn->in_bytes != link->seen_bytes)
+        {
+            link->seen_bytes = link->conn->in_bytes;
+            link->last_input = now;
+        }
+
+        if (link->conn == NULL)
+        {
+            if (now >= link->retry_at)
+                dfs_link_open(link);
+        }
+        else if (!link->up || link->ping_pending)
+        {
+            if (now - link->last_active > DFS_PING_TIMEOUT)
+            {
+                fprintf(stderr, "%s:%d not answering, reconnecting\n", b->ip, b->port);
+                dfs_conn_close(link->conn);
+            }
+        }
+        else if (link->inflight > 0)
+        {
+            if (!dfs_link_waiting(link))
+            {
+                link->last_input = now; // Held back by us, not stalled
+            }
+            else if (now - link->last_input > DFS_STALL_TIMEOUT)
+            {
+                fprintf(stderr, "%s:%d stalled, reconnecting\n", b->ip, b->port);
+                dfs_conn_close(link->conn);
+            }
+        }
+        else if (now - link->last_active >= DFS_PING_IDLE)
+        {
+            link->ping_pending = 1;
+            link->ping.ops = &dfs_ping_ops;
+            dfs_link_send(link, &link->ping, DFS_OP_PING, 0, NULL, 0);
+        }
+    }
+}
+
+// The pool of a server, created and connected on first use
+static inline struct dfs_backend *dfs_pool_get(struct dfs_loop *loop, const char *ip, int port)
+{
+    struct dfs_backend *b;
+
+    for (int i = 0; i < dfs_nbackends; i++)
+    {
+        b = dfs_backends[i];
+        if (b->loop == loop && b->port == port && strcmp(b->ip, ip) == 0)
+            return b;
+    }
+    if (dfs_nbackends == DFS_POOL_MAX_BACKENDS || (b = (struct dfs_backend *)calloc(1, sizeof(*b))) == NULL)
+        return NULL;
+
+    b->loop = loop;
+    snprintf(b->ip, sizeof(b->ip), "%s", ip);
+    b->port = port;
+    b->latency_us = DFS_LATENCY_INIT;
+    for (int i = 0; i < DFS_POOL_LINKS; i++)
+    {
+        b->links[i].backend = b;
+        b->links[i].backoff = DFS_RECONNECT_MIN;
+        dfs_link_open(&b->links[i]); // Pre-warmed: requests find the connections ready
+    }
+    if (dfs_timer_start(loop, &b->timer, DFS_POOL_TICK, dfs_backend_tick, b) < 0)
+        perror("timerfd failed"); // Links are still reopened on demand
+
+    dfs_backends[dfs_nbackends++] = b;
+    return b;
+}
+
+// What a call to a backend is expected to cost: the time its replies take to
+// start, scaled by the calls already waiting for it. INT64_MAX while the server
+// is unreachable.
+static inline int64_t dfs_backend_cost(const struct dfs_backend *b)
+{
+    int up = 0, inflight = 0;
+
+    for (int i = 0; i < DFS_POOL_LINKS; i++)
+    {
+        up |= b->links[i].up;
+        inflight += b->links[i].inflight - b->links[i].ping_pending;
+    }
+    if (!up)
+        return INT64_MAX;
+    return (b->latency_us + 1) * (inflight + 1);
+}
+
+// 95th percentile of the time the latest replies of a backend took to start, in
+// microseconds. -1 while too few replies arrived to tell.
+static inline int64_t dfs_backend_p95(const struct dfs_backend *b)
+{
+    uint32_t sorted[DFS_LATENCY_SAMPLES]; // The samples in ascending order
+    unsigned n = b->nsamples < DFS_LATENCY_SAMPLES ? b->nsamples : DFS_LATENCY_SAMPLES;
+
+    if (n < DFS_LATENCY_SAMPLES / 4)
+        return -1;
+    for (unsigned i = 0; i < n; i++)
+    {
+        unsigned j = i;
+        for (; j > 0 && sorted[j - 1] > b->samples[i]; j--)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = b->samples[i];
+    }
+    return sorted[(n * 95 - 1) / 100];
+}
+
+// Send a request on the least loaded connection of a backend. The caller queues
+// bodylen body bytes on call->link->conn right away. Returns -1 if the server is
+// unreachable.
+static inline int dfs_pool_call(struct dfs_backend *b, struct dfs_call *call, uint8_t opcode, int argc,
+                                const char **argv, uint64_t bodylen)
+{
+    struct dfs_link *best = NULL;
+
+    for (int i = 0; i < DFS_POOL_LINKS; i++)
+    {
+        struct dfs_link *link = &b->links[i];
+
+        if (link->conn == NULL && dfs_now_ms() >= link->retry_at)
+            dfs_link_open(link); // Try early rather than fail the request
+        if (link->conn == NULL)
+            continue;
+        // Established connections first, then the fewest calls in flight
+        if (best == NULL || (link->up && !best->up) ||
+            (link->up == best->up && link->inflight < best->inflight))
+            best = link;
+    }
+    if (best == NULL)
+    {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    dfs_link_send(best, call, opcode, argc, argv, bodylen);
+    return 0;
+}
+
+// Move the body of the reply frame being received straight to another connection,
+// see dfs_conn_splice. Called from on_frame, returns -1 if on_body gets it instead.
+static inline int dfs_call_splice(struct dfs_call *call, struct dfs_conn *dst)
+{
+    if (call->link == NULL || call->link->conn == NULL)
+        return -1;
+    return dfs_conn_splice(call->link->conn, dst);
+}
+
+// Send the rest of the frame body src is receiving as the body of a call's request,
+// see dfs_conn_splice. Called from src's on_frame right after dfs_pool_call.
+static inline int dfs_call_splice_body(struct dfs_call *call, struct dfs_conn *src)
+{
+    if (call->link == NULL || call->link->conn == NULL)
+        return -1;
+    return dfs_conn_splice(src, call->link->conn);
+}
+
+// Stop receiving the reply of a call while its consumer is congested. This
+// also holds back the replies queued behind it on the same connection.
+static inline void dfs_call_pause(struct dfs_call *call)
+{
+    if (call->link != NULL && call->link->conn != NULL)
+        dfs_conn_pause_read(call->link->conn);
+}
+
+// Continue receiving the reply of a call
+static inline void dfs_call_resume(struct dfs_call *call)
+{
+    if (call->link != NULL && call->link->conn != NULL)
+        dfs_conn_resume_read(call->link->conn);
+}
+
+#endif
@@ -0,0 +1,321 @@
+#ifndef DFS_PROTO_H
+#define DFS_PROTO_H
+
+// Binary framing shared by Smain, Spdf, Stext and client24s.
+//
+// Every message on every hop is a frame: a fixed 24-byte header followed by
+// `length` payload bytes. The first `arglen` payload bytes are the request
+// arguments (NUL-terminated strings back to back), the rest is the body
+// (file contents, tarball, listing text, ...). All integers are big endian.
+//
+//   0  u16 magic     DFS_MAGIC
+//   2  u8  version   DFS_VERSION
+//   3  u8  opcode    DFS_OP_*
+//   4  u16 flags     DFS_F_*
+//   6  u16 status    0 on success, otherwise an errno value (replies only)
+//   8  u32 req_id    echoed back in every reply frame for that request
+//  12  u32 arglen    bytes of arguments at the start of the payload
+//  16  u64 length    total payload bytes (arguments + body)
+//
+// A reply may be split over several frames; every frame except the last one
+// carries DFS_F_MORE. Because lengths are explicit, a connection can carry
+// any number of requests back to back.
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#define DFS_MAGIC 0x4446    // "DF"
+#define DFS_VERSION 1       // Bumped on incompatible header changes
+#define DFS_HDR_SIZE 24     // Size of the packed frame header
+#define DFS_MAX_ARGLEN 4096 // Upper bound on the argument block of a frame
+#define DFS_MAX_ARGS 8      // Upper bound on the number of arguments
+
+// Opcodes
+#define DFS_OP_UFILE 1   // args: filename, destination path[, upload id, offset, total size]; body: file
+                         // contents, or the part at offset of a file sent in ranges (see dfs_range.h)
+#define DFS_OP_DFILE 2   // args: path[, offset, length]; reply body: file contents, or that range of them;
+                         // reply args of a range: size of the whole file
+#define DFS_OP_RMFILE 3  // args: path
+#define DFS_OP_DTAR 4    // args: filetype[, "part" for a tarball without its end blocks, or "gzip" for it
+                         // compressed, as multi-member gzip]; body: hash ranges of the files wanted (see
+                         // dfs_route.h), all if empty; reply body: tarball
+#define DFS_OP_DISPLAY 5 // args: path; reply body: listing text
+#define DFS_OP_PING 6    // no args; empty reply, health check of a pooled connection
+#define DFS_OP_WATCH 7   // no args; endless reply (DFS_F_MORE frames) of change records of a store
+#define DFS_OP_STAT 8    // args: filename, destination path, upload id, offset; reply args: bytes of that
+                         // upload held from offset on (see dfs_range.h)
+
+// Flags
+#define DFS_F_REPLY 0x0001 // Frame is a reply to the request with the same id
+#define DFS_F_MORE 0x0002  // Further frames follow for the same request id
+
+struct dfs_hdr
+{
+    uint8_t version;  // Protocol version of the sender
+    uint8_t opcode;   // DFS_OP_* of the request
+    uint16_t flags;   // DFS_F_* bits
+    uint16_t status;  // 0 or errno value
+    uint32_t req_id;  // Request id chosen by the requester
+    uint32_t arglen;  // Argument bytes at the start of the payload
+    uint64_t length;  // Total payload bytes
+};
+
+// Serialize a header into its 24-byte wire form
+static inline void dfs_pack_hdr(const struct dfs_hdr *hdr, unsigned char *out)
+{
+    uint16_t v16;
+    uint32_t v32;
+    uint64_t v64;
+
+    v16 = htobe16(DFS_MAGIC);
+    memcpy(out, &v16, 2);
+    out[2] = DFS_VERSION;
+    out[3] = hdr->opcode;
+    v16 = htobe16(hdr->flags);
+    memcpy(out + 4, &v16, 2);
+    v16 = htobe16(hdr->status);
+    memcpy(out + 6, &v16, 2);
+    v32 = htobe32(hdr->req_id);
+    memcpy(out + 8, &v32, 4);
+    v32 = htobe32(hdr->arglen);
+    memcpy(out + 12, &v32, 4);
+    v64 = htobe64(hdr->length);
+    memcpy(out + 16, &v64, 8);
+}
+
+// Parse a 24-byte wire header, returns -1 if it is not a valid frame
+static inline int dfs_unpack_hdr(const unsigned char *in, struct dfs_hdr *hdr)
+{
+    uint16_t v16;
+    uint32_t v32;
+    uint64_t v64;
+
+    memcpy(&v16, in, 2);
+    if (be16toh(v16) != DFS_MAGIC || in[2] != DFS_VERSION)
+    {
+        return -1; // Not one of our frames, or a version we do not speak
+    }
+
+    hdr->version = in[2];
+    hdr->opcode = in[3];
+    memcpy(&v16, in + 4, 2);
+    hdr->flags = be16toh(v16);
+    memcpy(&v16, in + 6, 2);
+    hdr->status = be16toh(v16);
+    memcpy(&v32, in + 8, 4);
+    hdr->req_id = be32toh(v32);
+    memcpy(&v32, in + 12, 4);
+    hdr->arglen = be32toh(v32);
+    memcpy(&v64, in + 16, 8);
+    hdr->length = be64toh(v64);
+
+    // The argument block must fit in the payload and in our buffers
+    if (hdr->arglen > DFS_MAX_ARGLEN || hdr->arglen > hdr->length)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Write exactly len bytes, retrying on short writes and EINTR
+static inline int dfs_write_full(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Write all iovcnt buffers with as few calls as the descriptor allows, retrying on short
+// writes and EINTR. The iov array is consumed.
+static inline int dfs_writev_full(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        // Skip what was written, the rest of a partly written buffer goes next
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+// Read exactly len bytes, returns -1 on error or if the peer closed early
+static inline int dfs_read_full(int fd, void *buf, size_t len)
+{
+    char *p = (char *)buf;
+
+    while (len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+        {
+            errno = ECONNRESET; // Peer closed in the middle of a frame
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Pack argv into a NUL-separated argument block, returns its length or -1
+static inline int dfs_pack_args(char *buf, size_t cap, int argc, const char **argv)
+{
+    size_t used = 0;
+
+    for (int i = 0; i < argc; i++)
+    {
+        size_t n = strlen(argv[i]) + 1; // Keep the terminating NUL
+        if (used + n > cap || used + n > DFS_MAX_ARGLEN)
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(buf + used, argv[i], n);
+        used += n;
+    }
+    return (int)used;
+}
+
+// Split a received argument block in place, returns the number of arguments
+static inline int dfs_split_args(char *buf, uint32_t len, char **argv, int max)
+{
+    int argc = 0;
+    uint32_t start = 0;
+
+    buf[len] = '\0'; // Caller guarantees room for a terminator
+    for (uint32_t i = 0; i <= len && argc < max; i++)
+    {
+        if (buf[i] == '\0')
+        {
+            if (i == len && start == len)
+                break; // No trailing empty argument
+            argv[argc++] = buf + start;
+            start = i + 1;
+        }
+    }
+    for (int i = argc; i < max; i++)
+    {
+        argv[i] = buf + len; // Missing arguments read as empty strings
+    }
+    return argc;
+}
+
+// Send a frame header announcing `length` payload bytes
+static inline int dfs_send_hdr(int fd, uint8_t opcode, uint16_t flags, uint16_t status,
+                               uint32_t req_id, uint32_t arglen, uint64_t length)
+{
+    struct dfs_hdr hdr = {DFS_VERSION, opcode, flags, status, req_id, arglen, length};
+    unsigned char wire[DFS_HDR_SIZE];
+
+    dfs_pack_hdr(&hdr, wire);
+    return dfs_write_full(fd, wire, DFS_HDR_SIZE);
+}
+
+// Send a complete frame: header, argument block and an in-memory body, in one write
+static inline int dfs_send_frame(int fd, uint8_t opcode, uint16_t flags, uint16_t status, uint32_t req_id,
+                                 const char *args, uint32_t arglen, const void *body, uint64_t bodylen)
+{
+    struct dfs_hdr hdr = {DFS_VERSION, opcode, flags, status, req_id, arglen, arglen + bodylen};
+    unsigned char wire[DFS_HDR_SIZE];
+    struct iovec iov[3] = {{wire, DFS_HDR_SIZE}, {(void *)args, arglen}, {(void *)body, (size_t)bodylen}};
+
+    dfs_pack_hdr(&hdr, wire);
+    return dfs_writev_full(fd, iov, 3);
+}
+
+// Send a request frame built from argv, the body (if any) is streamed by the caller
+static inline int dfs_send_request(int fd, uint8_t opcode, uint32_t req_id, int argc, const char **argv,
+                                   uint64_t bodylen)
+{
+    char args[DFS_MAX_ARGLEN];
+    int arglen = dfs_pack_args(args, sizeof(args), argc, argv);
+
+    if (arglen < 0)
+        return -1;
+    struct dfs_hdr hdr = {DFS_VERSION, opcode, 0, 0, req_id, (uint32_t)arglen, (uint64_t)arglen + bodylen};
+    unsigned char wire[DFS_HDR_SIZE];
+    struct iovec iov[2] = {{wire, DFS_HDR_SIZE}, {args, (size_t)arglen}};
+
+    dfs_pack_hdr(&hdr, wire);
+    return dfs_writev_full(fd, iov, 2);
+}
+
+// Send a final reply carrying an errno status and a human readable message
+static inline int dfs_send_error(int fd, uint8_t opcode, uint32_t req_id, int err, const char *msg)
+{
+    return dfs_send_frame(fd, opcode, DFS_F_REPLY, (uint16_t)err, req_id, NULL, 0, msg, strlen(msg));
+}
+
+// Receive a frame header and its argument block; args must hold DFS_MAX_ARGLEN + 1 bytes
+static inline int dfs_recv_frame(int fd, struct dfs_hdr *hdr, char *args)
+{
+    unsigned char wire[DFS_HDR_SIZE];
+
+    if (dfs_read_full(fd, wire, DFS_HDR_SIZE) < 0)
+        return -1;
+    if (dfs_unpack_hdr(wire, hdr) < 0)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    if (hdr->arglen > 0 && dfs_read_full(fd, args, hdr->arglen) < 0)
+        return -1;
+    args[hdr->arglen] = '\0';
+    return 0;
+}
+
+// Read and discard n body bytes so the next frame starts in the right place
+static inline int dfs_skip(int fd, uint64_t n)
+{
+    char buffer[65536];
+
+    while (n > 0)
+    {
+        size_t want = n < sizeof(buffer) ? (size_t)n : sizeof(buffer);
+        if (dfs_read_full(fd, buffer, want) < 0)
+            return -1;
+        n -= want;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,329 @@
+#ifndef DFS_RANGE_H
+#define DFS_RANGE_H
+
+// Ranged transfers: large files moved as byte ranges over several
+// connections at once.
+//
+// A DFILE may name a range after its path, as a decimal offset and length.
+// The reply holds the bytes of the file in that range (fewer at the end of
+// the file) and carries the size of the whole file as its argument, so a
+// client can ask for a first range and spread the rest once it knows the
+// size.
+//
+// A UFILE may carry, after its usual arguments, the id the client chose for
+// the upload, the offset of its body in the file and the size of the whole
+// file. The body is a part of the file. Parts are written with pwrite(2)
+// into a partial file next to the destination, ".<name>.<id>.part", in any
+// order, by any process and over any connection. Once every part was
+// acknowledged, the client commits the upload with a part at the end of the
+// file and without a body; the partial file is then moved into place
+// atomically. Partial files never end in the suffix of a stored type, so
+// listings and archives do not see them.
+//
+// Uploads survive dropped connections and restarted servers. Every
+// DFS_RANGE_CHECKPOINT bytes of a part, and at its end, the partial file is
+// synced and the range written so far is appended to ".<name>.<id>.held". A
+// STAT names an upload and an offset and is answered with the number of
+// bytes held from that offset on, so a client resumes each part where the
+// server has it. The commit moves the file into place only once the held
+// ranges cover all of it.
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "dfs_loop.h"
+
+#define DFS_RANGE_ID_MAX 32                    // Longest upload id
+#define DFS_RANGE_CHECKPOINT (64 * 1024 * 1024) // Bytes of a part written between checkpoints
+
+// Where the body of a ranged UFILE goes
+struct dfs_range_part
+{
+    char id[DFS_RANGE_ID_MAX + 1]; // Upload id chosen by the client
+    uint64_t offset;               // Offset of the body in the file
+    uint64_t total;                // Size of the whole file
+    int commit;                    // Every part is in: move the file into place
+    uint64_t pos;                  // Offset of the next body bytes
+    uint64_t synced;               // Offset up to which the part is recorded as held
+};
+
+// Parse a decimal number making up all of text
+static inline int dfs_range_number(const char *text, uint64_t *value)
+{
+    char *end;
+
+    if (text[0] < '0' || text[0] > '9')
+        return -1;
+    errno = 0;
+    *value = strtoull(text, &end, 10);
+    return *end != '\0' || errno != 0 ? -1 : 0;
+}
+
+// Parse the range of a DFILE. Returns 1 for a range, 0 if the request names
+// none and -1 if it is malformed.
+static inline int dfs_range_parse(const char *offset, const char *length, uint64_t *off, uint64_t *len)
+{
+    if (offset[0] == '\0' && length[0] == '\0')
+        return 0;
+    if (dfs_range_number(offset, off) < 0 || dfs_range_number(length, len) < 0)
+        return -1;
+    return 1;
+}
+
+// Parse the upload id and offset of a UFILE part or a STAT. Returns 0, or -1
+// if they are malformed.
+static inline int dfs_range_parse_id(const char *id, const char *offset, struct dfs_range_part *part)
+{
+    size_t id_len = strlen(id);
+
+    if (id_len == 0 || id_len > DFS_RANGE_ID_MAX || strspn(id, "0123456789abcdefABCDEF") != id_len ||
+        dfs_range_number(offset, &part->offset) < 0)
+        return -1;
+    memcpy(part->id, id, id_len + 1);
+    part->pos = part->synced = part->offset;
+    return 0;
+}
+
+// Parse the part arguments of a UFILE with bodylen body bytes. Returns 1 for a
+// part, 0 for a whole file and -1 if they are malformed.
+static inline int dfs_range_parse_part(const char *id, const char *offset, const char *total, uint64_t bodylen,
+                                       struct dfs_range_part *part)
+{
+    if (id[0] == '\0' && offset[0] == '\0' && total[0] == '\0')
+        return 0;
+    if (dfs_range_parse_id(id, offset, part) < 0 || dfs_range_number(total, &part->total) < 0 ||
+        part->offset > part->total || bodylen > part->total - part->offset)
+        return -1;
+    part->commit = part->offset == part->total;
+    if (part->commit && bodylen > 0)
+        return -1;
+    return 1;
+}
+
+// Name of a file kept next to path for an upload to it: the partial file
+// (suffix "part") or the record of the ranges it holds ("held")
+static inline int dfs_range_part_path(const char *path, const struct dfs_range_part *part, const char *suffix,
+                                      char *out, size_t cap)
+{
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash != NULL ? (int)(slash - path + 1) : 0;
+    int n = snprintf(out, cap, "%.*s.%s.%s.%s", dir_len, path, path + dir_len, part->id, suffix);
+
+    if (n < 0 || (size_t)n >= cap)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+// Open the partial file of an upload to path for writing a part, creating it
+// for the first one. Returns the descriptor, or -1.
+static inline int dfs_range_part_open(const char *path, const struct dfs_range_part *part)
+{
+    char part_path[PATH_MAX];
+
+    if (dfs_range_part_path(path, part, "part", part_path, sizeof(part_path)) < 0)
+        return -1;
+    return open(part_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+}
+
+// Write all of data at offset off
+static inline int dfs_pwrite_full(int fd, const void *data, size_t len, uint64_t off)
+{
+    const char *p = (const char *)data;
+
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, p, len, (off_t)off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+        off += (uint64_t)n;
+    }
+    return 0;
+}
+
+// Record the bytes of a part written since the last checkpoint as held, once
+// they are on disk. fd is the partial file of the upload to path.
+static inline int dfs_range_checkpoint(int fd, const char *path, struct dfs_range_part *part)
+{
+    char held_path[PATH_MAX];
+    char record[48];
+    int held_fd, n, err = 0;
+
+    if (part->pos == part->synced)
+        return 0;
+    if (fdatasync(fd) < 0 || dfs_range_part_path(path, part, "held", held_path, sizeof(held_path)) < 0 ||
+        (held_fd = open(held_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666)) < 0)
+        return -1;
+
+    // One short append per record, so records of parts written at the same time never mix
+    n = snprintf(record, sizeof(record), "%llu %llu\n", (unsigned long long)part->offset,
+                 (unsigned long long)part->pos);
+    if (write(held_fd, record, (size_t)n) != n)
+        err = errno != 0 ? errno : EIO;
+    close(held_fd);
+    if (err != 0)
+    {
+        errno = err;
+        return -1;
+    }
+    part->synced = part->pos;
+    return 0;
+}
+
+// Write body bytes of a part to its place in the partial file fd of the
+// upload to path, checkpointing every DFS_RANGE_CHECKPOINT bytes
+static inline int dfs_range_part_write(int fd, const char *path, struct dfs_range_part *part, const void *data,
+                                       size_t len)
+{
+    if (dfs_pwrite_full(fd, data, len, part->pos) < 0)
+        return -1;
+    part->pos += len;
+    if (part->pos - part->synced >= DFS_RANGE_CHECKPOINT)
+        return dfs_range_checkpoint(fd, path, part);
+    return 0;
+}
+
+static inline int dfs_range_cmp(const void *a, const void *b)
+{
+    const uint64_t *x = (const uint64_t *)a, *y = (const uint64_t *)b;
+
+    return x[0] < y[0] ? -1 : x[0] > y[0];
+}
+
+// Number of bytes of the upload to path held from offset on without a gap,
+// into held: 0 if the upload is unknown. Returns 0, or -1 with errno set.
+static inline int dfs_range_held(const char *path, const struct dfs_range_part *part, uint64_t offset,
+                                 uint64_t *held)
+{
+    char held_path[PATH_MAX];
+    struct stat st;
+    char *text, *line;
+    uint64_t(*ranges)[2];
+    size_t count = 0;
+    uint64_t end = offset;
+    int fd, failed;
+
+    *held = 0;
+    if (dfs_range_part_path(path, part, "held", held_path, sizeof(held_path)) < 0)
+        return -1;
+    if ((fd = open(held_path, O_RDONLY | O_CLOEXEC)) < 0)
+        return errno == ENOENT ? 0 : -1;
+    if (fstat(fd, &st) < 0 || (text = (char *)malloc((size_t)st.st_size + 1)) == NULL)
+    {
+        close(fd);
+        return -1;
+    }
+    failed = dfs_read_full(fd, text, (size_t)st.st_size) < 0;
+    close(fd);
+    if (failed || (ranges = (uint64_t(*)[2])malloc(((size_t)st.st_size / 4 + 1) * sizeof(*ranges))) == NULL)
+    {
+        free(text);
+        return -1;
+    }
+    text[st.st_size] = '\0';
+
+    // The ranges in order of their start, each one reaching past the end so far extends it
+    for (line = text; *line != '\0'; line = strchr(line, '\n') + 1)
+    {
+        unsigned long long lo, hi;
+        if (strchr(line, '\n') == NULL)
+            break; // Torn last record
+        if (sscanf(line, "%llu %llu", &lo, &hi) == 2 && lo < hi)
+        {
+            ranges[count][0] = lo;
+            ranges[count++][1] = hi;
+        }
+    }
+    qsort(ranges, count, sizeof(*ranges), dfs_range_cmp);
+    for (size_t i = 0; i < count && ranges[i][0] <= end; i++)
+    {
+        if (ranges[i][1] > end)
+            end = ranges[i][1];
+    }
+    free(ranges);
+    free(text);
+    *held = end - offset;
+    return 0;
+}
+
+// Move the partial file of an upload into place at path once it holds the
+// whole file: synced, so the reply can count as a stored copy. With checksum
+// set (dfs_crc32 of dfs_catalog.h), the checksum of the file is computed into
+// crc on the way. st receives the file's status. Returns 0, or -1 with errno
+// set (ENOENT without any part, EAGAIN while parts are missing).
+static inline int dfs_range_part_commit(const char *path, const struct dfs_range_part *part,
+                                        uint32_t (*checksum)(uint32_t crc, const void *data, size_t len),
+                                        uint32_t *crc, struct stat *st)
+{
+    char part_path[PATH_MAX], held_path[PATH_MAX];
+    char buffer[65536];
+    uint64_t held;
+    int fd, err = 0;
+    ssize_t n;
+
+    if (dfs_range_part_path(path, part, "part", part_path, sizeof(part_path)) < 0 ||
+        dfs_range_part_path(path, part, "held", held_path, sizeof(held_path)) < 0 ||
+        (fd = open(part_path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    if (fstat(fd, st) < 0 || dfs_range_held(path, part, 0, &held) < 0)
+        err = errno;
+    else if ((uint64_t)st->st_size != part->total || held < part->total)
+        err = EAGAIN; // Parts did not arrive, or not all of them
+    if (crc != NULL)
+        *crc = 0;
+    for (off_t pos = 0; err == 0 && checksum != NULL && (n = pread(fd, buffer, sizeof(buffer), pos)) != 0; pos += n)
+    {
+        if (n < 0 && errno == EINTR)
+            n = 0;
+        else if (n < 0)
+            err = errno;
+        else
+            *crc = checksum(*crc, buffer, (size_t)n);
+    }
+    if (err == 0 && fsync(fd) < 0)
+        err = errno;
+    close(fd);
+    if (err == 0 && rename(part_path, path) < 0)
+        err = errno;
+    if (err == 0)
+        unlink(held_path);
+    if (err != 0)
+    {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Queue the reply to a ranged DFILE: the bytes of fd (a file of size bytes) from
+// off on, len at most, with the size as the argument. The connection takes over fd.
+static inline void dfs_range_send(struct dfs_conn *conn, uint8_t opcode, uint32_t req_id, int fd, uint64_t size,
+                                  uint64_t off, uint64_t len)
+{
+    char total[24]; // The argument
+    const char *argv[1] = {total};
+
+    if (off > size)
+        off = size;
+    if (len > size - off)
+        len = size - off;
+    snprintf(total, sizeof(total), "%llu", (unsigned long long)size);
+    dfs_conn_write_hdr_args(conn, opcode, DFS_F_REPLY, 0, req_id, 1, argv, len);
+    if (len > 0)
+        dfs_conn_write_file(conn, fd, (off_t)off, len);
+    else
+        close(fd);
+}
+
+#endif
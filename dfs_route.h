@@ -0,0 +1,474 @@
+#ifndef DFS_ROUTE_H
+#define DFS_ROUTE_H
+
+// Routing table of Smain: which storage nodes hold which files.
+//
+// The table is read from a config file, one storage node per line:
+//
+//   # type  host:port        store            [weight]
+//   pdf     127.0.0.1:6061   ~/spdf
+//   pdf     127.0.0.1:6063   ~/spdf2          2
+//   txt     127.0.0.1:6062   ~/stext
+//
+// The store is the directory the node keeps its files in, a path below
+// ~/smain maps to the same path below it. Each type has a consistent hash
+// ring: a node gets DFS_ROUTE_VNODES points on it per unit of weight, and a
+// path belongs to the node owning the first point at or after the path's
+// hash. Adding a node to a type only takes over the paths that now hash to
+// its points, about 1/n of them; everything else stays where it is.
+//
+// A type can be replicated:
+//
+//   replicate pdf 3 2   # three copies of every .pdf, uploads succeed once two are stored
+//
+// The copies of a path go to the owner and the next distinct nodes along
+// the ring. The points of the ring cut it into arcs, all paths hashing into
+// one arc have the same replicas; dtar serves each arc from one of them.
+//
+// Nodes keep their slot in the table for as long as they are configured,
+// so state kept per slot survives reloads. The file is checked for changes
+// with dfs_routes_refresh; a table that does not parse leaves the current
+// one in place.
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define DFS_ROUTE_MAX_NODES 16 // Storage nodes a table can hold
+#define DFS_ROUTE_MAX_TYPES 8  // File types a table can route
+#define DFS_ROUTE_VNODES 64    // Ring points per unit of weight
+#define DFS_ROUTE_MAX_WEIGHT 16
+#define DFS_ROUTE_MAX_COPIES 8 // Copies a type can be replicated to
+
+struct dfs_route_node
+{
+    int used;            // The slot holds a node
+    char type[8];        // Type of the files the node stores ("pdf", "txt")
+    char host[64];       // Address of the node
+    int port;
+    char store[PATH_MAX]; // Directory of the node's files, tilde expanded
+    int weight;          // Share of its type's paths relative to the other nodes of the type
+};
+
+// Point of a node on a ring
+struct dfs_route_point
+{
+    uint64_t hash;
+    int node; // Slot of the node
+};
+
+// Replication of a type
+struct dfs_route_policy
+{
+    char type[8];
+    int copies; // Nodes holding each file
+    int quorum; // Copies stored before an upload succeeds
+};
+
+// Ring of one type
+struct dfs_route_ring
+{
+    char type[8];
+    struct dfs_route_point *points; // Sorted by hash
+    size_t count;
+    int nodes;                      // Distinct nodes on the ring
+    int copies;                     // Nodes holding each file, at most nodes
+    int quorum;                     // Copies stored before an upload succeeds, at most copies
+};
+
+// Range of hashes, both ends included
+struct dfs_route_range
+{
+    uint64_t lo, hi;
+};
+
+struct dfs_routes
+{
+    char path[PATH_MAX];                              // Config file
+    const char *defaults;                             // Table used while the file does not exist
+    struct stat st;                                   // Config file as last loaded, zero for the defaults
+    struct dfs_route_node nodes[DFS_ROUTE_MAX_NODES]; // Nodes by slot
+    struct dfs_route_ring rings[DFS_ROUTE_MAX_TYPES]; // Rings by type
+    int nrings;
+    struct dfs_route_policy policies[DFS_ROUTE_MAX_TYPES]; // Replicated types
+    int npolicies;
+    unsigned version;                                 // Bumped by every reload
+};
+
+// Hash of len bytes of s: FNV-1a, mixed so that close strings land far apart on the ring
+static inline uint64_t dfs_route_hash(const char *s, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+static inline int dfs_route_point_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((const struct dfs_route_point *)a)->hash, y = ((const struct dfs_route_point *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+static inline void dfs_routes_free_rings(struct dfs_routes *r)
+{
+    for (int i = 0; i < r->nrings; i++)
+        free(r->rings[i].points);
+    r->nrings = 0;
+}
+
+// The ring of type, NULL if no node stores it
+static inline struct dfs_route_ring *dfs_route_ring(struct dfs_routes *r, const char *type)
+{
+    for (int i = 0; i < r->nrings; i++)
+    {
+        if (strcmp(r->rings[i].type, type) == 0)
+            return &r->rings[i];
+    }
+    return NULL;
+}
+
+// Place the nodes of the table on the rings of their types
+static inline int dfs_routes_build(struct dfs_routes *r)
+{
+    char name[128];
+
+    dfs_routes_free_rings(r);
+    for (int n = 0; n < DFS_ROUTE_MAX_NODES; n++)
+    {
+        struct dfs_route_node *node = &r->nodes[n];
+        struct dfs_route_ring *ring;
+
+        if (!node->used)
+            continue;
+        if ((ring = dfs_route_ring(r, node->type)) == NULL)
+        {
+            if (r->nrings == DFS_ROUTE_MAX_TYPES)
+                return -1;
+            ring = &r->rings[r->nrings++];
+            memset(ring, 0, sizeof(*ring));
+            snprintf(ring->type, sizeof(ring->type), "%s", node->type);
+            ring->copies = ring->quorum = 1;
+            for (int i = 0; i < r->npolicies; i++)
+            {
+                if (strcmp(r->policies[i].type, node->type) == 0)
+                {
+                    ring->copies = r->policies[i].copies;
+                    ring->quorum = r->policies[i].quorum;
+                }
+            }
+        }
+        ring->nodes++;
+        struct dfs_route_point *points =
+            realloc(ring->points, (ring->count + node->weight * DFS_ROUTE_VNODES) * sizeof(*points));
+        if (points == NULL)
+            return -1;
+        ring->points = points;
+
+        // Points follow from the node's address, not its slot, so every Smain places it alike
+        for (int v = 0; v < node->weight * DFS_ROUTE_VNODES; v++)
+        {
+            int len = snprintf(name, sizeof(name), "%s:%d#%d", node->host, node->port, v);
+            ring->points[ring->count].hash = dfs_route_hash(name, len);
+            ring->points[ring->count++].node = n;
+        }
+    }
+    for (int i = 0; i < r->nrings; i++)
+    {
+        struct dfs_route_ring *ring = &r->rings[i];
+
+        qsort(ring->points, ring->count, sizeof(struct dfs_route_point), dfs_route_point_cmp);
+        if (ring->copies > ring->nodes)
+            ring->copies = ring->nodes; // Fewer nodes than copies: every node holds every file
+        if (ring->quorum > ring->copies)
+            ring->quorum = ring->copies;
+    }
+    return 0;
+}
+
+// Parse a table into nodes (slots in file order) and replication policies. Returns the number of
+// nodes, -1 if invalid.
+static inline int dfs_routes_parse(const char *text, struct dfs_route_node *nodes, struct dfs_route_policy *policies,
+                                   int *npolicies)
+{
+    const char *line = text;
+    int count = 0, lineno = 0;
+
+    memset(nodes, 0, DFS_ROUTE_MAX_NODES * sizeof(*nodes));
+    *npolicies = 0;
+    while (*line)
+    {
+        const char *end = strchr(line, '\n');
+        size_t len = end ? (size_t)(end - line) : strlen(line);
+        char buf[PATH_MAX + 128], store[PATH_MAX];
+        struct dfs_route_node node;
+        int fields;
+
+        lineno++;
+        memset(&node, 0, sizeof(node));
+        node.weight = 1;
+        if (len >= sizeof(buf))
+            len = sizeof(buf) - 1;
+        memcpy(buf, line, len);
+        buf[len] = '\0';
+        line = end ? end + 1 : line + len;
+        if (strchr(buf, '#') != NULL)
+            *strchr(buf, '#') = '\0';
+
+        if (strncmp(buf + strspn(buf, " \t"), "replicate", 9) == 0)
+        {
+            struct dfs_route_policy policy;
+
+            policy.quorum = 0;
+            fields = sscanf(buf, " replicate %7s %d %d", policy.type, &policy.copies, &policy.quorum);
+            if (policy.quorum == 0)
+                policy.quorum = policy.copies / 2 + 1; // Majority
+            if (fields < 2 || policy.copies < 1 || policy.copies > DFS_ROUTE_MAX_COPIES || policy.quorum < 1 ||
+                policy.quorum > policy.copies || *npolicies == DFS_ROUTE_MAX_TYPES)
+            {
+                fprintf(stderr, "Routing table line %d is invalid\n", lineno);
+                return -1;
+            }
+            policies[(*npolicies)++] = policy;
+            continue;
+        }
+
+        fields = sscanf(buf, "%7s %63[^: \t]:%d %4095s %d", node.type, node.host, &node.port, store, &node.weight);
+        if (fields <= 0)
+            continue; // Blank or comment
+        if (fields < 4 || node.port <= 0 || node.port > 65535 || node.weight < 1 ||
+            node.weight > DFS_ROUTE_MAX_WEIGHT || count == DFS_ROUTE_MAX_NODES)
+        {
+            fprintf(stderr, "Routing table line %d is invalid\n", lineno);
+            return -1;
+        }
+        if (store[0] == '~')
+            snprintf(node.store, sizeof(node.store), "%s%s", getenv("HOME"), store + 1);
+        else
+            snprintf(node.store, sizeof(node.store), "%s", store);
+        for (size_t l = strlen(node.store); l > 1 && node.store[l - 1] == '/'; l--)
+            node.store[l - 1] = '\0';
+        node.used = 1;
+        nodes[count++] = node;
+    }
+    return count;
+}
+
+// Load the table from its file (or the defaults while there is none), keeping the slots of the
+// nodes that stay. Returns 0, or -1 with the current table left in place.
+static inline int dfs_routes_load(struct dfs_routes *r)
+{
+    struct dfs_route_node parsed[DFS_ROUTE_MAX_NODES], nodes[DFS_ROUTE_MAX_NODES];
+    struct dfs_route_policy policies[DFS_ROUTE_MAX_TYPES];
+    struct stat st;
+    char *text = NULL;
+    int count, npolicies;
+    FILE *fp = fopen(r->path, "re");
+
+    memset(&st, 0, sizeof(st));
+    if (fp != NULL)
+    {
+        if (fstat(fileno(fp), &st) == 0 && (text = malloc(st.st_size + 1)) != NULL)
+            text[fread(text, 1, st.st_size, fp)] = '\0';
+        fclose(fp);
+    }
+    else if (errno != ENOENT)
+    {
+        perror("Could not read routing table");
+        return -1;
+    }
+    count = dfs_routes_parse(text != NULL ? text : r->defaults, parsed, policies, &npolicies);
+    free(text);
+    if (count <= 0)
+    {
+        fprintf(stderr, "Routing table %s has no usable nodes, keeping the current one\n", r->path);
+        r->st = st; // Not read again until it changes
+        return -1;
+    }
+
+    // Nodes that stay keep their slot, new ones take the free slots
+    memset(nodes, 0, sizeof(nodes));
+    for (int i = 0; i < count; i++)
+    {
+        for (int n = 0; n < DFS_ROUTE_MAX_NODES; n++)
+        {
+            struct dfs_route_node *old = &r->nodes[n];
+            if (old->used && strcmp(old->type, parsed[i].type) == 0 && strcmp(old->host, parsed[i].host) == 0 &&
+                old->port == parsed[i].port && !nodes[n].used)
+            {
+                nodes[n] = parsed[i];
+                parsed[i].used = 0;
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < count; i++)
+    {
+        int n = 0;
+
+        if (!parsed[i].used)
+            continue;
+        // Slots of removed nodes are reused last, state about them may still be winding down
+        while (n < DFS_ROUTE_MAX_NODES && (nodes[n].used || r->nodes[n].used))
+            n++;
+        if (n == DFS_ROUTE_MAX_NODES)
+            for (n = 0; nodes[n].used; n++)
+                ;
+        nodes[n] = parsed[i];
+    }
+
+    memcpy(r->nodes, nodes, sizeof(nodes));
+    memcpy(r->policies, policies, sizeof(policies));
+    r->npolicies = npolicies;
+    r->st = st;
+    r->version++;
+    return dfs_routes_build(r);
+}
+
+// Set up the table of the config file at path, with defaults (a table in the same format) while
+// the file does not exist. Returns -1 if neither gives a table.
+static inline int dfs_routes_init(struct dfs_routes *r, const char *path, const char *defaults)
+{
+    memset(r, 0, sizeof(*r));
+    snprintf(r->path, sizeof(r->path), "%s", path);
+    r->defaults = defaults;
+    return dfs_routes_load(r);
+}
+
+// Reload the table if its file changed. Returns 1 if the table changed.
+static inline int dfs_routes_refresh(struct dfs_routes *r)
+{
+    struct stat st;
+
+    if (stat(r->path, &st) < 0)
+        memset(&st, 0, sizeof(st)); // Gone: back to the defaults
+    if (st.st_ino == r->st.st_ino && st.st_size == r->st.st_size && st.st_mtim.tv_sec == r->st.st_mtim.tv_sec &&
+        st.st_mtim.tv_nsec == r->st.st_mtim.tv_nsec)
+        return 0;
+    if (dfs_routes_load(r) < 0)
+        return 0;
+    printf("Routing table %s reloaded\n", r->path);
+    return 1;
+}
+
+// Position of the first point of a ring at or after hash
+static inline size_t dfs_route_find(const struct dfs_route_ring *ring, uint64_t hash)
+{
+    size_t lo = 0, hi = ring->count;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ring->points[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo == ring->count ? 0 : lo; // The ring wraps around
+}
+
+// Slots of the nodes holding the paths of the arc ending at point i, in order of preference: the
+// owner of the point, then the next distinct nodes along the ring. Returns their number.
+static inline int dfs_route_arc_replicas(const struct dfs_route_ring *ring, size_t i, int *slots)
+{
+    unsigned seen = 0;
+    int count = 0;
+
+    for (size_t n = 0; n < ring->count && count < ring->copies; n++)
+    {
+        int node = ring->points[(i + n) % ring->count].node;
+        if (seen & (1u << node))
+            continue;
+        seen |= 1u << node;
+        slots[count++] = node;
+    }
+    return count;
+}
+
+// Slots of the nodes of type holding key (a path relative to the stores), in order of preference.
+// Returns their number, 0 if no node stores type.
+static inline int dfs_route_replicas(struct dfs_routes *r, const char *type, const char *key, int *slots)
+{
+    struct dfs_route_ring *ring = dfs_route_ring(r, type);
+
+    if (ring == NULL || ring->count == 0)
+        return 0;
+    return dfs_route_arc_replicas(ring, dfs_route_find(ring, dfs_route_hash(key, strlen(key))), slots);
+}
+
+// Slot of the node of type owning key, -1 if no node stores type
+static inline int dfs_route_lookup(struct dfs_routes *r, const char *type, const char *key)
+{
+    int slots[DFS_ROUTE_MAX_COPIES];
+
+    return dfs_route_replicas(r, type, key, slots) > 0 ? slots[0] : -1;
+}
+
+// Parse ranges of hashes, one "<lo> <hi>" line each in hexadecimal, into ranges sorted by lo.
+// Returns their number, -1 if the text is not a list of ranges.
+static inline int dfs_route_ranges_parse(const char *text, size_t len, struct dfs_route_range **ranges)
+{
+    size_t cap = 0;
+    int count = 0;
+
+    *ranges = NULL;
+    while (len > 0)
+    {
+        char line[64];
+        const char *end = memchr(text, '\n', len);
+        size_t n = end ? (size_t)(end - text) : len;
+        unsigned long long lo, hi;
+
+        if (n >= sizeof(line))
+            goto invalid;
+        memcpy(line, text, n);
+        line[n] = '\0';
+        text += end ? n + 1 : n;
+        len -= end ? n + 1 : n;
+        if (sscanf(line, "%llx %llx", &lo, &hi) != 2 || lo > hi || (count > 0 && lo <= (*ranges)[count - 1].hi))
+            goto invalid;
+        if ((size_t)count == cap)
+        {
+            struct dfs_route_range *grown = realloc(*ranges, (cap = cap ? cap * 2 : 64) * sizeof(**ranges));
+            if (grown == NULL)
+                goto invalid;
+            *ranges = grown;
+        }
+        (*ranges)[count].lo = lo;
+        (*ranges)[count++].hi = hi;
+    }
+    return count;
+
+invalid:
+    free(*ranges);
+    *ranges = NULL;
+    return -1;
+}
+
+// Whether key (a path relative to the stores) hashes into one of count sorted ranges
+static inline int dfs_route_ranges_has(const struct dfs_route_range *ranges, int count, const char *key)
+{
+    uint64_t h = dfs_route_hash(key, strlen(key));
+    int lo = 0, hi = count;
+
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (ranges[mid].hi < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < count && ranges[lo].lo <= h;
+}
+
+#endif
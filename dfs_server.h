@@ -0,0 +1,303 @@
+#ifndef DFS_SERVER_H
+#define DFS_SERVER_H
+
+// Process model shared by Smain, Spdf and Stext.
+//
+// A server runs one or more workers. With a single worker the server process
+// itself accepts and serves. With N workers a supervisor forks them and
+// restarts any that dies; every worker opens its own SO_REUSEPORT listener
+// on the same port, so the kernel spreads new connections across workers,
+// and runs its own event loop, optionally pinned to one CPU.
+//
+// Within a worker, clients are served either by the epoll reactor or, for
+// comparison, by a child process per connection running the same handlers
+// in a private loop.
+
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "dfs_loop.h"
+
+#define DFS_MODE_EPOLL 0 // One process multiplexes its clients with epoll
+#define DFS_MODE_FORK 1  // One process per client, each running its own event loop
+
+#define DFS_EXIT_SETUP 2 // Exit status of a worker that could not start
+
+struct dfs_server_opts
+{
+    int port;    // TCP port to listen on
+    int mode;    // DFS_MODE_*
+    int workers; // Number of worker processes (-w 0 asks for one per online CPU)
+    int pin;     // Pin worker i to CPU i
+    int index;   // Index of this worker, set in the worker
+    void (*on_start)(struct dfs_loop *loop); // Called in each epoll worker before it serves clients, may be NULL
+};
+
+static volatile sig_atomic_t dfs_stop_requested; // Set by SIGTERM/SIGINT in the supervisor
+
+// Defaults: one epoll worker, unpinned
+static inline void dfs_server_opts_init(struct dfs_server_opts *opts, int port)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->port = port;
+    opts->mode = DFS_MODE_EPOLL;
+    opts->workers = 1;
+}
+
+// Handle one of the common options (-m epoll|fork, -w workers, -a), returns -1 if invalid
+static inline int dfs_server_opt(struct dfs_server_opts *opts, int opt, const char *arg)
+{
+    if (opt == 'm' && strcmp(arg, "epoll") == 0)
+        opts->mode = DFS_MODE_EPOLL;
+    else if (opt == 'm' && strcmp(arg, "fork") == 0)
+        opts->mode = DFS_MODE_FORK;
+    else if (opt == 'w' && strcmp(arg, "0") == 0)
+    {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        opts->workers = ncpu > 0 ? (int)ncpu : 1; // One worker per core
+    }
+    else if (opt == 'w' && atoi(arg) > 0)
+        opts->workers = atoi(arg);
+    else if (opt == 'a')
+        opts->pin = 1;
+    else
+        return -1;
+    return 0;
+}
+
+// Create, bind and listen on the server socket. reuseport lets several
+// workers bind the same port, each getting its own accept queue.
+static inline int dfs_open_listener(int port, int reuseport)
+{
+    int server_sock;                // Server socket descriptor
+    struct sockaddr_in server_addr; // Structure for the server address
+    int one = 1;
+
+    // Creating socket for the server
+    if ((server_sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    {
+        perror("Socket creation failed");
+        return -1;
+    }
+
+    // Restarting must not wait for old connections in TIME_WAIT
+    setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (reuseport && setsockopt(server_sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+        perror("SO_REUSEPORT failed");
+        close(server_sock);
+        return -1;
+    }
+
+    // Setting up the server address structure
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;         // IPv4 address family
+    server_addr.sin_addr.s_addr = INADDR_ANY; // Accept connections from any IP address
+    server_addr.sin_port = htons(port);       // Port number, converted to network byte order
+
+    // Binding the socket to the specified port
+    if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        perror("Bind failed");
+        close(server_sock);
+        return -1;
+    }
+
+    // Listening with the largest backlog the kernel allows so bursts are queued, not dropped
+    if (listen(server_sock, SOMAXCONN) < 0)
+    {
+        perror("Listen failed");
+        close(server_sock);
+        return -1;
+    }
+
+    return server_sock;
+}
+
+// SIGCHLD handler collecting every child that has exited
+static void dfs_reap_children(int sig)
+{
+    int saved_errno = errno; // waitpid must not disturb the interrupted code
+
+    (void)sig;
+    while (waitpid(-1, NULL, WNOHANG) > 0)
+        ;
+    errno = saved_errno;
+}
+
+// Serve all clients of this process from a single event loop
+static inline void dfs_run_epoll(int server_sock, void (*on_accept)(struct dfs_loop *loop, int fd),
+                                 void (*on_start)(struct dfs_loop *loop))
+{
+    struct dfs_loop loop;         // Event loop shared by all connections
+    struct dfs_listener listener; // Registration of the listening socket
+
+    if (dfs_loop_init(&loop) < 0 || dfs_loop_listen(&loop, &listener, server_sock, on_accept) < 0)
+    {
+        perror("Event loop setup failed");
+        exit(DFS_EXIT_SETUP);
+    }
+
+    if (on_start != NULL)
+        on_start(&loop);
+    dfs_loop_run(&loop);
+}
+
+// Serve each client from its own child process
+static inline void dfs_run_fork(int server_sock, void (*on_accept)(struct dfs_loop *loop, int fd))
+{
+    int client_sock;     // Client socket descriptor
+    pid_t child_pid;     // Process ID for the child process
+    struct sigaction sa; // Handler reaping finished children
+
+    // Reap every finished child as soon as it exits so no zombies pile up
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dfs_reap_children;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    while (1)
+    {
+        // Accepting a client connection
+        if ((client_sock = accept(server_sock, NULL, NULL)) < 0)
+        {
+            if (errno != EINTR)
+                perror("Client accept failed");
+            continue;
+        }
+
+        // Creating a child process to handle the client request
+        if ((child_pid = fork()) == 0)
+        {
+            struct dfs_loop loop; // Event loop of this client only
+
+            close(server_sock);       // Child process doesn't need the server socket
+            signal(SIGCHLD, SIG_DFL); // system() in the child waits for its own children
+            if (dfs_loop_init(&loop) < 0)
+            {
+                perror("epoll_create failed");
+                exit(EXIT_FAILURE);
+            }
+            on_accept(&loop, client_sock); // Handling client requests in the child process
+            dfs_loop_run(&loop);           // Returns once the client and its relays are gone
+            exit(0);                       // Exiting child process after handling client
+        }
+
+        if (child_pid < 0)
+            perror("Fork failed");
+        close(client_sock); // Parent process doesn't need the client socket
+    }
+}
+
+// Body of one worker: own listener, optional CPU pinning, own event loop
+static inline void dfs_run_worker(struct dfs_server_opts *opts, void (*on_accept)(struct dfs_loop *loop, int fd))
+{
+    int server_sock = dfs_open_listener(opts->port, opts->workers > 1);
+    if (server_sock < 0)
+        exit(DFS_EXIT_SETUP);
+
+    if (opts->pin)
+    {
+        cpu_set_t set;
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+        CPU_ZERO(&set);
+        CPU_SET(opts->index % (ncpu > 0 ? ncpu : 1), &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0)
+            perror("sched_setaffinity failed"); // Run unpinned rather than not at all
+    }
+
+    if (opts->mode == DFS_MODE_FORK)
+        dfs_run_fork(server_sock, on_accept);
+    else
+        dfs_run_epoll(server_sock, on_accept, opts->on_start);
+    close(server_sock);
+}
+
+static void dfs_request_stop(int sig)
+{
+    (void)sig;
+    dfs_stop_requested = 1;
+}
+
+// Fork worker `index` and return its pid, the worker itself never returns
+static inline pid_t dfs_spawn_worker(struct dfs_server_opts *opts, int index,
+                                     void (*on_accept)(struct dfs_loop *loop, int fd))
+{
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        opts->index = index;
+        dfs_run_worker(opts, on_accept);
+        exit(0);
+    }
+    if (pid < 0)
+        perror("Fork failed");
+    return pid;
+}
+
+// Run the server: inline with a single worker, otherwise as supervisor of N workers
+static inline void dfs_serve(struct dfs_server_opts *opts, void (*on_accept)(struct dfs_loop *loop, int fd))
+{
+    if (opts->workers <= 1)
+    {
+        dfs_run_worker(opts, on_accept);
+        return;
+    }
+
+    pid_t *pids = (pid_t *)calloc(opts->workers, sizeof(pid_t));
+    struct sigaction sa;
+
+    // Stop the workers when the supervisor is asked to stop
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = dfs_request_stop;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    for (int i = 0; i < opts->workers; i++)
+        pids[i] = dfs_spawn_worker(opts, i, on_accept);
+
+    // Restart workers that die, unless they could not even start
+    while (!dfs_stop_requested)
+    {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (int i = 0; i < opts->workers; i++)
+        {
+            if (pids[i] != pid)
+                continue;
+            if (WIFEXITED(status) && WEXITSTATUS(status) == DFS_EXIT_SETUP)
+            {
+                fprintf(stderr, "Worker %d failed to start, shutting down\n", i);
+                dfs_stop_requested = 1;
+                pids[i] = 0;
+            }
+            else
+            {
+                fprintf(stderr, "Worker %d exited, restarting it\n", i);
+                pids[i] = dfs_spawn_worker(opts, i, on_accept);
+            }
+        }
+    }
+
+    for (int i = 0; i < opts->workers; i++)
+    {
+        if (pids[i] > 0)
+            kill(pids[i], SIGTERM);
+    }
+    while (wait(NULL) > 0)
+        ;
+    free(pids);
+}
+
+#endif
@@ -0,0 +1,322 @@
+#ifndef DFS_TAR_H
+#define DFS_TAR_H
+
+// Streaming tar writer shared by Smain, Spdf and Stext.
+//
+// A dfs_tar walks a directory tree and sends every regular file whose name
+// ends in a given suffix as a ustar member, straight to a connection: no
+// shell, no find/tar processes and no archive on disk. Names longer than
+// ustar allows, and files of 8 GB and more, get a pax extended header.
+//
+// The archive is a multi-frame reply. Each member is one DFS_F_MORE frame
+// holding its header blocks, the file contents (queued as a file range, so
+// they go out with sendfile) and the padding. The last frame carries the
+// two zero blocks that end the archive, unless the archive is a part that
+// others follow (one storage node's share of a dtar): its last frame is
+// then empty. A part may also hold only the files a filter keeps, when the
+// files are replicated and each copy serves a share of them. Readers simply
+// concatenate the frame bodies, so the first member leaves as soon as it is
+// found.
+//
+// dfs_tar_pump queues members until the connection is congested and is
+// called again from the owner's on_drain, so a slow reader never makes the
+// server hold more than about DFS_OUT_HIGH bytes of archive.
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include "dfs_loop.h"
+
+#define DFS_TAR_BLOCK 512     // Tar block size, members are padded to it
+#define DFS_TAR_MAX_DEPTH 64  // Deepest directory nesting that is walked
+#define DFS_TAR_NAME 100      // Size of the ustar name field
+#define DFS_TAR_PREFIX 155    // Size of the ustar prefix field
+#define DFS_TAR_SIZE_MAX 077777777777ULL // Largest size the 12-byte octal field holds
+#define DFS_TAR_HEADERS_MAX (4 * DFS_TAR_BLOCK + PATH_MAX) // Room for the header blocks of one member
+
+struct dfs_tar
+{
+    struct dfs_conn *conn;              // Connection the archive is sent on
+    uint8_t opcode;                     // Opcode of the reply frames
+    uint32_t req_id;                    // Request the archive answers
+    char suffix[16];                    // Only files whose name ends in this are archived
+    int max_depth;                      // Subdirectory levels to descend into, -1 for all
+    int depth;                          // Directories open on the stack
+    DIR *dirs[DFS_TAR_MAX_DEPTH];       // Directories being read, innermost last
+    size_t path_len[DFS_TAR_MAX_DEPTH]; // Length of path for each open directory
+    char path[PATH_MAX];                // Path of the innermost directory
+    uint64_t members;                   // Members sent so far
+    int active;                         // Started and not yet finished or aborted
+    int part;                           // Leave out the end blocks, more members follow elsewhere
+    int (*keep)(const char *name, void *data); // Files archived, by path below the root; NULL for all
+    void *keep_data;                    // Passed to keep
+};
+
+static const unsigned char dfs_tar_zeros[2 * DFS_TAR_BLOCK]; // Padding, and the end of an archive
+
+// Write an octal number right aligned and NUL terminated into a field of len bytes
+static inline void dfs_tar_octal(char *field, size_t len, uint64_t value)
+{
+    field[len - 1] = '\0';
+    for (size_t i = len - 1; i-- > 0;)
+    {
+        field[i] = (char)('0' + (value & 7));
+        value >>= 3;
+    }
+}
+
+// Fill in the checksum of a header block
+static inline void dfs_tar_checksum(unsigned char *block)
+{
+    unsigned int sum = 0;
+
+    memset(block + 148, ' ', 8); // The field counts as spaces while summing
+    for (int i = 0; i < DFS_TAR_BLOCK; i++)
+        sum += block[i];
+    dfs_tar_octal((char *)block + 148, 7, sum);
+    block[155] = ' ';
+}
+
+// Build a ustar header block, returns -1 if name does not fit into name + prefix
+static inline int dfs_tar_header(unsigned char *block, const char *name, const struct stat *st, char type, uint64_t size)
+{
+    size_t len = strlen(name);
+    const char *base = name;
+
+    memset(block, 0, DFS_TAR_BLOCK);
+    if (len > DFS_TAR_NAME)
+    {
+        // Split at a slash so the tail fits into name and the head into prefix
+        const char *slash = name + len - DFS_TAR_NAME - 1;
+        while (*slash != '\0' && *slash != '/')
+            slash++;
+        if (*slash == '\0' || (size_t)(slash - name) > DFS_TAR_PREFIX || slash == name)
+            return -1;
+        memcpy(block + 345, name, slash - name);
+        base = slash + 1;
+    }
+    memcpy(block, base, strlen(base));
+
+    dfs_tar_octal((char *)block + 100, 8, st->st_mode & 07777);
+    dfs_tar_octal((char *)block + 108, 8, st->st_uid & 07777777);
+    dfs_tar_octal((char *)block + 116, 8, st->st_gid & 07777777);
+    dfs_tar_octal((char *)block + 124, 12, size > DFS_TAR_SIZE_MAX ? 0 : size);
+    dfs_tar_octal((char *)block + 136, 12, st->st_mtime > 0 ? (uint64_t)st->st_mtime : 0);
+    block[156] = (unsigned char)type;
+    memcpy(block + 257, "ustar", 6); // POSIX magic and version "00"
+    memcpy(block + 263, "00", 2);
+    dfs_tar_checksum(block);
+    return 0;
+}
+
+// Append one pax record ("<len> key=value\n", len counting itself) to buf
+static inline size_t dfs_tar_pax_record(char *buf, size_t cap, size_t used, const char *key, const char *value)
+{
+    size_t body = strlen(key) + strlen(value) + 3; // Space, '=' and newline
+    size_t len = body + 1;
+    char digits[24];
+
+    // The length field counts its own digits
+    while ((size_t)snprintf(digits, sizeof(digits), "%zu", len) + body != len)
+        len = (size_t)snprintf(digits, sizeof(digits), "%zu", len) + body;
+    if (used + len > cap)
+        return used;
+    snprintf(buf + used, cap - used, "%zu %s=%s\n", len, key, value);
+    return used + len;
+}
+
+// Build the header blocks of a member into headers (DFS_TAR_HEADERS_MAX bytes), returns their
+// length. name is stored as given, callers strip the leading slash.
+static inline size_t dfs_tar_headers(unsigned char *headers, const struct stat *st, const char *name)
+{
+    unsigned char ustar[DFS_TAR_BLOCK]; // The member's own header
+    uint64_t size = (uint64_t)st->st_size;
+    size_t hlen = 0;
+    int long_name = dfs_tar_header(ustar, name, st, '0', size) < 0;
+
+    // Names ustar cannot hold and sizes of 8 GB and more go into a pax extended header first
+    if (long_name || size > DFS_TAR_SIZE_MAX)
+    {
+        char records[DFS_TAR_BLOCK + PATH_MAX];
+        char number[24];
+        char short_name[DFS_TAR_NAME];
+        const char *base = strrchr(name, '/');
+        size_t rlen = 0;
+
+        if (long_name)
+            rlen = dfs_tar_pax_record(records, sizeof(records), rlen, "path", name);
+        if (size > DFS_TAR_SIZE_MAX)
+        {
+            snprintf(number, sizeof(number), "%llu", (unsigned long long)size);
+            rlen = dfs_tar_pax_record(records, sizeof(records), rlen, "size", number);
+        }
+
+        snprintf(short_name, sizeof(short_name), "PaxHeaders/%.80s", base ? base + 1 : name);
+        dfs_tar_header(headers, short_name, st, 'x', rlen);
+        memcpy(headers + DFS_TAR_BLOCK, records, rlen);
+        hlen = DFS_TAR_BLOCK + rlen;
+        while (hlen % DFS_TAR_BLOCK != 0)
+            headers[hlen++] = 0;
+
+        // The ustar header keeps what fits, readers take the pax records instead
+        if (long_name)
+        {
+            snprintf(short_name, sizeof(short_name), "%s", base ? base + 1 : name);
+            dfs_tar_header(ustar, short_name, st, '0', size);
+        }
+    }
+    memcpy(headers + hlen, ustar, DFS_TAR_BLOCK);
+    return hlen + DFS_TAR_BLOCK;
+}
+
+// Zero bytes that complete the last block of a member of the given size
+static inline size_t dfs_tar_padding(uint64_t size)
+{
+    return (size_t)((DFS_TAR_BLOCK - size % DFS_TAR_BLOCK) % DFS_TAR_BLOCK);
+}
+
+// Queue one regular file as a member frame; name is stored without a leading slash
+static inline void dfs_tar_member(struct dfs_tar *tar, int fd, const struct stat *st, const char *name)
+{
+    unsigned char headers[DFS_TAR_HEADERS_MAX];
+    uint64_t size = (uint64_t)st->st_size;
+    size_t padding = dfs_tar_padding(size);
+    size_t hlen = dfs_tar_headers(headers, st, name);
+
+    dfs_conn_write_hdr(tar->conn, tar->opcode, DFS_F_REPLY | DFS_F_MORE, 0, tar->req_id, 0, hlen + size + padding);
+    dfs_conn_write(tar->conn, headers, hlen);
+    if (size > 0)
+        dfs_conn_write_file(tar->conn, fd, 0, size); // Sent with sendfile, the connection closes fd
+    else
+        close(fd);
+    if (padding > 0)
+        dfs_conn_write(tar->conn, dfs_tar_zeros, padding);
+    tar->members++;
+}
+
+// Stop walking and close whatever directories are still open
+static inline void dfs_tar_abort(struct dfs_tar *tar)
+{
+    while (tar->depth > 0)
+        closedir(tar->dirs[--tar->depth]);
+    tar->active = 0;
+}
+
+// Begin an archive of the files below root whose names end in suffix. max_depth limits how
+// many directory levels below root are searched (0: root only, -1: all). A missing root gives
+// an empty archive. dfs_tar_pump sends it; setting part before that leaves out the end blocks,
+// setting keep filters the members.
+static inline void dfs_tar_start(struct dfs_tar *tar, struct dfs_conn *conn, uint8_t opcode, uint32_t req_id,
+                                 const char *root, const char *suffix, int max_depth)
+{
+    memset(tar, 0, sizeof(*tar));
+    tar->conn = conn;
+    tar->opcode = opcode;
+    tar->req_id = req_id;
+    tar->max_depth = max_depth;
+    tar->active = 1;
+    snprintf(tar->suffix, sizeof(tar->suffix), "%s", suffix);
+    snprintf(tar->path, sizeof(tar->path), "%s", root);
+
+    if ((tar->dirs[0] = opendir(root)) != NULL)
+    {
+        tar->path_len[0] = strlen(tar->path);
+        tar->depth = 1;
+    }
+    else
+    {
+        perror("Could not open directory");
+    }
+}
+
+// Advance the walk to the next member. Returns its open descriptor, with its path in tar->path
+// and its status in st, or -1 once the walk is over. Usable without a connection.
+static inline int dfs_tar_next(struct dfs_tar *tar, struct stat *st)
+{
+    size_t suffix_len = strlen(tar->suffix);
+
+    while (tar->depth > 0)
+    {
+        DIR *dir = tar->dirs[tar->depth - 1];
+        size_t dir_len = tar->path_len[tar->depth - 1];
+        struct dirent *entry;
+
+        tar->path[dir_len] = '\0'; // Forget the entry returned last
+        if ((entry = readdir(dir)) == NULL)
+        {
+            closedir(dir);
+            tar->depth--;
+            continue;
+        }
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        size_t name_len = strlen(entry->d_name);
+        if (dir_len + 1 + name_len >= sizeof(tar->path))
+            continue; // Too long to name
+        tar->path[dir_len] = '/';
+        memcpy(tar->path + dir_len + 1, entry->d_name, name_len + 1);
+
+        // Descend into subdirectories without following symbolic links, like find
+        int is_dir = entry->d_type == DT_DIR;
+        if (entry->d_type == DT_UNKNOWN && fstatat(dirfd(dir), entry->d_name, st, AT_SYMLINK_NOFOLLOW) == 0)
+            is_dir = S_ISDIR(st->st_mode);
+        if (is_dir)
+        {
+            DIR *sub;
+            if ((tar->max_depth < 0 || tar->depth <= tar->max_depth) && tar->depth < DFS_TAR_MAX_DEPTH &&
+                (sub = opendir(tar->path)) != NULL)
+            {
+                tar->dirs[tar->depth] = sub;
+                tar->path_len[tar->depth] = dir_len + 1 + name_len;
+                tar->depth++;
+            }
+            continue;
+        }
+
+        // Regular files with the wanted suffix become members
+        if (name_len >= suffix_len && strcmp(entry->d_name + name_len - suffix_len, tar->suffix) == 0 &&
+            (tar->keep == NULL || tar->keep(tar->path + tar->path_len[0] + 1, tar->keep_data)))
+        {
+            int fd = openat(dirfd(dir), entry->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd >= 0 && fstat(fd, st) == 0 && S_ISREG(st->st_mode))
+                return fd;
+            if (fd >= 0)
+                close(fd);
+        }
+    }
+    return -1;
+}
+
+// Queue members until the connection is congested or the walk is over. Returns 1 once the
+// whole archive is queued, 0 if it must be called again when the connection drains.
+static inline int dfs_tar_pump(struct dfs_tar *tar)
+{
+    struct stat st;
+    int fd;
+
+    if (!tar->active)
+        return 1;
+
+    while (!tar->conn->closed)
+    {
+        if (dfs_conn_congested(tar->conn))
+            return 0; // Continued from on_drain
+        if ((fd = dfs_tar_next(tar, &st)) < 0)
+            break;
+        dfs_tar_member(tar, fd, &st, tar->path[0] == '/' ? tar->path + 1 : tar->path);
+    }
+
+    // End of archive, unless the connection went away while members were queued
+    if (tar->active && !tar->conn->closed)
+    {
+        dfs_conn_send_frame(tar->conn, tar->opcode, DFS_F_REPLY, 0, tar->req_id, dfs_tar_zeros,
+                            tar->part ? 0 : sizeof(dfs_tar_zeros));
+        printf("Archive of %llu %s files queued\n", (unsigned long long)tar->members, tar->suffix);
+    }
+    dfs_tar_abort(tar);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,550 @@
+#ifndef DFS_URING_H
+#define DFS_URING_H
+
+// Upload writes through io_uring, for the storage servers' -u option.
+//
+// Without it an upload is written with one write(2) per chunk received and
+// synced with fsync(2), both blocking the worker's event loop: while one
+// file is flushed to disk every other connection of the worker waits. Here
+// body bytes are copied into buffers registered with the kernel, and each
+// full buffer is handed to a ring as one write at its offset. The loop goes
+// on serving while the kernel writes, and the final fsync is asynchronous
+// too. Writes queued while handling one batch of events are submitted
+// together by a single io_uring_enter before the loop waits again.
+//
+// Each worker (one per core with -w 0) has its own ring, created on first
+// use. A connection writes at most DFS_URING_AHEAD buffers ahead of the
+// disk, after that its owner stops reading until on_room. Large uploads also
+// get a fixed file slot, which saves the kernel looking up the descriptor
+// for every write; those of DFS_URING_DIRECT_MIN bytes and more that start
+// at a block boundary are written with O_DIRECT, so they do not push the
+// page cache out. Once buffers run out, or for the unaligned end of a file
+// written with O_DIRECT, bytes are written the usual way.
+//
+// The kernel header is used directly, no liburing. Where io_uring is not
+// available dfs_uring_open returns NULL and callers keep the blocking path.
+//
+// Callbacks run on the loop, never from within a dfs_uring_* call.
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "dfs_loop.h"
+#include "dfs_range.h"
+
+#define DFS_URING_ENTRIES 64               // Submission queue entries
+#define DFS_URING_BUFS 16                  // Registered buffers of a worker
+#define DFS_URING_BUF_SIZE (256 * 1024)    // Bytes of each, a multiple of the block size
+#define DFS_URING_AHEAD 4                  // Buffers a file may have in flight
+#define DFS_URING_FILES 64                 // Fixed file slots
+#define DFS_URING_FIXED_MIN (1024 * 1024)  // Uploads from this size on get a fixed file slot
+#define DFS_URING_DIRECT_MIN (64 * 1024 * 1024) // and from this size on are written with O_DIRECT
+#define DFS_URING_BLOCK 4096               // Alignment O_DIRECT asks for
+
+#define DFS_URING_WRITE 0 // A buffer being written
+#define DFS_URING_SYNC 1  // The final fsync of a file
+
+struct dfs_uring_file;
+
+// What a completion belongs to
+struct dfs_uring_req
+{
+    int kind;                  // DFS_URING_WRITE or DFS_URING_SYNC
+    int buf;                   // Buffer written
+    size_t len;                // Bytes of it
+    uint64_t off;              // Their place in the file
+    struct dfs_uring_file *f;
+};
+
+// An upload written through the ring
+struct dfs_uring_file
+{
+    int fd;                    // Owned: closed by dfs_uring_close
+    int slot;                  // Fixed file slot, -1 for none
+    int direct;                // Written with O_DIRECT
+    uint64_t pos;              // File offset of the next bytes given
+    int buf;                   // Buffer being filled, -1 for none
+    size_t buf_len;
+    uint64_t buf_off;          // File offset of its first byte
+    int inflight;              // Writes in the kernel
+    int syncing;               // The fsync is in the kernel
+    int datasync;              // Flush with fdatasync instead of fsync
+    int flushing;              // dfs_uring_flush was called, the sync follows the last write
+    int err;                   // errno of the first failure
+    int closed;                // The owner let go, freed once the kernel is done with it
+    int want_room;             // on_room once a write completes
+    void (*on_room)(struct dfs_uring_file *f);          // The owner may give more bytes
+    void (*on_flushed)(struct dfs_uring_file *f, int err); // Everything given is on disk, or failed
+    void *data;                // Owner specific state
+    struct dfs_uring_req sync_req;
+    struct dfs_uring_file *next_deferred; // Link in the syncs waiting for room in the ring
+};
+
+// The ring of a worker
+struct dfs_uring
+{
+    int started;               // 1 set up, -1 unavailable in this process
+    pid_t pid;                 // Process the ring belongs to, a forked child starts its own
+    int fd;                    // Ring descriptor
+    struct dfs_watch watch;    // eventfd the kernel signals completions through
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;     // Ring mappings, the same with IORING_FEAT_SINGLE_MMAP
+    size_t sq_map_len, cq_map_len, sqes_len;
+    unsigned queued;           // Entries added since the last submission
+    unsigned char *bufs;       // DFS_URING_BUFS buffers back to back, block aligned
+    int fixed_bufs;            // Registered with the kernel
+    int free_bufs[DFS_URING_BUFS];
+    int nfree_bufs;
+    struct dfs_uring_req reqs[DFS_URING_BUFS]; // The write of each buffer
+    int fixed_files;           // The fixed file table is registered
+    int free_slots[DFS_URING_FILES];
+    int nfree_slots;
+    struct dfs_uring_file *deferred; // Syncs that found the ring full
+};
+
+static struct dfs_uring dfs_uring;
+
+static inline int dfs_uring_enter(int fd, unsigned to_submit)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+static inline int dfs_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Hand every queued entry to the kernel
+static inline void dfs_uring_submit(void)
+{
+    struct dfs_uring *u = &dfs_uring;
+
+    while (u->queued > 0)
+    {
+        int n = dfs_uring_enter(u->fd, u->queued);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            perror("io_uring_enter failed"); // Retried before the loop waits again
+            return;
+        }
+        u->queued -= (unsigned)n;
+    }
+}
+
+
+// A free submission entry, cleared, NULL if even submitting left none
+static inline struct io_uring_sqe *dfs_uring_sqe(void)
+{
+    struct dfs_uring *u = &dfs_uring;
+    unsigned tail = *u->sq_tail;
+
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= DFS_URING_ENTRIES)
+    {
+        dfs_uring_submit();
+        if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= DFS_URING_ENTRIES)
+            return NULL;
+    }
+    struct io_uring_sqe *sqe = &u->sqes[tail & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Publish the entry dfs_uring_sqe returned, submitted before the loop waits
+static inline void dfs_uring_queue(void)
+{
+    struct dfs_uring *u = &dfs_uring;
+    unsigned tail = *u->sq_tail;
+
+    u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+}
+
+static inline void dfs_uring_release_buf(int buf)
+{
+    dfs_uring.free_bufs[dfs_uring.nfree_bufs++] = buf;
+}
+
+// Let go of the file once the kernel is done with it
+static inline void dfs_uring_free(struct dfs_uring_file *f)
+{
+    struct dfs_uring *u = &dfs_uring;
+
+    if (f->buf >= 0)
+        dfs_uring_release_buf(f->buf);
+    if (f->slot >= 0)
+    {
+        int none = -1;
+        struct io_uring_files_update update = {(unsigned)f->slot, 0, (uint64_t)(uintptr_t)&none};
+        dfs_uring_register(u->fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+        u->free_slots[u->nfree_slots++] = f->slot;
+    }
+    close(f->fd);
+    free(f);
+}
+
+// Write bytes the ring cannot take the usual way, at their place
+static inline void dfs_uring_write_now(struct dfs_uring_file *f, const void *data, size_t len, uint64_t off)
+{
+    if (f->direct)
+    {
+        // Memory and length are not aligned, the rest of the file goes through the page cache
+        int flags = fcntl(f->fd, F_GETFL);
+        fcntl(f->fd, F_SETFL, flags & ~O_DIRECT);
+        f->direct = 0;
+    }
+    if (f->err == 0 && dfs_pwrite_full(f->fd, data, len, off) < 0)
+        f->err = errno;
+}
+
+// Queue the sync that ends a flush
+static inline void dfs_uring_sync(struct dfs_uring_file *f)
+{
+    struct io_uring_sqe *sqe = dfs_uring_sqe();
+
+    f->sync_req.kind = DFS_URING_SYNC;
+    f->sync_req.f = f;
+    f->syncing = 1;
+    if (sqe == NULL)
+    {
+        // No room in the ring: queued again before the loop waits
+        f->next_deferred = dfs_uring.deferred;
+        dfs_uring.deferred = f;
+        return;
+    }
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = f->slot >= 0 ? f->slot : f->fd;
+    sqe->flags = f->slot >= 0 ? IOSQE_FIXED_FILE : 0;
+    sqe->fsync_flags = f->datasync ? IORING_FSYNC_DATASYNC : 0;
+    sqe->user_data = (uint64_t)(uintptr_t)&f->sync_req;
+    dfs_uring_queue();
+}
+
+// Hand the buffer being filled to the kernel
+static inline void dfs_uring_write_buf(struct dfs_uring_file *f)
+{
+    struct dfs_uring *u = &dfs_uring;
+    struct dfs_uring_req *req = &u->reqs[f->buf];
+    unsigned char *data = u->bufs + (size_t)f->buf * DFS_URING_BUF_SIZE;
+    struct io_uring_sqe *sqe;
+
+    if (f->direct && f->buf_len % DFS_URING_BLOCK != 0)
+    {
+        int flags = fcntl(f->fd, F_GETFL);
+        fcntl(f->fd, F_SETFL, flags & ~O_DIRECT); // The unaligned end of the file
+        f->direct = 0;
+    }
+    if ((sqe = dfs_uring_sqe()) == NULL)
+    {
+        dfs_uring_write_now(f, data, f->buf_len, f->buf_off);
+        dfs_uring_release_buf(f->buf);
+        f->buf = -1;
+        return;
+    }
+    req->kind = DFS_URING_WRITE;
+    req->buf = f->buf;
+    req->len = f->buf_len;
+    req->off = f->buf_off;
+    req->f = f;
+    sqe->opcode = u->fixed_bufs ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = f->slot >= 0 ? f->slot : f->fd;
+    sqe->flags = f->slot >= 0 ? IOSQE_FIXED_FILE : 0;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = (uint32_t)f->buf_len;
+    sqe->off = f->buf_off;
+    sqe->buf_index = (uint16_t)f->buf;
+    sqe->user_data = (uint64_t)(uintptr_t)req;
+    dfs_uring_queue();
+    f->inflight++;
+    f->buf = -1;
+}
+
+// Submit what the batch queued, and the syncs that did not fit before
+static void dfs_uring_before_wait(struct dfs_loop *loop)
+{
+    struct dfs_uring_file *deferred = dfs_uring.deferred;
+
+    (void)loop;
+    dfs_uring.deferred = NULL;
+    while (deferred != NULL)
+    {
+        struct dfs_uring_file *f = deferred;
+        deferred = f->next_deferred;
+        dfs_uring_sync(f);
+    }
+    dfs_uring_submit();
+}
+
+// A write or sync finished
+static inline void dfs_uring_complete(struct dfs_uring_req *req, int res)
+{
+    struct dfs_uring_file *f = req->f;
+
+    if (req->kind == DFS_URING_WRITE)
+    {
+        unsigned char *data = dfs_uring.bufs + (size_t)req->buf * DFS_URING_BUF_SIZE;
+        f->inflight--;
+        if (res < 0 && f->err == 0)
+            f->err = -res;
+        else if (res >= 0 && (size_t)res < req->len)
+            dfs_uring_write_now(f, data + res, req->len - res, req->off + res); // Short write, finish it here
+        dfs_uring_release_buf(req->buf);
+        if (f->closed)
+        {
+            if (f->inflight == 0 && !f->syncing)
+                dfs_uring_free(f);
+            return;
+        }
+        if (f->flushing && f->inflight == 0)
+            dfs_uring_sync(f);
+        else if (f->want_room)
+        {
+            f->want_room = 0;
+            f->on_room(f);
+        }
+        return;
+    }
+
+    f->syncing = 0;
+    if (res < 0 && f->err == 0)
+        f->err = -res;
+    if (f->closed)
+    {
+        if (f->inflight == 0)
+            dfs_uring_free(f);
+        return;
+    }
+    f->flushing = 0;
+    f->on_flushed(f, f->err);
+}
+
+// Completions arrived
+static void dfs_uring_event(struct dfs_watch *watch, uint32_t events)
+{
+    struct dfs_uring *u = &dfs_uring;
+    uint64_t count;
+
+    (void)events;
+    if (read(watch->fd, &count, sizeof(count)) < 0)
+        return;
+    for (;;)
+    {
+        unsigned head = *u->cq_head;
+        if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+            break;
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        struct dfs_uring_req *req = (struct dfs_uring_req *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+        dfs_uring_complete(req, res);
+    }
+}
+
+// Set up the ring of this process on the loop. Returns -1 if io_uring is not available.
+static inline int dfs_uring_start(struct dfs_loop *loop)
+{
+    struct dfs_uring *u = &dfs_uring;
+    struct io_uring_params p;
+    struct epoll_event ev;
+
+    if (u->started != 0 && u->pid == getpid())
+        return u->started > 0 ? 0 : -1;
+    memset(u, 0, sizeof(*u)); // A ring inherited over fork stays with the parent
+    u->pid = getpid();
+    u->started = -1;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER;
+    if ((u->fd = (int)syscall(__NR_io_uring_setup, DFS_URING_ENTRIES, &p)) < 0 && errno == EINVAL)
+    {
+        memset(&p, 0, sizeof(p)); // Kernels before 6.0
+        u->fd = (int)syscall(__NR_io_uring_setup, DFS_URING_ENTRIES, &p);
+    }
+    if (u->fd < 0)
+        return -1;
+    fcntl(u->fd, F_SETFD, FD_CLOEXEC);
+
+    // Map the rings and the submission entries
+    u->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        u->sq_map_len = u->cq_map_len = u->sq_map_len > u->cq_map_len ? u->sq_map_len : u->cq_map_len;
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq_map = (p.features & IORING_FEAT_SINGLE_MMAP) ? u->sq_map
+                                                       : mmap(NULL, u->cq_map_len, PROT_READ | PROT_WRITE,
+                                                              MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                          u->fd, IORING_OFF_SQES);
+    if (u->sq_map == MAP_FAILED || u->cq_map == MAP_FAILED || u->sqes == MAP_FAILED)
+    {
+        close(u->fd);
+        return -1;
+    }
+    u->sq_head = (unsigned *)((char *)u->sq_map + p.sq_off.head);
+    u->sq_tail = (unsigned *)((char *)u->sq_map + p.sq_off.tail);
+    u->sq_mask = (unsigned *)((char *)u->sq_map + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((char *)u->sq_map + p.sq_off.array);
+    u->cq_head = (unsigned *)((char *)u->cq_map + p.cq_off.head);
+    u->cq_tail = (unsigned *)((char *)u->cq_map + p.cq_off.tail);
+    u->cq_mask = (unsigned *)((char *)u->cq_map + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_map + p.cq_off.cqes);
+
+    // Completions wake the loop through an eventfd
+    if ((u->watch.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+        dfs_uring_register(u->fd, IORING_REGISTER_EVENTFD, &u->watch.fd, 1) < 0)
+    {
+        close(u->fd);
+        return -1;
+    }
+    u->watch.handler = dfs_uring_event;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &u->watch;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, u->watch.fd, &ev) < 0)
+    {
+        close(u->watch.fd);
+        close(u->fd);
+        return -1;
+    }
+
+    // Buffers pinned once instead of per write. Past the memlock limit they are used unregistered.
+    struct iovec iov[DFS_URING_BUFS];
+    if (posix_memalign((void **)&u->bufs, DFS_URING_BLOCK, (size_t)DFS_URING_BUFS * DFS_URING_BUF_SIZE) != 0)
+        return -1; // Left half set up, but started stays -1: nothing is submitted to it
+    for (int i = 0; i < DFS_URING_BUFS; i++)
+    {
+        iov[i].iov_base = u->bufs + (size_t)i * DFS_URING_BUF_SIZE;
+        iov[i].iov_len = DFS_URING_BUF_SIZE;
+        u->free_bufs[u->nfree_bufs++] = DFS_URING_BUFS - 1 - i;
+    }
+    u->fixed_bufs = dfs_uring_register(u->fd, IORING_REGISTER_BUFFERS, iov, DFS_URING_BUFS) == 0;
+
+    // An empty fixed file table, slots are filled by dfs_uring_open
+    int fds[DFS_URING_FILES];
+    for (int i = 0; i < DFS_URING_FILES; i++)
+    {
+        fds[i] = -1;
+        u->free_slots[u->nfree_slots++] = DFS_URING_FILES - 1 - i;
+    }
+    u->fixed_files = dfs_uring_register(u->fd, IORING_REGISTER_FILES, fds, DFS_URING_FILES) == 0;
+
+    loop->before_wait = dfs_uring_before_wait;
+    u->started = 1;
+    return 0;
+}
+
+// Write an upload of size bytes to fd, from offset pos on, through the ring of the
+// loop. The file takes over fd. NULL if io_uring is not available, fd is then
+// still the caller's.
+static inline struct dfs_uring_file *dfs_uring_open(struct dfs_loop *loop, int fd, uint64_t pos, uint64_t size)
+{
+    struct dfs_uring *u = &dfs_uring;
+    struct dfs_uring_file *f;
+
+    if (dfs_uring_start(loop) < 0 || (f = (struct dfs_uring_file *)calloc(1, sizeof(*f))) == NULL)
+        return NULL;
+    f->fd = fd;
+    f->pos = pos;
+    f->buf = -1;
+    f->slot = -1;
+    if (size >= DFS_URING_FIXED_MIN && u->fixed_files && u->nfree_slots > 0)
+    {
+        int slot = u->free_slots[u->nfree_slots - 1];
+        struct io_uring_files_update update = {(unsigned)slot, 0, (uint64_t)(uintptr_t)&fd};
+        if (dfs_uring_register(u->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1)
+        {
+            f->slot = slot;
+            u->nfree_slots--;
+        }
+    }
+    if (size >= DFS_URING_DIRECT_MIN && pos % DFS_URING_BLOCK == 0)
+    {
+        int flags = fcntl(fd, F_GETFL);
+        f->direct = flags >= 0 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0; // Not every file system has it
+    }
+    return f;
+}
+
+// Whether the owner should stop giving bytes. If so, on_room follows once it may go on.
+static inline int dfs_uring_busy(struct dfs_uring_file *f)
+{
+    f->want_room = f->inflight >= DFS_URING_AHEAD || (f->inflight > 0 && dfs_uring.nfree_bufs == 0);
+    return f->want_room;
+}
+
+// Give the next len bytes of the file. Returns -1 once writing failed, with errno.
+static inline int dfs_uring_write(struct dfs_uring_file *f, const void *data, size_t len)
+{
+    struct dfs_uring *u = &dfs_uring;
+    const unsigned char *p = (const unsigned char *)data;
+
+    while (len > 0 && f->err == 0)
+    {
+        if (f->buf < 0 && u->nfree_bufs == 0)
+        {
+            // Every buffer is in the kernel: write this part now
+            dfs_uring_write_now(f, p, len, f->pos);
+            f->pos += len;
+            break;
+        }
+        if (f->buf < 0)
+        {
+            f->buf = u->free_bufs[--u->nfree_bufs];
+            f->buf_len = 0;
+            f->buf_off = f->pos;
+        }
+        size_t n = DFS_URING_BUF_SIZE - f->buf_len;
+        if (n > len)
+            n = len;
+        memcpy(u->bufs + (size_t)f->buf * DFS_URING_BUF_SIZE + f->buf_len, p, n);
+        f->buf_len += n;
+        f->pos += n;
+        p += n;
+        len -= n;
+        if (f->buf_len == DFS_URING_BUF_SIZE)
+            dfs_uring_write_buf(f);
+    }
+    if (f->err != 0)
+    {
+        errno = f->err;
+        return -1;
+    }
+    return 0;
+}
+
+// Write what is left and sync the file (fdatasync with datasync), then on_flushed
+static inline void dfs_uring_flush(struct dfs_uring_file *f, int datasync)
+{
+    if (f->buf >= 0)
+        dfs_uring_write_buf(f);
+    f->datasync = datasync;
+    f->flushing = 1;
+    if (f->inflight == 0)
+        dfs_uring_sync(f);
+}
+
+// Let go of the file: no callback follows, it is closed once the kernel is done with it
+static inline void dfs_uring_close(struct dfs_uring_file *f)
+{
+    f->closed = 1;
+    if (f->buf >= 0)
+        dfs_uring_release_buf(f->buf); // Never written, the upload is abandoned
+    f->buf = -1;
+    if (f->inflight == 0 && !f->syncing)
+        dfs_uring_free(f);
+}
+
+#endif
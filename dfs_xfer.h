@@ -0,0 +1,141 @@
+#ifndef DFS_XFER_H
+#define DFS_XFER_H
+
+// Transfer helpers shared by Smain, Spdf, Stext and client24s.
+//
+// Bytes move in chunks sized to what is left of the transfer: at least
+// DFS_XFER_MIN, so small files and messages cost one buffer, and up to
+// DFS_XFER_MAX, so a large body costs a read or write call per few MB
+// instead of one per KB. Frames leave as one gathered write of header and
+// body where both are at hand (dfs_writev_full, and the output queue of
+// dfs_loop.h).
+//
+// Sockets are tuned by what they carry. Every framed connection turns
+// Nagle off: frames are written whole, so waiting for more only adds a
+// round trip when a short reply follows a request. A header followed by
+// a body sent from a file is corked (TCP_CORK, or MSG_MORE on the event
+// loop) so both share the first packet. Socket buffer sizes are left to
+// the kernel: setting SO_SNDBUF or SO_RCVBUF turns off its autotuning,
+// which grows them further than a fixed value would on long fat links.
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "dfs_proto.h"
+
+#define DFS_XFER_MIN (64 * 1024)       // Smallest transfer buffer
+#define DFS_XFER_MAX (4 * 1024 * 1024) // Largest transfer buffer
+
+// How a socket is used
+#define DFS_SOCK_FRAMED 0 // Frames of requests and replies
+
+// Buffer size for a transfer with len bytes left: the power of two that
+// holds them, within DFS_XFER_MIN and DFS_XFER_MAX
+static inline size_t dfs_xfer_chunk(uint64_t len)
+{
+    size_t size = DFS_XFER_MIN;
+
+    while (size < len && size < DFS_XFER_MAX)
+        size *= 2;
+    return size;
+}
+
+// Set the options of a socket for its use, best effort
+static inline void dfs_sock_tune(int fd, int use)
+{
+    int one = 1;
+
+    if (use == DFS_SOCK_FRAMED)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Hold back partial packets while a header and its body are written, then
+// send what is left once uncorked
+static inline void dfs_sock_cork(int fd, int on)
+{
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+// Read a body of len bytes from a blocking socket and pass it to sink in
+// chunks as they arrive. Returns -1 if the socket fails or closes early.
+static inline int dfs_recv_body(int fd, uint64_t len, void (*sink)(void *ctx, const char *data, size_t len), void *ctx)
+{
+    char fallback[4096]; // Used if no larger buffer can be had
+    size_t cap = dfs_xfer_chunk(len);
+    char *buffer = len > 0 ? (char *)malloc(cap) : NULL;
+
+    if (buffer == NULL)
+    {
+        buffer = fallback;
+        cap = sizeof(fallback);
+    }
+    while (len > 0)
+    {
+        ssize_t n = read(fd, buffer, len < cap ? (size_t)len : cap);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            if (n == 0)
+                errno = ECONNRESET; // Peer closed in the middle of a frame
+            break;
+        }
+        sink(ctx, buffer, (size_t)n);
+        len -= (uint64_t)n;
+    }
+    if (buffer != fallback)
+        free(buffer);
+    return len == 0 ? 0 : -1;
+}
+
+// Create dir and the directories above it that are missing. Returns -1 with
+// errno set if one of them cannot be created.
+static inline int dfs_make_dirs(const char *dir)
+{
+    char temp[4096];
+    size_t len = strlen(dir);
+
+    if (len == 0 || len >= sizeof(temp))
+    {
+        errno = len == 0 ? ENOENT : ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(temp, dir, len + 1);
+    for (char *p = temp + 1; ; p++)
+    {
+        if (*p != '/' && *p != '\0')
+            continue;
+        char c = *p;
+        *p = '\0'; // Temporarily end the path at this directory
+        if (mkdir(temp, S_IRWXU) != 0 && errno != EEXIST)
+            return -1;
+        if (c == '\0')
+            return 0;
+        *p = c;
+    }
+}
+
+// Create the directories a file at path goes in
+static inline int dfs_make_parent_dirs(const char *path)
+{
+    char dir[4096];
+    const char *slash = strrchr(path, '/');
+
+    if (slash == NULL || slash == path)
+        return 0; // In the current or the root directory
+    if ((size_t)(slash - path) >= sizeof(dir))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(dir, path, slash - path);
+    dir[slash - path] = '\0';
+    return dfs_make_dirs(dir);
+}
+
+#endif